@@ -187,9 +187,9 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
 
     // estimate segs
     nsegs = SegmentationForPIGraph(view, line3s, segs, DegreesToRadians(1));
-    RemoveThinRegionInSegmentation(segs, 1, true);
-    RemoveEmbededRegionsInSegmentation(segs, true);
-    nsegs = DensifySegmentation(segs, true);
+    nsegs = CleanupSegmentation(true)
+                .removeThinRegions(1)
+                .removeEmbededRegions()(segs);
     assert(IsDenseSegmentation(segs));
 
     if (showGUI) {
@@ -271,18 +271,20 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
   }
 
   // build pigraph!
+  // the caches of PIGraphs are named pigraph_*, the mg_* caches written before
+  // PIGraph archives were versioned are left unread
   PIGraph<PanoramicCamera> mg;
-  if (options.refresh_mg_init || !misc::LoadCache(identity, "mg_init", mg)) {
+  if (options.refresh_mg_init || !misc::LoadCache(identity, "pigraph_init", mg)) {
     std::cout << "########## refreshing mg init ###########" << std::endl;
     START_TIME_RECORD(mg_init);
     mg = BuildPIGraph(view, vps, vertVPId, segs, line3s, DegreesToRadians(1),
                       DegreesToRadians(1), DegreesToRadians(1), thetaTiny,
-                      thetaLarge, thetaTiny);
+                      thetaLarge, thetaTiny, thetaMid * 2 / 3.0);
     STOP_TIME_RECORD(mg_init);
-    misc::SaveCache(identity, "mg_init", mg);
+    misc::SaveCache(identity, "pigraph_init", mg);
   }
 
-  std::vector<std::array<std::set<int>, 2>> line2leftRightSegs;
+  std::vector<std::array<std::vector<int>, 2>> line2leftRightSegs;
   if (options.refresh_line2leftRightSegs ||
       !misc::LoadCache(identity, "line2leftRightSegs", line2leftRightSegs)) {
     std::cout << "########## refreshing line2leftRightSegs ###########"
@@ -295,7 +297,7 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
 
   // attach orientation constraints
   if (options.refresh_mg_oriented ||
-      !misc::LoadCache(identity, "mg_oriented", mg)) {
+      !misc::LoadCache(identity, "pigraph_oriented", mg)) {
     std::cout << "########## refreshing mg oriented ###########" << std::endl;
     START_TIME_RECORD(mg_oriented);
     if (options.usePrincipleDirectionPrior) {
@@ -308,7 +310,7 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
       AttachGCConstraints(mg, gc, 0.7, 0.7, true);
     }
     STOP_TIME_RECORD(mg_oriented);
-    misc::SaveCache(identity, "mg_oriented", mg);
+    misc::SaveCache(identity, "pigraph_oriented", mg);
   }
 
   // detect occlusions
@@ -330,7 +332,7 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
   }
 
   if (options.refresh_mg_occdetected ||
-      !misc::LoadCache(identity, "mg_occdetected", mg)) {
+      !misc::LoadCache(identity, "pigraph_occdetected", mg)) {
     std::cout << "########## refreshing mg occdetected ###########"
               << std::endl;
     START_TIME_RECORD(mg_occdetected);
@@ -342,13 +344,13 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
       DisableBottomSeg(mg);
     }
     STOP_TIME_RECORD(mg_occdetected);
-    misc::SaveCache(identity, "mg_occdetected", mg);
+    misc::SaveCache(identity, "pigraph_occdetected", mg);
   }
 
   PIConstraintGraph cg;
   PICGDeterminablePart dp;
   if (options.refresh_mg_reconstructed ||
-      !misc::LoadCache(identity, "mg_reconstructed", mg, cg, dp)) {
+      !misc::LoadCache(identity, "pigraph_reconstructed", mg, cg, dp)) {
     std::cout << "########## refreshing mg reconstructed ###########"
               << std::endl;
     START_TIME_RECORD(mg_reconstructed);
@@ -363,7 +365,7 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
       return report;
     }
     STOP_TIME_RECORD(mg_reconstructed);
-    misc::SaveCache(identity, "mg_reconstructed", mg, cg, dp);
+    misc::SaveCache(identity, "pigraph_reconstructed", mg, cg, dp);
   }
 
   if (showGUI) {
@@ -385,7 +387,7 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
                             },
                             nullptr, true);
 
-    VisualizeReconstructionCompact(anno.rectifiedImage, dp, cg, mg, true,
+    VisualizeReconstructionCompact(anno.fullRectifiedImage(), dp, cg, mg, true,
                                    false);
   }
 
@@ -400,7 +402,7 @@ bool GetPanoramaReconstructionResult(
     const PanoramaReconstructionOptions &options, PIGraph<PanoramicCamera> &mg,
     PIConstraintGraph &cg, PICGDeterminablePart &dp) {
   auto identity = options.identityOfImage(anno.impath);
-  return misc::LoadCache(identity, "mg_reconstructed", mg, cg, dp);
+  return misc::LoadCache(identity, "pigraph_reconstructed", mg, cg, dp);
 }
 
 std::vector<LineSidingWeight> GetPanoramaReconstructionOcclusionResult(
@@ -4,6 +4,7 @@
 #include "basic_types.hpp"
 #include "cameras.hpp"
 #include "containers.hpp"
+#include "direction_index.hpp"
 #include "geo_context.hpp"
 #include "image.hpp"
 #include "line_detection.hpp"
@@ -111,11 +112,410 @@ double PixelWeight(const PanoramicCamera &cam, const Pixel &p) {
 }
 double PixelWeight(const PerspectiveCamera &cam, const Pixel &p) { return 1.0; }
 
+// BndPixelLabels
+// the sorted labels of the 2x2 block starting at a boundary pixel, and the
+// junction id of the pixel if it has 3 or more labels
+struct BndPixelLabels {
+  int labels[4];
+  int nlabels;
+  int juncId;
+  bool contains(int seg) const {
+    return std::find(labels, labels + nlabels, seg) != labels + nlabels;
+  }
+};
+
+template <class CameraT>
+inline BndPixelLabels MakeBndPixelLabels(const Imagei &segs, const Pixel &p,
+                                         const CameraT &cam) {
+  BndPixelLabels bl;
+  bl.nlabels = 0;
+  bl.juncId = -1;
+  ForEachNeighborhoodPixel(p, 0, 1, 0, 1, cam, [&bl, &segs](const Pixel &np) {
+    bl.labels[bl.nlabels++] = segs(np);
+  });
+  std::sort(bl.labels, bl.labels + bl.nlabels);
+  bl.nlabels = std::unique(bl.labels, bl.labels + bl.nlabels) - bl.labels;
+  return bl;
+}
+
+// TraceBnd
+// walks from the junc at juncPixel along the pixels whose 2x2 blocks hold both
+// segi and segj, until a junc of a larger id is met, returns that junc, or -1
+// if the walk ends elsewhere, bndPixelLabels gives the labels of a pixel, with
+// less than 2 of them off bnds, the walked pixels are marked with visitStamp
+template <class CameraT, class BndPixelLabelsFunT>
+int TraceBnd(const Imagei &segs, const CameraT &cam,
+             BndPixelLabelsFunT bndPixelLabels, int junc,
+             const Pixel &juncPixel, int segi, int segj, Imagei &visited,
+             int visitStamp, std::vector<Pixel> &pixels, bool &segiIsOnLeft) {
+  // use dfs
+  int saySegIIsOnLeft = 0, saySegIIsOnRight = 0;
+  pixels = {juncPixel};
+  visited(juncPixel) = visitStamp;
+
+  int lastDirId = 0;
+  while (true) {
+    Pixel curp = pixels.back();
+
+    // find another junc!
+    int tojuncid = pixels.size() > 1 ? bndPixelLabels(curp).juncId : -1;
+    if (junc < tojuncid) {
+      if (saySegIIsOnLeft < saySegIIsOnRight) {
+        assert(saySegIIsOnLeft == 0);
+        segiIsOnLeft = false;
+      } else {
+        assert(saySegIIsOnRight == 0);
+        segiIsOnLeft = true;
+      }
+      return tojuncid;
+    }
+
+    // * - * - *
+    // | d | a |
+    // * -[*]- *
+    // | c | b |
+    // * - * - *
+    static const int dxs[] = {1, 0, -1, 0};
+    static const int dys[] = {0, 1, 0, -1};
+
+    static const int leftdxs[] = {1, 1, 0, 0};
+    static const int leftdys[] = {0, 1, 1, 0};
+
+    static const int rightdxs[] = {1, 0, 0, 1};
+    static const int rightdys[] = {1, 1, 0, 0};
+
+    bool hasMore = false;
+    for (int kk = 0; kk < 4; kk++) {
+      int k = (lastDirId + kk + 3) % 4;
+      auto nextp = curp + Pixel(dxs[k], dys[k]);
+
+      if (!RectifyPixel(nextp, cam)) { // note that the top/bottom borders
+                                       // cannot be crossed!
+        continue;
+      }
+      const auto &nextLabels = bndPixelLabels(nextp);
+      if (!nextLabels.contains(segi) || !nextLabels.contains(segj)) {
+        continue;
+      }
+      if (visited(nextp) == visitStamp) {
+        continue;
+      }
+
+      auto rightp = curp + Pixel(rightdxs[k], rightdys[k]);
+      RectifyPixel(rightp, cam);
+      auto leftp = curp + Pixel(leftdxs[k], leftdys[k]);
+      RectifyPixel(leftp, cam);
+      if (Contains(segs.size(), rightp) && Contains(segs.size(), leftp)) {
+        if (segs(rightp) == segi && segs(leftp) == segj) {
+          saySegIIsOnRight++;
+        } else if (segs(rightp) == segj && segs(leftp) == segi) {
+          saySegIIsOnLeft++;
+        } else {
+          continue;
+        }
+      }
+
+      pixels.push_back(nextp);
+      visited(nextp) = visitStamp;
+      lastDirId = k;
+      hasMore = true;
+      break;
+    }
+
+    if (!hasMore) {
+      return -1;
+    }
+  }
+}
+
+// SmoothedBndDirs
+// directions of the pixels of a bnd, skipping those closer than the size of a
+// pixel to the last one kept, the last pixel is always kept
+template <class CameraT>
+std::vector<Vec3> SmoothedBndDirs(const std::vector<Pixel> &pixels,
+                                  const CameraT &cam) {
+  assert(pixels.size() >= 2);
+  const double bndSampleAngle = 1.1 / cam.focal();
+  std::vector<Vec3> smoothedDirs;
+  for (int j = 0; j < pixels.size() - 1; j++) {
+    auto dir = normalize(cam.toSpace(pixels[j]));
+    if (smoothedDirs.empty() ||
+        AngleBetweenDirected(smoothedDirs.back(), dir) >= bndSampleAngle) {
+      smoothedDirs.push_back(dir);
+    }
+  }
+  smoothedDirs.push_back(normalize(cam.toSpace(pixels.back())));
+  assert(smoothedDirs.size() >= 2);
+  return smoothedDirs;
+}
+
+// SplitBndDirs
+// splits the dirs of a bnd into pieces along great circles, each of 2 or more
+// dirs
+inline std::vector<std::vector<Vec3>>
+SplitBndDirs(const std::vector<Vec3> &dirs, double bndPieceSplitAngleThres) {
+  assert(dirs.size() > 0);
+  std::vector<std::vector<Vec3>> pieces;
+  std::vector<Vec3> curPiece = {dirs.front()};
+  for (int j = 1; j <= dirs.size(); j++) {
+    if (j < dirs.size() && AllAlong(curPiece, curPiece.front(), dirs[j],
+                                    bndPieceSplitAngleThres)) {
+      curPiece.push_back(dirs[j]);
+    } else {
+      if (curPiece.size() >= 2) {
+        pieces.push_back(std::move(curPiece));
+        curPiece.clear();
+      }
+      if (j < dirs.size()) {
+        curPiece.push_back(dirs[j]);
+      }
+    }
+  }
+  return pieces;
+}
+
+// BndPieceClass
+// the vp the bnd piece is all along, or -1
+template <class DirsT>
+inline int BndPieceClass(const DirsT &piece, const std::vector<Vec3> &vps,
+                         double bndPieceClassifyAngleThres) {
+  assert(piece.size() > 1);
+  Vec3 center = piece[piece.size() / 2];
+  assert(vps.size() >= 3);
+  for (int j = 0; j < 3; j++) {
+    if (AllAlong(piece, center, vps[j], bndPieceClassifyAngleThres)) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+// BndPieceLength
+template <class DirsT> inline double BndPieceLength(const DirsT &piece) {
+  double length = 0.0;
+  for (int j = 1; j < piece.size(); j++) {
+    length += AngleBetweenDirected(piece[j - 1], piece[j]);
+  }
+  return length;
+}
+
+// SegMaskSampler
+// samples the mask of a seg in another camera, the same as
+// (MakeCameraSampler(outCam, inCam)(segs) == seg) but computed in the calling
+// thread, the buffers are reused by later calls
+class SegMaskSampler {
+public:
+  template <class OutCameraT, class InCameraT>
+  Image operator()(const OutCameraT &outCam, const InCameraT &inCam,
+                   const Imagei &segs, int seg) {
+    Sizei sz = outCam.screenSize();
+    Imagef mapx = scratch(_mapx, sz), mapy = scratch(_mapy, sz);
+    _screenps.resize(sz.width);
+    _p3s.resize(sz.width);
+    for (int y = 0; y < sz.height; y++) {
+      float *mapxRow = mapx[y];
+      float *mapyRow = mapy[y];
+      for (int x = 0; x < sz.width; x++) {
+        _screenps[x] = Point2(x, y);
+      }
+      BatchToSpace(outCam, _screenps.data(), _p3s.data(), sz.width);
+      BatchToScreen(inCam, _p3s.data(), _screenps.data(), sz.width);
+      for (int x = 0; x < sz.width; x++) {
+        if (!inCam.isVisibleOnScreen(_p3s[x])) {
+          mapxRow[x] = mapyRow[x] = -1;
+          continue;
+        }
+        mapxRow[x] = static_cast<float>(_screenps[x](0));
+        mapyRow[x] = static_cast<float>(_screenps[x](1));
+      }
+    }
+    Imagei sampled = scratch(_sampled, sz);
+    cv::remap(segs, sampled, mapx, mapy, cv::INTER_NEAREST,
+              cv::BORDER_REPLICATE);
+    Imageub mask = scratch(_mask, sz);
+    cv::compare(sampled, seg, mask, cv::CMP_EQ);
+    return mask;
+  }
+
+private:
+  // the top left part of buffer, which only grows
+  template <class T> static Image_<T> scratch(Image_<T> &buffer, Sizei sz) {
+    if (buffer.cols < sz.width || buffer.rows < sz.height) {
+      buffer.create(std::max(buffer.rows, sz.height),
+                    std::max(buffer.cols, sz.width));
+    }
+    return buffer(cv::Rect(0, 0, sz.width, sz.height));
+  }
+
+private:
+  Imagef _mapx, _mapy;
+  Imagei _sampled;
+  Imageub _mask;
+  std::vector<Point2> _screenps;
+  std::vector<Point3> _p3s;
+};
+
+// LinesOccupation
+// lines with samples inside the box of half size boxRadius around the
+// direction of each pixel (which were searched from an RTree of line samples
+// per pixel before), stored in rows of pixel indices, the pixels tested for a
+// sample are within the angular radius of the box
+CompressedRows<int>
+LinesOccupation(const PanoramicCamera &cam, const std::vector<Vec3> &ind2dir,
+                const std::vector<std::vector<Vec3>> &lineSamples,
+                double boxRadius) {
+  int width = cam.screenSize().width;
+  int height = cam.screenSize().height;
+  double angleRadius = 2.0 * asin(std::min(1.0, boxRadius * sqrt(3.0) / 2.0));
+  int dy = int(ceil(angleRadius / M_PI * height)) + 2;
+
+  std::vector<int> lastLine(width * height, -1);
+  auto forEachOccupiedPixel = [&](int lineid, auto &&fun) {
+    for (const Vec3 &sample : lineSamples[lineid]) {
+      Point2 c = cam.toScreen(sample);
+      double latitude = c[1] / height * M_PI - M_PI_2;
+      int dx = width;
+      if (std::abs(latitude) + angleRadius < M_PI_2 - 2 * M_PI / height) {
+        dx = int(ceil(asin(sin(angleRadius) / cos(latitude)) / M_PI / 2.0 *
+                      width)) +
+             2;
+      }
+      int cx = int(c[0]), cy = int(c[1]);
+      int xfirst = cx - dx, xlast = cx + dx;
+      if (xlast - xfirst + 1 >= width) {
+        xfirst = 0;
+        xlast = width - 1;
+      }
+      for (int y = std::max(cy - dy, 0); y <= std::min(cy + dy, height - 1);
+           y++) {
+        for (int xx = xfirst; xx <= xlast; xx++) {
+          int x = (xx % width + width) % width;
+          int ind = Sub2Ind(Pixel(x, y), width, height);
+          if (lastLine[ind] == lineid) {
+            continue;
+          }
+          const Vec3 &dir = ind2dir[ind];
+          bool inBox = true;
+          for (int k = 0; k < 3 && inBox; k++) {
+            inBox = dir[k] - boxRadius <= sample[k] &&
+                    sample[k] <= dir[k] + boxRadius;
+          }
+          if (inBox) {
+            lastLine[ind] = lineid;
+            fun(ind);
+          }
+        }
+      }
+    }
+  };
+
+  CompressedRows<int> occupation;
+  occupation.resetCounts(width * height);
+  for (int i = 0; i < lineSamples.size(); i++) {
+    forEachOccupiedPixel(i, [&occupation](int ind) { occupation.count(ind); });
+  }
+  occupation.allocate();
+  std::fill(lastLine.begin(), lastLine.end(), -1);
+  for (int i = 0; i < lineSamples.size(); i++) {
+    forEachOccupiedPixel(
+        i, [&occupation, i](int ind) { occupation.fill(ind, i); });
+  }
+  return occupation;
+}
+
+// PIGraphCameraTraits
+// what building a PIGraph does differently on panoramic and perspective
+// cameras, resolved at compile time, pixel weights, rectification and
+// neighborhoods are the overloads above, the screen layout is inherited from
+// CameraScreenTraits
+template <class CameraT> struct PIGraphCameraTraits {};
+
+template <> struct PIGraphCameraTraits<PanoramicCamera>
+    : CameraScreenTraits<PanoramicCamera> {
+  // contours of seg and its center, contours found on the panorama are
+  // resampled in a partial panoramic camera around the seg for precision
+  static Vec3 segContours(const PanoramicCamera &cam, const Imagei &segs,
+                          int seg, std::vector<std::vector<Pixel>> &contours,
+                          const std::vector<Vec3> &directions,
+                          const Vec3 &centerDirection,
+                          SegMaskSampler &maskSampler,
+                          std::vector<std::vector<Vec3>> &segContours) {
+    // get max angle distance from center direction
+    double radiusAngle = 0.0;
+    for (auto &d : directions) {
+      double a = AngleBetweenDirected(centerDirection, d);
+      if (radiusAngle < a) {
+        radiusAngle = a;
+      }
+    }
+
+    // perform a more precise sample !
+    int newSampleSize = cam.focal() * radiusAngle * 2 + 2;
+    PartialPanoramicCamera sCam(
+        newSampleSize, newSampleSize, cam.focal(), cam.eye(), centerDirection,
+        ProposeXYDirectionsFromZDirection(centerDirection).second);
+    // collect better contours
+    contours.clear();
+    Image regionMask = maskSampler(sCam, cam, segs, seg);
+    cv::findContours(regionMask, contours, CV_RETR_EXTERNAL,
+                     CV_CHAIN_APPROX_SIMPLE); // CV_RETR_EXTERNAL: get only the
+                                              // outer contours
+    std::sort(contours.begin(), contours.end(),
+              [](const std::vector<Pixel> &ca, const std::vector<Pixel> &cb) {
+                return ca.size() > cb.size();
+              });
+
+    auto iter =
+        std::find_if(contours.begin(), contours.end(),
+                     [](const std::vector<Pixel> &c) { return c.size() <= 2; });
+    contours.erase(iter, contours.end());
+
+    segContours.resize(contours.size());
+    Vec3 center = Origin();
+    for (int j = 0; j < contours.size(); j++) {
+      auto &cs = segContours[j];
+      cs.reserve(contours[j].size());
+      for (auto &p : contours[j]) {
+        cs.push_back(normalize(sCam.toSpace(p)));
+        center += cs.back();
+      }
+    }
+    if (center != Origin()) {
+      center /= norm(center);
+    } else {
+      center = normalize(centerDirection);
+    }
+    return center;
+  }
+};
+
+template <> struct PIGraphCameraTraits<PerspectiveCamera>
+    : CameraScreenTraits<PerspectiveCamera> {
+  // contours found on the screen are used directly
+  static Vec3 segContours(const PerspectiveCamera &cam, const Imagei &segs,
+                          int seg, std::vector<std::vector<Pixel>> &contours,
+                          const std::vector<Vec3> &directions,
+                          const Vec3 &centerDirection,
+                          SegMaskSampler &maskSampler,
+                          std::vector<std::vector<Vec3>> &segContours) {
+    segContours.resize(contours.size());
+    for (int j = 0; j < contours.size(); j++) {
+      auto &cs = segContours[j];
+      cs.reserve(contours[j].size());
+      for (auto &p : contours[j]) {
+        cs.push_back(normalize(cam.toSpace(p)));
+      }
+    }
+    return centerDirection;
+  }
+};
+
 int SegmentationForPIGraph(const PanoramicView &view,
                            const std::vector<Classified<Line3>> &lines,
                            Imagei &segs, double lineExtendAngle, double sigma,
                            double c, double minSize,
-                           int widthThresToRemoveThinRegions) {
+                           int widthThresToRemoveThinRegions,
+                           SegmentationHierarchy *hierarchy) {
 
   Image3ub im = view.image;
   int width = im.cols;
@@ -127,8 +527,8 @@ int SegmentationForPIGraph(const PanoramicView &view,
     smoothed = im.clone();
   }
 
-  // register lines in RTree
-  RTreeMap<Vec3, int> linesRTree;
+  // sample lines
+  std::vector<std::vector<Vec3>> lineSamples(lines.size());
   static const double lineSampleAngle = DegreesToRadians(2);
   for (int i = 0; i < lines.size(); i++) {
     if (lines[i].claz == -1) { // don't consider clutter lines here
@@ -139,17 +539,28 @@ int SegmentationForPIGraph(const PanoramicView &view,
     for (double a = 0.0; a <= spanAngle + lineSampleAngle / 2;
          a += lineSampleAngle) {
       auto direction = RotateDirection(line.first, line.second, a);
-      linesRTree.emplace(normalize(direction), i);
+      lineSamples[i].push_back(normalize(direction));
     }
   }
 
   // register pixel ind -> spatial direction
   std::vector<Vec3> ind2dir(width * height);
-  for (auto it = im.begin(); it != im.end(); ++it) {
-    auto p = it.pos();
-    Vec3 dir = normalize(view.camera.toSpace(p));
-    ind2dir[Sub2Ind(p, width, height)] = dir;
-  }
+  ForEachRow(im, [&view, &ind2dir, width, height](
+                     int y, const Vec<uint8_t, 3> *, int cols) {
+    std::vector<Point2> ps(cols);
+    std::vector<Vec3> dirs(cols);
+    for (int x = 0; x < cols; x++) {
+      ps[x] = Point2(x, y);
+    }
+    BatchToSpace(view.camera, ps.data(), dirs.data(), cols);
+    for (int x = 0; x < cols; x++) {
+      ind2dir[Sub2Ind(Pixel(x, y), width, height)] = normalize(dirs[x]);
+    }
+  });
+
+  // rasterize lines
+  CompressedRows<int> nearbyLinesMap =
+      LinesOccupation(view.camera, ind2dir, lineSamples, lineSampleAngle * 3);
 
   // pixel graph
   using Vertex = double;
@@ -179,12 +590,7 @@ int SegmentationForPIGraph(const PanoramicView &view,
     for (int x = 0; x < width; x++) {
       Pixel p(x, y);
       Vec3 dir = ind2dir[Sub2Ind(p, width, height)];
-      std::set<int> nearbyLines;
-      linesRTree.search(BoundingBox(dir).expand(lineSampleAngle * 3),
-                        [&nearbyLines](const std::pair<Vec3, int> &lineSample) {
-                          nearbyLines.insert(lineSample.second);
-                          return true;
-                        });
+      auto nearbyLines = nearbyLinesMap[Sub2Ind(p, width, height)];
 
       static const int dx[] = {1, 0, 1, -1};
       static const int dy[] = {0, 1, 1, 1};
@@ -242,6 +648,9 @@ int SegmentationForPIGraph(const PanoramicView &view,
     return e1.weight < e2.weight;
   });
 
+  if (hierarchy) {
+    *hierarchy = SegmentationHierarchy(width, height);
+  }
   std::vector<double> thresholds(vertices.size(), c);
   MergeFindSet<Vertex> mfset(vertices.begin(), vertices.end());
   for (int i = 0; i < edges.size(); i++) {
@@ -255,6 +664,9 @@ int SegmentationForPIGraph(const PanoramicView &view,
       mfset.join(a, b);
       a = mfset.find(a);
       thresholds[a] = edge.weight + c / mfset.data(a);
+      if (hierarchy) {
+        hierarchy->merge(edge.ind1, edge.ind2, edge.weight);
+      }
     }
   }
   while (true) {
@@ -269,6 +681,9 @@ int SegmentationForPIGraph(const PanoramicView &view,
       if (mfset.data(a) < minSize || mfset.data(b) < minSize) {
         mfset.join(a, b);
         merged = true;
+        if (hierarchy) {
+          hierarchy->merge(edge.ind1, edge.ind2, edge.weight);
+        }
       }
     }
     if (!merged) {
@@ -289,6 +704,20 @@ int SegmentationForPIGraph(const PanoramicView &view,
     }
   }
 
+  // merge the rest along edges to complete the hierarchy
+  if (hierarchy) {
+    hierarchy->markSegmentation();
+    for (int i = 0; i < edges.size(); i++) {
+      const Edge &edge = edges[i];
+      int a = mfset.find(edge.ind1);
+      int b = mfset.find(edge.ind2);
+      if (a != b) {
+        mfset.join(a, b);
+        hierarchy->merge(edge.ind1, edge.ind2, edge.weight);
+      }
+    }
+  }
+
   bool mergeThinRegions = false;
   if (!mergeThinRegions) {
     return numCCs;
@@ -335,6 +764,10 @@ int SegmentationForPIGraph(const PanoramicView &view,
     }
   }
 
+  CompressedRows<int> nearbyLinesMapOfThinRegions = LinesOccupation(
+      view.camera, ind2dir, lineSamples,
+      std::max(lineSampleAngle * 3,
+               widthThresToRemoveThinRegions * 3 / view.camera.focal()));
   std::vector<std::map<int, double>> distanceTable(width * height);
   for (auto it = segs.begin(); it != segs.end(); ++it) {
     auto p = it.pos();
@@ -343,14 +776,7 @@ int SegmentationForPIGraph(const PanoramicView &view,
     auto &dtable = distanceTable[p.x * height + p.y];
 
     Vec3 dir = ind2dir[Sub2Ind(p, width, height)];
-    std::set<int> nearbyLines;
-    linesRTree.search(BoundingBox(dir).expand(std::max(
-                          lineSampleAngle * 3, widthThresToRemoveThinRegions *
-                                                   3 / view.camera.focal())),
-                      [&nearbyLines](const std::pair<Vec3, int> &lineSample) {
-                        nearbyLines.insert(lineSample.second);
-                        return true;
-                      });
+    auto nearbyLines = nearbyLinesMapOfThinRegions[Sub2Ind(p, width, height)];
 
     for (int x = -widthThresToRemoveThinRegions;
          x <= widthThresToRemoveThinRegions; x++) {
@@ -436,27 +862,441 @@ int SegmentationForPIGraph(const PanoramicView &view,
   return DensifySegmentation(segs, true);
 }
 
-#ifdef KKK
-PIGraph<PanoramicCamera> BuildPIGraph(
-    const PanoramicView &view, const std::vector<Vec3> &vps, int verticalVPId,
+// SegContoursInBox
+// contours of seg and its center, the contours are found inside the bounding
+// box of seg with a margin of 1 pixel, where they are the same as those found
+// in the whole image, returns false if there are none
+template <class CameraT>
+bool SegContoursInBox(const View<CameraT> &view, const Imagei &segs, int seg,
+                      int minx, int miny, int maxx, int maxy,
+                      SegMaskSampler &maskSampler,
+                      std::vector<std::vector<Vec3>> &segContours,
+                      Vec3 &segCenter) {
+  cv::Rect roi(cv::Point(std::max(minx - 1, 0), std::max(miny - 1, 0)),
+               cv::Point(std::min(maxx + 2, segs.cols),
+                         std::min(maxy + 2, segs.rows)));
+  Image regionMask = (segs(roi) == seg);
+
+  // find contour of the region
+  std::vector<std::vector<Pixel>> contours;
+  cv::findContours(regionMask, contours, CV_RETR_EXTERNAL,
+                   CV_CHAIN_APPROX_SIMPLE, // CV_RETR_EXTERNAL: get only the
+                                           // outer contours
+                   roi.tl());
+  if (contours.empty()) {
+    return false;
+  }
+
+  Vec3 centerDirection(0, 0, 0);
+  std::vector<Vec3> directions;
+  directions.reserve(CountOf<Pixel>(contours));
+  for (auto &cs : contours) {
+    for (auto &c : cs) {
+      directions.push_back(normalize(view.camera.toSpace(c)));
+      centerDirection += directions.back();
+    }
+  }
+  if (centerDirection != Origin()) {
+    centerDirection /= norm(centerDirection);
+  }
+
+  segCenter = PIGraphCameraTraits<CameraT>::segContours(
+      view.camera, segs, seg, contours, directions, centerDirection,
+      maskSampler, segContours);
+  return true;
+}
+
+// LineSamples
+inline std::vector<Vec3> LineSamples(const Line3 &line, double sampleAngle) {
+  std::vector<Vec3> samples;
+  double angle = AngleBetweenDirected(line.first, line.second);
+  for (double a = 0; a <= angle; a += sampleAngle) {
+    samples.push_back(normalize(RotateDirection(line.first, line.second, a)));
+  }
+  return samples;
+}
+
+// LinePieceData
+// a line piece bound to a bnd piece (seg is -1), or to a seg (bndPiece is -1)
+struct LinePieceData {
+  int bndPiece;
+  int seg;
+  std::vector<Vec3> samples;
+  double length;
+};
+
+// SplitLine
+// splits line samples where the nearest bnd piece changes, or the seg under
+// them changes away from bnd pieces
+template <class NearestBndPieceFunT, class SegFunT>
+std::vector<LinePieceData> SplitLine(const std::vector<Vec3> &samples,
+                                     NearestBndPieceFunT nearestBndPieceOf,
+                                     SegFunT segOf) {
+  std::vector<LinePieceData> pieces;
+  int lastDetectedBndPiece = -1;
+  int lastDetectedSeg = -1;
+  std::vector<Vec3> collectedSamples;
+  for (int j = 0; j <= samples.size(); j++) {
+    int nearestBndPiece = -1;
+    int nearestSeg = -1;
+    if (j < samples.size()) {
+      nearestBndPiece = nearestBndPieceOf(samples[j]);
+      nearestSeg = segOf(samples[j]);
+    }
+    bool neighborChanged =
+        (nearestBndPiece != lastDetectedBndPiece ||
+         (nearestBndPiece == -1 && lastDetectedSeg != nearestSeg) ||
+         j == samples.size() - 1) &&
+        !(lastDetectedBndPiece == -1 && lastDetectedSeg == -1);
+    if (neighborChanged) {
+      double len = AngleBetweenDirected(collectedSamples.front(),
+                                          collectedSamples.back());
+      if (collectedSamples.size() >= 2) {
+        // line piece bound to bnd piece, or to seg
+        pieces.push_back({lastDetectedBndPiece,
+                          lastDetectedBndPiece != -1 ? -1 : lastDetectedSeg,
+                          std::move(collectedSamples), len});
+      }
+      collectedSamples.clear();
+    }
+    if (j < samples.size()) {
+      collectedSamples.push_back(samples[j]);
+    }
+
+    lastDetectedBndPiece = nearestBndPiece;
+    lastDetectedSeg = nearestSeg;
+  }
+  return pieces;
+}
+
+// LineRelationBetween
+// incidences for lines of the same class, intersections for lines of
+// different classes, anchor is the position of the relation
+inline bool LineRelationBetween(const Classified<Line3> &cli,
+                                const Classified<Line3> &clj,
+                                const std::vector<Vec3> &vps,
+                                double intersectionAngleThreshold,
+                                double incidenceAngleAlongDirectionThreshold,
+                                double incidenceAngleVerticalDirectionThreshold,
+                                Vec3 &anchor, bool &isIncidence) {
+  auto &linei = cli.component;
+  int clazi = cli.claz;
+  Vec3 ni = normalize(linei.first.cross(linei.second));
+  auto &linej = clj.component;
+  int clazj = clj.claz;
+  Vec3 nj = normalize(linej.first.cross(linej.second));
+
+  auto nearest = DistanceBetweenTwoLines(linei, linej);
+  double d = AngleBetweenDirected(nearest.second.first.position,
+                                    nearest.second.second.position);
+
+  if (clazi == clazj && clazi >= 0) { // incidences for classified lines
+    auto conCenter = normalize(nearest.second.first.position +
+                               nearest.second.second.position);
+    auto &vp = vps[clazi];
+    if (AngleBetweenDirected(vp, conCenter) < intersectionAngleThreshold) {
+      return false;
+    }
+    if (d < incidenceAngleAlongDirectionThreshold &&
+        AngleBetweenUndirected(ni, nj) <
+            incidenceAngleVerticalDirectionThreshold) {
+      if (HasValue(conCenter, IsInfOrNaN<double>)) {
+        return false;
+      }
+      anchor = conCenter;
+      isIncidence = true;
+      return true;
+    }
+  } else if (clazi != clazj && clazi >= 0 &&
+             clazj >= 0) { // intersections for classified lines
+    if (d < intersectionAngleThreshold) {
+      auto conCenter = normalize(ni.cross(nj));
+      if (Distance(conCenter, linei) > intersectionAngleThreshold * 4 ||
+          Distance(conCenter, linej) > intersectionAngleThreshold * 4) {
+        return false;
+      }
+      if (HasValue(conCenter, IsInfOrNaN<double>)) {
+        return false;
+      }
+      anchor = conCenter;
+      isIncidence = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+// LineRelationData
+struct LineRelationData {
+  int line1, line2;
+  Vec3 anchor;
+  bool isIncidence;
+};
+
+// FindLineRelations
+// both incidences and intersections need the nearest points of two lines to be
+// closer than the thresholds, so only lines whose bounding caps (around the
+// line centers) are that close are tested, the candidates of each line are
+// found in an rtree of the caps in parallel, the relations are ordered as in
+// a pairwise scan
+inline std::vector<LineRelationData>
+FindLineRelations(const std::vector<Classified<Line3>> &lines,
+                  const std::vector<Vec3> &vps,
+                  double intersectionAngleThreshold,
+                  double incidenceAngleAlongDirectionThreshold,
+                  double incidenceAngleVerticalDirectionThreshold) {
+  const double maxGap = std::max(intersectionAngleThreshold,
+                                 incidenceAngleAlongDirectionThreshold);
+  std::vector<Vec3> line2capCenter(lines.size());
+  std::vector<double> line2capRadius(lines.size());
+  std::vector<Box3> line2capBox(lines.size());
+  RTree<Box3, int> capTree;
+  for (int i = 0; i < lines.size(); i++) {
+    auto &line = lines[i].component;
+    line2capCenter[i] =
+        normalize(normalize(line.first) + normalize(line.second));
+    line2capRadius[i] = AngleBetweenDirected(line.first, line.second) / 2.0;
+    // caps of radius + maxGap / 2 intersect for each candidate pair, their
+    // boxes are bounded by the chord lengths
+    double r = std::min(line2capRadius[i] + maxGap / 2.0, M_PI);
+    line2capBox[i] = BoundingBox(line2capCenter[i]).expand(2.0 * sin(r / 2.0));
+    capTree.insert(line2capBox[i], i);
+  }
+
+  std::vector<std::vector<LineRelationData>> line2relations(lines.size());
+  ParallelForRange(0, lines.size(), [&](int first, int last) {
+    std::vector<int> candidates;
+    for (int i = first; i < last; i++) {
+      candidates.clear();
+      capTree.search(line2capBox[i], [i, &candidates](int j) {
+        if (j > i) {
+          candidates.push_back(j);
+        }
+        return true;
+      });
+      std::sort(candidates.begin(), candidates.end());
+      for (int j : candidates) {
+        if (AngleBetweenDirected(line2capCenter[i], line2capCenter[j]) >=
+            line2capRadius[i] + line2capRadius[j] + maxGap) {
+          continue;
+        }
+        Vec3 anchor;
+        bool isIncidence = false;
+        if (LineRelationBetween(lines[i], lines[j], vps,
+                                intersectionAngleThreshold,
+                                incidenceAngleAlongDirectionThreshold,
+                                incidenceAngleVerticalDirectionThreshold,
+                                anchor, isIncidence)) {
+          line2relations[i].push_back({i, j, anchor, isIncidence});
+        }
+      }
+    }
+  });
+
+  std::vector<LineRelationData> relations;
+  for (auto &rs : line2relations) {
+    relations.insert(relations.end(), rs.begin(), rs.end());
+  }
+  return relations;
+}
+
+// AddLineVotes
+// adds the votes of a line for an intersection at anchor to votes, scaled by
+// sign, which is 1 or -1 so that the votes of a line are removed exactly
+inline void AddLineVotes(const Classified<Line3> &cline,
+                         const std::vector<Vec3> &vps, const Vec3 &anchor,
+                         double sign, Mat<double, 3, 2> &votes) {
+  static const double angleThreshold = M_PI / 32;
+  static const double sigma = 0.1;
+
+  enum LineVotingDirection : int {
+    TowardsVanishingPoint = 0,
+    TowardsOppositeOfVanishingPoint = 1
+  };
+  auto &line = cline.component;
+  int claz = cline.claz;
+  if (claz == -1 || claz >= 3)
+    return;
+
+  auto &vp = vps[claz];
+  Vec3 center = normalize(line.center());
+
+  Vec3 center2vp = normalize(center.cross(vp));
+  Vec3 center2pos = normalize(center.cross(anchor));
+
+  double angle = AngleBetweenUndirected(center2vp, center2pos);
+  double angleSmall = angle > M_PI_2 ? (M_PI - angle) : angle;
+  if (IsInfOrNaN(angleSmall))
+    return;
+
+  assert(angleSmall >= 0 && angleSmall <= M_PI_2);
+
+  double angleScore =
+      exp(-(angleSmall / angleThreshold) * (angleSmall / angleThreshold) /
+          sigma / sigma / 2);
+
+  auto proj = ProjectionOfPointOnLine(anchor, line);
+  double projRatio = BoundBetween(proj.ratio, 0.0, 1.0);
+
+  Vec3 lined = line.first.cross(line.second);
+  double lineSpanAngle = AngleBetweenDirected(line.first, line.second);
+  double towardsFirst = angleScore * lineSpanAngle * (1 - projRatio);
+  double towardsSecond = angleScore * lineSpanAngle * projRatio;
+  if (AngleBetweenDirected(center2vp, lined) < M_PI_2) { // first-second-vp
+    votes(claz, TowardsVanishingPoint) += sign * towardsFirst;
+    votes(claz, TowardsOppositeOfVanishingPoint) += sign * towardsSecond;
+  } else { // vp-first-second
+    votes(claz, TowardsOppositeOfVanishingPoint) += sign * towardsFirst;
+    votes(claz, TowardsVanishingPoint) += sign * towardsSecond;
+  }
+}
+
+// IntersectionWeight
+inline double IntersectionWeight(const Mat<double, 3, 2> &votes) {
+  return std::max(0.1f, ComputeIntersectionJunctionWeightWithLinesVotes(
+                            Mat<float, 3, 2>(votes)));
+}
+
+// UpdateLineRelationWeights
+// junction weights, those of intersections are voted by all the lines, in
+// parallel over relations, the votes are kept so that the updates of lines
+// only add or remove their own
+template <class CameraT> void UpdateLineRelationWeights(PIGraph<CameraT> &mg) {
+  mg.lineRelation2weight.resize(mg.nlineRelations());
+  mg.lineRelation2votes.assign(mg.nlineRelations(), Mat<double, 3, 2>());
+  ParallelForRange(0, mg.nlineRelations(), [&mg](int first, int last) {
+    for (int i = first; i < last; i++) {
+      if (mg.lineRelation2IsIncidence[i]) {
+        mg.lineRelation2weight[i] = IncidenceJunctionWeight(false);
+        continue;
+      }
+      for (auto &line : mg.lines) {
+        AddLineVotes(line, mg.vps, mg.lineRelation2anchor[i], 1.0,
+                     mg.lineRelation2votes[i]);
+      }
+      mg.lineRelation2weight[i] = IntersectionWeight(mg.lineRelation2votes[i]);
+    }
+  });
+}
+
+// IsConsistent
+namespace details {
+template <class ContT> inline bool RowContains(const ContT &row, int id) {
+  return std::find(row.begin(), row.end(), id) != row.end();
+}
+
+// whether the records refer to each other
+template <class CameraT> bool IsConsistent(const PIGraph<CameraT> &mg) {
+  if (mg.seg2bnds.size() != mg.nsegs || mg.seg2linePieces.size() != mg.nsegs ||
+      mg.seg2control.size() != mg.nsegs ||
+      mg.seg2areaRatio.size() != mg.nsegs ||
+      mg.seg2center.size() != mg.nsegs || mg.seg2contours.size() != mg.nsegs) {
+    return false;
+  }
+  // linePieces
+  int nlps = mg.nlinePieces();
+  if (mg.linePiece2length.size() != nlps || mg.linePiece2line.size() != nlps ||
+      mg.linePiece2seg.size() != nlps ||
+      mg.linePiece2segLineRelation.size() != nlps ||
+      mg.linePiece2bndPiece.size() != nlps ||
+      mg.linePiece2bndPieceInSameDirection.size() != nlps ||
+      mg.line2linePieces.nelements() != nlps ||
+      mg.seg2linePieces.nelements() + mg.bndPiece2linePieces.nelements() !=
+          nlps) {
+    return false;
+  }
+  for (int lp = 0; lp < nlps; lp++) {
+    int bp = mg.linePiece2bndPiece[lp];
+    int seg = mg.linePiece2seg[lp];
+    if (!RowContains(mg.line2linePieces[mg.linePiece2line[lp]], lp) ||
+        (bp != -1 &&
+         (seg != -1 || !RowContains(mg.bndPiece2linePieces[bp], lp))) ||
+        (bp == -1 && !RowContains(mg.seg2linePieces[seg], lp))) {
+      return false;
+    }
+  }
+  // lines and lineRelations
+  if (mg.line2linePieces.size() != mg.nlines() ||
+      mg.line2lineRelations.size() != mg.nlines() ||
+      mg.line2used.size() != mg.nlines() || !mg.lineSamples ||
+      mg.lineSamples->nlines() != mg.nlines()) {
+    return false;
+  }
+  int nlrs = mg.nlineRelations();
+  if (mg.lineRelations.size() != nlrs || mg.lineRelation2lines.size() != nlrs ||
+      mg.lineRelation2weight.size() != nlrs ||
+      mg.lineRelation2votes.size() != nlrs ||
+      mg.lineRelation2IsIncidence.size() != nlrs ||
+      mg.line2lineRelations.nelements() != nlrs * 2) {
+    return false;
+  }
+  for (int lr = 0; lr < nlrs; lr++) {
+    auto &lines = mg.lineRelation2lines[lr];
+    if (!RowContains(mg.line2lineRelations[lines.first], lr) ||
+        !RowContains(mg.line2lineRelations[lines.second], lr)) {
+      return false;
+    }
+  }
+  // bndPieces
+  int nbps = mg.nbndPieces();
+  if (mg.bndPiece2length.size() != nbps || mg.bndPiece2classes.size() != nbps ||
+      mg.bndPiece2bnd.size() != nbps ||
+      mg.bndPiece2linePieces.size() != nbps ||
+      mg.bndPiece2segRelation.size() != nbps ||
+      mg.bnd2bndPieces.nelements() != nbps) {
+    return false;
+  }
+  for (int bp = 0; bp < nbps; bp++) {
+    if (!RowContains(mg.bnd2bndPieces[mg.bndPiece2bnd[bp]], bp)) {
+      return false;
+    }
+  }
+  // bnds and juncs
+  int nbnds = mg.nbnds();
+  if (mg.bnd2segs.size() != nbnds || mg.bnd2juncs.size() != nbnds ||
+      mg.seg2bnds.nelements() != nbnds * 2 ||
+      mg.junc2bnds.size() != mg.njuncs() ||
+      mg.junc2bnds.nelements() != nbnds * 2) {
+    return false;
+  }
+  for (int bnd = 0; bnd < nbnds; bnd++) {
+    auto &segs = mg.bnd2segs[bnd];
+    auto &juncs = mg.bnd2juncs[bnd];
+    if (!RowContains(mg.seg2bnds[segs.first], bnd) ||
+        !RowContains(mg.seg2bnds[segs.second], bnd) ||
+        !RowContains(mg.junc2bnds[juncs.first], bnd) ||
+        !RowContains(mg.junc2bnds[juncs.second], bnd)) {
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+// BuildPIGraph
+namespace details {
+template <class CameraT>
+PIGraph<CameraT> BuildPIGraphImpl(
+    const View<CameraT> &view, const std::vector<Vec3> &vps, int verticalVPId,
     const Imagei &segs, const std::vector<Classified<Line3>> &lines,
     double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
     double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
     double incidenceAngleAlongDirectionThreshold,
-    double incidenceAngleVerticalDirectionThreshold) {
+    double incidenceAngleVerticalDirectionThreshold,
+    double lineSampleIndexAngle) {
 
-  static constexpr bool _inPerspectiveMode =
-      std::is_same<std::decay_t<decltype(view.camera)>,
-                   PerspectiveCamera>::value;
   assert(incidenceAngleVerticalDirectionThreshold >
          bndPieceBoundToLineAngleThres);
 
-  PIGraph<PanoramicCamera> mg;
+  PIGraph<CameraT> mg;
   mg.view = view;
   int width = view.image.cols;
   int height = view.image.rows;
   assert(vps.size() >= 3);
   mg.vps = std::vector<Vec3>(vps.begin(), vps.begin() + 3);
+  for (auto &vp : mg.vps) {
+    vp = normalize(vp);
+  }
   mg.verticalVPId = verticalVPId;
 
   mg.segs = segs;
@@ -466,17 +1306,28 @@ PIGraph<PanoramicCamera> BuildPIGraph(
   // init segs
 
   mg.seg2areaRatio.resize(nsegs);
-  mg.seg2bnds.resize(nsegs);
+  std::vector<std::vector<int>> seg2bnds(nsegs);
   mg.seg2center.resize(nsegs);
   mg.seg2control.resize(nsegs);
-  mg.seg2linePieces.resize(nsegs);
+  std::vector<std::vector<int>> seg2linePieces(nsegs);
   mg.seg2contours.resize(nsegs);
 
+  // areas and bounding boxes of segs in one scan
   mg.fullArea = 0.0;
-  for (auto it = mg.segs.begin(); it != mg.segs.end(); ++it) {
-    double weight = PixelWeight(view.camera, it.pos());
-    mg.seg2areaRatio[*it] += weight;
-    mg.fullArea += weight;
+  std::vector<int> seg2minx(nsegs, width), seg2maxx(nsegs, -1);
+  std::vector<int> seg2miny(nsegs, height), seg2maxy(nsegs, -1);
+  for (int y = 0; y < height; y++) {
+    double weight = PixelWeight(view.camera, Pixel(0, y));
+    const int *row = mg.segs[y];
+    for (int x = 0; x < width; x++) {
+      int seg = row[x];
+      mg.seg2areaRatio[seg] += weight;
+      mg.fullArea += weight;
+      seg2minx[seg] = std::min(seg2minx[seg], x);
+      seg2maxx[seg] = std::max(seg2maxx[seg], x);
+      seg2miny[seg] = std::min(seg2miny[seg], y);
+      seg2maxy[seg] = std::max(seg2maxy[seg], y);
+    }
   }
   for (int i = 0; i < nsegs; i++) {
     mg.seg2areaRatio[i] /= mg.fullArea;
@@ -484,98 +1335,17 @@ PIGraph<PanoramicCamera> BuildPIGraph(
     control.orientationClaz = control.orientationNotClaz = -1;
     control.used = true;
   }
-  for (int i = 0; i < nsegs; i++) {
-    Image regionMask = (mg.segs == i);
-
-    // find contour of the region
-    std::vector<std::vector<Pixel>> contours;
-    cv::findContours(regionMask, contours, CV_RETR_EXTERNAL,
-                     CV_CHAIN_APPROX_SIMPLE); // CV_RETR_EXTERNAL: get only the
-                                              // outer contours
-    if (contours.empty()) {
-      continue;
-    }
-
-    Vec3 centerDirection(0, 0, 0);
-    std::vector<Vec3> directions;
-    directions.reserve(CountOf<Pixel>(contours));
-    for (auto &cs : contours) {
-      for (auto &c : cs) {
-        directions.push_back(normalize(view.camera.toSpace(c)));
-        centerDirection += directions.back();
-      }
-    }
-    if (centerDirection != Origin()) {
-      centerDirection /= norm(centerDirection);
-    }
-
-    if (_inPerspectiveMode) {
-      // perspecive mode
-      mg.seg2contours[i].resize(contours.size());
-      mg.seg2center[i] = centerDirection;
-      for (int j = 0; j < contours.size(); j++) {
-        auto &cs = mg.seg2contours[i][j];
-        cs.reserve(contours[j].size());
-        for (auto &p : contours[j]) {
-          cs.push_back(normalize(view.camera.toSpace(p)));
-        }
-      }
-
-    } else {
-
-      // panoramic mode
-      // get max angle distance from center direction
-      double radiusAngle = 0.0;
-      for (auto &d : directions) {
-        double a = AngleBetweenDirected(centerDirection, d);
-        if (radiusAngle < a) {
-          radiusAngle = a;
-        }
-      }
-
-      // perform a more precise sample !
-      int newSampleSize = view.camera.focal() * radiusAngle * 2 + 2;
-      PartialPanoramicCamera sCam(
-          newSampleSize, newSampleSize, view.camera.focal(), view.camera.eye(),
-          centerDirection,
-          ProposeXYDirectionsFromZDirection(centerDirection).second);
-      Imagei sampledSegmentedRegions =
-          MakeCameraSampler(sCam, view.camera)(segs);
-
-      // collect better contours
-      contours.clear();
-      regionMask = (sampledSegmentedRegions == i);
-      cv::findContours(
-          regionMask, contours, CV_RETR_EXTERNAL,
-          CV_CHAIN_APPROX_SIMPLE); // CV_RETR_EXTERNAL: get only the
-                                   // outer contours
-      std::sort(contours.begin(), contours.end(),
-                [](const std::vector<Pixel> &ca, const std::vector<Pixel> &cb) {
-                  return ca.size() > cb.size();
-                });
-
-      auto iter = std::find_if(
-          contours.begin(), contours.end(),
-          [](const std::vector<Pixel> &c) { return c.size() <= 2; });
-      contours.erase(iter, contours.end());
-
-      mg.seg2contours[i].resize(contours.size());
-      mg.seg2center[i] = Origin();
-      for (int j = 0; j < contours.size(); j++) {
-        auto &cs = mg.seg2contours[i][j];
-        cs.reserve(contours[j].size());
-        for (auto &p : contours[j]) {
-          cs.push_back(normalize(sCam.toSpace(p)));
-          mg.seg2center[i] += cs.back();
-        }
-      }
-      if (mg.seg2center[i] != Origin()) {
-        mg.seg2center[i] /= norm(mg.seg2center[i]);
-      } else {
-        mg.seg2center[i] = normalize(centerDirection);
+  ParallelForRange(0, nsegs, [&](int first, int last) {
+    SegMaskSampler maskSampler;
+    for (int i = first; i < last; i++) {
+      if (seg2maxx[i] < 0) {
+        continue;
       }
+      SegContoursInBox(view, segs, i, seg2minx[i], seg2miny[i], seg2maxx[i],
+                       seg2maxy[i], maskSampler, mg.seg2contours[i],
+                       mg.seg2center[i]);
     }
-  }
+  }, -1, 8);
 
   // init lines
   mg.lines = lines;
@@ -586,542 +1356,220 @@ PIGraph<PanoramicCamera> BuildPIGraph(
     l.component = normalize(l.component);
   }
   int nlines = lines.size();
-  mg.line2linePieces.resize(nlines);
-  mg.line2lineRelations.resize(nlines);
+  std::vector<std::vector<int>> line2linePieces(nlines);
+  std::vector<std::vector<int>> line2lineRelations(nlines);
   mg.line2used.resize(nlines, true);
 
   // analyze segs, bnds, juncs ...
-  // collect real border pixels
-  std::set<Pixel> realBorderPixels;
-  if (_inPerspectiveMode) {
-    for (int x = 0; x < width; x++) {
-      realBorderPixels.insert(Pixel(x, 0));
-      realBorderPixels.insert(Pixel(x, height - 1));
-    }
-    for (int y = 0; y < height; y++) {
-      realBorderPixels.insert(Pixel(0, y));
-      realBorderPixels.insert(Pixel(width - 1, y));
-    }
-  }
-
-  std::map<std::set<int>, std::vector<int>> segs2juncs;
-  std::vector<std::vector<int>> seg2juncs(nsegs);
-  std::map<std::pair<int, int>, std::set<Pixel>> segpair2pixels;
-
-  std::map<Pixel, std::set<int>> pixel2segs;
-  std::map<Pixel, int> pixel2junc;
-
+  // boundary pixels are marked in a bitmask, their labels are stored in a
+  // hash map keyed by pixel indices
   std::vector<Pixel> juncPositions;
   std::vector<std::vector<int>> junc2segs;
 
   std::cout << "recording pixels" << std::endl;
   assert(segs.size() == view.camera.screenSize());
-  for (auto it = segs.begin(); it != segs.end(); ++it) {
-    auto p = it.pos();
-
-    // seg ids related
-    // std::set<int> idset = {segs(p), segs(Pixel((p.x + 1) % segs.cols, p.y))};
-    // if (p.y <
-    //    height - 1) { // note that the top/bottom borders cannot be crossed!
-    //  idset.insert(segs(Pixel(p.x, p.y + 1)));
-    //  idset.insert(segs(Pixel((p.x + 1) % segs.cols, p.y + 1)));
-    //}
-
-    std::set<int> idset;
-    ForEachNeighborhoodPixel(
-        p, 0, 1, 0, 1, view.camera,
-        [&idset, &segs](const Pixel &np) { idset.insert(segs(np)); });
-
-    if (idset.size() <= 1) {
-      continue;
-    }
-
-    // meet a bnd or a junc (and bnd) pixel
-    pixel2segs[p] = std::move(idset);
-    auto &relatedsegs = pixel2segs[p];
-
-    // register this pixel as a bnd candidate for bnd of related segids
-    for (auto ii = relatedsegs.begin(); ii != relatedsegs.end(); ++ii) {
-      for (auto jj = std::next(ii); jj != relatedsegs.end(); ++jj) {
-        segpair2pixels[MakeOrderedPair(*ii, *jj)].insert(p);
+  Imageb isBndPixel(segs.size(), false);
+  FlatHashMap<int, BndPixelLabels> pixel2labels;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      Pixel p(x, y);
+      BndPixelLabels bl = MakeBndPixelLabels(segs, p, view.camera);
+      if (bl.nlabels <= 1) {
+        continue;
       }
-    }
 
-    // meet a junc
-    if (relatedsegs.size() >= 3) {
-      // create a new junc
-      juncPositions.push_back(p);
-      int newjuncid = juncPositions.size() - 1;
-      pixel2junc[p] = newjuncid;
-      segs2juncs[relatedsegs].push_back(newjuncid);
-      for (int segid : relatedsegs) {
-        seg2juncs[segid].push_back(newjuncid);
+      // meet a bnd or a junc (and bnd) pixel
+      isBndPixel(p) = true;
+
+      // meet a junc
+      if (bl.nlabels >= 3) {
+        // create a new junc
+        juncPositions.push_back(p);
+        bl.juncId = juncPositions.size() - 1;
+        junc2segs.emplace_back(bl.labels, bl.labels + bl.nlabels);
       }
-      junc2segs.emplace_back(relatedsegs.begin(), relatedsegs.end());
+      pixel2labels[Sub2Ind(p, width, height)] = bl;
     }
   }
+  // the labels of a boundary pixel, none for others
+  BndPixelLabels noLabels;
+  noLabels.nlabels = 0;
+  noLabels.juncId = -1;
+  auto bndPixelLabels = [&](const Pixel &p) -> const BndPixelLabels & {
+    return isBndPixel(p) ? *pixel2labels.find(Sub2Ind(p, width, height))
+                         : noLabels;
+  };
 
   // now we have juncs
   mg.junc2positions.resize(juncPositions.size());
   for (int i = 0; i < juncPositions.size(); i++) {
     mg.junc2positions[i] = normalize(view.camera.toSpace(juncPositions[i]));
   }
-  mg.junc2bnds.resize(juncPositions.size());
+  std::vector<std::vector<int>> junc2bnds(juncPositions.size());
 
   std::cout << "connecting boundaries" << std::endl;
 
   // connect different junctions using allbndpixels
   // and thus generate seperated bnds
   std::vector<std::vector<Pixel>> bndPixels;
+  Imagei visited(segs.size(), 0);
+  int visitStamp = 0;
   for (int i = 0; i < juncPositions.size(); i++) {
-    auto &juncpos = juncPositions[i];
     auto &relatedSegIds = junc2segs[i];
-
     for (int ii = 0; ii < relatedSegIds.size(); ii++) {
       for (int jj = ii + 1; jj < relatedSegIds.size(); jj++) {
         int segi = relatedSegIds[ii];
         int segj = relatedSegIds[jj];
 
-        const auto &pixelsForThisSegPair =
-            segpair2pixels.at(MakeOrderedPair(segi, segj));
-
         std::vector<Pixel> pixelsForThisBnd;
-        std::set<Pixel> visitedPixels;
-
-        // use dfs
-        int saySegIIsOnLeft = 0, saySegIIsOnRight = 0;
-        pixelsForThisBnd.push_back(juncpos);
-        visitedPixels.insert(juncpos);
-
-        int lastDirId = 0;
-        while (true) {
-
-          auto &curp = pixelsForThisBnd.back();
-
-          // find another junc!
-          if (pixelsForThisBnd.size() > 1 && Contains(pixel2junc, curp) &&
-              i < pixel2junc.at(curp)) {
-            int tojuncid = pixel2junc.at(curp);
-
-            // make a new bnd!
-            bndPixels.push_back(std::move(pixelsForThisBnd));
-            int newbndid = bndPixels.size() - 1;
-            mg.bnd2juncs.emplace_back(i, tojuncid);
-
-            if (saySegIIsOnLeft < saySegIIsOnRight) {
-              assert(saySegIIsOnLeft == 0);
-              mg.bnd2segs.emplace_back(segj, segi); // left, right
-            } else {
-              assert(saySegIIsOnRight == 0);
-              mg.bnd2segs.emplace_back(segi, segj);
-            }
-            saySegIIsOnLeft = saySegIIsOnRight = 0;
-
-            mg.junc2bnds[i].push_back(newbndid);
-            mg.junc2bnds[tojuncid].push_back(newbndid);
-
-            mg.seg2bnds[segi].push_back(newbndid);
-            mg.seg2bnds[segj].push_back(newbndid);
-
-            break;
-          }
+        bool segiIsOnLeft = false;
+        int tojuncid = TraceBnd(segs, view.camera, bndPixelLabels, i,
+                                juncPositions[i], segi, segj, visited,
+                                ++visitStamp, pixelsForThisBnd, segiIsOnLeft);
+        if (tojuncid == -1) {
+          continue;
+        }
 
-          // * - * - *
-          // | d | a |
-          // * -[*]- *
-          // | c | b |
-          // * - * - *
-          static const int dxs[] = {1, 0, -1, 0};
-          static const int dys[] = {0, 1, 0, -1};
-
-          static const int leftdxs[] = {1, 1, 0, 0};
-          static const int leftdys[] = {0, 1, 1, 0};
-
-          static const int rightdxs[] = {1, 0, 0, 1};
-          static const int rightdys[] = {1, 1, 0, 0};
-
-          bool hasMore = false;
-          for (int kk = 0; kk < 4; kk++) {
-            int k = (lastDirId + kk + 3) % 4;
-            auto nextp = curp + Pixel(dxs[k], dys[k]);
-
-            if (!RectifyPixel(nextp, view.camera)) { // note that the top/bottom
-                                                     // borders cannot be
-                                                     // crossed!
-              continue;
-            }
-            if (!Contains(pixelsForThisSegPair, nextp)) {
-              continue;
-            }
-            if (Contains(visitedPixels, nextp)) {
-              continue;
-            }
+        // make a new bnd!
+        bndPixels.push_back(std::move(pixelsForThisBnd));
+        int newbndid = bndPixels.size() - 1;
+        mg.bnd2juncs.emplace_back(i, tojuncid);
+        if (segiIsOnLeft) {
+          mg.bnd2segs.emplace_back(segi, segj); // left, right
+        } else {
+          mg.bnd2segs.emplace_back(segj, segi);
+        }
 
-            auto rightp = curp + Pixel(rightdxs[k], rightdys[k]);
-            RectifyPixel(rightp, view.camera);
-            auto leftp = curp + Pixel(leftdxs[k], leftdys[k]);
-            RectifyPixel(leftp, view.camera);
-            if (Contains(segs, rightp) && Contains(segs, leftp)) {
-              if (segs(rightp) == segi && segs(leftp) == segj) {
-                saySegIIsOnRight++;
-              } else if (segs(rightp) == segj && segs(leftp) == segi) {
-                saySegIIsOnLeft++;
-              } else {
-                continue;
-              }
-            }
+        junc2bnds[i].push_back(newbndid);
+        junc2bnds[tojuncid].push_back(newbndid);
 
-            pixelsForThisBnd.push_back(nextp);
-            visitedPixels.insert(nextp);
-            lastDirId = k;
-            hasMore = true;
-            break;
-          }
-
-          if (!hasMore) {
-            break;
-          }
-        }
+        seg2bnds[segi].push_back(newbndid);
+        seg2bnds[segj].push_back(newbndid);
       }
     }
   }
 
   // split bnds into pieces
   std::cout << "splitting boundaries" << std::endl;
-  std::vector<std::vector<Vec3>> bnd2SmoothedDirs(bndPixels.size());
-  const double bndSampleAngle = 1.1 / mg.view.camera.focal();
+  std::vector<std::vector<Vec3>> bndPiece2dirs;
+  std::vector<std::vector<int>> bnd2bndPieces(mg.bnd2segs.size());
   for (int i = 0; i < bndPixels.size(); i++) {
-    assert(bndPixels[i].size() >= 2);
-    auto &smoothedDirs = bnd2SmoothedDirs[i];
-    for (int j = 0; j < bndPixels[i].size() - 1; j++) {
-      auto &pixel = bndPixels[i][j];
-      auto dir = normalize(view.camera.toSpace(pixel));
-      if (smoothedDirs.empty() ||
-          AngleBetweenDirected(smoothedDirs.back(), dir) >= bndSampleAngle) {
-        smoothedDirs.push_back(dir);
-      }
-    }
-    smoothedDirs.push_back(normalize(view.camera.toSpace(bndPixels[i].back())));
-    assert(smoothedDirs.size() >= 2);
-  }
-  mg.bnd2bndPieces.resize(mg.bnd2segs.size());
-  for (int i = 0; i < bnd2SmoothedDirs.size(); i++) {
-    const auto &dirs = bnd2SmoothedDirs[i];
-    assert(dirs.size() > 0);
-
-    std::vector<Vec3> curPiece = {dirs.front()};
-    for (int j = 1; j <= dirs.size(); j++) {
-      if (j < dirs.size() && AllAlong(curPiece, curPiece.front(), dirs[j],
-                                      bndPieceSplitAngleThres)) {
-        curPiece.push_back(dirs[j]);
-      } else {
-        if (curPiece.size() >= 2) {
-          mg.bndPiece2dirs.push_back(std::move(curPiece));
-          mg.bndPiece2bnd.push_back(i);
-          int bndPieceId = mg.bndPiece2dirs.size() - 1;
-          mg.bnd2bndPieces[i].push_back(bndPieceId);
-          curPiece.clear();
-        }
-        if (j < dirs.size()) {
-          curPiece.push_back(dirs[j]);
-        }
-      }
+    for (auto &piece : SplitBndDirs(SmoothedBndDirs(bndPixels[i], view.camera),
+                                    bndPieceSplitAngleThres)) {
+      bndPiece2dirs.push_back(std::move(piece));
+      mg.bndPiece2bnd.push_back(i);
+      bnd2bndPieces[i].push_back(bndPiece2dirs.size() - 1);
     }
   }
 
   // bndPieces properties
   // classes
   std::cout << "classifying boundary pieces" << std::endl;
-  mg.bndPiece2classes.resize(mg.bndPiece2dirs.size(), -1);
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    auto &piece = mg.bndPiece2dirs[i];
-    assert(piece.size() > 1);
-    Vec3 center = piece[piece.size() / 2];
-    mg.bndPiece2classes[i] = -1;
-    assert(vps.size() >= 3);
-    for (int j = 0; j < 3; j++) {
-      if (AllAlong(piece, center, vps[j], bndPieceClassifyAngleThres)) {
-        mg.bndPiece2classes[i] = j;
-        break;
-      }
-    }
+  mg.bndPiece2classes.resize(bndPiece2dirs.size(), -1);
+  for (int i = 0; i < bndPiece2dirs.size(); i++) {
+    mg.bndPiece2classes[i] =
+        BndPieceClass(bndPiece2dirs[i], mg.vps, bndPieceClassifyAngleThres);
   }
   // lengths
-  mg.bndPiece2length.resize(mg.bndPiece2dirs.size(), 0);
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    auto &piece = mg.bndPiece2dirs[i];
-    for (int j = 1; j < piece.size(); j++) {
-      mg.bndPiece2length[i] += AngleBetweenDirected(piece[j - 1], piece[j]);
-    }
+  mg.bndPiece2length.resize(bndPiece2dirs.size(), 0);
+  for (int i = 0; i < bndPiece2dirs.size(); i++) {
+    mg.bndPiece2length[i] = BndPieceLength(bndPiece2dirs[i]);
   }
-  mg.bndPiece2linePieces.resize(mg.bndPiece2dirs.size());
-  mg.bndPiece2segRelation.resize(mg.bndPiece2dirs.size(), SegRelation::Unknown);
+  std::vector<std::vector<int>> bndPiece2linePieces(bndPiece2dirs.size());
+  mg.bndPiece2segRelation.resize(bndPiece2dirs.size(), SegRelation::Unknown);
 
-  // register bndPiece dirs in RTree
-  RTreeMap<Vec3, int> bndPieceRTree;
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    for (auto &d : mg.bndPiece2dirs[i]) {
-      bndPieceRTree.emplace(normalize(d), i);
+  // rasterize bndPiece dirs to find the nearest bndPiece of line samples
+  std::vector<Vec3> bndPieceDirs;
+  std::vector<int> bndPieceDir2bndPiece;
+  for (int i = 0; i < bndPiece2dirs.size(); i++) {
+    for (auto &d : bndPiece2dirs[i]) {
+      bndPieceDirs.push_back(d);
+      bndPieceDir2bndPiece.push_back(i);
     }
   }
-  RTreeMap<Vec3, int> lineRTree;
+  NearestDirectionIndex<CameraT> nearestBndPieceDirIndex(
+      view.camera, bndPieceDirs, bndPieceBoundToLineAngleThres);
+
   const double lineSampleAngle = bndPieceBoundToLineAngleThres / 5.0;
   std::vector<std::vector<Vec3>> lineSamples(mg.lines.size());
   for (int i = 0; i < mg.lines.size(); i++) {
-    auto &line = mg.lines[i];
-    double angle =
-        AngleBetweenDirected(line.component.first, line.component.second);
-    for (double a = 0; a <= angle; a += lineSampleAngle) {
-      Vec3 sample = normalize(
-          RotateDirection(line.component.first, line.component.second, a));
-      lineSamples[i].push_back(sample);
-      lineRTree.emplace(sample, i);
+    lineSamples[i] = LineSamples(mg.lines[i].component, lineSampleAngle);
+  }
+
+  // split lines to linePieces, in parallel over lines, the pieces are then
+  // registered in the order of lines
+  std::vector<std::vector<LinePieceData>> line2linePieceData(mg.lines.size());
+  ParallelForRange(0, mg.lines.size(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      line2linePieceData[i] = SplitLine(
+          lineSamples[i],
+          [&](const Vec3 &d) {
+            int bndPieceDirId = nearestBndPieceDirIndex.nearest(view.camera, d);
+            return bndPieceDirId == -1 ? -1
+                                       : bndPieceDir2bndPiece[bndPieceDirId];
+          },
+          [&](const Vec3 &d) {
+            return segs(BoundPixel(ToPixel(view.camera.toScreen(d)),
+                                   view.camera));
+          });
     }
-  }
-
-  // split lines to linePieces
+  });
+  std::vector<std::vector<Vec3>> linePiece2samples;
   for (int i = 0; i < mg.lines.size(); i++) {
     Vec3 lineRotNormal = normalize(
         mg.lines[i].component.first.cross(mg.lines[i].component.second));
-    auto &samples = lineSamples[i];
-    int lastDetectedBndPiece = -1;
-    int lastDetectedSeg = -1;
-    std::vector<Vec3> collectedSamples;
-    for (int j = 0; j <= samples.size(); j++) {
-      double minAngleDist = bndPieceBoundToLineAngleThres;
-      int nearestBndPiece = -1;
-      int nearestSeg = -1;
-      if (j < samples.size()) {
-        auto &d = samples[j];
-        bndPieceRTree.search(
-            BoundingBox(d).expand(
-                std::max(bndSampleAngle, bndPieceBoundToLineAngleThres) * 3),
-            [&d, &minAngleDist,
-             &nearestBndPiece](const std::pair<Vec3, int> &bndPieceD) {
-              double angleDist = AngleBetweenDirected(bndPieceD.first, d);
-              if (angleDist < minAngleDist) {
-                minAngleDist = angleDist;
-                nearestBndPiece = bndPieceD.second;
-              }
-              return true;
-            });
-        auto pixel = ToPixel(view.camera.toScreen(d));
-        pixel.x = WrapBetween(pixel.x, 0, width);
-        pixel.y = BoundBetween(pixel.y, 0, height - 1);
-        nearestSeg = segs(pixel);
-      }
-      bool neighborChanged =
-          (nearestBndPiece != lastDetectedBndPiece ||
-           (nearestBndPiece == -1 && lastDetectedSeg != nearestSeg) ||
-           j == samples.size() - 1) &&
-          !(lastDetectedBndPiece == -1 && lastDetectedSeg == -1);
-      if (neighborChanged) {
-        double len = AngleBetweenDirected(collectedSamples.front(),
-                                            collectedSamples.back());
-        if (collectedSamples.size() >= 2) {
-          if (lastDetectedBndPiece != -1) { // line piece bound to bnd piece
-            mg.linePiece2bndPiece.push_back(lastDetectedBndPiece);
-            int linePieceId = mg.linePiece2bndPiece.size() - 1;
-            mg.line2linePieces[i].push_back(linePieceId);
-            mg.linePiece2line.push_back(i);
-            mg.linePiece2samples.push_back(std::move(collectedSamples));
-            mg.linePiece2length.push_back(len);
-            mg.linePiece2seg.push_back(-1);
-            mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
-            auto &bndPieceDirs = mg.bndPiece2dirs[lastDetectedBndPiece];
-            assert(bndPieceDirs.size() > 1);
-            Vec3 bndRotNormal = bndPieceDirs.front().cross(bndPieceDirs.back());
-            mg.linePiece2bndPieceInSameDirection.push_back(
-                lineRotNormal.dot(bndRotNormal) > 0);
-            mg.bndPiece2linePieces[lastDetectedBndPiece].push_back(linePieceId);
-          } else { // line piece bound to seg
-            mg.linePiece2bndPiece.push_back(-1);
-            int linePieceId = mg.linePiece2bndPiece.size() - 1;
-            mg.line2linePieces[i].push_back(linePieceId);
-            mg.linePiece2line.push_back(i);
-            mg.linePiece2samples.push_back(std::move(collectedSamples));
-            mg.linePiece2length.push_back(len);
-            mg.linePiece2seg.push_back(lastDetectedSeg);
-            mg.seg2linePieces[lastDetectedSeg].push_back(linePieceId);
-            mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
-            mg.linePiece2bndPieceInSameDirection.push_back(true);
-          }
-        }
-        collectedSamples.clear();
-      }
-      if (j < samples.size()) {
-        collectedSamples.push_back(samples[j]);
+    for (auto &lpd : line2linePieceData[i]) {
+      mg.linePiece2bndPiece.push_back(lpd.bndPiece);
+      int linePieceId = mg.linePiece2bndPiece.size() - 1;
+      line2linePieces[i].push_back(linePieceId);
+      mg.linePiece2line.push_back(i);
+      linePiece2samples.push_back(std::move(lpd.samples));
+      mg.linePiece2length.push_back(lpd.length);
+      mg.linePiece2seg.push_back(lpd.seg);
+      mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
+      if (lpd.bndPiece != -1) { // line piece bound to bnd piece
+        auto &pieceDirs = bndPiece2dirs[lpd.bndPiece];
+        assert(pieceDirs.size() > 1);
+        Vec3 bndRotNormal = pieceDirs.front().cross(pieceDirs.back());
+        mg.linePiece2bndPieceInSameDirection.push_back(
+            lineRotNormal.dot(bndRotNormal) > 0);
+        bndPiece2linePieces[lpd.bndPiece].push_back(linePieceId);
+      } else { // line piece bound to seg
+        seg2linePieces[lpd.seg].push_back(linePieceId);
+        mg.linePiece2bndPieceInSameDirection.push_back(true);
       }
-
-      lastDetectedBndPiece = nearestBndPiece;
-      lastDetectedSeg = nearestSeg;
     }
   }
 
   // build line relations
-  for (int i = 0; i < mg.lines.size(); i++) {
-    for (int j = i + 1; j < mg.lines.size(); j++) {
-      auto &linei = mg.lines[i].component;
-      int clazi = mg.lines[i].claz;
-      Vec3 ni = normalize(linei.first.cross(linei.second));
-      auto &linej = mg.lines[j].component;
-      int clazj = mg.lines[j].claz;
-      Vec3 nj = normalize(linej.first.cross(linej.second));
-
-      auto nearest = DistanceBetweenTwoLines(linei, linej);
-      double d = AngleBetweenDirected(nearest.second.first.position,
-                                        nearest.second.second.position);
-
-      if (clazi == clazj && clazi >= 0) { // incidences for classified lines
-        auto conCenter = normalize(nearest.second.first.position +
-                                   nearest.second.second.position);
-        auto conDir =
-            (nearest.second.first.position - nearest.second.second.position);
-
-        auto &vp = vps[clazi];
-
-        if (AngleBetweenDirected(vp, conCenter) < intersectionAngleThreshold)
-          continue;
-
-        if (d < incidenceAngleAlongDirectionThreshold &&
-            AngleBetweenUndirected(ni, nj) <
-                incidenceAngleVerticalDirectionThreshold) {
-          // LineRelationData lrd;
-          // lrd.type = LineRelationData::Type::Incidence;
-          // lrd.normalizedRelationCenter = conCenter;
-          // lrd.junctionWeight = 5.0;
-
-          if (HasValue(conCenter, IsInfOrNaN<double>))
-            continue;
-
-          mg.lineRelations.push_back(LineRelation::Unknown);
-          mg.lineRelation2lines.emplace_back(i, j);
-          int lineRelationId = mg.lineRelation2lines.size() - 1;
-          mg.line2lineRelations[i].push_back(lineRelationId);
-          mg.line2lineRelations[j].push_back(lineRelationId);
-          mg.lineRelation2anchor.push_back(conCenter);
-          mg.lineRelation2weight.push_back(5.0);
-          mg.lineRelation2IsIncidence.push_back(true);
-
-          // mg.addConstraint(std::move(lrd), lhs[i], lhs[j]);
-        }
-
-      } else if (clazi != clazj && clazi >= 0 &&
-                 clazj >= 0) { // intersections for classified lines
-        if (d < intersectionAngleThreshold) {
-          auto conCenter = normalize(ni.cross(nj));
-
-          if (Distance(conCenter, linei) > intersectionAngleThreshold * 4 ||
-              Distance(conCenter, linej) > intersectionAngleThreshold * 4)
-            continue;
-
-          // LineRelationData lrd;
-          // lrd.type = LineRelationData::Type::Intersection;
-          // lrd.normalizedRelationCenter = conCenter;
-          // lrd.junctionWeight = 3.0;
-
-          if (HasValue(conCenter, IsInfOrNaN<double>))
-            continue;
-
-          mg.lineRelations.push_back(LineRelation::Unknown);
-          mg.lineRelation2lines.emplace_back(i, j);
-          int lineRelationId = mg.lineRelation2lines.size() - 1;
-          mg.line2lineRelations[i].push_back(lineRelationId);
-          mg.line2lineRelations[j].push_back(lineRelationId);
-          mg.lineRelation2anchor.push_back(conCenter);
-          mg.lineRelation2weight.push_back(3.0);
-          mg.lineRelation2IsIncidence.push_back(false);
-
-          // mg.addConstraint(std::move(lrd), lhs[i], lhs[j]);
-        }
-      }
-    }
-  }
-
-  // line relation weights
-  // compute junction weights
-  static const double angleThreshold = M_PI / 32;
-  static const double sigma = 0.1;
-
-  enum LineVotingDirection : int {
-    TowardsVanishingPoint = 0,
-    TowardsOppositeOfVanishingPoint = 1
-  };
-  enum class JunctionType : int { L, T, Y, W, X };
-  for (int i = 0; i < mg.lineRelation2lines.size(); i++) {
-    // std::cout << lr.topo.hd.id << std::endl;
-    if (mg.lineRelation2IsIncidence[i]) {
-      mg.lineRelation2weight[i] = IncidenceJunctionWeight(false);
-    } else {
-      Mat<float, 3, 2> votingData;
-      std::fill(std::begin(votingData), std::end(votingData), 0);
-
-      for (int lineid = 0; lineid < mg.lines.size(); lineid++) {
-        auto &line = mg.lines[lineid].component;
-        int claz = mg.lines[lineid].claz;
-        if (claz == -1 || claz >= 3)
-          continue;
-
-        auto &vp = vps[claz];
-        Vec3 center = normalize(line.center());
-
-        Vec3 center2vp = normalize(center.cross(vp));
-        Vec3 center2pos = normalize(center.cross(mg.lineRelation2anchor[i]));
-
-        double angle = AngleBetweenUndirected(center2vp, center2pos);
-        double angleSmall = angle > M_PI_2 ? (M_PI - angle) : angle;
-        if (IsInfOrNaN(angleSmall))
-          continue;
-
-        assert(angleSmall >= 0 && angleSmall <= M_PI_2);
-
-        double angleScore =
-            exp(-(angleSmall / angleThreshold) * (angleSmall / angleThreshold) /
-                sigma / sigma / 2);
-
-        auto proj = ProjectionOfPointOnLine(mg.lineRelation2anchor[i], line);
-        double projRatio = BoundBetween(proj.ratio, 0.0, 1.0);
-
-        Vec3 lined = line.first.cross(line.second);
-        double lineSpanAngle = AngleBetweenDirected(line.first, line.second);
-        if (AngleBetweenDirected(center2vp, lined) <
-            M_PI_2) { // first-second-vp
-          votingData(claz, TowardsVanishingPoint) +=
-              angleScore * lineSpanAngle * (1 - projRatio);
-          votingData(claz, TowardsOppositeOfVanishingPoint) +=
-              angleScore * lineSpanAngle * projRatio;
-        } else { // vp-first-second
-          votingData(claz, TowardsOppositeOfVanishingPoint) +=
-              angleScore * lineSpanAngle * (1 - projRatio);
-          votingData(claz, TowardsVanishingPoint) +=
-              angleScore * lineSpanAngle * projRatio;
-        }
-      }
-      mg.lineRelation2weight[i] = std::max(
-          0.1f, ComputeIntersectionJunctionWeightWithLinesVotes(votingData));
-    }
-  }
-
-  // normalize all directions
-  for (auto &ds : mg.bndPiece2dirs) {
-    for (auto &d : ds) {
-      d = normalize(d);
-    }
-  }
-  for (auto &d : mg.junc2positions) {
-    d = normalize(d);
-  }
-  for (auto &ds : mg.linePiece2samples) {
-    for (auto &d : ds) {
-      d = normalize(d);
-    }
-  }
-  for (auto &d : mg.lineRelation2anchor) {
-    d = normalize(d);
-  }
-  for (auto &l : mg.lines) {
-    l.component = normalize(l.component);
-  }
+  auto lineRelationData = FindLineRelations(
+      mg.lines, mg.vps, intersectionAngleThreshold,
+      incidenceAngleAlongDirectionThreshold,
+      incidenceAngleVerticalDirectionThreshold);
+  for (auto &lrd : lineRelationData) {
+    mg.lineRelations.push_back(LineRelation::Unknown);
+    mg.lineRelation2lines.emplace_back(lrd.line1, lrd.line2);
+    int lineRelationId = mg.lineRelation2lines.size() - 1;
+    line2lineRelations[lrd.line1].push_back(lineRelationId);
+    line2lineRelations[lrd.line2].push_back(lineRelationId);
+    mg.lineRelation2anchor.push_back(lrd.anchor);
+    mg.lineRelation2IsIncidence.push_back(lrd.isIncidence);
+  }
+
+  // freeze the adjacencies into compressed rows
+  mg.seg2bnds = CompressedRows<int>(seg2bnds);
+  mg.seg2linePieces = CompressedRows<int>(seg2linePieces);
+  mg.linePiece2samples = CompressedRows<Vec3>(linePiece2samples);
+  mg.line2linePieces = CompressedRows<int>(line2linePieces);
+  mg.line2lineRelations = CompressedRows<int>(line2lineRelations);
+  mg.bndPiece2dirs = CompressedRows<Vec3>(bndPiece2dirs);
+  mg.bndPiece2linePieces = CompressedRows<int>(bndPiece2linePieces);
+  mg.bnd2bndPieces = CompressedRows<int>(bnd2bndPieces);
+  mg.junc2bnds = CompressedRows<int>(junc2bnds);
+
+  // normalize all directions, vps, juncs, bnd pieces, lines, their samples
+  // and the anchors of their relations are normalized when they are made, as
+  // in the updates of the graph
   for (auto &d : mg.seg2center) {
     d = normalize(d);
   }
@@ -1132,14 +1580,19 @@ PIGraph<PanoramicCamera> BuildPIGraph(
       }
     }
   }
-  for (auto &vp : mg.vps) {
-    vp = normalize(vp);
-  }
 
+  // line relation weights, voted by the normalized lines as in the updates of
+  // lines
+  UpdateLineRelationWeights(mg);
+
+  // line samples on the normalized lines
+  mg.lineSamples =
+      std::make_shared<const LineSampleIndex>(mg.lines, lineSampleIndexAngle);
+
+  assert(IsConsistent(mg));
   return mg;
 }
-
-#endif
+}
 
 PIGraph<PanoramicCamera> BuildPIGraph(
     const PanoramicView &view, const std::vector<Vec3> &vps, int verticalVPId,
@@ -1147,739 +1600,706 @@ PIGraph<PanoramicCamera> BuildPIGraph(
     double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
     double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
     double incidenceAngleAlongDirectionThreshold,
-    double incidenceAngleVerticalDirectionThreshold) {
-
-  static constexpr bool _inPerspectiveMode =
-      std::is_same<std::decay_t<decltype(view.camera)>,
-                   PerspectiveCamera>::value;
-  assert(incidenceAngleVerticalDirectionThreshold >
-         bndPieceBoundToLineAngleThres);
-
-  PIGraph<PanoramicCamera> mg;
-  mg.view = view;
-  int width = view.image.cols;
-  int height = view.image.rows;
-  assert(vps.size() >= 3);
-  mg.vps = std::vector<Vec3>(vps.begin(), vps.begin() + 3);
-  mg.verticalVPId = verticalVPId;
+    double incidenceAngleVerticalDirectionThreshold,
+    double lineSampleIndexAngle) {
+  return details::BuildPIGraphImpl(
+      view, vps, verticalVPId, segs, lines, bndPieceSplitAngleThres,
+      bndPieceClassifyAngleThres, bndPieceBoundToLineAngleThres,
+      intersectionAngleThreshold, incidenceAngleAlongDirectionThreshold,
+      incidenceAngleVerticalDirectionThreshold, lineSampleIndexAngle);
+}
 
-  mg.segs = segs;
-  int nsegs = MinMaxValOfImage(segs).second + 1;
-  mg.nsegs = nsegs;
+//PIGraph<PanoramicCamera>
+//BuildPIGraph(const PanoramicView &view, const std::vector<Vec3> &vps,
+//             int verticalVPId, const std::vector<Classified<Line3>> &lines,
+//             double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
+//             double bndPieceBoundToLineAngleThres,
+//             double intersectionAngleThreshold,
+//             double incidenceAngleAlongDirectionThreshold,
+//             double incidenceAngleVerticalDirectionThreshold) {
+//
+//  Imagei segs;
+//  int nsegs = SegmentationForPIGraph(view, lines, segs, DegreesToRadians(5));
+//
+//  RemoveThinRegionInSegmentation(segs, 1, true);
+//  RemoveSmallRegionInSegmentation(segs, 100, true);
+//  RemoveDanglingPixelsInSegmentation(segs, true);
+//  nsegs = DensifySegmentation(segs, true);
+//
+//  return BuildPIGraph(view, vps, verticalVPId, segs, lines,
+//                      bndPieceSplitAngleThres, bndPieceClassifyAngleThres,
+//                      bndPieceBoundToLineAngleThres, intersectionAngleThreshold,
+//                      incidenceAngleAlongDirectionThreshold,
+//                      incidenceAngleVerticalDirectionThreshold);
+//}
 
-  // init segs
+PIGraph<PerspectiveCamera> BuildPIGraph(
+    const PerspectiveView &view, const std::vector<Vec3> &vps, int verticalVPId,
+    const Imagei &segs, const std::vector<Classified<Line3>> &lines,
+    double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
+    double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
+    double incidenceAngleAlongDirectionThreshold,
+    double incidenceAngleVerticalDirectionThreshold,
+    double lineSampleIndexAngle) {
+  return details::BuildPIGraphImpl(
+      view, vps, verticalVPId, segs, lines, bndPieceSplitAngleThres,
+      bndPieceClassifyAngleThres, bndPieceBoundToLineAngleThres,
+      intersectionAngleThreshold, incidenceAngleAlongDirectionThreshold,
+      incidenceAngleVerticalDirectionThreshold, lineSampleIndexAngle);
+}
 
-  mg.seg2areaRatio.resize(nsegs);
-  mg.seg2bnds.resize(nsegs);
-  mg.seg2center.resize(nsegs);
-  mg.seg2control.resize(nsegs);
-  mg.seg2linePieces.resize(nsegs);
-  mg.seg2contours.resize(nsegs);
 
-  mg.fullArea = 0.0;
-  for (auto it = mg.segs.begin(); it != mg.segs.end(); ++it) {
-    double weight = PixelWeight(view.camera, it.pos());
-    mg.seg2areaRatio[*it] += weight;
-    mg.fullArea += weight;
-  }
-  for (int i = 0; i < nsegs; i++) {
-    mg.seg2areaRatio[i] /= mg.fullArea;
-    auto &control = mg.seg2control[i];
-    control.orientationClaz = control.orientationNotClaz = -1;
-    control.used = true;
-  }
-  for (int i = 0; i < nsegs; i++) {
-    Image regionMask = (mg.segs == i);
 
-    // find contour of the region
-    std::vector<std::vector<Pixel>> contours;
-    cv::findContours(regionMask, contours, CV_RETR_EXTERNAL,
-                     CV_CHAIN_APPROX_SIMPLE); // CV_RETR_EXTERNAL: get only the
-                                              // outer contours
-    if (contours.empty()) {
-      continue;
-    }
 
-    Vec3 centerDirection(0, 0, 0);
-    std::vector<Vec3> directions;
-    directions.reserve(CountOf<Pixel>(contours));
-    for (auto &cs : contours) {
-      for (auto &c : cs) {
-        directions.push_back(normalize(view.camera.toSpace(c)));
-        centerDirection += directions.back();
-      }
-    }
-    if (centerDirection != Origin()) {
-      centerDirection /= norm(centerDirection);
-    }
 
-    if (_inPerspectiveMode) {
-      // perspecive mode
-      mg.seg2contours[i].resize(contours.size());
-      mg.seg2center[i] = centerDirection;
-      for (int j = 0; j < contours.size(); j++) {
-        auto &cs = mg.seg2contours[i][j];
-        cs.reserve(contours[j].size());
-        for (auto &p : contours[j]) {
-          cs.push_back(normalize(view.camera.toSpace(p)));
-        }
-      }
-
-    } else {
 
-      // panoramic mode
-      // get max angle distance from center direction
-      double radiusAngle = 0.0;
-      for (auto &d : directions) {
-        double a = AngleBetweenDirected(centerDirection, d);
-        if (radiusAngle < a) {
-          radiusAngle = a;
-        }
-      }
 
-      // perform a more precise sample !
-      int newSampleSize = view.camera.focal() * radiusAngle * 2 + 2;
-      PartialPanoramicCamera sCam(
-          newSampleSize, newSampleSize, view.camera.focal(), view.camera.eye(),
-          centerDirection,
-          ProposeXYDirectionsFromZDirection(centerDirection).second);
-      Imagei sampledSegmentedRegions =
-          MakeCameraSampler(sCam, view.camera)(segs);
-
-      // collect better contours
-      contours.clear();
-      regionMask = (sampledSegmentedRegions == i);
-      cv::findContours(
-          regionMask, contours, CV_RETR_EXTERNAL,
-          CV_CHAIN_APPROX_SIMPLE); // CV_RETR_EXTERNAL: get only the
-                                   // outer contours
-      std::sort(contours.begin(), contours.end(),
-                [](const std::vector<Pixel> &ca, const std::vector<Pixel> &cb) {
-                  return ca.size() > cb.size();
-                });
-
-      auto iter = std::find_if(
-          contours.begin(), contours.end(),
-          [](const std::vector<Pixel> &c) { return c.size() <= 2; });
-      contours.erase(iter, contours.end());
-
-      mg.seg2contours[i].resize(contours.size());
-      mg.seg2center[i] = Origin();
-      for (int j = 0; j < contours.size(); j++) {
-        auto &cs = mg.seg2contours[i][j];
-        cs.reserve(contours[j].size());
-        for (auto &p : contours[j]) {
-          cs.push_back(normalize(sCam.toSpace(p)));
-          mg.seg2center[i] += cs.back();
-        }
-      }
-      if (mg.seg2center[i] != Origin()) {
-        mg.seg2center[i] /= norm(mg.seg2center[i]);
-      } else {
-        mg.seg2center[i] = normalize(centerDirection);
-      }
+// PIGraph updates
+namespace details {
+// new ids of n elements after erasing those with erased(i), -1 for them
+template <class PredT> std::vector<int> CompactIds(int n, PredT erased) {
+  std::vector<int> newIds(n, -1);
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    if (!erased(i)) {
+      newIds[i] = m++;
     }
   }
+  return newIds;
+}
 
-  // init lines
-  mg.lines = lines;
-  for (auto &l : mg.lines) {
-    if (l.claz >= mg.vps.size()) {
-      l.claz = -1;
+// erases the elements with new ids -1, and moves the rest to their new ids
+template <class T>
+void EraseElements(std::vector<T> &v, const std::vector<int> &newIds) {
+  assert(v.size() == newIds.size());
+  int m = 0;
+  for (int i = 0; i < v.size(); i++) {
+    if (newIds[i] != -1) {
+      assert(newIds[i] == m);
+      v[m++] = std::move(v[i]);
     }
-    l.component = normalize(l.component);
   }
-  int nlines = lines.size();
-  mg.line2linePieces.resize(nlines);
-  mg.line2lineRelations.resize(nlines);
-  mg.line2used.resize(nlines, true);
-
-  // analyze segs, bnds, juncs ...
-  // collect real border pixels
-  std::set<Pixel> realBorderPixels;
-  if (_inPerspectiveMode) {
-    for (int x = 0; x < width; x++) {
-      realBorderPixels.insert(Pixel(x, 0));
-      realBorderPixels.insert(Pixel(x, height - 1));
-    }
-    for (int y = 0; y < height; y++) {
-      realBorderPixels.insert(Pixel(0, y));
-      realBorderPixels.insert(Pixel(width - 1, y));
+  v.resize(m);
+}
+template <class T>
+void EraseElements(CompressedRows<T> &rows, const std::vector<int> &newIds) {
+  assert(rows.size() == newIds.size());
+  for (int i = newIds.size() - 1; i >= 0; i--) {
+    if (newIds[i] == -1) {
+      rows.eraseRow(i);
     }
   }
+}
 
-  std::map<std::set<int>, std::vector<int>> segs2juncs;
-  std::vector<std::vector<int>> seg2juncs(nsegs);
-  std::map<std::pair<int, int>, std::set<Pixel>> segpair2pixels;
-
-  std::map<Pixel, std::set<int>> pixel2segs;
-  std::map<Pixel, int> pixel2junc;
-
-  std::vector<Pixel> juncPositions;
-  std::vector<std::vector<int>> junc2segs;
-
-  std::cout << "recording pixels" << std::endl;
-  assert(segs.size() == view.camera.screenSize());
-  for (auto it = segs.begin(); it != segs.end(); ++it) {
-    auto p = it.pos();
+// maps ids with newIds, ids mapped to -1 are erased from rows
+inline void RemapIds(CompressedRows<int> &rows,
+                     const std::vector<int> &newIds) {
+  rows.eraseIf([&newIds](int id) { return newIds[id] == -1; });
+  for (int &id : rows.data()) {
+    id = newIds[id];
+  }
+}
+inline void RemapIds(std::vector<int> &ids, const std::vector<int> &newIds) {
+  for (int &id : ids) {
+    if (id != -1) {
+      id = newIds[id];
+    }
+  }
+}
 
-    std::set<int> idset;
+// SplitLineByNearBndPieces
+// splits a line of mg as BuildPIGraph does, the nearest bnd piece dirs of its
+// samples are searched among the bnd pieces of the segs in the pixel windows
+// around them, since a bnd piece dir within bndPieceBoundToLineAngleThres of a
+// sample is at a pixel of the window labeled with a seg of its bnd
+template <class CameraT>
+std::vector<LinePieceData>
+SplitLineByNearBndPieces(const PIGraph<CameraT> &mg, const Line3 &line,
+                         double bndPieceBoundToLineAngleThres) {
+  auto &cam = mg.view.camera;
+  auto samples = LineSamples(line, bndPieceBoundToLineAngleThres / 5.0);
+  std::vector<uint8_t> segIsNear(mg.nsegs, false);
+  for (auto &d : samples) {
+    Point2 c = cam.toScreen(d);
+    int dx, dy;
+    PIGraphCameraTraits<CameraT>::pixelWindow(
+        cam, c, bndPieceBoundToLineAngleThres, dx, dy);
     ForEachNeighborhoodPixel(
-        p, 0, 1, 0, 1, view.camera,
-        [&idset, &segs](const Pixel &np) { idset.insert(segs(np)); });
-
-    if (idset.size() <= 1) {
+        BoundPixel(ToPixel(c), cam), -dx, dx, -dy, dy, cam,
+        [&mg, &segIsNear](const Pixel &p) { segIsNear[mg.segs(p)] = true; });
+  }
+  std::vector<int> nearBndPieces;
+  for (int seg = 0; seg < mg.nsegs; seg++) {
+    if (!segIsNear[seg]) {
       continue;
     }
-
-    // meet a bnd or a junc (and bnd) pixel
-    pixel2segs[p] = std::move(idset);
-    auto &relatedsegs = pixel2segs[p];
-
-    // register this pixel as a bnd candidate for bnd of related segids
-    for (auto ii = relatedsegs.begin(); ii != relatedsegs.end(); ++ii) {
-      for (auto jj = std::next(ii); jj != relatedsegs.end(); ++jj) {
-        segpair2pixels[MakeOrderedPair(*ii, *jj)].insert(p);
-      }
-    }
-
-    // meet a junc
-    if (relatedsegs.size() >= 3) {
-      // create a new junc
-      juncPositions.push_back(p);
-      int newjuncid = juncPositions.size() - 1;
-      pixel2junc[p] = newjuncid;
-      segs2juncs[relatedsegs].push_back(newjuncid);
-      for (int segid : relatedsegs) {
-        seg2juncs[segid].push_back(newjuncid);
+    for (int bnd : mg.seg2bnds[seg]) {
+      for (int bp : mg.bnd2bndPieces[bnd]) {
+        nearBndPieces.push_back(bp);
       }
-      junc2segs.emplace_back(relatedsegs.begin(), relatedsegs.end());
     }
   }
-
-  // now we have juncs
-  mg.junc2positions.resize(juncPositions.size());
-  for (int i = 0; i < juncPositions.size(); i++) {
-    mg.junc2positions[i] = normalize(view.camera.toSpace(juncPositions[i]));
-  }
-  mg.junc2bnds.resize(juncPositions.size());
-
-  std::cout << "connecting boundaries" << std::endl;
-
-  // connect different junctions using allbndpixels
-  // and thus generate seperated bnds
-  std::vector<std::vector<Pixel>> bndPixels;
-  for (int i = 0; i < juncPositions.size(); i++) {
-    auto &juncpos = juncPositions[i];
-    auto &relatedSegIds = junc2segs[i];
-
-    for (int ii = 0; ii < relatedSegIds.size(); ii++) {
-      for (int jj = ii + 1; jj < relatedSegIds.size(); jj++) {
-        int segi = relatedSegIds[ii];
-        int segj = relatedSegIds[jj];
-
-        const auto &pixelsForThisSegPair =
-            segpair2pixels.at(MakeOrderedPair(segi, segj));
-
-        std::vector<Pixel> pixelsForThisBnd;
-        std::set<Pixel> visitedPixels;
-
-        // use dfs
-        int saySegIIsOnLeft = 0, saySegIIsOnRight = 0;
-        pixelsForThisBnd.push_back(juncpos);
-        visitedPixels.insert(juncpos);
-
-        int lastDirId = 0;
-        while (true) {
-
-          auto &curp = pixelsForThisBnd.back();
-
-          // find another junc!
-          if (pixelsForThisBnd.size() > 1 && Contains(pixel2junc, curp) &&
-              i < pixel2junc.at(curp)) {
-            int tojuncid = pixel2junc.at(curp);
-
-            // make a new bnd!
-            bndPixels.push_back(std::move(pixelsForThisBnd));
-            int newbndid = bndPixels.size() - 1;
-            mg.bnd2juncs.emplace_back(i, tojuncid);
-
-            if (saySegIIsOnLeft < saySegIIsOnRight) {
-              assert(saySegIIsOnLeft == 0);
-              mg.bnd2segs.emplace_back(segj, segi); // left, right
-            } else {
-              assert(saySegIIsOnRight == 0);
-              mg.bnd2segs.emplace_back(segi, segj);
+  std::sort(nearBndPieces.begin(), nearBndPieces.end());
+  nearBndPieces.erase(std::unique(nearBndPieces.begin(), nearBndPieces.end()),
+                      nearBndPieces.end());
+
+  return SplitLine(
+      samples,
+      [&mg, &nearBndPieces, bndPieceBoundToLineAngleThres](const Vec3 &d) {
+        int nearestBndPiece = -1;
+        double nearestDot = -1.0;
+        Vec3 nearestDir;
+        for (int bp : nearBndPieces) {
+          for (auto &dir : mg.bndPiece2dirs[bp]) {
+            double dot = dir.dot(d);
+            if (dot > nearestDot) {
+              nearestDot = dot;
+              nearestBndPiece = bp;
+              nearestDir = dir;
             }
-            saySegIIsOnLeft = saySegIIsOnRight = 0;
-
-            mg.junc2bnds[i].push_back(newbndid);
-            mg.junc2bnds[tojuncid].push_back(newbndid);
-
-            mg.seg2bnds[segi].push_back(newbndid);
-            mg.seg2bnds[segj].push_back(newbndid);
-
-            break;
           }
+        }
+        return nearestBndPiece != -1 && AngleBetweenDirected(nearestDir, d) <
+                                            bndPieceBoundToLineAngleThres
+                   ? nearestBndPiece
+                   : -1;
+      },
+      [&mg, &cam](const Vec3 &d) {
+        return mg.segs(BoundPixel(ToPixel(cam.toScreen(d)), cam));
+      });
+}
 
-          // * - * - *
-          // | d | a |
-          // * -[*]- *
-          // | c | b |
-          // * - * - *
-          static const int dxs[] = {1, 0, -1, 0};
-          static const int dys[] = {0, 1, 0, -1};
-
-          static const int leftdxs[] = {1, 1, 0, 0};
-          static const int leftdys[] = {0, 1, 1, 0};
-
-          static const int rightdxs[] = {1, 0, 0, 1};
-          static const int rightdys[] = {1, 1, 0, 0};
-
-          bool hasMore = false;
-          for (int kk = 0; kk < 4; kk++) {
-            int k = (lastDirId + kk + 3) % 4;
-            auto nextp = curp + Pixel(dxs[k], dys[k]);
-
-            if (!RectifyPixel(nextp, view.camera)) { // note that the top/bottom
-                                                     // borders cannot be
-                                                     // crossed!
-              continue;
-            }
-            if (!Contains(pixelsForThisSegPair, nextp)) {
-              continue;
-            }
-            if (Contains(visitedPixels, nextp)) {
-              continue;
-            }
-
-            auto rightp = curp + Pixel(rightdxs[k], rightdys[k]);
-            RectifyPixel(rightp, view.camera);
-            auto leftp = curp + Pixel(leftdxs[k], leftdys[k]);
-            RectifyPixel(leftp, view.camera);
-            if (Contains(segs.size(), rightp) && Contains(segs.size(), leftp)) {
-              if (segs(rightp) == segi && segs(leftp) == segj) {
-                saySegIIsOnRight++;
-              } else if (segs(rightp) == segj && segs(leftp) == segi) {
-                saySegIIsOnLeft++;
-              } else {
-                continue;
-              }
-            }
-
-            pixelsForThisBnd.push_back(nextp);
-            visitedPixels.insert(nextp);
-            lastDirId = k;
-            hasMore = true;
-            break;
-          }
+template <class CameraT> void RemoveLineImpl(PIGraph<CameraT> &mg, int line) {
+  assert(line >= 0 && line < mg.nlines());
+  Classified<Line3> removed = mg.lines[line];
 
-          if (!hasMore) {
-            break;
-          }
-        }
-      }
+  // linePieces of the line
+  auto lp2new = CompactIds(mg.nlinePieces(), [&mg, line](int lp) {
+    return mg.linePiece2line[lp] == line;
+  });
+  EraseElements(mg.linePiece2samples, lp2new);
+  EraseElements(mg.linePiece2length, lp2new);
+  EraseElements(mg.linePiece2line, lp2new);
+  EraseElements(mg.linePiece2seg, lp2new);
+  EraseElements(mg.linePiece2segLineRelation, lp2new);
+  EraseElements(mg.linePiece2bndPiece, lp2new);
+  EraseElements(mg.linePiece2bndPieceInSameDirection, lp2new);
+  RemapIds(mg.seg2linePieces, lp2new);
+  RemapIds(mg.bndPiece2linePieces, lp2new);
+  RemapIds(mg.line2linePieces, lp2new);
+
+  // lineRelations of the line
+  auto lr2new = CompactIds(mg.nlineRelations(), [&mg, line](int lr) {
+    return mg.lineRelation2lines[lr].first == line ||
+           mg.lineRelation2lines[lr].second == line;
+  });
+  EraseElements(mg.lineRelations, lr2new);
+  EraseElements(mg.lineRelation2anchor, lr2new);
+  EraseElements(mg.lineRelation2lines, lr2new);
+  EraseElements(mg.lineRelation2weight, lr2new);
+  EraseElements(mg.lineRelation2votes, lr2new);
+  EraseElements(mg.lineRelation2IsIncidence, lr2new);
+  RemapIds(mg.line2lineRelations, lr2new);
+
+  // the line
+  auto line2new =
+      CompactIds(mg.nlines(), [line](int l) { return l == line; });
+  EraseElements(mg.lines, line2new);
+  EraseElements(mg.line2linePieces, line2new);
+  EraseElements(mg.line2lineRelations, line2new);
+  EraseElements(mg.line2used, line2new);
+  RemapIds(mg.linePiece2line, line2new);
+  for (auto &lines : mg.lineRelation2lines) {
+    lines.first = line2new[lines.first];
+    lines.second = line2new[lines.second];
+  }
+
+  // the line has voted for the other intersections
+  for (int lr = 0; lr < mg.nlineRelations(); lr++) {
+    if (mg.lineRelation2IsIncidence[lr]) {
+      continue;
     }
+    AddLineVotes(removed, mg.vps, mg.lineRelation2anchor[lr], -1.0,
+                 mg.lineRelation2votes[lr]);
+    mg.lineRelation2weight[lr] = IntersectionWeight(mg.lineRelation2votes[lr]);
   }
+  mg.lineSamples = std::make_shared<const LineSampleIndex>(
+      mg.lines, mg.lineSamples->sampleAngle());
+  assert(IsConsistent(mg));
+}
 
-  // split bnds into pieces
-  std::cout << "splitting boundaries" << std::endl;
-  std::vector<std::vector<Vec3>> bnd2SmoothedDirs(bndPixels.size());
-  const double bndSampleAngle = 1.1 / mg.view.camera.focal();
-  for (int i = 0; i < bndPixels.size(); i++) {
-    assert(bndPixels[i].size() >= 2);
-    auto &smoothedDirs = bnd2SmoothedDirs[i];
-    for (int j = 0; j < bndPixels[i].size() - 1; j++) {
-      auto &pixel = bndPixels[i][j];
-      auto dir = normalize(view.camera.toSpace(pixel));
-      if (smoothedDirs.empty() ||
-          AngleBetweenDirected(smoothedDirs.back(), dir) >= bndSampleAngle) {
-        smoothedDirs.push_back(dir);
-      }
+template <class CameraT>
+int AddLineImpl(PIGraph<CameraT> &mg, const Classified<Line3> &cline,
+                double bndPieceBoundToLineAngleThres,
+                double intersectionAngleThreshold,
+                double incidenceAngleAlongDirectionThreshold,
+                double incidenceAngleVerticalDirectionThreshold) {
+  Classified<Line3> l = cline;
+  if (l.claz >= mg.vps.size()) {
+    l.claz = -1;
+  }
+  l.component = normalize(l.component);
+  mg.lines.push_back(l);
+  int line = mg.lines.size() - 1;
+  mg.line2linePieces.appendRow();
+  mg.line2lineRelations.appendRow();
+  mg.line2used.push_back(true);
+
+  // split the line to linePieces
+  auto pieces = SplitLineByNearBndPieces(mg, l.component,
+                                         bndPieceBoundToLineAngleThres);
+  Vec3 lineRotNormal =
+      normalize(l.component.first.cross(l.component.second));
+  for (auto &lpd : pieces) {
+    mg.linePiece2bndPiece.push_back(lpd.bndPiece);
+    int linePieceId = mg.linePiece2bndPiece.size() - 1;
+    mg.line2linePieces.insert(line, linePieceId);
+    mg.linePiece2line.push_back(line);
+    mg.linePiece2samples.appendRow(lpd.samples.begin(), lpd.samples.end());
+    mg.linePiece2length.push_back(lpd.length);
+    mg.linePiece2seg.push_back(lpd.seg);
+    mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
+    if (lpd.bndPiece != -1) { // line piece bound to bnd piece
+      auto pieceDirs = mg.bndPiece2dirs[lpd.bndPiece];
+      assert(pieceDirs.size() > 1);
+      Vec3 bndRotNormal = pieceDirs.front().cross(pieceDirs.back());
+      mg.linePiece2bndPieceInSameDirection.push_back(
+          lineRotNormal.dot(bndRotNormal) > 0);
+      mg.bndPiece2linePieces.insert(lpd.bndPiece, linePieceId);
+    } else { // line piece bound to seg
+      mg.seg2linePieces.insert(lpd.seg, linePieceId);
+      mg.linePiece2bndPieceInSameDirection.push_back(true);
+    }
+  }
+
+  // the line votes for the other intersections, after the other lines as when
+  // they are voted in a build
+  int nOldLineRelations = mg.nlineRelations();
+  for (int lr = 0; lr < nOldLineRelations; lr++) {
+    if (mg.lineRelation2IsIncidence[lr]) {
+      continue;
     }
-    smoothedDirs.push_back(normalize(view.camera.toSpace(bndPixels[i].back())));
-    assert(smoothedDirs.size() >= 2);
+    AddLineVotes(l, mg.vps, mg.lineRelation2anchor[lr], 1.0,
+                 mg.lineRelation2votes[lr]);
+    mg.lineRelation2weight[lr] = IntersectionWeight(mg.lineRelation2votes[lr]);
   }
-  mg.bnd2bndPieces.resize(mg.bnd2segs.size());
-  for (int i = 0; i < bnd2SmoothedDirs.size(); i++) {
-    const auto &dirs = bnd2SmoothedDirs[i];
-    assert(dirs.size() > 0);
 
-    std::vector<Vec3> curPiece = {dirs.front()};
-    for (int j = 1; j <= dirs.size(); j++) {
-      if (j < dirs.size() && AllAlong(curPiece, curPiece.front(), dirs[j],
-                                      bndPieceSplitAngleThres)) {
-        curPiece.push_back(dirs[j]);
-      } else {
-        if (curPiece.size() >= 2) {
-          mg.bndPiece2dirs.push_back(std::move(curPiece));
-          mg.bndPiece2bnd.push_back(i);
-          int bndPieceId = mg.bndPiece2dirs.size() - 1;
-          mg.bnd2bndPieces[i].push_back(bndPieceId);
-          curPiece.clear();
-        }
-        if (j < dirs.size()) {
-          curPiece.push_back(dirs[j]);
-        }
+  // relate to the other lines, the intersections are voted by all the lines
+  for (int i = 0; i < line; i++) {
+    Vec3 anchor;
+    bool isIncidence = false;
+    if (!LineRelationBetween(mg.lines[i], mg.lines[line], mg.vps,
+                             intersectionAngleThreshold,
+                             incidenceAngleAlongDirectionThreshold,
+                             incidenceAngleVerticalDirectionThreshold, anchor,
+                             isIncidence)) {
+      continue;
+    }
+    mg.lineRelations.push_back(LineRelation::Unknown);
+    mg.lineRelation2lines.emplace_back(i, line);
+    int lineRelationId = mg.lineRelation2lines.size() - 1;
+    mg.line2lineRelations.insert(i, lineRelationId);
+    mg.line2lineRelations.insert(line, lineRelationId);
+    mg.lineRelation2anchor.push_back(anchor);
+    mg.lineRelation2IsIncidence.push_back(isIncidence);
+    Mat<double, 3, 2> votes;
+    if (isIncidence) {
+      mg.lineRelation2weight.push_back(IncidenceJunctionWeight(false));
+    } else {
+      for (auto &cl : mg.lines) {
+        AddLineVotes(cl, mg.vps, anchor, 1.0, votes);
       }
+      mg.lineRelation2weight.push_back(IntersectionWeight(votes));
     }
+    mg.lineRelation2votes.push_back(votes);
   }
 
-  // bndPieces properties
-  // classes
-  std::cout << "classifying boundary pieces" << std::endl;
-  mg.bndPiece2classes.resize(mg.bndPiece2dirs.size(), -1);
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    auto &piece = mg.bndPiece2dirs[i];
-    assert(piece.size() > 1);
-    Vec3 center = piece[piece.size() / 2];
-    mg.bndPiece2classes[i] = -1;
-    assert(vps.size() >= 3);
-    for (int j = 0; j < 3; j++) {
-      if (AllAlong(piece, center, vps[j], bndPieceClassifyAngleThres)) {
-        mg.bndPiece2classes[i] = j;
-        break;
+  mg.lineSamples = std::make_shared<const LineSampleIndex>(
+      mg.lines, mg.lineSamples->sampleAngle());
+  assert(IsConsistent(mg));
+  return line;
+}
+
+template <class CameraT>
+int MergeSegsImpl(PIGraph<CameraT> &mg, int seg1, int seg2,
+                  double bndPieceSplitAngleThres,
+                  double bndPieceClassifyAngleThres,
+                  double bndPieceBoundToLineAngleThres) {
+  assert(seg1 != seg2 && seg1 >= 0 && seg1 < mg.nsegs && seg2 >= 0 &&
+         seg2 < mg.nsegs);
+  auto &cam = mg.view.camera;
+  int width = mg.segs.cols;
+  int height = mg.segs.rows;
+
+  // bnds of the segs, with their bndPieces, those of the merged seg are traced
+  // again below
+  auto bnd2new = CompactIds(mg.nbnds(), [&mg, seg1, seg2](int bnd) {
+    auto &segs = mg.bnd2segs[bnd];
+    return segs.first == seg1 || segs.first == seg2 || segs.second == seg1 ||
+           segs.second == seg2;
+  });
+  auto bp2new = CompactIds(mg.nbndPieces(), [&mg, &bnd2new](int bp) {
+    return bnd2new[mg.bndPiece2bnd[bp]] == -1;
+  });
+  // lines bound to these bndPieces or to the segs are split again
+  std::vector<uint8_t> lineIsAffected(mg.nlines(), false);
+  for (int lp = 0; lp < mg.nlinePieces(); lp++) {
+    int bp = mg.linePiece2bndPiece[lp];
+    int seg = mg.linePiece2seg[lp];
+    if ((bp != -1 && bp2new[bp] == -1) || seg == seg1 || seg == seg2) {
+      lineIsAffected[mg.linePiece2line[lp]] = true;
+    }
+  }
+  RemapIds(mg.linePiece2bndPiece, bp2new);
+  EraseElements(mg.bndPiece2dirs, bp2new);
+  EraseElements(mg.bndPiece2length, bp2new);
+  EraseElements(mg.bndPiece2classes, bp2new);
+  EraseElements(mg.bndPiece2bnd, bp2new);
+  EraseElements(mg.bndPiece2linePieces, bp2new);
+  EraseElements(mg.bndPiece2segRelation, bp2new);
+  RemapIds(mg.bnd2bndPieces, bp2new);
+  EraseElements(mg.bnd2bndPieces, bnd2new);
+  EraseElements(mg.bnd2segs, bnd2new);
+  EraseElements(mg.bnd2juncs, bnd2new);
+  RemapIds(mg.bndPiece2bnd, bnd2new);
+  RemapIds(mg.seg2bnds, bnd2new);
+  RemapIds(mg.junc2bnds, bnd2new);
+
+  // seg2 into seg1, whose rows of bnds are both empty now, then erase seg2
+  mg.seg2areaRatio[seg1] += mg.seg2areaRatio[seg2];
+  auto seg2new = CompactIds(mg.nsegs, [seg2](int seg) { return seg == seg2; });
+  int seg = seg2new[seg1];
+  EraseElements(mg.seg2bnds, seg2new);
+  EraseElements(mg.seg2linePieces, seg2new);
+  EraseElements(mg.seg2control, seg2new);
+  EraseElements(mg.seg2areaRatio, seg2new);
+  EraseElements(mg.seg2center, seg2new);
+  EraseElements(mg.seg2contours, seg2new);
+  for (auto &segs : mg.bnd2segs) {
+    segs.first = seg2new[segs.first];
+    segs.second = seg2new[segs.second];
+  }
+  for (int &s : mg.linePiece2seg) {
+    if (s != -1) {
+      s = s == seg2 ? seg : seg2new[s];
+    }
+  }
+  mg.nsegs--;
+
+  // relabel segs, and find contours of the merged seg in its bounding box,
+  // segs may share its data with the segs BuildPIGraph was given and with the
+  // copies of mg, so it is detached first
+  mg.segs = mg.segs.clone();
+  int minx = width, maxx = -1, miny = height, maxy = -1;
+  for (int y = 0; y < height; y++) {
+    int *row = mg.segs[y];
+    for (int x = 0; x < width; x++) {
+      row[x] = seg2new[row[x] == seg2 ? seg1 : row[x]];
+      if (row[x] == seg) {
+        minx = std::min(minx, x);
+        maxx = std::max(maxx, x);
+        miny = std::min(miny, y);
+        maxy = std::max(maxy, y);
       }
     }
   }
-  // lengths
-  mg.bndPiece2length.resize(mg.bndPiece2dirs.size(), 0);
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    auto &piece = mg.bndPiece2dirs[i];
-    for (int j = 1; j < piece.size(); j++) {
-      mg.bndPiece2length[i] += AngleBetweenDirected(piece[j - 1], piece[j]);
-    }
+  mg.seg2contours[seg].clear();
+  if (maxx >= 0) {
+    SegMaskSampler maskSampler;
+    SegContoursInBox(mg.view, mg.segs, seg, minx, miny, maxx, maxy,
+                     maskSampler, mg.seg2contours[seg], mg.seg2center[seg]);
   }
-  mg.bndPiece2linePieces.resize(mg.bndPiece2dirs.size());
-  mg.bndPiece2segRelation.resize(mg.bndPiece2dirs.size(), SegRelation::Unknown);
 
-  // register bndPiece dirs in RTree
-  RTreeMap<Vec3, int> bndPieceRTree;
-  for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
-    for (auto &d : mg.bndPiece2dirs[i]) {
-      bndPieceRTree.emplace(normalize(d), i);
-    }
+  // juncs whose 2x2 blocks still hold 3 segs or more, as BuildPIGraph finds
+  // them, and those still with bnds, which SplitBnd made
+  std::vector<Pixel> junc2pixel(mg.njuncs());
+  for (int junc = 0; junc < mg.njuncs(); junc++) {
+    junc2pixel[junc] =
+        BoundPixel(RoundToPixel(cam.toScreen(mg.junc2positions[junc])), cam);
   }
-  RTreeMap<Vec3, int> lineRTree;
-  const double lineSampleAngle = bndPieceBoundToLineAngleThres / 5.0;
-  std::vector<std::vector<Vec3>> lineSamples(mg.lines.size());
-  for (int i = 0; i < mg.lines.size(); i++) {
-    auto &line = mg.lines[i];
-    double angle =
-        AngleBetweenDirected(line.component.first, line.component.second);
-    for (double a = 0; a <= angle; a += lineSampleAngle) {
-      Vec3 sample = normalize(
-          RotateDirection(line.component.first, line.component.second, a));
-      lineSamples[i].push_back(sample);
-      lineRTree.emplace(sample, i);
+  auto junc2new = CompactIds(mg.njuncs(), [&](int junc) {
+    return mg.junc2bnds[junc].empty() &&
+           MakeBndPixelLabels(mg.segs, junc2pixel[junc], cam).nlabels < 3;
+  });
+  EraseElements(mg.junc2positions, junc2new);
+  EraseElements(mg.junc2bnds, junc2new);
+  EraseElements(junc2pixel, junc2new);
+  for (auto &juncs : mg.bnd2juncs) {
+    juncs.first = junc2new[juncs.first];
+    juncs.second = junc2new[juncs.second];
+  }
+
+  // bnds of the merged seg, traced from the juncs as BuildPIGraph does
+  FlatHashMap<int, int> pixel2junc(mg.njuncs());
+  for (int junc = 0; junc < mg.njuncs(); junc++) {
+    pixel2junc[Sub2Ind(junc2pixel[junc], width, height)] = junc;
+  }
+  auto bndPixelLabels = [&](const Pixel &p) {
+    BndPixelLabels bl = MakeBndPixelLabels(mg.segs, p, cam);
+    if (bl.nlabels >= 3) {
+      const int *junc = pixel2junc.find(Sub2Ind(p, width, height));
+      bl.juncId = junc ? *junc : -1;
+    }
+    return bl;
+  };
+  Imagei visited(mg.segs.size(), 0);
+  int visitStamp = 0;
+  std::vector<Vec3> newBndPieceDirs;
+  for (int junc = 0; junc < mg.njuncs(); junc++) {
+    BndPixelLabels bl = MakeBndPixelLabels(mg.segs, junc2pixel[junc], cam);
+    if (bl.nlabels < 3 || !bl.contains(seg)) {
+      continue;
     }
-  }
-
-  // split lines to linePieces
-  for (int i = 0; i < mg.lines.size(); i++) {
-    Vec3 lineRotNormal = normalize(
-        mg.lines[i].component.first.cross(mg.lines[i].component.second));
-    auto &samples = lineSamples[i];
-    int lastDetectedBndPiece = -1;
-    int lastDetectedSeg = -1;
-    std::vector<Vec3> collectedSamples;
-    for (int j = 0; j <= samples.size(); j++) {
-      double minAngleDist = bndPieceBoundToLineAngleThres;
-      int nearestBndPiece = -1;
-      int nearestSeg = -1;
-      if (j < samples.size()) {
-        auto &d = samples[j];
-        bndPieceRTree.search(
-            BoundingBox(d).expand(
-                std::max(bndSampleAngle, bndPieceBoundToLineAngleThres) * 3),
-            [&d, &minAngleDist,
-             &nearestBndPiece](const std::pair<Vec3, int> &bndPieceD) {
-              double angleDist = AngleBetweenDirected(bndPieceD.first, d);
-              if (angleDist < minAngleDist) {
-                minAngleDist = angleDist;
-                nearestBndPiece = bndPieceD.second;
-              }
-              return true;
-            });
-        auto pixel = ToPixel(view.camera.toScreen(d));
-        pixel.x = WrapBetween(pixel.x, 0, width);
-        pixel.y = BoundBetween(pixel.y, 0, height - 1);
-        nearestSeg = segs(pixel);
-      }
-      bool neighborChanged =
-          (nearestBndPiece != lastDetectedBndPiece ||
-           (nearestBndPiece == -1 && lastDetectedSeg != nearestSeg) ||
-           j == samples.size() - 1) &&
-          !(lastDetectedBndPiece == -1 && lastDetectedSeg == -1);
-      if (neighborChanged) {
-        double len = AngleBetweenDirected(collectedSamples.front(),
-                                            collectedSamples.back());
-        if (collectedSamples.size() >= 2) {
-          if (lastDetectedBndPiece != -1) { // line piece bound to bnd piece
-            mg.linePiece2bndPiece.push_back(lastDetectedBndPiece);
-            int linePieceId = mg.linePiece2bndPiece.size() - 1;
-            mg.line2linePieces[i].push_back(linePieceId);
-            mg.linePiece2line.push_back(i);
-            mg.linePiece2samples.push_back(std::move(collectedSamples));
-            mg.linePiece2length.push_back(len);
-            mg.linePiece2seg.push_back(-1);
-            mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
-            auto &bndPieceDirs = mg.bndPiece2dirs[lastDetectedBndPiece];
-            assert(bndPieceDirs.size() > 1);
-            Vec3 bndRotNormal = bndPieceDirs.front().cross(bndPieceDirs.back());
-            mg.linePiece2bndPieceInSameDirection.push_back(
-                lineRotNormal.dot(bndRotNormal) > 0);
-            mg.bndPiece2linePieces[lastDetectedBndPiece].push_back(linePieceId);
-          } else { // line piece bound to seg
-            mg.linePiece2bndPiece.push_back(-1);
-            int linePieceId = mg.linePiece2bndPiece.size() - 1;
-            mg.line2linePieces[i].push_back(linePieceId);
-            mg.linePiece2line.push_back(i);
-            mg.linePiece2samples.push_back(std::move(collectedSamples));
-            mg.linePiece2length.push_back(len);
-            mg.linePiece2seg.push_back(lastDetectedSeg);
-            mg.seg2linePieces[lastDetectedSeg].push_back(linePieceId);
-            mg.linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
-            mg.linePiece2bndPieceInSameDirection.push_back(true);
-          }
+    for (int ii = 0; ii < bl.nlabels; ii++) {
+      for (int jj = ii + 1; jj < bl.nlabels; jj++) {
+        int segi = bl.labels[ii];
+        int segj = bl.labels[jj];
+        if (segi != seg && segj != seg) {
+          continue;
         }
-        collectedSamples.clear();
-      }
-      if (j < samples.size()) {
-        collectedSamples.push_back(samples[j]);
-      }
-
-      lastDetectedBndPiece = nearestBndPiece;
-      lastDetectedSeg = nearestSeg;
-    }
-  }
-
-  // build line relations
-  for (int i = 0; i < mg.lines.size(); i++) {
-    for (int j = i + 1; j < mg.lines.size(); j++) {
-      auto &linei = mg.lines[i].component;
-      int clazi = mg.lines[i].claz;
-      Vec3 ni = normalize(linei.first.cross(linei.second));
-      auto &linej = mg.lines[j].component;
-      int clazj = mg.lines[j].claz;
-      Vec3 nj = normalize(linej.first.cross(linej.second));
-
-      auto nearest = DistanceBetweenTwoLines(linei, linej);
-      double d = AngleBetweenDirected(nearest.second.first.position,
-                                        nearest.second.second.position);
-
-      if (clazi == clazj && clazi >= 0) { // incidences for classified lines
-        auto conCenter = normalize(nearest.second.first.position +
-                                   nearest.second.second.position);
-        auto conDir =
-            (nearest.second.first.position - nearest.second.second.position);
-
-        auto &vp = vps[clazi];
-
-        if (AngleBetweenDirected(vp, conCenter) < intersectionAngleThreshold)
+        std::vector<Pixel> pixels;
+        bool segiIsOnLeft = false;
+        int toJunc =
+            TraceBnd(mg.segs, cam, bndPixelLabels, junc, junc2pixel[junc],
+                     segi, segj, visited, ++visitStamp, pixels, segiIsOnLeft);
+        if (toJunc == -1) {
           continue;
-
-        if (d < incidenceAngleAlongDirectionThreshold &&
-            AngleBetweenUndirected(ni, nj) <
-                incidenceAngleVerticalDirectionThreshold) {
-          // LineRelationData lrd;
-          // lrd.type = LineRelationData::Type::Incidence;
-          // lrd.normalizedRelationCenter = conCenter;
-          // lrd.junctionWeight = 5.0;
-
-          if (HasValue(conCenter, IsInfOrNaN<double>))
-            continue;
-
-          mg.lineRelations.push_back(LineRelation::Unknown);
-          mg.lineRelation2lines.emplace_back(i, j);
-          int lineRelationId = mg.lineRelation2lines.size() - 1;
-          mg.line2lineRelations[i].push_back(lineRelationId);
-          mg.line2lineRelations[j].push_back(lineRelationId);
-          mg.lineRelation2anchor.push_back(conCenter);
-          mg.lineRelation2weight.push_back(5.0);
-          mg.lineRelation2IsIncidence.push_back(true);
-
-          // mg.addConstraint(std::move(lrd), lhs[i], lhs[j]);
         }
-
-      } else if (clazi != clazj && clazi >= 0 &&
-                 clazj >= 0) { // intersections for classified lines
-        if (d < intersectionAngleThreshold) {
-          auto conCenter = normalize(ni.cross(nj));
-
-          if (Distance(conCenter, linei) > intersectionAngleThreshold * 4 ||
-              Distance(conCenter, linej) > intersectionAngleThreshold * 4)
-            continue;
-
-          // LineRelationData lrd;
-          // lrd.type = LineRelationData::Type::Intersection;
-          // lrd.normalizedRelationCenter = conCenter;
-          // lrd.junctionWeight = 3.0;
-
-          if (HasValue(conCenter, IsInfOrNaN<double>))
-            continue;
-
-          mg.lineRelations.push_back(LineRelation::Unknown);
-          mg.lineRelation2lines.emplace_back(i, j);
-          int lineRelationId = mg.lineRelation2lines.size() - 1;
-          mg.line2lineRelations[i].push_back(lineRelationId);
-          mg.line2lineRelations[j].push_back(lineRelationId);
-          mg.lineRelation2anchor.push_back(conCenter);
-          mg.lineRelation2weight.push_back(3.0);
-          mg.lineRelation2IsIncidence.push_back(false);
-
-          // mg.addConstraint(std::move(lrd), lhs[i], lhs[j]);
+        mg.bnd2juncs.emplace_back(junc, toJunc);
+        if (segiIsOnLeft) {
+          mg.bnd2segs.emplace_back(segi, segj); // left, right
+        } else {
+          mg.bnd2segs.emplace_back(segj, segi);
         }
-      }
-    }
-  }
-
-  // line relation weights
-  // compute junction weights
-  static const double angleThreshold = M_PI / 32;
-  static const double sigma = 0.1;
-
-  enum LineVotingDirection : int {
-    TowardsVanishingPoint = 0,
-    TowardsOppositeOfVanishingPoint = 1
-  };
-  enum class JunctionType : int { L, T, Y, W, X };
-  for (int i = 0; i < mg.lineRelation2lines.size(); i++) {
-    // std::cout << lr.topo.hd.id << std::endl;
-    if (mg.lineRelation2IsIncidence[i]) {
-      mg.lineRelation2weight[i] = IncidenceJunctionWeight(false);
-    } else {
-      Mat<float, 3, 2> votingData;
-      std::fill(std::begin(votingData), std::end(votingData), 0);
-
-      for (int lineid = 0; lineid < mg.lines.size(); lineid++) {
-        auto &line = mg.lines[lineid].component;
-        int claz = mg.lines[lineid].claz;
-        if (claz == -1 || claz >= 3)
-          continue;
-
-        auto &vp = vps[claz];
-        Vec3 center = normalize(line.center());
-
-        Vec3 center2vp = normalize(center.cross(vp));
-        Vec3 center2pos = normalize(center.cross(mg.lineRelation2anchor[i]));
-
-        double angle = AngleBetweenUndirected(center2vp, center2pos);
-        double angleSmall = angle > M_PI_2 ? (M_PI - angle) : angle;
-        if (IsInfOrNaN(angleSmall))
-          continue;
-
-        assert(angleSmall >= 0 && angleSmall <= M_PI_2);
-
-        double angleScore =
-            exp(-(angleSmall / angleThreshold) * (angleSmall / angleThreshold) /
-                sigma / sigma / 2);
-
-        auto proj = ProjectionOfPointOnLine(mg.lineRelation2anchor[i], line);
-        double projRatio = BoundBetween(proj.ratio, 0.0, 1.0);
-
-        Vec3 lined = line.first.cross(line.second);
-        double lineSpanAngle = AngleBetweenDirected(line.first, line.second);
-        if (AngleBetweenDirected(center2vp, lined) <
-            M_PI_2) { // first-second-vp
-          votingData(claz, TowardsVanishingPoint) +=
-              angleScore * lineSpanAngle * (1 - projRatio);
-          votingData(claz, TowardsOppositeOfVanishingPoint) +=
-              angleScore * lineSpanAngle * projRatio;
-        } else { // vp-first-second
-          votingData(claz, TowardsOppositeOfVanishingPoint) +=
-              angleScore * lineSpanAngle * (1 - projRatio);
-          votingData(claz, TowardsVanishingPoint) +=
-              angleScore * lineSpanAngle * projRatio;
+        int bnd = mg.bnd2segs.size() - 1;
+        mg.junc2bnds.insert(junc, bnd);
+        mg.junc2bnds.insert(toJunc, bnd);
+        mg.seg2bnds.insert(segi, bnd);
+        mg.seg2bnds.insert(segj, bnd);
+        mg.bnd2bndPieces.appendRow();
+        for (auto &piece : SplitBndDirs(SmoothedBndDirs(pixels, cam),
+                                        bndPieceSplitAngleThres)) {
+          mg.bndPiece2dirs.appendRow(piece.begin(), piece.end());
+          int bp = mg.nbndPieces() - 1;
+          mg.bndPiece2length.push_back(BndPieceLength(piece));
+          mg.bndPiece2classes.push_back(
+              BndPieceClass(piece, mg.vps, bndPieceClassifyAngleThres));
+          mg.bndPiece2bnd.push_back(bnd);
+          mg.bndPiece2linePieces.appendRow();
+          mg.bndPiece2segRelation.push_back(SegRelation::Unknown);
+          mg.bnd2bndPieces.insert(bnd, bp);
+          newBndPieceDirs.insert(newBndPieceDirs.end(), piece.begin(),
+                                 piece.end());
         }
       }
-      mg.lineRelation2weight[i] = std::max(
-          0.1f, ComputeIntersectionJunctionWeightWithLinesVotes(votingData));
     }
   }
 
-  // normalize all directions
-  for (auto &ds : mg.bndPiece2dirs) {
-    for (auto &d : ds) {
-      d = normalize(d);
-    }
-  }
-  for (auto &d : mg.junc2positions) {
-    d = normalize(d);
-  }
-  for (auto &ds : mg.linePiece2samples) {
-    for (auto &d : ds) {
-      d = normalize(d);
+  // lines with samples near the new bndPieces are split again as well
+  double searchAngle =
+      bndPieceBoundToLineAngleThres + mg.lineSamples->sampleAngle() / 2;
+  for (auto &d : newBndPieceDirs) {
+    mg.lineSamples->search(
+        BoundingBox(d).expand(searchAngle),
+        [&lineIsAffected](
+            const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
+          lineIsAffected[lineSample.second.second] = true;
+          return true;
+        });
+  }
+
+  // linePieces in the order of lines as BuildPIGraph registers them, those of
+  // the other lines are kept
+  std::vector<std::vector<Vec3>> linePiece2samples;
+  std::vector<double> linePiece2length;
+  std::vector<int> linePiece2line;
+  std::vector<int> linePiece2seg;
+  std::vector<SegLineRelation> linePiece2segLineRelation;
+  std::vector<int> linePiece2bndPiece;
+  std::vector<uint8_t> linePiece2bndPieceInSameDirection;
+  std::vector<std::vector<int>> line2linePieces(mg.nlines());
+  for (int line = 0; line < mg.nlines(); line++) {
+    if (!lineIsAffected[line]) {
+      for (int lp : mg.line2linePieces[line]) {
+        linePiece2samples.push_back(mg.linePiece2samples[lp].evalAsStdVector());
+        linePiece2length.push_back(mg.linePiece2length[lp]);
+        linePiece2seg.push_back(mg.linePiece2seg[lp]);
+        linePiece2segLineRelation.push_back(mg.linePiece2segLineRelation[lp]);
+        linePiece2bndPiece.push_back(mg.linePiece2bndPiece[lp]);
+        linePiece2bndPieceInSameDirection.push_back(
+            mg.linePiece2bndPieceInSameDirection[lp]);
+        linePiece2line.push_back(line);
+        line2linePieces[line].push_back(linePiece2line.size() - 1);
+      }
+      continue;
     }
-  }
-  for (auto &d : mg.lineRelation2anchor) {
-    d = normalize(d);
-  }
-  for (auto &l : mg.lines) {
-    l.component = normalize(l.component);
-  }
-  for (auto &d : mg.seg2center) {
-    d = normalize(d);
-  }
-  for (auto &dss : mg.seg2contours) {
-    for (auto &ds : dss) {
-      for (auto &d : ds) {
-        d = normalize(d);
+    auto &l = mg.lines[line].component;
+    Vec3 lineRotNormal = normalize(l.first.cross(l.second));
+    for (auto &lpd : SplitLineByNearBndPieces(mg, l,
+                                              bndPieceBoundToLineAngleThres)) {
+      bool inSameDirection = true;
+      if (lpd.bndPiece != -1) { // line piece bound to bnd piece
+        auto pieceDirs = mg.bndPiece2dirs[lpd.bndPiece];
+        assert(pieceDirs.size() > 1);
+        Vec3 bndRotNormal = pieceDirs.front().cross(pieceDirs.back());
+        inSameDirection = lineRotNormal.dot(bndRotNormal) > 0;
       }
+      linePiece2samples.push_back(std::move(lpd.samples));
+      linePiece2length.push_back(lpd.length);
+      linePiece2seg.push_back(lpd.seg);
+      linePiece2segLineRelation.push_back(SegLineRelation::Unknown);
+      linePiece2bndPiece.push_back(lpd.bndPiece);
+      linePiece2bndPieceInSameDirection.push_back(inSameDirection);
+      linePiece2line.push_back(line);
+      line2linePieces[line].push_back(linePiece2line.size() - 1);
+    }
+  }
+  std::vector<std::vector<int>> seg2linePieces(mg.nsegs);
+  std::vector<std::vector<int>> bndPiece2linePieces(mg.nbndPieces());
+  for (int lp = 0; lp < linePiece2line.size(); lp++) {
+    if (linePiece2bndPiece[lp] != -1) {
+      bndPiece2linePieces[linePiece2bndPiece[lp]].push_back(lp);
+    } else {
+      seg2linePieces[linePiece2seg[lp]].push_back(lp);
+    }
+  }
+  mg.linePiece2samples = CompressedRows<Vec3>(linePiece2samples);
+  mg.linePiece2length = std::move(linePiece2length);
+  mg.linePiece2line = std::move(linePiece2line);
+  mg.linePiece2seg = std::move(linePiece2seg);
+  mg.linePiece2segLineRelation = std::move(linePiece2segLineRelation);
+  mg.linePiece2bndPiece = std::move(linePiece2bndPiece);
+  mg.linePiece2bndPieceInSameDirection =
+      std::move(linePiece2bndPieceInSameDirection);
+  mg.line2linePieces = CompressedRows<int>(line2linePieces);
+  mg.seg2linePieces = CompressedRows<int>(seg2linePieces);
+  mg.bndPiece2linePieces = CompressedRows<int>(bndPiece2linePieces);
+
+  assert(IsConsistent(mg));
+  return seg;
+}
+
+template <class CameraT>
+int SplitBndImpl(PIGraph<CameraT> &mg, int bnd, int k) {
+  assert(bnd >= 0 && bnd < mg.nbnds());
+  auto bps = mg.bnd2bndPieces[bnd].evalAsStdVector();
+  assert(k > 0 && k < bps.size());
+
+  // the new junc and the new bnd
+  mg.junc2positions.push_back(mg.bndPiece2dirs[bps[k]].front());
+  int junc = mg.junc2positions.size() - 1;
+  int toJunc = mg.bnd2juncs[bnd].second;
+  mg.bnd2segs.push_back(mg.bnd2segs[bnd]);
+  mg.bnd2juncs.emplace_back(junc, toJunc);
+  mg.bnd2juncs[bnd].second = junc;
+  int newBnd = mg.bnd2segs.size() - 1;
+
+  // bndPieces from k on to the new bnd
+  std::vector<uint8_t> moved(mg.nbndPieces(), false);
+  for (int i = k; i < bps.size(); i++) {
+    moved[bps[i]] = true;
+    mg.bndPiece2bnd[bps[i]] = newBnd;
+  }
+  mg.bnd2bndPieces.eraseIf([&moved](int bp) { return moved[bp]; });
+  mg.bnd2bndPieces.appendRow(bps.begin() + k, bps.end());
+
+  // juncs and segs of the new bnd
+  // the last one, as the bnd is registered to its from junc first
+  auto toJuncBnds = mg.junc2bnds[toJunc];
+  for (int i = toJuncBnds.size() - 1; i >= 0; i--) {
+    if (toJuncBnds[i] == bnd) {
+      toJuncBnds[i] = newBnd;
+      break;
     }
   }
-  for (auto &vp : mg.vps) {
-    vp = normalize(vp);
-  }
+  int juncBnds[] = {bnd, newBnd};
+  mg.junc2bnds.appendRow(std::begin(juncBnds), std::end(juncBnds));
+  mg.seg2bnds.insert(mg.bnd2segs[bnd].first, newBnd);
+  mg.seg2bnds.insert(mg.bnd2segs[bnd].second, newBnd);
 
-  return mg;
+  assert(IsConsistent(mg));
+  return junc;
 }
-
-
-
-//PIGraph<PanoramicCamera>
-//BuildPIGraph(const PanoramicView &view, const std::vector<Vec3> &vps,
-//             int verticalVPId, const std::vector<Classified<Line3>> &lines,
-//             double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
-//             double bndPieceBoundToLineAngleThres,
-//             double intersectionAngleThreshold,
-//             double incidenceAngleAlongDirectionThreshold,
-//             double incidenceAngleVerticalDirectionThreshold) {
-//
-//  Imagei segs;
-//  int nsegs = SegmentationForPIGraph(view, lines, segs, DegreesToRadians(5));
-//
-//  RemoveThinRegionInSegmentation(segs, 1, true);
-//  RemoveSmallRegionInSegmentation(segs, 100, true);
-//  RemoveDanglingPixelsInSegmentation(segs, true);
-//  nsegs = DensifySegmentation(segs, true);
-//
-//  return BuildPIGraph(view, vps, verticalVPId, segs, lines,
-//                      bndPieceSplitAngleThres, bndPieceClassifyAngleThres,
-//                      bndPieceBoundToLineAngleThres, intersectionAngleThreshold,
-//                      incidenceAngleAlongDirectionThreshold,
-//                      incidenceAngleVerticalDirectionThreshold);
-//}
-
-PIGraph<PerspectiveCamera> BuildPIGraph(
-    const PerspectiveView &view, const std::vector<Vec3> &vps, int verticalVPId,
-    const Imagei &segs, const std::vector<Classified<Line3>> &lines,
-    double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
-    double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
-    double incidenceAngleAlongDirectionThreshold,
-    double incidenceAngleVerticalDirectionThreshold) {
-
-
-    // todo
-
-  return PIGraph<PerspectiveCamera>();
 }
 
+void RemoveLine(PIGraph<PanoramicCamera> &mg, int line) {
+  details::RemoveLineImpl(mg, line);
+}
+void RemoveLine(PIGraph<PerspectiveCamera> &mg, int line) {
+  details::RemoveLineImpl(mg, line);
+}
 
+int AddLine(PIGraph<PanoramicCamera> &mg, const Classified<Line3> &line,
+            double bndPieceBoundToLineAngleThres,
+            double intersectionAngleThreshold,
+            double incidenceAngleAlongDirectionThreshold,
+            double incidenceAngleVerticalDirectionThreshold) {
+  return details::AddLineImpl(mg, line, bndPieceBoundToLineAngleThres,
+                              intersectionAngleThreshold,
+                              incidenceAngleAlongDirectionThreshold,
+                              incidenceAngleVerticalDirectionThreshold);
+}
+int AddLine(PIGraph<PerspectiveCamera> &mg, const Classified<Line3> &line,
+            double bndPieceBoundToLineAngleThres,
+            double intersectionAngleThreshold,
+            double incidenceAngleAlongDirectionThreshold,
+            double incidenceAngleVerticalDirectionThreshold) {
+  return details::AddLineImpl(mg, line, bndPieceBoundToLineAngleThres,
+                              intersectionAngleThreshold,
+                              incidenceAngleAlongDirectionThreshold,
+                              incidenceAngleVerticalDirectionThreshold);
+}
 
+int MergeSegs(PIGraph<PanoramicCamera> &mg, int seg1, int seg2,
+              double bndPieceSplitAngleThres,
+              double bndPieceClassifyAngleThres,
+              double bndPieceBoundToLineAngleThres) {
+  return details::MergeSegsImpl(mg, seg1, seg2, bndPieceSplitAngleThres,
+                                bndPieceClassifyAngleThres,
+                                bndPieceBoundToLineAngleThres);
+}
+int MergeSegs(PIGraph<PerspectiveCamera> &mg, int seg1, int seg2,
+              double bndPieceSplitAngleThres,
+              double bndPieceClassifyAngleThres,
+              double bndPieceBoundToLineAngleThres) {
+  return details::MergeSegsImpl(mg, seg1, seg2, bndPieceSplitAngleThres,
+                                bndPieceClassifyAngleThres,
+                                bndPieceBoundToLineAngleThres);
+}
 
+int SplitBnd(PIGraph<PanoramicCamera> &mg, int bnd, int k) {
+  return details::SplitBndImpl(mg, bnd, k);
+}
+int SplitBnd(PIGraph<PerspectiveCamera> &mg, int bnd, int k) {
+  return details::SplitBndImpl(mg, bnd, k);
+}
 
+bool IsConsistent(const PIGraph<PanoramicCamera> &mg) {
+  return details::IsConsistent(mg);
+}
+bool IsConsistent(const PIGraph<PerspectiveCamera> &mg) {
+  return details::IsConsistent(mg);
+}
 
+// LineSampleIndex
+LineSampleIndex::LineSampleIndex(const std::vector<Classified<Line3>> &lines,
+                                 double sampleAngle)
+    : _sampleAngle(sampleAngle) {
+  std::vector<std::vector<Line3>> line2samples(lines.size());
+  for (int i = 0; i < lines.size(); i++) {
+    auto &line = lines[i].component;
+    double spanAngle = AngleBetweenDirected(line.first, line.second);
+    for (double a = 0.0; a < spanAngle; a += sampleAngle) {
+      Vec3 sample1 = normalize(RotateDirection(line.first, line.second, a));
+      Vec3 sample2 = normalize(
+          RotateDirection(line.first, line.second, a + sampleAngle));
+      line2samples[i].emplace_back(sample1, sample2);
+      _samplesTree.emplace(normalize(sample1 + sample2),
+                           std::make_pair(Line3(sample1, sample2), i));
+    }
+  }
+  _line2samples = CompressedRows<Line3>(line2samples);
+}
 
 // PerfectSegMaskView
 namespace details {
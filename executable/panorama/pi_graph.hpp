@@ -2,6 +2,8 @@
 
 #include "basic_types.hpp"
 #include "cameras.hpp"
+#include "containers.hpp"
+#include "segmentation.hpp"
 #include "utility.hpp"
 
 #include "color.hpp"
@@ -40,6 +42,37 @@ enum class SegLineRelation { Attached, Detached, Unknown };
 // whether two line connects
 enum class LineRelation { Attached, Detached, Unknown };
 
+// LineSampleIndex
+// lines cut into pieces of sampleAngle, kept in rows of lines and in an rtree
+// of the piece centers, it is not changed once built so it can be searched
+// concurrently and shared by the copies of a PIGraph, whose lineSamples is
+// built with the graph and replaced by the updates of its lines
+class LineSampleIndex {
+public:
+  LineSampleIndex(const std::vector<Classified<Line3>> &lines,
+                  double sampleAngle);
+
+  double sampleAngle() const { return _sampleAngle; }
+  int nlines() const { return _line2samples.size(); }
+  // pieces of the line from its first end
+  auto samplesOf(int line) const { return _line2samples[line]; }
+  // callback: (const std::pair<Vec3, std::pair<Line3, int>> &) -> bool, the
+  // piece center, the piece and its line
+  template <class CallbackFunctorT>
+  int search(const Box3 &b, CallbackFunctorT &&callback) const {
+    return _samplesTree.search(b, std::forward<CallbackFunctorT>(callback));
+  }
+
+private:
+  double _sampleAngle;
+  CompressedRows<Line3> _line2samples;
+  RTreeMap<Vec3, std::pair<Line3, int>> _samplesTree;
+};
+
+// PIGraph
+// adjacencies are stored as compressed rows over contiguous storage, and flags
+// as bytes, BuildPIGraph collects them in std vectors and freezes them at last,
+// CompressedRows::evalAsStdVectors converts them back
 template <class CameraT> struct PIGraph {
   View<CameraT> view;
   std::vector<Vec3> vps;
@@ -48,8 +81,8 @@ template <class CameraT> struct PIGraph {
   // seg
   Imagei segs;
   int nsegs;
-  std::vector<std::vector<int>> seg2bnds;
-  std::vector<std::vector<int>> seg2linePieces;
+  CompressedRows<int> seg2bnds;
+  CompressedRows<int> seg2linePieces;
   std::vector<SegControl> seg2control;
   std::vector<double> seg2areaRatio;
   double fullArea;
@@ -57,7 +90,7 @@ template <class CameraT> struct PIGraph {
   std::vector<std::vector<std::vector<Vec3>>> seg2contours;
 
   // linePiece
-  std::vector<std::vector<Vec3>> linePiece2samples;
+  CompressedRows<Vec3> linePiece2samples;
   std::vector<double> linePiece2length;
   std::vector<int> linePiece2line;
   std::vector<int> linePiece2seg; // could be -1
@@ -67,14 +100,14 @@ template <class CameraT> struct PIGraph {
                                  // bndPiece2segRelation
 
   std::vector<int> linePiece2bndPiece; // could be -1 (either 2seg or 2bndPiece)
-  std::vector<bool> linePiece2bndPieceInSameDirection;
+  std::vector<uint8_t> linePiece2bndPieceInSameDirection;
   int nlinePieces() const { return linePiece2samples.size(); }
 
   // line
   std::vector<Classified<Line3>> lines;
-  std::vector<std::vector<int>> line2linePieces;
-  std::vector<std::vector<int>> line2lineRelations;
-  std::vector<bool> line2used;
+  CompressedRows<int> line2linePieces;
+  CompressedRows<int> line2lineRelations;
+  std::vector<uint8_t> line2used;
   int nlines() const { return lines.size(); }
 
   // lineRelation
@@ -82,61 +115,109 @@ template <class CameraT> struct PIGraph {
   std::vector<Vec3> lineRelation2anchor;
   std::vector<std::pair<int, int>> lineRelation2lines;
   std::vector<double> lineRelation2weight;
-  std::vector<bool> lineRelation2IsIncidence;
+  // votes of lines for intersections, zeros for incidences
+  std::vector<Mat<double, 3, 2>> lineRelation2votes;
+  std::vector<uint8_t> lineRelation2IsIncidence;
   int nlineRelations() const { return lineRelation2anchor.size(); }
 
   // bndPiece (a STRAIGHT boundary piece in a bnd)
-  std::vector<std::vector<Vec3>> bndPiece2dirs; // continuous
+  CompressedRows<Vec3> bndPiece2dirs; // continuous
   std::vector<double> bndPiece2length;
   std::vector<int> bndPiece2classes;
   std::vector<int> bndPiece2bnd;
-  std::vector<std::vector<int>> bndPiece2linePieces;
+  CompressedRows<int> bndPiece2linePieces;
   std::vector<SegRelation> bndPiece2segRelation;
   int nbndPieces() const { return bndPiece2dirs.size(); }
 
   // bnd (a CONTINUOUS boundary between TWO segs)
-  std::vector<std::vector<int>> bnd2bndPieces; // continuously connected
+  CompressedRows<int> bnd2bndPieces; // continuously connected
   std::vector<std::pair<int, int>> bnd2segs;   // left , right
   std::vector<std::pair<int, int>> bnd2juncs;  // from, to
   int nbnds() const { return bnd2bndPieces.size(); }
 
-  // junc (junction of >=3 bnds)
+  // junc (junction of >=3 segs, or on a bnd split by SplitBnd)
   std::vector<Vec3> junc2positions;
-  std::vector<std::vector<int>> junc2bnds;
+  CompressedRows<int> junc2bnds;
   int njuncs() const { return junc2positions.size(); }
 
-  template <class Archiver> void serialize(Archiver &ar) {
-    ar(view, vps, verticalVPId);
-    ar(segs, nsegs, seg2bnds, seg2linePieces, seg2control, seg2areaRatio,
-       fullArea, seg2center, seg2contours);
-    ar(linePiece2samples, linePiece2length, linePiece2line, linePiece2seg,
-       linePiece2segLineRelation, linePiece2bndPiece,
-       linePiece2bndPieceInSameDirection);
-    ar(lines, line2linePieces, line2lineRelations);
-    ar(lineRelations, lineRelation2anchor, lineRelation2lines,
-       lineRelation2weight, lineRelation2IsIncidence);
-    ar(bndPiece2dirs, bndPiece2length, bndPiece2classes, bndPiece2bnd,
-       bndPiece2linePieces, bndPiece2segRelation);
-    ar(bnd2bndPieces, bnd2segs, bnd2juncs);
-    ar(junc2positions, junc2bnds);
+  // samples of lines, only their sample angle is serialized
+  std::shared_ptr<const LineSampleIndex> lineSamples;
+
+  // version 4 stores adjacencies as compressed rows and flags as bytes, and
+  // starts with archiveMagic, version 5 adds the votes of lines, graphs of
+  // other versions or without the magic are rejected so that their caches are
+  // rebuilt, the unversioned ones read the first bytes of their view as the
+  // version and the magic, lineSamples is rebuilt when loaded
+  static constexpr std::uint64_t archiveMagic = 0x3368706172474950ull;
+  template <class Archiver>
+  void save(Archiver &ar, const std::uint32_t version) const {
+    std::uint64_t magic = archiveMagic;
+    ar(magic);
+    serializeRecords(ar, *this);
+    double lineSampleAngle = lineSamples->sampleAngle();
+    ar(lineSampleAngle);
+  }
+  template <class Archiver>
+  void load(Archiver &ar, const std::uint32_t version) {
+    if (version != 5) {
+      throw std::runtime_error("PIGraph of an old version is not loaded");
+    }
+    std::uint64_t magic = 0;
+    ar(magic);
+    if (magic != archiveMagic) {
+      throw std::runtime_error("PIGraph archive is not recognized");
+    }
+    serializeRecords(ar, *this);
+    double lineSampleAngle = 0.0;
+    ar(lineSampleAngle);
+    lineSamples =
+        std::make_shared<const LineSampleIndex>(lines, lineSampleAngle);
+  }
+
+private:
+  // the records, of a const graph when saved
+  template <class Archiver, class PIGraphT>
+  static void serializeRecords(Archiver &ar, PIGraphT &mg) {
+    ar(mg.view, mg.vps, mg.verticalVPId);
+    ar(mg.segs, mg.nsegs, mg.seg2bnds, mg.seg2linePieces, mg.seg2control,
+       mg.seg2areaRatio, mg.fullArea, mg.seg2center, mg.seg2contours);
+    ar(mg.linePiece2samples, mg.linePiece2length, mg.linePiece2line,
+       mg.linePiece2seg, mg.linePiece2segLineRelation, mg.linePiece2bndPiece,
+       mg.linePiece2bndPieceInSameDirection);
+    ar(mg.lines, mg.line2linePieces, mg.line2lineRelations);
+    ar(mg.lineRelations, mg.lineRelation2anchor, mg.lineRelation2lines,
+       mg.lineRelation2weight, mg.lineRelation2votes,
+       mg.lineRelation2IsIncidence);
+    ar(mg.bndPiece2dirs, mg.bndPiece2length, mg.bndPiece2classes,
+       mg.bndPiece2bnd, mg.bndPiece2linePieces, mg.bndPiece2segRelation);
+    ar(mg.bnd2bndPieces, mg.bnd2segs, mg.bnd2juncs);
+    ar(mg.junc2positions, mg.junc2bnds);
   }
 };
 
+// SegmentationForPIGraph
+// if hierarchy is given, it records all the merges at the weights of their
+// edges, those of the result are marked, and the ones after merge the rest
+// segments along edges in the order of weights
 int SegmentationForPIGraph(const PanoramicView &view,
                            const std::vector<Classified<Line3>> &lines,
                            Imagei &segs,
                            double lineExtendAngle = DegreesToRadians(5),
                            double sigma = 10.0, double c = 1.0,
                            double minSize = 200,
-                           int widthThresToRemoveThinRegions = 2);
+                           int widthThresToRemoveThinRegions = 2,
+                           SegmentationHierarchy *hierarchy = nullptr);
 
+// BuildPIGraph
+// lineSampleIndexAngle is the sample angle of lineSamples
 PIGraph<PanoramicCamera> BuildPIGraph(
     const PanoramicView &view, const std::vector<Vec3> &vps, int verticalVPId,
     const Imagei &segs, const std::vector<Classified<Line3>> &lines,
     double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
     double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
     double incidenceAngleAlongDirectionThreshold,
-    double incidenceAngleVerticalDirectionThreshold);
+    double incidenceAngleVerticalDirectionThreshold,
+    double lineSampleIndexAngle);
 
 PIGraph<PerspectiveCamera> BuildPIGraph(
     const PerspectiveView &view, const std::vector<Vec3> &vps, int verticalVPId,
@@ -144,7 +225,55 @@ PIGraph<PerspectiveCamera> BuildPIGraph(
     double bndPieceSplitAngleThres, double bndPieceClassifyAngleThres,
     double bndPieceBoundToLineAngleThres, double intersectionAngleThreshold,
     double incidenceAngleAlongDirectionThreshold,
-    double incidenceAngleVerticalDirectionThreshold);
+    double incidenceAngleVerticalDirectionThreshold,
+    double lineSampleIndexAngle);
+
+// PIGraph updates
+// ids after an erased element shift down by one, the others are kept, and the
+// line relation weights are revoted, relations of the touched line pieces are
+// reset to Unknown, the updates of lines rebuild lineSamples
+
+// RemoveLine
+void RemoveLine(PIGraph<PanoramicCamera> &mg, int line);
+void RemoveLine(PIGraph<PerspectiveCamera> &mg, int line);
+
+// AddLine
+// returns the id of the new line, relations to the other lines are added
+int AddLine(PIGraph<PanoramicCamera> &mg, const Classified<Line3> &line,
+            double bndPieceBoundToLineAngleThres,
+            double intersectionAngleThreshold,
+            double incidenceAngleAlongDirectionThreshold,
+            double incidenceAngleVerticalDirectionThreshold);
+int AddLine(PIGraph<PerspectiveCamera> &mg, const Classified<Line3> &line,
+            double bndPieceBoundToLineAngleThres,
+            double intersectionAngleThreshold,
+            double incidenceAngleAlongDirectionThreshold,
+            double incidenceAngleVerticalDirectionThreshold);
+
+// MergeSegs
+// merges seg2 into seg1 and returns the new id of seg1, the bnds, juncs, bnd
+// pieces and line pieces are then those BuildPIGraph makes of the merged segs,
+// the bnds of the merged seg are traced again, and the lines near them or on
+// the segs are split again, the thresholds are those given to BuildPIGraph
+int MergeSegs(PIGraph<PanoramicCamera> &mg, int seg1, int seg2,
+              double bndPieceSplitAngleThres,
+              double bndPieceClassifyAngleThres,
+              double bndPieceBoundToLineAngleThres);
+int MergeSegs(PIGraph<PerspectiveCamera> &mg, int seg1, int seg2,
+              double bndPieceSplitAngleThres,
+              double bndPieceClassifyAngleThres,
+              double bndPieceBoundToLineAngleThres);
+
+// SplitBnd
+// splits bnd before its k-th bnd piece and returns the new junc, the new bnd
+// takes the bnd pieces from k on
+int SplitBnd(PIGraph<PanoramicCamera> &mg, int bnd, int k);
+int SplitBnd(PIGraph<PerspectiveCamera> &mg, int bnd, int k);
+
+// IsConsistent
+// whether the records of mg refer to each other, the updates keep it so
+bool IsConsistent(const PIGraph<PanoramicCamera> &mg);
+bool IsConsistent(const PIGraph<PerspectiveCamera> &mg);
 
 // PerfectSegMaskView
 View<PartialPanoramicCamera, Imageub>
@@ -192,4 +321,9 @@ float OutsiderIntersectionJunctionWeight();
 float ComputeIntersectionJunctionWeightWithLinesVotes(
     const Mat<float, 3, 2> &votes);
 }
-}
\ No newline at end of file
+}
+
+CEREAL_CLASS_VERSION(
+    pano::experimental::PIGraph<pano::core::PanoramicCamera>, 5);
+CEREAL_CLASS_VERSION(
+    pano::experimental::PIGraph<pano::core::PerspectiveCamera>, 5);
@@ -0,0 +1,440 @@
+#include <numeric>
+
+#include "pi_graph.hpp"
+
+#include "../../panoramix/panoramix.unittest.hpp"
+
+using namespace pano;
+using namespace pano::experimental;
+
+namespace {
+
+const double bndPieceSplitAngleThres = DegreesToRadians(1);
+const double bndPieceClassifyAngleThres = DegreesToRadians(1);
+const double bndPieceBoundToLineAngleThres = DegreesToRadians(1);
+const double intersectionAngleThreshold = DegreesToRadians(2);
+const double incidenceAngleAlongDirectionThreshold = DegreesToRadians(15);
+const double incidenceAngleVerticalDirectionThreshold = DegreesToRadians(2);
+const double lineSampleIndexAngle = DegreesToRadians(2);
+
+PerspectiveCamera TestCamera() {
+  return PerspectiveCamera(160, 120, Point2(80, 60), 100);
+}
+
+// labels of a 4 x 3 grid of segs, the inner crossings of the grid are juncs
+// of 4 segs, the boundary between the last two rows steps down in the second
+// column, so that the bnd there has several bnd pieces
+Imagei GridSegs() {
+  Imagei segs(120, 160);
+  for (int y = 0; y < segs.rows; y++) {
+    for (int x = 0; x < segs.cols; x++) {
+      int col = x / 40;
+      int row = y < 40 ? 0 : y < (x >= 60 && x < 80 ? 90 : 80) ? 1 : 2;
+      segs(y, x) = row * 4 + col;
+    }
+  }
+  return segs;
+}
+
+Classified<Line3> LineOnScreen(const PerspectiveCamera &cam, double x1,
+                               double y1, double x2, double y2, int claz) {
+  return ClassifyAs(Line3(normalize(cam.toSpace(Point2(x1, y1))),
+                          normalize(cam.toSpace(Point2(x2, y2)))),
+                    claz);
+}
+
+// lines across and along the bnds, horizontal lines on the screen pass
+// through the second vp and vertical ones through the third
+std::vector<Classified<Line3>> TestLines(const PerspectiveCamera &cam) {
+  return {LineOnScreen(cam, 10, 60, 70, 60, 1),
+          LineOnScreen(cam, 75, 60, 150, 60, 1),
+          LineOnScreen(cam, 45, 39.5, 115, 39.5, 1),
+          LineOnScreen(cam, 100, 10, 100, 110, 2),
+          LineOnScreen(cam, 60, 20, 60, 100, 2),
+          LineOnScreen(cam, 20, 100, 140, 100, 1),
+          LineOnScreen(cam, 20, 20, 140, 100, -1)};
+}
+
+PIGraph<PerspectiveCamera> BuildTestPIGraph(
+    const Imagei &segs, const std::vector<Classified<Line3>> &lines) {
+  PerspectiveView view(TestCamera());
+  std::vector<Vec3> vps = {Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1)};
+  return BuildPIGraph(view, vps, 2, segs, lines, bndPieceSplitAngleThres,
+                      bndPieceClassifyAngleThres, bndPieceBoundToLineAngleThres,
+                      intersectionAngleThreshold,
+                      incidenceAngleAlongDirectionThreshold,
+                      incidenceAngleVerticalDirectionThreshold,
+                      lineSampleIndexAngle);
+}
+
+// the records of lines and linePieces, with their ids
+void ExpectSameLinePieces(const PIGraph<PerspectiveCamera> &a,
+                          const PIGraph<PerspectiveCamera> &b) {
+  ASSERT_EQ(a.nlines(), b.nlines());
+  for (int i = 0; i < a.nlines(); i++) {
+    EXPECT_EQ(a.lines[i].claz, b.lines[i].claz);
+    EXPECT_EQ(a.lines[i].component.first, b.lines[i].component.first);
+    EXPECT_EQ(a.lines[i].component.second, b.lines[i].component.second);
+  }
+  EXPECT_EQ(a.line2linePieces.evalAsStdVectors(),
+            b.line2linePieces.evalAsStdVectors());
+  EXPECT_EQ(a.line2used, b.line2used);
+
+  ASSERT_EQ(a.nlinePieces(), b.nlinePieces());
+  EXPECT_EQ(a.linePiece2samples.evalAsStdVectors(),
+            b.linePiece2samples.evalAsStdVectors());
+  EXPECT_EQ(a.linePiece2length, b.linePiece2length);
+  EXPECT_EQ(a.linePiece2line, b.linePiece2line);
+  EXPECT_EQ(a.linePiece2seg, b.linePiece2seg);
+  EXPECT_TRUE(a.linePiece2segLineRelation == b.linePiece2segLineRelation);
+  EXPECT_EQ(a.linePiece2bndPiece, b.linePiece2bndPiece);
+  EXPECT_EQ(a.linePiece2bndPieceInSameDirection,
+            b.linePiece2bndPieceInSameDirection);
+  EXPECT_EQ(a.seg2linePieces.evalAsStdVectors(),
+            b.seg2linePieces.evalAsStdVectors());
+  EXPECT_EQ(a.bndPiece2linePieces.evalAsStdVectors(),
+            b.bndPiece2linePieces.evalAsStdVectors());
+
+  ASSERT_EQ(a.nlines(), a.lineSamples->nlines());
+  ASSERT_EQ(b.nlines(), b.lineSamples->nlines());
+  EXPECT_EQ(a.lineSamples->sampleAngle(), b.lineSamples->sampleAngle());
+  for (int i = 0; i < a.nlines(); i++) {
+    auto samplesa = a.lineSamples->samplesOf(i);
+    auto samplesb = b.lineSamples->samplesOf(i);
+    ASSERT_EQ(samplesa.size(), samplesb.size());
+    for (int j = 0; j < samplesa.size(); j++) {
+      EXPECT_EQ(samplesa[j].first, samplesb[j].first);
+      EXPECT_EQ(samplesa[j].second, samplesb[j].second);
+    }
+  }
+}
+
+// ids of lineRelations in the order of their lines, the relations of an added
+// line are appended to those of a graph instead of ordered as in a build
+std::vector<int>
+LineRelationsInLineOrder(const PIGraph<PerspectiveCamera> &mg) {
+  std::vector<int> lrs(mg.nlineRelations());
+  std::iota(lrs.begin(), lrs.end(), 0);
+  std::sort(lrs.begin(), lrs.end(), [&mg](int lr1, int lr2) {
+    return mg.lineRelation2lines[lr1] < mg.lineRelation2lines[lr2];
+  });
+  return lrs;
+}
+
+// the records of lineRelations lrsa of a and lrsb of b
+void ExpectSameLineRelations(const PIGraph<PerspectiveCamera> &a,
+                             const std::vector<int> &lrsa,
+                             const PIGraph<PerspectiveCamera> &b,
+                             const std::vector<int> &lrsb) {
+  ASSERT_EQ(lrsa.size(), lrsb.size());
+  for (int k = 0; k < lrsa.size(); k++) {
+    int i = lrsa[k], j = lrsb[k];
+    EXPECT_TRUE(a.lineRelations[i] == b.lineRelations[j]);
+    EXPECT_EQ(a.lineRelation2anchor[i], b.lineRelation2anchor[j]);
+    EXPECT_EQ(a.lineRelation2lines[i], b.lineRelation2lines[j]);
+    EXPECT_EQ(a.lineRelation2IsIncidence[i], b.lineRelation2IsIncidence[j]);
+    // the votes of a removed line are subtracted from the sums of all
+    for (int m = 0; m < 6; m++) {
+      EXPECT_NEAR(a.lineRelation2votes[i].val[m],
+                  b.lineRelation2votes[j].val[m], 1e-9);
+    }
+    EXPECT_EQ(a.lineRelation2weight[i], b.lineRelation2weight[j]);
+  }
+}
+
+// the records of lines, linePieces and lineRelations, with their ids
+void ExpectSameLines(const PIGraph<PerspectiveCamera> &a,
+                     const PIGraph<PerspectiveCamera> &b) {
+  ExpectSameLinePieces(a, b);
+  EXPECT_EQ(a.line2lineRelations.evalAsStdVectors(),
+            b.line2lineRelations.evalAsStdVectors());
+  ASSERT_EQ(a.nlineRelations(), b.nlineRelations());
+  std::vector<int> lrs(a.nlineRelations());
+  std::iota(lrs.begin(), lrs.end(), 0);
+  ExpectSameLineRelations(a, lrs, b, lrs);
+}
+
+// the samples of each line, with the segs they are bound to, or the left and
+// right segs of the bnd they are bound to
+void LineSamplesWithSegs(
+    const PIGraph<PerspectiveCamera> &mg,
+    std::vector<std::vector<Vec3>> &line2samples,
+    std::vector<std::vector<std::pair<int, int>>> &line2segs) {
+  line2samples.assign(mg.nlines(), {});
+  line2segs.assign(mg.nlines(), {});
+  for (int line = 0; line < mg.nlines(); line++) {
+    for (int lp : mg.line2linePieces[line]) {
+      std::pair<int, int> segs(mg.linePiece2seg[lp], -1);
+      int bp = mg.linePiece2bndPiece[lp];
+      if (bp != -1) {
+        segs = mg.bnd2segs[mg.bndPiece2bnd[bp]];
+      }
+      for (auto &d : mg.linePiece2samples[lp]) {
+        line2samples[line].push_back(d);
+        line2segs[line].push_back(segs);
+      }
+    }
+  }
+}
+
+// the bnds as their segs, the pixels of their juncs and their bnd piece dirs
+std::vector<std::tuple<std::pair<int, int>, Pixel, Pixel,
+                       std::vector<std::vector<Vec3>>>>
+SortedBnds(const PIGraph<PerspectiveCamera> &mg) {
+  std::vector<std::tuple<std::pair<int, int>, Pixel, Pixel,
+                         std::vector<std::vector<Vec3>>>>
+      bnds;
+  for (int bnd = 0; bnd < mg.nbnds(); bnd++) {
+    std::vector<std::vector<Vec3>> bndPieceDirs;
+    for (int bp : mg.bnd2bndPieces[bnd]) {
+      bndPieceDirs.push_back(mg.bndPiece2dirs[bp].evalAsStdVector());
+    }
+    auto &juncs = mg.bnd2juncs[bnd];
+    bnds.emplace_back(mg.bnd2segs[bnd],
+                      RoundToPixel(mg.view.camera.toScreen(
+                          mg.junc2positions[juncs.first])),
+                      RoundToPixel(mg.view.camera.toScreen(
+                          mg.junc2positions[juncs.second])),
+                      std::move(bndPieceDirs));
+  }
+  std::sort(bnds.begin(), bnds.end(), [](const auto &a, const auto &b) {
+    return std::tie(std::get<0>(a), std::get<1>(a).x, std::get<1>(a).y,
+                    std::get<2>(a).x, std::get<2>(a).y) <
+           std::tie(std::get<0>(b), std::get<1>(b).x, std::get<1>(b).y,
+                    std::get<2>(b).x, std::get<2>(b).y);
+  });
+  return bnds;
+}
+
+// merges seg2 into seg1 and compares the graph with the one built on the
+// merged segs
+void ExpectMergedAsRebuilt(int seg1, int seg2) {
+  auto segs = GridSegs();
+  auto lines = TestLines(TestCamera());
+  auto mg = BuildTestPIGraph(segs, lines);
+  Imagei segsBefore = segs.clone();
+
+  auto merged = mg;
+  int seg = MergeSegs(merged, seg1, seg2, bndPieceSplitAngleThres,
+                      bndPieceClassifyAngleThres,
+                      bndPieceBoundToLineAngleThres);
+  EXPECT_EQ(seg1, seg);
+  EXPECT_TRUE(IsConsistent(merged));
+  // the labels given to BuildPIGraph and those of mg are not changed
+  EXPECT_EQ(0, cv::countNonZero(segs != segsBefore));
+  EXPECT_EQ(0, cv::countNonZero(mg.segs != segsBefore));
+
+  Imagei mergedSegs = segs.clone();
+  for (int &label : mergedSegs) {
+    label = label == seg2 ? seg1 : label > seg2 ? label - 1 : label;
+  }
+  auto rebuilt = BuildTestPIGraph(mergedSegs, lines);
+  EXPECT_EQ(0, cv::countNonZero(merged.segs != mergedSegs));
+
+  // segs
+  ASSERT_EQ(rebuilt.nsegs, merged.nsegs);
+  for (int i = 0; i < rebuilt.nsegs; i++) {
+    EXPECT_NEAR(rebuilt.seg2areaRatio[i], merged.seg2areaRatio[i], 1e-9);
+    EXPECT_LT(norm(rebuilt.seg2center[i] - merged.seg2center[i]), 1e-9);
+    ASSERT_EQ(rebuilt.seg2contours[i].size(), merged.seg2contours[i].size());
+    for (int j = 0; j < rebuilt.seg2contours[i].size(); j++) {
+      ASSERT_EQ(rebuilt.seg2contours[i][j].size(),
+                merged.seg2contours[i][j].size());
+      for (int k = 0; k < rebuilt.seg2contours[i][j].size(); k++) {
+        EXPECT_LT(norm(rebuilt.seg2contours[i][j][k] -
+                       merged.seg2contours[i][j][k]),
+                  1e-9);
+      }
+    }
+  }
+
+  // bnds, juncs and bnd pieces, the ids of bnds and bnd pieces differ
+  EXPECT_EQ(rebuilt.junc2positions, merged.junc2positions);
+  EXPECT_EQ(rebuilt.nbnds(), merged.nbnds());
+  EXPECT_EQ(rebuilt.nbndPieces(), merged.nbndPieces());
+  EXPECT_TRUE(SortedBnds(rebuilt) == SortedBnds(merged));
+
+  // lines are split into the same pieces, bound to the same segs and bnds,
+  // the pieces bound to segs keep the ids of a build
+  std::vector<std::vector<Vec3>> rebuiltSamples, mergedSamples;
+  std::vector<std::vector<std::pair<int, int>>> rebuiltSegs, mergedSegsOfLines;
+  LineSamplesWithSegs(rebuilt, rebuiltSamples, rebuiltSegs);
+  LineSamplesWithSegs(merged, mergedSamples, mergedSegsOfLines);
+  EXPECT_EQ(rebuiltSamples, mergedSamples);
+  EXPECT_EQ(rebuiltSegs, mergedSegsOfLines);
+  EXPECT_EQ(rebuilt.line2linePieces.evalAsStdVectors(),
+            merged.line2linePieces.evalAsStdVectors());
+  EXPECT_EQ(rebuilt.linePiece2seg, merged.linePiece2seg);
+  EXPECT_EQ(rebuilt.seg2linePieces.evalAsStdVectors(),
+            merged.seg2linePieces.evalAsStdVectors());
+  EXPECT_EQ(rebuilt.lineRelation2lines, merged.lineRelation2lines);
+}
+}
+
+TEST(PIGraphTest, SegmentationHierarchy) {
+  // a small panorama of colored blocks
+  Image3ub im(32, 64);
+  for (int y = 0; y < im.rows; y++) {
+    for (int x = 0; x < im.cols; x++) {
+      im(y, x) = Vec<uint8_t, 3>(x / 16 * 60, y / 16 * 120,
+                                 (x / 8 + y / 8) % 2 * 30);
+    }
+  }
+  auto view = CreatePanoramicView(Image(im));
+  Imagei segs;
+  SegmentationHierarchy hierarchy;
+  int nsegs = SegmentationForPIGraph(view, {}, segs, DegreesToRadians(5), 1.0,
+                                     1.0, 20, 2, &hierarchy);
+  ASSERT_GT(nsegs, 1);
+  EXPECT_EQ(size_t(im.rows * im.cols - 1), hierarchy.nmerges());
+
+  // the merges of the result give its labels
+  Imagei cut;
+  EXPECT_EQ(nsegs, hierarchy.cutSegmentation(cut));
+  EXPECT_EQ(0, cv::countNonZero(cut != segs));
+  EXPECT_EQ(nsegs, hierarchy.cutToSegmentNumber(nsegs, cut));
+  EXPECT_EQ(0, cv::countNonZero(cut != segs));
+
+  // the levels are the weights of the merged edges, a cut at the heaviest one
+  // takes all the merges
+  float maxLevel = 0.0f;
+  for (size_t i = 0; i < hierarchy.nmerges(); i++) {
+    EXPECT_GE(hierarchy.level(i), 0.0f);
+    maxLevel = std::max(maxLevel, hierarchy.level(i));
+  }
+  EXPECT_EQ(1, hierarchy.cutAtLevel(maxLevel, cut));
+  EXPECT_EQ(im.rows * im.cols, hierarchy.cutAtLevel(-1.0, cut));
+}
+
+TEST(PIGraphTest, BuildPIGraph) {
+  auto segs = GridSegs();
+  auto mg = BuildTestPIGraph(segs, TestLines(TestCamera()));
+  EXPECT_TRUE(IsConsistent(mg));
+  EXPECT_EQ(12, mg.nsegs);
+  EXPECT_GT(mg.nbnds(), mg.njuncs());
+  EXPECT_GT(mg.nbndPieces(), mg.nbnds());
+  EXPECT_GT(mg.nlineRelations(), 0);
+  // some line pieces are bound to bnd pieces, the others to segs
+  int nbound = std::count_if(mg.linePiece2bndPiece.begin(),
+                             mg.linePiece2bndPiece.end(),
+                             [](int bp) { return bp != -1; });
+  EXPECT_GT(nbound, 0);
+  EXPECT_LT(nbound, mg.nlinePieces());
+  // the samples of each line cover it
+  EXPECT_EQ(lineSampleIndexAngle, mg.lineSamples->sampleAngle());
+  for (int line = 0; line < mg.nlines(); line++) {
+    auto &l = mg.lines[line].component;
+    auto samples = mg.lineSamples->samplesOf(line);
+    ASSERT_FALSE(samples.empty());
+    EXPECT_LT(AngleBetweenDirected(l.first, samples.front().first), 1e-9);
+    EXPECT_GE(AngleBetweenDirected(l.first, samples.back().second),
+              AngleBetweenDirected(l.first, l.second) - 1e-9);
+  }
+}
+
+TEST(PIGraphTest, RemoveLine) {
+  auto segs = GridSegs();
+  auto lines = TestLines(TestCamera());
+  auto mg = BuildTestPIGraph(segs, lines);
+  for (int line = 0; line < lines.size(); line++) {
+    auto removed = mg;
+    RemoveLine(removed, line);
+    EXPECT_TRUE(IsConsistent(removed));
+
+    auto restLines = lines;
+    restLines.erase(restLines.begin() + line);
+    auto rebuilt = BuildTestPIGraph(segs, restLines);
+    ExpectSameLines(rebuilt, removed);
+  }
+}
+
+TEST(PIGraphTest, AddLine) {
+  auto cam = TestCamera();
+  auto segs = GridSegs();
+  auto lines = TestLines(cam);
+  auto mg = BuildTestPIGraph(segs, lines);
+  for (auto &line : {LineOnScreen(cam, 30, 79.5, 150, 79.5, 1),
+                     LineOnScreen(cam, 120, 5, 120, 115, 2),
+                     LineOnScreen(cam, 5, 110, 155, 10, -1)}) {
+    auto added = mg;
+    AddLine(added, line, bndPieceBoundToLineAngleThres,
+            intersectionAngleThreshold, incidenceAngleAlongDirectionThreshold,
+            incidenceAngleVerticalDirectionThreshold);
+
+    // the bnd pieces near the line are found as by the index of a build
+    auto moreLines = lines;
+    moreLines.push_back(line);
+    auto rebuilt = BuildTestPIGraph(segs, moreLines);
+    ExpectSameLinePieces(rebuilt, added);
+    ExpectSameLineRelations(rebuilt, LineRelationsInLineOrder(rebuilt), added,
+                            LineRelationsInLineOrder(added));
+  }
+}
+
+TEST(PIGraphTest, AddLineThenRemoveLine) {
+  auto cam = TestCamera();
+  auto segs = GridSegs();
+  auto mg = BuildTestPIGraph(segs, TestLines(cam));
+  for (auto &line : {LineOnScreen(cam, 30, 79.5, 150, 79.5, 1),
+                     LineOnScreen(cam, 120, 5, 120, 115, 2),
+                     LineOnScreen(cam, 5, 110, 155, 10, -1)}) {
+    auto added = mg;
+    int id = AddLine(added, line, bndPieceBoundToLineAngleThres,
+                     intersectionAngleThreshold,
+                     incidenceAngleAlongDirectionThreshold,
+                     incidenceAngleVerticalDirectionThreshold);
+    EXPECT_EQ(mg.nlines(), id);
+    EXPECT_TRUE(IsConsistent(added));
+    EXPECT_GT(added.nlinePieces(), mg.nlinePieces());
+
+    RemoveLine(added, id);
+    EXPECT_TRUE(IsConsistent(added));
+    ExpectSameLines(mg, added);
+  }
+}
+
+TEST(PIGraphTest, MergeSegs) {
+  // the two last segs of the middle row, which meet at juncs of 4 segs that
+  // still join 3 segs
+  ExpectMergedAsRebuilt(6, 7);
+}
+
+TEST(PIGraphTest, MergeSegsAtTJunctions) {
+  // the second seg of the middle row and the third one of the last row meet
+  // at the T juncs of the step, which are removed, and the bnds they joined
+  // are joined
+  ExpectMergedAsRebuilt(5, 10);
+}
+
+TEST(PIGraphTest, SplitBnd) {
+  auto mg = BuildTestPIGraph(GridSegs(), TestLines(TestCamera()));
+  int nsplits = 0;
+  for (int bnd = 0; bnd < mg.nbnds(); bnd++) {
+    auto bps = mg.bnd2bndPieces[bnd].evalAsStdVector();
+    for (int k = 1; k < bps.size(); k++) {
+      auto split = mg;
+      int junc = SplitBnd(split, bnd, k);
+      nsplits++;
+      EXPECT_TRUE(IsConsistent(split));
+      EXPECT_EQ(mg.nbnds() + 1, split.nbnds());
+      EXPECT_EQ(mg.njuncs() + 1, split.njuncs());
+      EXPECT_EQ(mg.nbndPieces(), split.nbndPieces());
+      EXPECT_EQ(mg.njuncs(), junc);
+
+      // the new bnd takes the bnd pieces from k on, and the new junc joins
+      // the two bnds
+      int newBnd = mg.nbnds();
+      EXPECT_EQ(std::vector<int>(bps.begin(), bps.begin() + k),
+                split.bnd2bndPieces[bnd].evalAsStdVector());
+      EXPECT_EQ(std::vector<int>(bps.begin() + k, bps.end()),
+                split.bnd2bndPieces[newBnd].evalAsStdVector());
+      EXPECT_EQ(junc, split.bnd2juncs[bnd].second);
+      EXPECT_EQ(junc, split.bnd2juncs[newBnd].first);
+      EXPECT_EQ(mg.bnd2juncs[bnd].second, split.bnd2juncs[newBnd].second);
+      EXPECT_EQ(mg.bnd2segs[bnd], split.bnd2segs[newBnd]);
+      EXPECT_EQ(std::vector<int>({bnd, newBnd}),
+                split.junc2bnds[junc].evalAsStdVector());
+    }
+  }
+  EXPECT_GT(nsplits, 0);
+}
@@ -175,6 +175,19 @@ int PILayoutAnnotation::setCoplanar(int f1, int f2) {
   return coplanarFacePairs.size() - 1;
 }
 
+Image PILayoutAnnotation::fullRectifiedImage() const {
+  // annotations before ver2 rectified the image at full resolution
+  if (horiCenterRatio < 0 || fullImage.filename().empty()) {
+    return rectifiedImage.clone();
+  }
+  Image im = fullImage.get().clone();
+  if (im.empty() ||
+      !MakePanorama(im, static_cast<int>(horiCenterRatio * im.rows))) {
+    return rectifiedImage.clone();
+  }
+  return im;
+}
+
 std::string LayoutAnnotationFilePath(const std::string &imagePath) {
   QFileInfo finfo(QString::fromStdString(imagePath));
   if (!finfo.exists())
@@ -204,20 +217,24 @@ LoadOrInitializeNewLayoutAnnotation(const std::string &imagePath) {
   if (!annofinfo.exists() ||
       !LoadFromDisk(annofinfo.absoluteFilePath().toStdString(), anno)) {
 
-    // initialize new annotation
-    anno.originalImage = cv::imread(imagePath);
+    // initialize new annotation, the working panorama is 700 pixels high so
+    // decode at the smallest scale keeping the width no less than 1400
+    static const int workingHeight = 700;
+    anno.originalImage =
+        ImageReadReduced(imagePath, Sizei(workingHeight * 2, 0));
 
-    // rectify the image
+    // rectify the image and resize it to the working resolution
     std::cout << "rectifying image" << std::endl;
     anno.rectifiedImage = anno.originalImage.clone();
     gui::MakePanoramaByHand(anno.rectifiedImage, &anno.extendedOnTop,
                             &anno.extendedOnBottom, &anno.topIsPlane,
-                            &anno.bottomIsPlane);
+                            &anno.bottomIsPlane, workingHeight,
+                            &anno.horiCenterRatio);
 
     // create view
     std::cout << "creating views" << std::endl;
     Image image = anno.rectifiedImage.clone();
-    ResizeToHeight(image, 700);
+    ResizeToHeight(image, workingHeight);
     anno.view = CreatePanoramicView(image);
 
     // collect lines
@@ -250,6 +267,7 @@ LoadOrInitializeNewLayoutAnnotation(const std::string &imagePath) {
   }
 
   anno.impath = imagePath;
+  anno.fullImage = LazyImage(imagePath);
 
   return anno;
 }
@@ -324,14 +342,14 @@ PIGraph<PanoramicCamera> ConvertToPIGraph(const PILayoutAnnotation &anno) {
 
   // estimate segs
   nsegs = SegmentationForPIGraph(view, {}, segs, DegreesToRadians(1));
-  RemoveThinRegionInSegmentation(segs, 1, true);
-  nsegs = DensifySegmentation(segs, true);
+  nsegs = CleanupSegmentation(true).removeThinRegions(1)(segs);
   assert(IsDenseSegmentation(segs));
 
   PIGraph<PanoramicCamera> mg = BuildPIGraph(view, anno.vps, anno.vertVPId, segs, {},
                             DegreesToRadians(1), DegreesToRadians(1),
                             DegreesToRadians(2), DegreesToRadians(5),
-                            DegreesToRadians(60), DegreesToRadians(5));
+                            DegreesToRadians(60), DegreesToRadians(5),
+                            DegreesToRadians(5) / 3.0);
 
   return mg;
 }
@@ -13,10 +13,12 @@ using namespace pano::core;
 struct PILayoutAnnotation {
   std::string impath; // ver1
 
-  Image originalImage;
-  Image rectifiedImage;
+  Image originalImage;  // decoded at reduced scale
+  Image rectifiedImage; // at working resolution
+  LazyImage fullImage;  // full resolution image of impath, not serialized
   bool extendedOnTop;
   bool extendedOnBottom;
+  float horiCenterRatio; // ver2, horizon row / image rows, -1 if unknown
 
   bool topIsPlane;    // ver1
   bool bottomIsPlane; // ver1
@@ -37,7 +39,7 @@ struct PILayoutAnnotation {
   std::vector<std::pair<int, int>> coplanarFacePairs;
   std::vector<Polygon3> clutters;
 
-  PILayoutAnnotation() : vertVPId(-1) {}
+  PILayoutAnnotation() : horiCenterRatio(-1), vertVPId(-1) {}
 
   int ncorners() const { return corners.size(); }
   int nborders() const { return border2corners.size(); }
@@ -50,6 +52,10 @@ struct PILayoutAnnotation {
   void regenerateFaces();
   int setCoplanar(int f1, int f2);
 
+  // a copy of fullImage rectified like rectifiedImage, for display, falls back
+  // to rectifiedImage if the annotation does not know how it was rectified
+  Image fullRectifiedImage() const;
+
   template <class Archiver>
   inline void serialize(Archiver &ar, std::int32_t version) {
     if (version == 0) {
@@ -65,6 +71,15 @@ struct PILayoutAnnotation {
       ar(lines);
       ar(corners, border2corners, border2connected);
       ar(face2corners, face2control, face2plane, coplanarFacePairs, clutters);
+    } else if (version == 2) {
+      ar(impath);
+      ar(originalImage, rectifiedImage, extendedOnTop, extendedOnBottom);
+      ar(horiCenterRatio);
+      ar(topIsPlane, bottomIsPlane);
+      ar(view, vps, vertVPId);
+      ar(lines);
+      ar(corners, border2corners, border2connected);
+      ar(face2corners, face2control, face2plane, coplanarFacePairs, clutters);
     }
   }
 };
@@ -84,4 +99,4 @@ Imageb GuessMask(const PILayoutAnnotation &anno);
 }
 }
 
-CEREAL_CLASS_VERSION(pano::experimental::PILayoutAnnotation, 1);
\ No newline at end of file
+CEREAL_CLASS_VERSION(pano::experimental::PILayoutAnnotation, 2);
\ No newline at end of file
@@ -272,7 +272,7 @@ void PILayoutAnnotationWidget::setCurAnnotation(PILayoutAnnotation *anno,
 
   // build image scene
   SceneBuilder sb;
-  ResourceStore::set("tex", anno->rectifiedImage);
+  ResourceStore::set("tex", anno->fullRectifiedImage());
   Sphere3 sp;
   sp.center = Origin();
   sp.radius = visualDepthImage;
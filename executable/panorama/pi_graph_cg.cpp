@@ -370,7 +370,7 @@ BuildPIConstraintGraph(const PIGraph<PanoramicCamera> &mg, double minAngleThresF
 
 PIConstraintGraph BuildPIConstraintGraph(
     const PIGraph<PanoramicCamera> &mg, const std::vector<LineSidingWeight> &lsw,
-    const std::vector<std::array<std::set<int>, 2>> &line2leftRightSegs,
+    const std::vector<std::array<std::vector<int>, 2>> &line2leftRightSegs,
     double minAngleThresForAWideEdge) {
 
   PIConstraintGraph cg;
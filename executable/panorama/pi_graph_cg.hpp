@@ -80,7 +80,7 @@ BuildPIConstraintGraph(const PIGraph<PanoramicCamera> &mg,
 PIConstraintGraph BuildPIConstraintGraph(
     const PIGraph<PanoramicCamera> &mg,
     const std::vector<LineSidingWeight> &lsw,
-    const std::vector<std::array<std::set<int>, 2>> &line2leftRightSegs,
+    const std::vector<std::array<std::vector<int>, 2>> &line2leftRightSegs,
     double minAngleThresForAWideEdge);
 
 PICGDeterminablePart LocateDeterminablePart(const PIConstraintGraph &cg,
@@ -909,19 +909,13 @@ void DetectOcclusions(PIGraph<PanoramicCamera> &mg,
   int width = mg.segs.cols;
   int height = mg.segs.rows;
 
-  RTreeMap<Vec3, std::pair<Line3, int>> lineSamplesTree;
-  for (int i = 0; i < mg.nlines(); i++) {
-    auto &line = mg.lines[i].component;
-    double spanAngle = AngleBetweenDirected(line.first, line.second);
-    for (double a = 0.0; a < spanAngle;
-         a += angleSizeForPixelsNearLines / 3.0) {
-      Vec3 sample1 = normalize(RotateDirection(line.first, line.second, a));
-      Vec3 sample2 = normalize(RotateDirection(
-          line.first, line.second, a + angleSizeForPixelsNearLines / 3.0));
-      lineSamplesTree.emplace(normalize(sample1 + sample2),
-                              std::make_pair(Line3(sample1, sample2), i));
-    }
-  }
+  // pixels are weighted once per sample of mg.lineSamples they are near, the
+  // sample centers are within the angle plus half a sample of those pixels
+  const LineSampleIndex &lineSamples = *mg.lineSamples;
+  assert(lineSamples.nlines() == mg.nlines() &&
+         lineSamples.sampleAngle() <= angleSizeForPixelsNearLines);
+  const double searchAngle =
+      angleSizeForPixelsNearLines + lineSamples.sampleAngle() / 2.0;
 
   // collect lines' nearby pixels and segs
   std::vector<std::set<Pixel>> line2nearbyPixels(mg.nlines());
@@ -935,8 +929,8 @@ void DetectOcclusions(PIGraph<PanoramicCamera> &mg,
     double weight = cos((p.y - (height - 1) / 2.0) / (height - 1) * M_PI);
     Vec3 dir = normalize(mg.view.camera.toSpace(p));
     int seg = *it;
-    lineSamplesTree.search(
-        BoundingBox(dir).expand(angleSizeForPixelsNearLines * 3),
+    lineSamples.search(
+        BoundingBox(dir).expand(searchAngle),
         [&mg, &dir, &line2nearbyPixels, &line2nearbySegsWithLocalCenterDir,
          &line2nearbySegsWithWeight, angleSizeForPixelsNearLines, p, seg,
          weight](const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
@@ -1671,6 +1665,97 @@ void DetectOcclusions(PIGraph<PanoramicCamera> &mg,
   }
 }
 
+namespace {
+// CollectSegsInLineSweeps
+// segs in the quads swept from lines toward the other vps, weighted by their
+// pixels in a perspective camera around each line, only the pixels inside
+// the quads are sampled from the panorama segs (as the camera sampler does,
+// nearest with replicated borders), lines are swept in parallel
+void CollectSegsInLineSweeps(
+    const PIGraph<PanoramicCamera> &mg, double angleSizeForPixelsNearLines,
+    std::vector<std::map<int, double>> &line2leftSegsWithWeight,
+    std::vector<std::map<int, double>> &line2rightSegsWithWeight) {
+  ParallelForRange(0, mg.nlines(), [&](int first, int last) {
+    for (int line = first; line < last; line++) {
+      auto &l = mg.lines[line].component;
+      int claz = mg.lines[line].claz;
+      if (claz == -1) {
+        continue;
+      }
+      for (int vpid = 0; vpid < mg.vps.size(); vpid++) {
+        if (vpid == claz) {
+          continue;
+        }
+        Vec3 vp = mg.vps[vpid];
+        if (vp.dot(normalize(l.center())) < 0) {
+          vp = -vp;
+        }
+
+        Vec3 lineRight = l.first.cross(l.second);
+        bool onLeft = (vp - l.first).dot(lineRight) < 0;
+
+        double lineAngleToVP = std::min(AngleBetweenDirected(l.first, vp),
+                                        AngleBetweenDirected(l.second, vp));
+        double sweepAngle =
+            std::min(angleSizeForPixelsNearLines, lineAngleToVP - 1e-4);
+        std::vector<Vec3> sweepQuad = {
+            normalize(l.first), normalize(l.second),
+            RotateDirection(l.second, vp, sweepAngle),
+            RotateDirection(l.first, vp, sweepAngle)};
+        Vec3 z = normalize(l.center());
+        Vec3 y = normalize(normalize(l).direction());
+        const double focal = mg.view.camera.focal() * 1.2;
+        int w = std::ceil(tan(sweepAngle + 0.01) * focal * 2 * 1.5);
+        int h = std::ceil(
+            (2 * tan(AngleBetweenDirected(l.first, l.second) / 2.0) + 0.01) *
+            focal * 1.5);
+        PerspectiveCamera pc(w, h, Point2(w / 2.0, h / 2.0), focal, Origin(),
+                             z, y);
+
+        std::vector<Point2i> quadProjs(4);
+        for (int i = 0; i < 4; i++) {
+          quadProjs[i] = pc.toScreen(sweepQuad[i]);
+          quadProjs[i][0] = BoundBetween(quadProjs[i][0], 0, w);
+          quadProjs[i][1] = BoundBetween(quadProjs[i][1], 0, h);
+        }
+        cv::Rect footprint =
+            cv::boundingRect(quadProjs) & cv::Rect(0, 0, w, h);
+        if (footprint.area() == 0) {
+          continue;
+        }
+        for (auto &p : quadProjs) {
+          p[0] -= footprint.x;
+          p[1] -= footprint.y;
+        }
+        Imageub mask(footprint.size(), false);
+        cv::fillConvexPoly(mask, quadProjs, true);
+
+        auto &segsWithWeight = (onLeft ? line2leftSegsWithWeight
+                                       : line2rightSegsWithWeight)[line];
+        for (int yy = 0; yy < mask.rows; yy++) {
+          for (int xx = 0; xx < mask.cols; xx++) {
+            if (!mask(yy, xx)) {
+              continue;
+            }
+            Point2 pos(footprint.x + xx, footprint.y + yy);
+            Point2 panoPos = mg.view.camera.toScreen(pc.toSpace(pos));
+            Pixel panoPixel(
+                BoundBetween(static_cast<int>(std::round(panoPos[0])), 0,
+                             mg.segs.cols - 1),
+                BoundBetween(static_cast<int>(std::round(panoPos[1])), 0,
+                             mg.segs.rows - 1));
+            int seg = mg.segs(panoPixel);
+            double pixelDistToEyeSquared =
+                Square(Distance(pos, pc.principlePoint())) + focal * focal;
+            segsWithWeight[seg] += 1.0 * focal * focal / pixelDistToEyeSquared;
+          }
+        }
+      }
+    }
+  });
+}
+}
+
 std::vector<LineSidingWeight> ComputeLinesSidingWeights(
     const PIGraph<PanoramicCamera> &mg,
     double minAngleSizeOfLineInTJunction /*= DegreesToRadians(3)*/,
@@ -1683,74 +1768,8 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeights(
   std::vector<std::map<int, double>> line2leftSegsWithWeight(mg.nlines());
   std::vector<std::map<int, double>> line2rightSegsWithWeight(mg.nlines());
 
-  // todo
-  // use the sweep operation instead!!!!
-  // THERE_ARE_BUGS_HERE("Use the Sweep Operation to detect orientation
-  // violation between lines and segs!");
-
-  for (int line = 0; line < mg.nlines(); line++) {
-    auto &l = mg.lines[line].component;
-    int claz = mg.lines[line].claz;
-    if (claz == -1) {
-      continue;
-    }
-    for (int vpid = 0; vpid < mg.vps.size(); vpid++) {
-      if (vpid == claz) {
-        continue;
-      }
-      Vec3 vp = mg.vps[vpid];
-      if (vp.dot(normalize(l.center())) < 0) {
-        vp = -vp;
-      }
-
-      Vec3 lineRight = l.first.cross(l.second);
-      bool onLeft = (vp - l.first).dot(lineRight) < 0;
-
-      double lineAngleToVP = std::min(AngleBetweenDirected(l.first, vp),
-                                      AngleBetweenDirected(l.second, vp));
-      double sweepAngle =
-          std::min(angleSizeForPixelsNearLines, lineAngleToVP - 1e-4);
-      std::vector<Vec3> sweepQuad = {normalize(l.first), normalize(l.second),
-                                     RotateDirection(l.second, vp, sweepAngle),
-                                     RotateDirection(l.first, vp, sweepAngle)};
-      Vec3 z = normalize(l.center());
-      Vec3 y = normalize(normalize(l).direction());
-      Vec3 x = normalize(y.cross(z));
-      const double focal = mg.view.camera.focal() * 1.2;
-      int w = std::ceil(tan(sweepAngle + 0.01) * focal * 2 * 1.5);
-      int h = std::ceil(
-          (2 * tan(AngleBetweenDirected(l.first, l.second) / 2.0) + 0.01) *
-          focal * 1.5);
-      PerspectiveCamera pc(w, h, Point2(w / 2.0, h / 2.0), focal, Origin(), z,
-                           y);
-
-      Imagei sampledSegs = MakeCameraSampler(pc, mg.view.camera)(mg.segs);
-
-      std::vector<Point2i> quadProjs(4);
-      for (int i = 0; i < 4; i++) {
-        quadProjs[i] = pc.toScreen(sweepQuad[i]);
-        // assert(IsBetween(quadProjs[i][0], 0, w));
-        // assert(IsBetween(quadProjs[i][1], 0, h));
-        quadProjs[i][0] = BoundBetween(quadProjs[i][0], 0, w);
-        quadProjs[i][1] = BoundBetween(quadProjs[i][1], 0, h);
-      }
-      Imageub mask(pc.screenSize(), false);
-      cv::fillConvexPoly(mask, quadProjs, true);
-
-      for (auto it = sampledSegs.begin(); it != sampledSegs.end(); ++it) {
-        if (!mask(it.pos())) {
-          continue;
-        }
-        int seg = *it;
-        double pixelDistToEyeSquared =
-            Square(Distance(ecast<double>(it.pos()), pc.principlePoint())) +
-            focal * focal;
-        (onLeft ? line2leftSegsWithWeight
-                : line2rightSegsWithWeight)[line][seg] +=
-            1.0 * focal * focal / pixelDistToEyeSquared;
-      }
-    }
-  }
+  CollectSegsInLineSweeps(mg, angleSizeForPixelsNearLines,
+                          line2leftSegsWithWeight, line2rightSegsWithWeight);
 
   if (line2leftSegsWithWeightPtr) {
     *line2leftSegsWithWeightPtr = line2leftSegsWithWeight;
@@ -2161,69 +2180,8 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeights2(
   std::vector<std::map<int, double>> line2leftSegsWithWeight(mg.nlines());
   std::vector<std::map<int, double>> line2rightSegsWithWeight(mg.nlines());
 
-  for (int line = 0; line < mg.nlines(); line++) {
-    auto &l = mg.lines[line].component;
-    int claz = mg.lines[line].claz;
-    if (claz == -1) {
-      continue;
-    }
-    for (int vpid = 0; vpid < mg.vps.size(); vpid++) {
-      if (vpid == claz) {
-        continue;
-      }
-      Vec3 vp = mg.vps[vpid];
-      if (vp.dot(normalize(l.center())) < 0) {
-        vp = -vp;
-      }
-
-      Vec3 lineRight = l.first.cross(l.second);
-      bool onLeft = (vp - l.first).dot(lineRight) < 0;
-
-      double lineAngleToVP = std::min(AngleBetweenDirected(l.first, vp),
-                                      AngleBetweenDirected(l.second, vp));
-      double sweepAngle =
-          std::min(angleSizeForPixelsNearLines, lineAngleToVP - 1e-4);
-      std::vector<Vec3> sweepQuad = {normalize(l.first), normalize(l.second),
-                                     RotateDirection(l.second, vp, sweepAngle),
-                                     RotateDirection(l.first, vp, sweepAngle)};
-      Vec3 z = normalize(l.center());
-      Vec3 y = normalize(normalize(l).direction());
-      Vec3 x = normalize(y.cross(z));
-      const double focal = mg.view.camera.focal() * 1.2;
-      int w = std::ceil(tan(sweepAngle + 0.01) * focal * 2 * 1.5);
-      int h = std::ceil(
-          (2 * tan(AngleBetweenDirected(l.first, l.second) / 2.0) + 0.01) *
-          focal * 1.5);
-      PerspectiveCamera pc(w, h, Point2(w / 2.0, h / 2.0), focal, Origin(), z,
-                           y);
-
-      Imagei sampledSegs = MakeCameraSampler(pc, mg.view.camera)(mg.segs);
-
-      std::vector<Point2i> quadProjs(4);
-      for (int i = 0; i < 4; i++) {
-        quadProjs[i] = pc.toScreen(sweepQuad[i]);
-        // assert(IsBetween(quadProjs[i][0], 0));
-        // assert(IsBetween(quadProjs[i][1], 0));
-        quadProjs[i][0] = BoundBetween(quadProjs[i][0], 0, w);
-        quadProjs[i][1] = BoundBetween(quadProjs[i][1], 0, h);
-      }
-      Imageub mask(pc.screenSize(), false);
-      cv::fillConvexPoly(mask, quadProjs, true);
-
-      for (auto it = sampledSegs.begin(); it != sampledSegs.end(); ++it) {
-        if (!mask(it.pos())) {
-          continue;
-        }
-        int seg = *it;
-        double pixelDistToEyeSquared =
-            Square(Distance(ecast<double>(it.pos()), pc.principlePoint())) +
-            focal * focal;
-        (onLeft ? line2leftSegsWithWeight
-                : line2rightSegsWithWeight)[line][seg] +=
-            1.0 * focal * focal / pixelDistToEyeSquared;
-      }
-    }
-  }
+  CollectSegsInLineSweeps(mg, angleSizeForPixelsNearLines,
+                          line2leftSegsWithWeight, line2rightSegsWithWeight);
 
   if (line2leftSegsWithWeightPtr) {
     *line2leftSegsWithWeightPtr = line2leftSegsWithWeight;
@@ -2719,97 +2677,83 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeightsFromAnnotation(
   return lsw;
 }
 
-std::vector<std::array<std::set<int>, 2>>
+std::vector<std::array<std::vector<int>, 2>>
 CollectSegsNearLines(const PIGraph<PanoramicCamera> &mg,
                      double angleSizeForPixelsNearLines) {
+  const LineSampleIndex &lineSamples = *mg.lineSamples;
+  assert(lineSamples.nlines() == mg.nlines());
+  // longer samples would widen the windows beyond the pixels near the line
+  assert(lineSamples.sampleAngle() > 0 &&
+         lineSamples.sampleAngle() <= angleSizeForPixelsNearLines);
 
   int width = mg.segs.cols;
   int height = mg.segs.rows;
 
-  RTreeMap<Vec3, std::pair<Line3, int>> lineSamplesTree;
-  for (int i = 0; i < mg.nlines(); i++) {
-    auto &line = mg.lines[i].component;
-    double spanAngle = AngleBetweenDirected(line.first, line.second);
-    for (double a = 0.0; a < spanAngle;
-         a += angleSizeForPixelsNearLines / 3.0) {
-      Vec3 sample1 = normalize(RotateDirection(line.first, line.second, a));
-      Vec3 sample2 = normalize(RotateDirection(
-          line.first, line.second, a + angleSizeForPixelsNearLines / 3.0));
-      lineSamplesTree.emplace(normalize(sample1 + sample2),
-                              std::make_pair(Line3(sample1, sample2), i));
-    }
-  }
+  // pixels near a line sample are within this angle to the sample center
+  const double windowAngle =
+      angleSizeForPixelsNearLines + lineSamples.sampleAngle() / 2.0;
 
-  // collect lines' nearby pixels and segs
-  std::vector<std::set<Pixel>> line2nearbyPixels(mg.nlines());
-  std::vector<std::map<int, Vec3>> line2nearbySegsWithLocalCenterDir(
+  // collect lines' nearby segs, each line visits the pixels around its samples
+  std::vector<std::array<std::vector<int>, 2>> line2leftRightSegs(
       mg.nlines());
-  std::vector<std::map<int, bool>> line2nearbySegsWithOnLeftFlag(mg.nlines());
-  std::vector<std::map<int, double>> line2nearbySegsWithWeight(mg.nlines());
-
-  for (auto it = mg.segs.begin(); it != mg.segs.end(); ++it) {
-    Pixel p = it.pos();
-    double weight = cos((p.y - (height - 1) / 2.0) / (height - 1) * M_PI);
-    Vec3 dir = normalize(mg.view.camera.toSpace(p));
-    int seg = *it;
-    lineSamplesTree.search(
-        BoundingBox(dir).expand(angleSizeForPixelsNearLines * 3),
-        [&mg, &dir, &line2nearbyPixels, &line2nearbySegsWithLocalCenterDir,
-         &line2nearbySegsWithWeight, angleSizeForPixelsNearLines, p, seg,
-         weight](const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
-          auto line = normalize(mg.lines[lineSample.second.second].component);
-          // d(dir, line) < angleSizeForPixelsNearLines && lambda(dir, line) \in
-          // [0, 1]
-          auto dirOnLine = DistanceFromPointToLine(dir, lineSample.second.first)
-                               .second.position;
-          double angleDist = AngleBetweenDirected(dir, dirOnLine);
-          double lambda = ProjectionOfPointOnLine(dir, line)
-                              .ratio; // the projected position on line
-          if (angleDist < angleSizeForPixelsNearLines &&
-              IsBetween(lambda, 0.0, 1.0)) {
-            line2nearbyPixels[lineSample.second.second].insert(p);
-            auto &localCenterDir =
-                line2nearbySegsWithLocalCenterDir[lineSample.second.second]
-                                                 [seg];
-            localCenterDir += dir * weight;
-            double &segWeight =
-                line2nearbySegsWithWeight[lineSample.second.second][seg];
-            segWeight +=
-                weight *
-                Gaussian(
-                    lambda - 0.5,
-                    0.1); // the closer to the center, the more important it is!
+  ParallelForRange(0, mg.nlines(), [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      auto line = normalize(mg.lines[i].component);
+      std::map<int, Vec3> nearbySegsWithLocalCenterDir;
+      for (auto &sample : lineSamples.samplesOf(i)) {
+        // the pixel window of the sample
+        Point2 c = mg.view.camera.toScreen(normalize(sample.center()));
+        int cx = c[0], cy = c[1];
+        int dy = int(ceil(windowAngle / M_PI * height)) + 1;
+        int dx = width;
+        double latitude = c[1] / height * M_PI - M_PI_2;
+        if (std::abs(latitude) + windowAngle < M_PI_2 - 2 * M_PI / height) {
+          dx = int(ceil(asin(sin(windowAngle) / cos(latitude)) / M_PI / 2.0 *
+                        width)) +
+               1;
+        }
+        int xfirst = cx - dx, xlast = cx + dx;
+        if (xlast - xfirst + 1 >= width) {
+          xfirst = 0;
+          xlast = width - 1;
+        }
+        for (int y = std::max(cy - dy, 0); y <= std::min(cy + dy, height - 1);
+             y++) {
+          double weight = cos((y - (height - 1) / 2.0) / (height - 1) * M_PI);
+          for (int x = xfirst; x <= xlast; x++) {
+            Pixel p(WrapBetween(x, 0, width), y);
+            Vec3 dir = normalize(mg.view.camera.toSpace(p));
+            // d(dir, line) < angleSizeForPixelsNearLines && lambda(dir, line)
+            // \in [0, 1]
+            auto dirOnLine =
+                DistanceFromPointToLine(dir, sample).second.position;
+            double angleDist = AngleBetweenDirected(dir, dirOnLine);
+            if (angleDist >= angleSizeForPixelsNearLines) {
+              continue;
+            }
+            double lambda = ProjectionOfPointOnLine(dir, line)
+                                .ratio; // the projected position on line
+            if (IsBetween(lambda, 0.0, 1.0)) {
+              nearbySegsWithLocalCenterDir[mg.segs(p)] += dir * weight;
+            }
           }
-          return true;
-        });
-  }
-  for (int i = 0; i < mg.nlines(); i++) {
-    auto &nearbySegsWithLocalCenterDir = line2nearbySegsWithLocalCenterDir[i];
-    auto &line = mg.lines[i].component;
-    Vec3 lineRight = line.first.cross(line.second);
-    for (auto &segWithDir : nearbySegsWithLocalCenterDir) {
-      Vec3 centerDir = normalize(segWithDir.second);
-      bool onLeft = (centerDir - line.first).dot(lineRight) < 0;
-      line2nearbySegsWithOnLeftFlag[i][segWithDir.first] = onLeft;
-    }
-  }
-
-  std::vector<std::array<std::set<int>, 2>> line2leftRightSegs;
-  line2leftRightSegs.resize(mg.nlines());
-  for (int line = 0; line < mg.nlines(); line++) {
-    for (auto &pp : line2nearbySegsWithOnLeftFlag[line]) {
-      int seg = pp.first;
-      bool onLeft = pp.second;
-      line2leftRightSegs[line][onLeft ? 0 : 1].insert(seg);
+        }
+      }
+      Vec3 lineRight = line.first.cross(line.second);
+      for (auto &segWithDir : nearbySegsWithLocalCenterDir) {
+        Vec3 centerDir = normalize(segWithDir.second);
+        bool onLeft = (centerDir - line.first).dot(lineRight) < 0;
+        line2leftRightSegs[i][onLeft ? 0 : 1].push_back(segWithDir.first);
+      }
     }
-  }
+  });
 
   return line2leftRightSegs;
 }
 
 void ApplyLinesSidingWeights(
     PIGraph<PanoramicCamera> &mg, const std::vector<LineSidingWeight> &lsw,
-    const std::vector<std::array<std::set<int>, 2>> &line2leftRightSegs,
+    const std::vector<std::array<std::vector<int>, 2>> &line2leftRightSegs,
     bool connectSegsOnDanglingLine) {
 
   // fill back labels
@@ -2850,14 +2794,16 @@ void ApplyLinesSidingWeights(
     if (!lineSidingWeight.connectRight()) {
       for (int lp : mg.line2linePieces[line]) {
         int seg = mg.linePiece2seg[lp];
-        if (seg != -1 && Contains(rightSegs, seg)) {
+        if (seg != -1 &&
+            std::binary_search(rightSegs.begin(), rightSegs.end(), seg)) {
           mg.linePiece2segLineRelation[lp] = SegLineRelation::Detached;
         }
       }
     } else if (!lineSidingWeight.connectLeft()) {
       for (int lp : mg.line2linePieces[line]) {
         int seg = mg.linePiece2seg[lp];
-        if (seg != -1 && Contains(leftSegs, seg)) {
+        if (seg != -1 &&
+            std::binary_search(leftSegs.begin(), leftSegs.end(), seg)) {
           mg.linePiece2segLineRelation[lp] = SegLineRelation::Detached;
         }
       }
@@ -7,6 +7,9 @@ namespace experimental {
 
 class PILayoutAnnotation;
 
+// DetectOcclusions
+// pixels near lines are found around the samples of mg.lineSamples, which
+// should be no longer than angleSizeForPixelsNearLines
 void DetectOcclusions(
     PIGraph<PanoramicCamera> &mg, double minAngleSizeOfLineInTJunction = DegreesToRadians(3),
     double lambdaShrinkForHLineDetectionInTJunction = 0.2,
@@ -61,13 +64,17 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeightsFromAnnotation(
     double sampleAngleStep = DegreesToRadians(0.5),
     double angleThres = DegreesToRadians(2), double ratioThres = 0.6);
 
-std::vector<std::array<std::set<int>, 2>>
+// CollectSegsNearLines
+// segs on the left and right of each line within angleSizeForPixelsNearLines,
+// found around the samples of mg.lineSamples, which should be no longer than
+// that angle
+std::vector<std::array<std::vector<int>, 2>>
 CollectSegsNearLines(const PIGraph<PanoramicCamera> &mg,
                      double angleSizeForPixelsNearLines = DegreesToRadians(2));
 
 void ApplyLinesSidingWeights(
     PIGraph<PanoramicCamera> &mg, const std::vector<LineSidingWeight> &lsw,
-    const std::vector<std::array<std::set<int>, 2>> &line2leftRightSegs,
+    const std::vector<std::array<std::vector<int>, 2>> &line2leftRightSegs,
     bool connectSegsOnDanglingLine);
 }
 }
\ No newline at end of file
@@ -44,7 +44,7 @@ std::vector<Polygon3> CompactModel(const PICGDeterminablePart &dp,
   // add bndpiece head corners
   std::vector<int> bndPiece2corner(mg.nbndPieces(), -1);
   for (int bnd = 0; bnd < mg.nbnds(); bnd++) {
-    auto &bps = mg.bnd2bndPieces[bnd];
+    const auto &bps = mg.bnd2bndPieces[bnd];
     assert(!bps.empty());
     for (int k = 1; k < bps.size(); k++) {
       int bp = bps[k];
@@ -105,7 +105,7 @@ std::vector<Polygon3> CompactModel(const PICGDeterminablePart &dp,
       // lastBndRightHand
 
       while (orderedJuncs.back() != orderedJuncs.front()) {
-        auto &bndCands = mg.junc2bnds[orderedJuncs.back()];
+        const auto &bndCands = mg.junc2bnds[orderedJuncs.back()];
         // int bndSelected = -1;
         // int nextJuncSelected = -1;
         bool foundBnd = false;
@@ -141,7 +141,7 @@ std::vector<Polygon3> CompactModel(const PICGDeterminablePart &dp,
         assert(junc2corner[junc] != -1);
         cs.push_back(junc2corner[junc]);
         creversed.push_back(false);
-        auto &bps = mg.bnd2bndPieces[bnd];
+        const auto &bps = mg.bnd2bndPieces[bnd];
         if (!rev) {
           for (int k = 1; k < bps.size(); k++) {
             int bp = bps[k];
@@ -11,11 +11,10 @@ std::vector<Polygon3> CompactModel(const PICGDeterminablePart &dp,
                                    const PIGraph<PanoramicCamera> &mg, double distThres);
 
 template <class T> void FillHoles(Image_<T> &im, const Imageb &holeMask) {
-  // fill the holes
-  for (auto it = im.begin(); it != im.end(); ++it) {
-    auto p = it.pos();
+  // fill the holes, only non-hole pixels are read so rows can run in parallel
+  ForEachPixel(im, [&im, &holeMask](const Pixel &p, T &value) {
     if (!holeMask(p)) {
-      continue;
+      return;
     }
     int located = 0;
     T valueSum = 0;
@@ -35,16 +34,15 @@ template <class T> void FillHoles(Image_<T> &im, const Imageb &holeMask) {
             continue;
           }
           pp.x = WrapBetween(pp.x, 0, im.cols);
-          auto anotherValue = im(pp);
           if (!holeMask(pp)) {
-            valueSum += anotherValue;
+            valueSum += im(pp);
             located++;
           }
         }
       }
     }
-    *it = valueSum / std::max(located, 1);
-  }
+    value = valueSum / std::max(located, 1);
+  });
 }
 
 std::vector<Vec3> ComputeSegNormals(const PICGDeterminablePart &dp,
@@ -57,15 +55,14 @@ Image3d SurfaceNormalMap(const CameraT &cam, const PICGDeterminablePart &dp,
                          bool smoothed) {
   auto seg2normal = ComputeSegNormals(dp, cg, mg, smoothed);
   Image3d snm(cam.screenSize());
-  for (auto it = snm.begin(); it != snm.end(); ++it) {
-    auto p = it.pos();
+  ForEachPixel(snm, [&cam, &mg, &seg2normal](const Pixel &p, Vec3 &normal) {
     auto dir = normalize(cam.toSpace(p));
     auto pp = ToPixel(mg.view.camera.toScreen(dir));
     pp.x = WrapBetween(pp.x, 0, mg.segs.cols);
     pp.y = BoundBetween(pp.y, 0, mg.segs.rows - 1);
     int seg = mg.segs(pp);
-    *it = seg2normal[seg];
-  }
+    normal = seg2normal[seg];
+  });
   return snm;
 }
 
@@ -79,29 +76,20 @@ Imaged SurfaceDepthMap(const CameraT &cam, const PICGDeterminablePart &dp,
                        bool smoothed = true) {
   auto seg2plane = ComputeSegPlanes(dp, cg, mg, true);
   Imaged depths(cam.screenSize(), 0.0);
-  double minv = std::numeric_limits<double>::max();
-  double maxv = 0.0;
-  for (auto it = depths.begin(); it != depths.end(); ++it) {
-    auto pos = it.pos();
+  ForEachPixel(depths, [&cam, &mg, &seg2plane](const Pixel &pos,
+                                               double &depth) {
     int seg = mg.segs(pos);
     if (!mg.seg2control[seg].used) {
-      *it = -1;
-      continue;
+      depth = -1;
+      return;
     }
     auto &plane = seg2plane[seg];
     if (plane.normal == Origin()) {
-      continue;
+      return;
     }
     Vec3 dir = normalize(cam.toSpace(pos));
-    double depth = norm(Intersection(Ray3(Origin(), dir), plane));
-    if (depth < minv) {
-      minv = depth;
-    }
-    if (depth > maxv) {
-      maxv = depth;
-    }
-    *it = depth;
-  }
+    depth = norm(Intersection(Ray3(Origin(), dir), plane));
+  });
   // fill the holes
   std::vector<double> ordered(depths.begin(), depths.end());
   ordered.erase(std::remove(ordered.begin(), ordered.end(), 0.0),
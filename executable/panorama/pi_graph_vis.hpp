@@ -73,7 +73,7 @@ inline Image3f PrintPIGraph(const PIGraph<PanoramicCamera> &mg,
       gui::Color color = lpColor(lp);
       if (color.isTransparent())
         continue;
-      auto &ps = mg.linePiece2samples[lp];
+      const auto &ps = mg.linePiece2samples[lp];
       for (int i = 1; i < ps.size(); i++) {
         auto p1 = ToPixel(mg.view.camera.toScreen(ps[i - 1]));
         auto p2 = ToPixel(mg.view.camera.toScreen(ps[i]));
@@ -91,7 +91,7 @@ inline Image3f PrintPIGraph(const PIGraph<PanoramicCamera> &mg,
       gui::Color color = bpColor(bp);
       if (color.isTransparent())
         continue;
-      auto &e = mg.bndPiece2dirs[bp];
+      const auto &e = mg.bndPiece2dirs[bp];
       for (int i = 1; i < e.size(); i++) {
         auto p1 = core::ToPixel(mg.view.camera.toScreen(e[i - 1]));
         auto p2 = core::ToPixel(mg.view.camera.toScreen(e[i]));
@@ -125,7 +125,7 @@ PrintPIGraph2(const PIGraph<PanoramicCamera> &mg, SegColorerT &&segColor,
       gui::Color color = lpColor(lp);
       if (color.isTransparent())
         continue;
-      auto &ps = mg.linePiece2samples[lp];
+      const auto &ps = mg.linePiece2samples[lp];
       for (int i = 1; i < ps.size(); i++) {
         auto p1 = ToPixel(mg.view.camera.toScreen(ps[i - 1]));
         auto p2 = ToPixel(mg.view.camera.toScreen(ps[i]));
@@ -143,7 +143,7 @@ PrintPIGraph2(const PIGraph<PanoramicCamera> &mg, SegColorerT &&segColor,
       gui::Color color = bpColor(bp);
       if (color.isTransparent())
         continue;
-      auto &e = mg.bndPiece2dirs[bp];
+      const auto &e = mg.bndPiece2dirs[bp];
       for (int i = 1; i < e.size(); i++) {
         auto p1 = core::ToPixel(mg.view.camera.toScreen(e[i - 1]));
         auto p2 = core::ToPixel(mg.view.camera.toScreen(e[i]));
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "basic_types.hpp"
+#include "parallel.hpp"
 #include "utility.hpp"
 
 namespace pano {
@@ -97,6 +98,16 @@ int ConnectedComponents(VertIterT verts_begin, VertIterT verts_end,
                         NeighborVertsContainerGetterT get_neighbor_verts,
                         VertexTypeRecorderT record_vert_type,
                         VertCompareT compare_vert = VertCompareT());
+
+// RadixKeyOfFloat
+// maps floats to unsigned keys with the same order (-0.0 goes before 0.0)
+inline uint32_t RadixKeyOfFloat(float f);
+
+// ParallelRadixSort
+// stable LSD radix sort on 32 bit keys, KeyFunT(const T &) -> uint32_t
+// histograms and scatters run on contiguous chunks in parallel
+template <class T, class KeyFunT>
+void ParallelRadixSort(std::vector<T> &data, KeyFunT &&key);
 }
 }
 
@@ -512,5 +523,80 @@ int ConnectedComponents(VertIterT verts_begin, VertIterT verts_end,
 
   return cid;
 }
+
+// RadixKeyOfFloat
+inline uint32_t RadixKeyOfFloat(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// ParallelRadixSort
+template <class T, class KeyFunT>
+void ParallelRadixSort(std::vector<T> &data, KeyFunT &&key) {
+  static const int nbits = 8;
+  static const int nbuckets = 1 << nbits;
+  static const int minChunkSize = 1 << 16;
+  const size_t n = data.size();
+  if (n <= 1) {
+    return;
+  }
+  int nchunks = static_cast<int>(std::min<size_t>(
+      std::max<unsigned>(std::thread::hardware_concurrency(), 1),
+      n / minChunkSize + 1));
+  auto chunkBegin = [n, nchunks](int c) { return n * c / nchunks; };
+
+  std::vector<T> buffer(n);
+  std::vector<std::array<size_t, nbuckets>> offsets(nchunks);
+  T *src = data.data();
+  T *dst = buffer.data();
+  for (int shift = 0; shift < 32; shift += nbits) {
+    // histogram of each chunk
+    ParallelForRange(0, nchunks, [&](int cfirst, int clast) {
+      for (int c = cfirst; c < clast; c++) {
+        auto &hist = offsets[c];
+        hist.fill(0);
+        for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); i++) {
+          hist[(key(src[i]) >> shift) & (nbuckets - 1)]++;
+        }
+      }
+    }, nchunks);
+    // skip the pass if all keys share the digit
+    bool trivial = false;
+    for (int d = 0; d < nbuckets && !trivial; d++) {
+      size_t total = 0;
+      for (int c = 0; c < nchunks; c++) {
+        total += offsets[c][d];
+      }
+      trivial = total == n;
+    }
+    if (trivial) {
+      continue;
+    }
+    // exclusive prefix sums ordered by (digit, chunk) keep the sort stable
+    size_t sum = 0;
+    for (int d = 0; d < nbuckets; d++) {
+      for (int c = 0; c < nchunks; c++) {
+        size_t count = offsets[c][d];
+        offsets[c][d] = sum;
+        sum += count;
+      }
+    }
+    // scatter
+    ParallelForRange(0, nchunks, [&](int cfirst, int clast) {
+      for (int c = cfirst; c < clast; c++) {
+        auto &ofs = offsets[c];
+        for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); i++) {
+          dst[ofs[(key(src[i]) >> shift) & (nbuckets - 1)]++] =
+              std::move(src[i]);
+        }
+      }
+    }, nchunks);
+    std::swap(src, dst);
+  }
+  if (src != data.data()) {
+    std::move(buffer.begin(), buffer.end(), data.begin());
+  }
+}
 }
 }
@@ -276,4 +276,29 @@ TEST(AlgorithmsTest, TopologicalSort) {
       ASSERT_TRUE(fromPos <= toPos);
     }
   }
-}
\ No newline at end of file
+}
+TEST(AlgorithmsTest, ParallelRadixSort) {
+  struct Edge {
+    float w;
+    int id;
+  };
+  std::default_random_engine rng;
+  std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+  for (int n : {0, 1, 17, 1000, 500000}) {
+    std::vector<Edge> edges(n);
+    for (int i = 0; i < n; i++) {
+      // many ties to check the stability
+      edges[i].w = i % 3 == 0 ? std::round(dist(rng)) : dist(rng);
+      edges[i].id = i;
+    }
+    auto expected = edges;
+    std::stable_sort(
+        expected.begin(), expected.end(),
+        [](const Edge &e1, const Edge &e2) { return e1.w < e2.w; });
+    core::ParallelRadixSort(
+        edges, [](const Edge &e) { return core::RadixKeyOfFloat(e.w); });
+    for (int i = 0; i < n; i++) {
+      ASSERT_EQ(expected[i].id, edges[i].id);
+    }
+  }
+}
@@ -24,6 +24,7 @@
 #include "decorate.hpp"
 #include "eigen.hpp"
 #include "failable.hpp"
+#include "fast_math.hpp"
 #include "geometry.hpp"
 #include "image.hpp"
 #include "macros.hpp"
@@ -67,3 +67,43 @@ TEST(BasicType, VecCast) {
     ASSERT_TRUE(i == core::Vec3(1, 2, 3));
   }
 }
+
+TEST(BasicType, ForEachPixel) {
+  core::Imagei im(123, 77, 0);
+  core::ForEachPixel(im, [](const core::Pixel &p, int &v) { v = p.x + p.y; });
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    ASSERT_EQ(*it, it.pos().x + it.pos().y);
+  }
+  core::ForEachRow(im, [](int y, int *row, int cols) {
+    for (int x = 0; x < cols; x++) {
+      row[x] -= y;
+    }
+  });
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    ASSERT_EQ(*it, it.pos().x);
+  }
+}
+
+TEST(BasicType, ForEachRowWindow) {
+  core::Imagei im(50, 60, 0);
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    *it = it.pos().x;
+  }
+  for (bool wrap : {false, true}) {
+    core::ForEachRowWindow(
+        im, 2, wrap, [&im, wrap](int y, const core::ImageRowWindow<int> &w) {
+          for (int x = 0; x < w.cols(); x++) {
+            for (int dy = -2; dy <= 2; dy++) {
+              for (int dx = -2; dx <= 2; dx++) {
+                bool inside = y + dy >= 0 && y + dy < im.rows &&
+                              (wrap || (x + dx >= 0 && x + dx < im.cols));
+                ASSERT_EQ(w.contains(x + dx, dy), inside);
+                if (inside) {
+                  ASSERT_EQ(w(x + dx, dy), (x + dx + im.cols) % im.cols);
+                }
+              }
+            }
+          }
+        });
+  }
+}
@@ -98,6 +98,37 @@ Point3 PerspectiveCamera::toSpace(const Point2 &p2d) const {
               realPosition(2) / realPosition(3));
 }
 
+void PerspectiveCamera::toScreen(const Point3 *p3ds, Point2 *p2ds,
+                                 size_t n) const {
+  const Mat4 &m = _viewProjectionMatrix;
+  const double w = 2.0 * _principlePoint[0], h = 2.0 * _principlePoint[1];
+  for (size_t i = 0; i < n; i++) {
+    const Point3 &p = p3ds[i];
+    double px = m(0, 0) * p[0] + m(0, 1) * p[1] + m(0, 2) * p[2] + m(0, 3);
+    double py = m(1, 0) * p[0] + m(1, 1) * p[1] + m(1, 2) * p[2] + m(1, 3);
+    double pw = m(3, 0) * p[0] + m(3, 1) * p[1] + m(3, 2) * p[2] + m(3, 3);
+    double xratio = px / pw / 2;
+    double yratio = py / pw / 2;
+    p2ds[i] = Point2((xratio + 0.5) * w, h - (yratio + 0.5) * h);
+  }
+}
+
+void PerspectiveCamera::toSpace(const Point2 *p2ds, Point3 *p3ds,
+                                size_t n) const {
+  // invert once for the whole batch instead of solving for each point
+  Mat4 inv = _viewProjectionMatrix.inv(cv::DECOMP_LU);
+  const double w = 2.0 * _principlePoint[0], h = 2.0 * _principlePoint[1];
+  for (size_t i = 0; i < n; i++) {
+    double xratio = (p2ds[i][0] / w - 0.5) * 2;
+    double yratio = ((h - p2ds[i][1]) / h - 0.5) * 2;
+    double r[4];
+    for (int k = 0; k < 4; k++) {
+      r[k] = inv(k, 0) * xratio + inv(k, 1) * yratio + inv(k, 2) + inv(k, 3);
+    }
+    p3ds[i] = Point3(r[0] / r[3], r[1] / r[3], r[2] / r[3]);
+  }
+}
+
 void PerspectiveCamera::resizeScreen(const Size &sz, bool updateMat) {
   if (_screenH == sz.height && _screenW == sz.width)
     return;
@@ -281,6 +312,34 @@ Vec3 PanoramicCamera::direction(const Point2 &p2d) const {
   return dd(0) * _xaxis + dd(1) * _yaxis + dd(2) * _zaxis;
 }
 
+void PanoramicCamera::toScreen(const Point3 *p3ds, Point2 *p2ds,
+                               size_t n) const {
+  auto sz = screenSize();
+  const double xscale = sz.width / 2.0 / M_PI, yscale = sz.height / M_PI;
+  for (size_t i = 0; i < n; i++) {
+    Vec3 d = p3ds[i] - _eye;
+    double xx = d.dot(_xaxis), yy = d.dot(_yaxis), zz = d.dot(_zaxis);
+    double longitude = RasterMath::atan2(yy, xx);
+    double latitude = RasterMath::atan2(zz, std::sqrt(yy * yy + xx * xx));
+    p2ds[i] = Point2((longitude + M_PI) * xscale, (latitude + M_PI_2) * yscale);
+  }
+}
+
+void PanoramicCamera::toSpace(const Point2 *p2ds, Point3 *p3ds,
+                              size_t n) const {
+  auto sz = screenSize();
+  const double longiscale = 2 * M_PI / double(sz.width),
+               latiscale = M_PI / double(sz.height);
+  for (size_t i = 0; i < n; i++) {
+    double longi = p2ds[i][0] * longiscale - M_PI;
+    double lati = p2ds[i][1] * latiscale - M_PI_2;
+    double coslati = RasterMath::cos(lati);
+    p3ds[i] = (RasterMath::cos(longi) * coslati) * _xaxis +
+              (RasterMath::sin(longi) * coslati) * _yaxis +
+              RasterMath::sin(lati) * _zaxis + _eye;
+  }
+}
+
 PartialPanoramicCamera::PartialPanoramicCamera(int w, int h, double focal,
                                                const Vec3 &eye,
                                                const Vec3 &center,
@@ -350,6 +409,113 @@ Vec3 PartialPanoramicCamera::direction(const Point2 &p2d) const {
   return dd(0) * _xaxis + dd(1) * _yaxis + dd(2) * _zaxis;
 }
 
+void PartialPanoramicCamera::toScreen(const Point3 *p3ds, Point2 *p2ds,
+                                      size_t n) const {
+  double halfLongitudeAngleBound = _screenW / 2.0 / _focal;
+  double halfLatitudeAngleBound = _screenH / 2.0 / _focal;
+  for (size_t i = 0; i < n; i++) {
+    Vec3 d = p3ds[i] - _eye;
+    double xx = d.dot(_xaxis), yy = d.dot(_yaxis), zz = d.dot(_zaxis);
+    double longitude = RasterMath::atan2(yy, xx);
+    double latitude = RasterMath::atan2(zz, std::sqrt(yy * yy + xx * xx));
+    p2ds[i] = Point2((longitude + halfLongitudeAngleBound) * _focal,
+                     (latitude + halfLatitudeAngleBound) * _focal);
+  }
+}
+
+void PartialPanoramicCamera::toSpace(const Point2 *p2ds, Point3 *p3ds,
+                                     size_t n) const {
+  double halfLongitudeAngleBound = _screenW / 2.0 / _focal;
+  double halfLatitudeAngleBound = _screenH / 2.0 / _focal;
+  for (size_t i = 0; i < n; i++) {
+    double longi = p2ds[i][0] / _focal - halfLongitudeAngleBound;
+    double lati = p2ds[i][1] / _focal - halfLatitudeAngleBound;
+    double coslati = RasterMath::cos(lati);
+    p3ds[i] = (RasterMath::cos(longi) * coslati) * _xaxis +
+              (RasterMath::sin(longi) * coslati) * _yaxis +
+              RasterMath::sin(lati) * _zaxis + _eye;
+  }
+}
+
+CubeMapCamera::CubeMapCamera(int faceSize, const Vec3 &eye,
+                             const Vec3 &center, const Vec3 &up)
+    : _faceSize(faceSize), _eye(eye), _center(center), _up(up) {
+  makeFaces();
+}
+
+CubeMapCamera::CubeMapCamera(const PanoramicCamera &panoCam, int faceSize)
+    : _faceSize(faceSize > 0 ? faceSize
+                             : static_cast<int>(panoCam.focal() * 2.0)),
+      _eye(panoCam.eye()), _center(panoCam.center()), _up(panoCam.up()) {
+  makeFaces();
+}
+
+void CubeMapCamera::makeFaces() {
+  _xaxis = normalize(_center - _eye);
+  _yaxis = normalize(_up.cross(_xaxis));
+  _zaxis = normalize(_xaxis.cross(_yaxis));
+  int tile = tileSize();
+  Vec3 dirs[] = {_xaxis, _yaxis, -_xaxis, -_yaxis, _zaxis, -_zaxis};
+  Vec3 ups[] = {-_zaxis, -_zaxis, -_zaxis, -_zaxis, _xaxis, _xaxis};
+  _faces.clear();
+  for (int i = 0; i < 6; i++) {
+    _faces.emplace_back(tile, tile, Point2(tile, tile) / 2.0, _faceSize / 2.0,
+                        _eye, _eye + dirs[i], ups[i]);
+  }
+}
+
+int CubeMapCamera::faceId(const Point3 &p3) const {
+  Vec3 d = p3 - _eye;
+  double xx = d.dot(_xaxis), yy = d.dot(_yaxis), zz = d.dot(_zaxis);
+  double ax = abs(xx), ay = abs(yy), az = abs(zz);
+  if (ax >= ay && ax >= az) {
+    return xx >= 0 ? 0 : 2;
+  }
+  if (ay >= az) {
+    return yy >= 0 ? 1 : 3;
+  }
+  return zz >= 0 ? 4 : 5;
+}
+
+Point2 CubeMapCamera::toScreen(const Point3 &p3) const {
+  int id = faceId(p3);
+  return _faces[id].toScreen(p3) + Point2(id * tileSize(), 0);
+}
+
+Point3 CubeMapCamera::toSpace(const Point2 &p2d) const {
+  int id = BoundBetween(static_cast<int>(floor(p2d[0] / tileSize())), 0, 5);
+  return _faces[id].toSpace(p2d - Point2(id * tileSize(), 0));
+}
+
+void CubeMapCamera::toScreen(const Point3 *p3ds, Point2 *p2ds,
+                             size_t n) const {
+  for (size_t i = 0; i < n; i++) {
+    p2ds[i] = toScreen(p3ds[i]);
+  }
+}
+
+void CubeMapCamera::toSpace(const Point2 *p2ds, Point3 *p3ds,
+                            size_t n) const {
+  // convert runs of points on the same face in batches
+  std::vector<Point2> local;
+  size_t first = 0;
+  while (first < n) {
+    int id = BoundBetween(static_cast<int>(floor(p2ds[first][0] / tileSize())),
+                          0, 5);
+    Point2 offset(id * tileSize(), 0);
+    local.clear();
+    size_t last = first;
+    while (last < n &&
+           BoundBetween(static_cast<int>(floor(p2ds[last][0] / tileSize())), 0,
+                        5) == id) {
+      local.push_back(p2ds[last] - offset);
+      last++;
+    }
+    _faces[id].toSpace(local.data(), p3ds + first, local.size());
+    first = last;
+  }
+}
+
 namespace {
 
 inline double UniformSphericalAngleToScreenLength(double angle, double focal) {
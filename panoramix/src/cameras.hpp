@@ -49,6 +49,10 @@ public:
   Vec3 direction(const Point2 &p2d) const { return toSpace(p2d) - _eye; }
   Vec3 direction(const Pixel &p) const { return direction(Point2(p.x, p.y)); }
 
+  // batched conversions of n points
+  void toScreen(const Point3 *p3ds, Point2 *p2ds, size_t n) const;
+  void toSpace(const Point2 *p2ds, Point3 *p3ds, size_t n) const;
+
   const Mat4 &viewMatrix() const { return _viewMatrix; }
   const Mat4 &projectionMatrix() const { return _projectionMatrix; }
   const Mat4 &viewProjectionMatrix() const { return _viewProjectionMatrix; }
@@ -131,6 +135,10 @@ public:
   Vec3 direction(const Point2 &p2d) const;
   Vec3 direction(const Pixel &p) const { return direction(Point2(p.x, p.y)); }
 
+  // batched conversions of n points, using RasterMath
+  void toScreen(const Point3 *p3ds, Point2 *p2ds, size_t n) const;
+  void toSpace(const Point2 *p2ds, Point3 *p3ds, size_t n) const;
+
 private:
   double _focal;
   Vec3 _eye, _center, _up;
@@ -174,6 +182,10 @@ public:
     return PanoramicCamera(_focal, _eye, _center, _up);
   }
 
+  // batched conversions of n points, using RasterMath
+  void toScreen(const Point3 *p3ds, Point2 *p2ds, size_t n) const;
+  void toSpace(const Point2 *p2ds, Point3 *p3ds, size_t n) const;
+
 private:
   double _screenW, _screenH;
   double _focal;
@@ -189,6 +201,59 @@ private:
   friend class cereal::access;
 };
 
+// cube map camera
+// six perspective faces of 90 degrees laid out horizontally in the order
+// +x, +y, -x, -y, +z, -z of the camera frame, each face tile carries a one
+// pixel margin so that bilinear sampling near face borders stays on the face
+class CubeMapCamera {
+public:
+  explicit CubeMapCamera(int faceSize = 500, const Point3 &eye = Vec3(0, 0, 0),
+                         const Point3 &center = Vec3(1, 0, 0),
+                         const Vec3 &up = Vec3(0, 0, 1));
+  // faceSize <= 0 keeps the angular resolution of panoCam at face centers
+  explicit CubeMapCamera(const PanoramicCamera &panoCam, int faceSize = -1);
+
+  Sizei screenSize() const { return Sizei(tileSize() * 6, tileSize()); }
+  int faceSize() const { return _faceSize; }
+  int tileSize() const { return _faceSize + 2; }
+  const PerspectiveCamera &face(int i) const { return _faces[i]; }
+  const std::vector<PerspectiveCamera> &faces() const { return _faces; }
+  const Point3 &eye() const { return _eye; }
+  const Point3 &center() const { return _center; }
+  const Vec3 &up() const { return _up; }
+  int faceId(const Point3 &p3d) const;
+  Point2 toScreen(const Point3 &p3d) const;
+  bool isVisibleOnScreen(const Point3 &p3d) const { return true; }
+  HPoint2 toScreenInHPoint(const Point3 &p3d) const {
+    return HPoint2(toScreen(p3d), 1.0);
+  }
+  Point3 toSpace(const Point2 &p2d) const;
+  Point3 toSpace(const Pixel &p) const { return toSpace(Vec2(p.x, p.y)); }
+  Vec3 direction(const Point2 &p2d) const { return toSpace(p2d) - _eye; }
+  Vec3 direction(const Pixel &p) const { return direction(Point2(p.x, p.y)); }
+
+  // batched conversions of n points
+  void toScreen(const Point3 *p3ds, Point2 *p2ds, size_t n) const;
+  void toSpace(const Point2 *p2ds, Point3 *p3ds, size_t n) const;
+
+private:
+  void makeFaces();
+
+private:
+  int _faceSize;
+  Vec3 _eye, _center, _up;
+  Vec3 _xaxis, _yaxis, _zaxis;
+  std::vector<PerspectiveCamera> _faces;
+
+  template <class Archive> void serialize(Archive &ar) {
+    ar(_faceSize);
+    ar(_eye, _center, _up);
+    ar(_xaxis, _yaxis, _zaxis);
+    ar(_faces);
+  }
+  friend class cereal::access;
+};
+
 namespace {
 template <class T> struct IsCameraImpl {
   template <class TT>
@@ -214,6 +279,91 @@ template <class T> struct IsCameraImpl {
 template <class T>
 struct IsCamera : std::integral_constant<bool, IsCameraImpl<T>::value> {};
 
+namespace {
+template <class T> struct HasBatchedProjectionImpl {
+  template <class TT>
+  static auto test(int) -> decltype(
+      std::declval<TT>().toScreen(std::declval<const core::Point3 *>(),
+                                  std::declval<core::Point2 *>(), size_t()),
+      std::declval<TT>().toSpace(std::declval<const core::Point2 *>(),
+                                 std::declval<core::Point3 *>(), size_t()),
+      std::true_type()) {
+    return std::true_type();
+  }
+  template <class> static std::false_type test(...) {
+    return std::false_type();
+  }
+  static const bool value =
+      std::is_same<decltype(test<T>(0)), std::true_type>::value;
+};
+}
+
+// judge whether camera T provides batched toScreen/toSpace
+template <class T>
+struct HasBatchedProjection
+    : std::integral_constant<bool, IsCamera<T>::value &&
+                                       HasBatchedProjectionImpl<T>::value> {};
+
+namespace {
+template <class CameraT>
+inline void BatchToScreenPrivate(const CameraT &cam, const Point3 *p3ds,
+                                 Point2 *p2ds, size_t n, std::true_type) {
+  cam.toScreen(p3ds, p2ds, n);
+}
+template <class CameraT>
+inline void BatchToScreenPrivate(const CameraT &cam, const Point3 *p3ds,
+                                 Point2 *p2ds, size_t n, std::false_type) {
+  for (size_t i = 0; i < n; i++) {
+    p2ds[i] = cam.toScreen(p3ds[i]);
+  }
+}
+template <class CameraT>
+inline void BatchToSpacePrivate(const CameraT &cam, const Point2 *p2ds,
+                                Point3 *p3ds, size_t n, std::true_type) {
+  cam.toSpace(p2ds, p3ds, n);
+}
+template <class CameraT>
+inline void BatchToSpacePrivate(const CameraT &cam, const Point2 *p2ds,
+                                Point3 *p3ds, size_t n, std::false_type) {
+  for (size_t i = 0; i < n; i++) {
+    p3ds[i] = cam.toSpace(p2ds[i]);
+  }
+}
+}
+
+// BatchToScreen
+// use the batched conversion of the camera if there is one
+template <class CameraT>
+inline void BatchToScreen(const CameraT &cam, const Point3 *p3ds, Point2 *p2ds,
+                          size_t n) {
+  BatchToScreenPrivate(cam, p3ds, p2ds, n,
+                       std::integral_constant<bool, HasBatchedProjection<
+                                                        CameraT>::value>());
+}
+template <class CameraT>
+inline std::vector<Point2> BatchToScreen(const CameraT &cam,
+                                         const std::vector<Point3> &p3ds) {
+  std::vector<Point2> p2ds(p3ds.size());
+  BatchToScreen(cam, p3ds.data(), p2ds.data(), p3ds.size());
+  return p2ds;
+}
+
+// BatchToSpace
+template <class CameraT>
+inline void BatchToSpace(const CameraT &cam, const Point2 *p2ds, Point3 *p3ds,
+                         size_t n) {
+  BatchToSpacePrivate(cam, p2ds, p3ds, n,
+                      std::integral_constant<bool, HasBatchedProjection<
+                                                       CameraT>::value>());
+}
+template <class CameraT>
+inline std::vector<Point3> BatchToSpace(const CameraT &cam,
+                                        const std::vector<Point2> &p2ds) {
+  std::vector<Point3> p3ds(p2ds.size());
+  BatchToSpace(cam, p2ds.data(), p3ds.data(), p2ds.size());
+  return p3ds;
+}
+
 // sample image from image using camera conversion
 template <class OutCameraT, class InCameraT> class CameraSampler {
   static_assert(IsCamera<OutCameraT>::value && IsCamera<InCameraT>::value,
@@ -226,22 +376,27 @@ public:
         _inCam(std::forward<ICamT>(inCam)) {
     assert(outCam.eye() == inCam.eye());
     auto outCamSize = _outCam.screenSize();
-    _mapx = cv::Mat::zeros(outCamSize, CV_32FC1);
-    _mapy = cv::Mat::zeros(outCamSize, CV_32FC1);
-    for (int j = 0; j < outCamSize.height; j++) {
-      for (int i = 0; i < outCamSize.width; i++) {
-        Vec2 screenp(i, j);
-        Vec3 p3 = _outCam.toSpace(screenp);
-        if (!_inCam.isVisibleOnScreen(p3)) {
-          _mapx.at<float>(j, i) = -1;
-          _mapy.at<float>(j, i) = -1;
+    _mapx = Imagef::zeros(outCamSize);
+    _mapy = Imagef::zeros(outCamSize);
+    ForEachRow(_mapx, [this](int j, float *mapxRow, int cols) {
+      float *mapyRow = _mapy[j];
+      std::vector<Point2> screenps(cols);
+      std::vector<Point3> p3s(cols);
+      for (int i = 0; i < cols; i++) {
+        screenps[i] = Point2(i, j);
+      }
+      BatchToSpace(_outCam, screenps.data(), p3s.data(), cols);
+      BatchToScreen(_inCam, p3s.data(), screenps.data(), cols);
+      for (int i = 0; i < cols; i++) {
+        if (!_inCam.isVisibleOnScreen(p3s[i])) {
+          mapxRow[i] = -1;
+          mapyRow[i] = -1;
           continue;
         }
-        Vec2 screenpOnInCam = _inCam.toScreen(p3);
-        _mapx.at<float>(j, i) = static_cast<float>(screenpOnInCam(0));
-        _mapy.at<float>(j, i) = static_cast<float>(screenpOnInCam(1));
+        mapxRow[i] = static_cast<float>(screenps[i](0));
+        mapyRow[i] = static_cast<float>(screenps[i](1));
       }
-    }
+    });
   }
 
   Image operator()(const Image &inputIm, int borderMode = cv::BORDER_REPLICATE,
@@ -299,7 +454,7 @@ public:
 private:
   OutCameraT _outCam;
   InCameraT _inCam;
-  cv::Mat _mapx, _mapy;
+  Imagef _mapx, _mapy;
 };
 
 template <class OutCameraT, class InCameraT>
@@ -402,10 +557,13 @@ Combine(const OutCameraT &camera,
   View<OutCameraT, Image_<T>> v;
   v.camera = camera;
   v.image = Image_<T>::zeros(camera.screenSize());
-  for (auto it = converted.begin(); it != converted.end(); ++it) {
-    float count = counts(it.pos());
-    v.image(it.pos()) = *it / std::max(count, 1.0f);
-  }
+  ForEachRow(v.image, [&converted, &counts](int y, T *row, int cols) {
+    const T *convertedRow = converted[y];
+    const float *countsRow = counts[y];
+    for (int x = 0; x < cols; x++) {
+      row[x] = convertedRow[x] / std::max(countsRow[x], 1.0f);
+    }
+  });
   return v;
 }
 
@@ -425,9 +583,13 @@ Combine(const OutCameraT &camera,
   for (int i = 0; i < views.size(); i++) {
     auto sampler = MakeCameraSampler(camera, views[i].component.camera);
     auto piece = sampler(views[i].component.image, cv::BORDER_CONSTANT);
-    for (auto it = converted.begin(); it != converted.end(); ++it) {
-      *it += (piece(it.pos()) * views[i].weight());
-    }
+    auto weight = views[i].weight();
+    ForEachRow(converted, [&piece, &weight](int y, T *row, int cols) {
+      const T *pieceRow = piece[y];
+      for (int x = 0; x < cols; x++) {
+        row[x] += (pieceRow[x] * weight);
+      }
+    });
     counts +=
         sampler(Imagef(views[i].component.image.size(), views[i].weight()),
                 cv::BORDER_CONSTANT);
@@ -435,10 +597,13 @@ Combine(const OutCameraT &camera,
   View<OutCameraT, Image_<T>> v;
   v.camera = camera;
   v.image = Image_<T>::zeros(camera.screenSize());
-  for (auto it = converted.begin(); it != converted.end(); ++it) {
-    float count = counts(it.pos());
-    v.image(it.pos()) = *it / std::max(count, 1.0f);
-  }
+  ForEachRow(v.image, [&converted, &counts](int y, T *row, int cols) {
+    const T *convertedRow = converted[y];
+    const float *countsRow = counts[y];
+    for (int x = 0; x < cols; x++) {
+      row[x] = convertedRow[x] / std::max(countsRow[x], 1.0f);
+    }
+  });
   return v;
 }
 
@@ -461,6 +626,24 @@ T MeanInMask(const View<InCameraT, Image_<T>> &source,
 using PerspectiveView = View<PerspectiveCamera>;
 using PanoramicView = View<PanoramicCamera>;
 using PartialPanoramicView = View<PartialPanoramicCamera>;
+using CubeMapView = View<CubeMapCamera>;
+
+// CreateCubeMapView
+// resample a panorama into a cube map once (bilinearly), narrow perspective
+// views can then be sampled from it through planar face projections instead
+// of spherical mappings
+// views sampled from the cube map are interpolated twice, which blurs them
+// more than views sampled from the panorama directly, so images fed to
+// feature extractors should still be sampled from the panorama
+template <class ImageT>
+View<CubeMapCamera, ImageT>
+CreateCubeMapView(const View<PanoramicCamera, ImageT> &panoView,
+                  int faceSize = -1) {
+  CubeMapCamera cam(panoView.camera, faceSize);
+  const Image &im = panoView.image;
+  return View<CubeMapCamera, ImageT>(MakeCameraSampler(cam, panoView.camera)(im),
+                                     cam);
+}
 
 PanoramicCamera CreatePanoramicCamera(const Image &panorama,
                                       const Point3 &eye = Point3(0, 0, 0),
@@ -7,7 +7,12 @@ using namespace pano;
 
 static_assert(core::IsCamera<core::PerspectiveCamera>::value, "");
 static_assert(core::IsCamera<core::PanoramicCamera>::value, "");
+static_assert(core::IsCamera<core::CubeMapCamera>::value, "");
 static_assert(!core::IsCamera<core::Line3>::value, "");
+static_assert(core::HasBatchedProjection<core::PerspectiveCamera>::value, "");
+static_assert(core::HasBatchedProjection<core::PanoramicCamera>::value, "");
+static_assert(
+    core::HasBatchedProjection<core::PartialPanoramicCamera>::value, "");
 
 TEST(Camera, PerspectiveCamera) {
   core::PerspectiveCamera cam(1000, 1000, core::Point2(500, 500), 500,
@@ -57,6 +62,66 @@ TEST(Camera, PerspectiveCameraRandom) {
   }
 }
 
+template <class CameraT>
+void CheckBatchedProjection(const CameraT &cam, bool roundTrip = true) {
+  std::vector<core::Point2> p2s;
+  for (int i = 0; i < 100; i++) {
+    p2s.emplace_back(abs(rand()) % cam.screenSize().width,
+                     abs(rand()) % cam.screenSize().height);
+  }
+  auto p3s = core::BatchToSpace(cam, p2s);
+  auto p2s2 = core::BatchToScreen(cam, p3s);
+  for (int i = 0; i < p2s.size(); i++) {
+    // batched conversions may use the approximations of RasterMath
+    ASSERT_LT(core::norm(p3s[i] - cam.toSpace(p2s[i])), 1e-5);
+    ASSERT_LT(core::norm(p2s2[i] - cam.toScreen(p3s[i])), 1e-2);
+    if (roundTrip) {
+      ASSERT_LT(core::norm(p2s2[i] - p2s[i]), 0.01);
+    }
+  }
+}
+
+TEST(Camera, BatchedProjection) {
+  CheckBatchedProjection(core::PerspectiveCamera(
+      1000, 1000, core::Point2(500, 500), 500, core::Vec3(5, 0, 0),
+      core::Vec3(5, 5, 0)));
+  CheckBatchedProjection(core::PanoramicCamera(
+      200, core::Vec3(1, 2, 3), core::Vec3(0, 1, 0), core::Vec3(0, 0, 1)));
+  CheckBatchedProjection(core::PartialPanoramicCamera(
+      600, 400, 300, core::Vec3(1, 2, 3), core::Vec3(0, 1, 0),
+      core::Vec3(0, 0, -1)));
+  // margin pixels of a cube face are projected back to the neighbor face
+  CheckBatchedProjection(core::CubeMapCamera(300, core::Vec3(1, 2, 3),
+                                             core::Vec3(0, 1, 0),
+                                             core::Vec3(0, 0, 1)),
+                         false);
+}
+
+TEST(Camera, CubeMapCamera) {
+  core::PanoramicCamera panoCam(200);
+  core::CubeMapCamera cam(panoCam);
+  ASSERT_EQ(cam.faceSize(), 400);
+  ASSERT_EQ(cam.screenSize(), core::Sizei(cam.tileSize() * 6, cam.tileSize()));
+  for (int i = 0; i < 1000; i++) {
+    core::Vec3 dir(rand() - RAND_MAX / 2, rand() - RAND_MAX / 2,
+                   rand() - RAND_MAX / 2);
+    dir = core::normalize(dir);
+    auto p = cam.toScreen(dir);
+    int id = cam.faceId(dir);
+    // stays inside the face tile, out of the margins
+    ASSERT_GE(p[0], id * cam.tileSize() + 1 - 1e-6);
+    ASSERT_LE(p[0], (id + 1) * cam.tileSize() - 1 + 1e-6);
+    ASSERT_GE(p[1], 1 - 1e-6);
+    ASSERT_LE(p[1], cam.tileSize() - 1 + 1e-6);
+    auto dir2 = core::normalize(cam.direction(p));
+    ASSERT_LT(core::norm(dir - dir2), 1e-4);
+  }
+  // the +x face looks at the panorama center
+  auto c = cam.toScreen(panoCam.center());
+  ASSERT_LT(core::norm(c - core::Point2(cam.tileSize(), cam.tileSize()) / 2.0),
+            1e-4);
+}
+
 TEST(Camera, CameraSampler) {
   auto im = core::ImageRead(PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano1.jpg");
   if (im.empty()) {
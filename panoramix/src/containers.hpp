@@ -118,6 +118,225 @@ private:
   size_t _nelements;
 };
 
+// CompressedRows
+// a vector of vectors stored as one flat array plus row offsets, built either
+// from nested vectors or by count then fill:
+//   rows.resetCounts(n); rows.count(i) ...; rows.allocate(); rows.fill(i, v) ...
+template <class T> class CompressedRows {
+public:
+  template <class PtrT> struct Row {
+    PtrT b, e;
+    PtrT begin() const { return b; }
+    PtrT end() const { return e; }
+    size_t size() const { return e - b; }
+    bool empty() const { return b == e; }
+    decltype(auto) operator[](size_t i) const {
+      assert(b + i < e);
+      return b[i];
+    }
+    decltype(auto) front() const { return *b; }
+    decltype(auto) back() const { return *(e - 1); }
+    std::vector<T> evalAsStdVector() const { return std::vector<T>(b, e); }
+  };
+
+public:
+  CompressedRows() : _offsets(1, 0) {}
+  explicit CompressedRows(const std::vector<std::vector<T>> &rows)
+      : _offsets(rows.size() + 1, 0) {
+    for (size_t i = 0; i < rows.size(); i++) {
+      _offsets[i + 1] = _offsets[i] + rows[i].size();
+    }
+    _data.reserve(_offsets.back());
+    for (auto &r : rows) {
+      _data.insert(_data.end(), r.begin(), r.end());
+    }
+  }
+
+  size_t size() const { return _offsets.size() - 1; }
+  bool empty() const { return size() == 0; }
+  size_t nelements() const { return _data.size(); }
+
+  Row<const T *> operator[](size_t i) const {
+    assert(i < size());
+    return Row<const T *>{_data.data() + _offsets[i],
+                          _data.data() + _offsets[i + 1]};
+  }
+  Row<T *> operator[](size_t i) {
+    assert(i < size());
+    return Row<T *>{_data.data() + _offsets[i], _data.data() + _offsets[i + 1]};
+  }
+
+  const std::vector<size_t> &offsets() const { return _offsets; }
+  const std::vector<T> &data() const { return _data; }
+  std::vector<T> &data() { return _data; }
+
+  // count then fill
+  // counts of different rows can be added concurrently, so can fills
+  void resetCounts(size_t nrows) {
+    _offsets.assign(nrows + 1, 0);
+    _data.clear();
+  }
+  void count(size_t i, size_t n = 1) { _offsets[i + 1] += n; }
+  void allocate() {
+    for (size_t i = 0; i + 1 < _offsets.size(); i++) {
+      _offsets[i + 1] += _offsets[i];
+    }
+    _data.resize(_offsets.back());
+    _cursors.assign(_offsets.begin(), _offsets.end() - 1);
+  }
+  void fill(size_t i, const T &v) {
+    assert(_cursors[i] < _offsets[i + 1]);
+    _data[_cursors[i]++] = v;
+  }
+
+  // edits
+  // each one moves the elements after the edited place
+  template <class IterT> void appendRow(IterT first, IterT last) {
+    _data.insert(_data.end(), first, last);
+    _offsets.push_back(_data.size());
+  }
+  void appendRow() { _offsets.push_back(_data.size()); }
+  void eraseRow(size_t i) {
+    assert(i < size());
+    size_t n = _offsets[i + 1] - _offsets[i];
+    _data.erase(_data.begin() + _offsets[i], _data.begin() + _offsets[i + 1]);
+    _offsets.erase(_offsets.begin() + i + 1);
+    for (size_t k = i + 1; k < _offsets.size(); k++) {
+      _offsets[k] -= n;
+    }
+  }
+  void insert(size_t i, const T &v) { // at the end of row i
+    assert(i < size());
+    _data.insert(_data.begin() + _offsets[i + 1], v);
+    for (size_t k = i + 1; k < _offsets.size(); k++) {
+      _offsets[k]++;
+    }
+  }
+  // erase elements v with pred(v) in all rows
+  template <class PredT> void eraseIf(PredT pred) {
+    size_t n = 0, first = 0;
+    for (size_t i = 0; i + 1 < _offsets.size(); i++) {
+      for (size_t k = first; k < _offsets[i + 1]; k++) {
+        if (!pred(_data[k])) {
+          _data[n++] = std::move(_data[k]);
+        }
+      }
+      first = _offsets[i + 1];
+      _offsets[i + 1] = n;
+    }
+    _data.resize(n);
+  }
+
+  std::vector<std::vector<T>> evalAsStdVectors() const {
+    std::vector<std::vector<T>> rows(size());
+    for (size_t i = 0; i < size(); i++) {
+      rows[i] = (*this)[i].evalAsStdVector();
+    }
+    return rows;
+  }
+
+  template <class ArchiveT> void serialize(ArchiveT &ar) {
+    ar(_offsets, _data);
+  }
+
+private:
+  std::vector<size_t> _offsets;
+  std::vector<T> _data;
+  std::vector<size_t> _cursors;
+};
+
+// FlatHashMap
+// an open addressing hash map with linear probing, all the slots are stored in
+// one flat array, elements can not be erased
+template <class KeyT, class ValT, class HashT = std::hash<KeyT>>
+class FlatHashMap {
+public:
+  explicit FlatHashMap(size_t capacity = 0) : _size(0) { reserve(capacity); }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  void reserve(size_t n) {
+    size_t nslots = 16;
+    while (nslots < n * 2) {
+      nslots *= 2;
+    }
+    if (nslots > _slots.size()) {
+      rehash(nslots);
+    }
+  }
+
+  ValT &operator[](const KeyT &key) {
+    if ((_size + 1) * 2 > _slots.size()) {
+      rehash(_slots.empty() ? 16 : _slots.size() * 2);
+    }
+    size_t i = slotOf(key);
+    if (!_occupied[i]) {
+      _occupied[i] = true;
+      _slots[i].first = key;
+      _slots[i].second = ValT();
+      _size++;
+    }
+    return _slots[i].second;
+  }
+
+  const ValT *find(const KeyT &key) const {
+    if (_slots.empty()) {
+      return nullptr;
+    }
+    size_t i = slotOf(key);
+    return _occupied[i] ? &_slots[i].second : nullptr;
+  }
+  ValT *find(const KeyT &key) {
+    return const_cast<ValT *>(
+        static_cast<const FlatHashMap &>(*this).find(key));
+  }
+  bool contains(const KeyT &key) const { return find(key) != nullptr; }
+
+  // fun(const KeyT &, const ValT &), in the slot order
+  template <class FunT> void forEach(FunT &&fun) const {
+    for (size_t i = 0; i < _slots.size(); i++) {
+      if (_occupied[i]) {
+        fun(_slots[i].first, _slots[i].second);
+      }
+    }
+  }
+
+  template <class ArchiveT> void serialize(ArchiveT &ar) {
+    ar(_slots, _occupied, _size);
+  }
+
+private:
+  // the slot holding key, or the empty slot where it should be
+  size_t slotOf(const KeyT &key) const {
+    size_t mask = _slots.size() - 1;
+    size_t i = HashT()(key) & mask;
+    while (_occupied[i] && !(_slots[i].first == key)) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void rehash(size_t nslots) {
+    std::vector<std::pair<KeyT, ValT>> slots(nslots);
+    std::vector<uint8_t> occupied(nslots, false);
+    std::swap(slots, _slots);
+    std::swap(occupied, _occupied);
+    for (size_t i = 0; i < slots.size(); i++) {
+      if (occupied[i]) {
+        size_t j = slotOf(slots[i].first);
+        _occupied[j] = true;
+        _slots[j] = std::move(slots[i]);
+      }
+    }
+  }
+
+private:
+  std::vector<std::pair<KeyT, ValT>> _slots;
+  std::vector<uint8_t> _occupied;
+  size_t _size;
+};
+
 
 // RTreeSet
 template <class T, class BoundingBoxFunctorT = DefaultBoundingBoxFunctor>
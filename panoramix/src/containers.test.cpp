@@ -1,5 +1,6 @@
 #include <vector>
 #include <list>
+#include <map>
 #include <random>
 
 #include "containers.hpp"
@@ -100,3 +101,64 @@ TEST(ContainerTest, Dictionary) {
   ASSERT_TRUE(dict3.at({1, 2, 3, 1}) == "1231");
   ASSERT_TRUE(dict3.at({1, 3, 2, 1}) == "1321");
 }
+
+TEST(ContainerTest, CompressedRows) {
+  std::vector<std::vector<int>> rows = {{1, 2, 3}, {}, {4}, {5, 6}};
+  core::CompressedRows<int> crows(rows);
+  ASSERT_EQ(rows.size(), crows.size());
+  ASSERT_EQ(6, crows.nelements());
+  ASSERT_TRUE(crows[1].empty());
+  ASSERT_EQ(3, crows[0].back());
+  ASSERT_TRUE(crows.evalAsStdVectors() == rows);
+
+  // count then fill
+  core::CompressedRows<int> crows2;
+  crows2.resetCounts(rows.size());
+  for (int i = 0; i < rows.size(); i++) {
+    crows2.count(i, rows[i].size());
+  }
+  crows2.allocate();
+  for (int i = rows.size() - 1; i >= 0; i--) {
+    for (int v : rows[i]) {
+      crows2.fill(i, v);
+    }
+  }
+  ASSERT_TRUE(crows2.data() == crows.data());
+  ASSERT_TRUE(crows2.offsets() == crows.offsets());
+
+  // edits
+  crows.insert(1, 7);
+  crows.insert(3, 8);
+  crows.eraseRow(0);
+  std::vector<int> row = {9, 10};
+  crows.appendRow(row.begin(), row.end());
+  crows.appendRow();
+  ASSERT_TRUE(crows.evalAsStdVectors() ==
+              std::vector<std::vector<int>>({{7}, {4}, {5, 6, 8}, {9, 10}, {}}));
+  crows.eraseIf([](int v) { return v % 2 == 0; });
+  ASSERT_TRUE(crows.evalAsStdVectors() ==
+              std::vector<std::vector<int>>({{7}, {}, {5}, {9}, {}}));
+  ASSERT_EQ(3, crows.nelements());
+}
+
+TEST(ContainerTest, FlatHashMap) {
+  core::FlatHashMap<int, int> m;
+  std::map<int, int> expected;
+  for (int i = 0; i < 10000; i++) {
+    int key = std::rand() % 3000;
+    m[key] += i;
+    expected[key] += i;
+  }
+  ASSERT_EQ(expected.size(), m.size());
+  for (auto &kv : expected) {
+    ASSERT_TRUE(m.contains(kv.first));
+    ASSERT_EQ(kv.second, *m.find(kv.first));
+  }
+  ASSERT_TRUE(m.find(-1) == nullptr);
+  int n = 0;
+  m.forEach([&n, &expected](int key, int val) {
+    ASSERT_EQ(expected.at(key), val);
+    n++;
+  });
+  ASSERT_EQ(expected.size(), n);
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "basic_types.hpp"
+#include "cameras.hpp"
+#include "containers.hpp"
+#include "image.hpp"
+#include "utility.hpp"
+
+namespace pano {
+namespace core {
+
+// CameraScreenTraits
+// how directions are laid out on the screens of panoramic and perspective
+// cameras, resolved at compile time
+template <class CameraT> struct CameraScreenTraits {};
+
+template <> struct CameraScreenTraits<PanoramicCamera> {
+  // whether the left and right borders of the screen are connected
+  static constexpr bool wrapsHorizontally = true;
+
+  // half sizes of a pixel window around screen position c covering all the
+  // directions within radius of the direction at c
+  static void pixelWindow(const PanoramicCamera &cam, const Point2 &c,
+                          double radius, int &dx, int &dy) {
+    int width = cam.screenSize().width;
+    int height = cam.screenSize().height;
+    dy = int(ceil(radius / M_PI * height)) + 1;
+    dx = width;
+    double latitude = c[1] / height * M_PI - M_PI_2;
+    if (std::abs(latitude) + radius < M_PI_2 - 2 * M_PI / height) {
+      dx = int(ceil(asin(sin(radius) / cos(latitude)) / M_PI / 2.0 * width)) +
+           1;
+    }
+  }
+};
+
+template <> struct CameraScreenTraits<PerspectiveCamera> {
+  static constexpr bool wrapsHorizontally = false;
+
+  // the magnification of the screen grows with the angle to the optical axis
+  static void pixelWindow(const PerspectiveCamera &cam, const Point2 &c,
+                          double radius, int &dx, int &dy) {
+    Vec3 axis = normalize(cam.center() - cam.eye());
+    double angle =
+        AngleBetweenDirected(axis, normalize(cam.toSpace(c) - cam.eye()));
+    dx = dy = std::max(cam.screenSize().width, cam.screenSize().height);
+    if (angle + radius < M_PI_2 - 1e-2) {
+      double cosMax = cos(angle + radius);
+      dx = dy = int(ceil(radius * cam.focal() / cosMax / cosMax)) + 1;
+    }
+  }
+};
+
+// BoundPixel
+// wraps x around on screens connected horizontally and bounds it otherwise,
+// bounds y
+template <class CameraT> inline Pixel BoundPixel(Pixel p, const CameraT &cam) {
+  int width = cam.screenSize().width;
+  int height = cam.screenSize().height;
+  p.x = CameraScreenTraits<CameraT>::wrapsHorizontally
+            ? WrapBetween(p.x, 0, width)
+            : BoundBetween(p.x, 0, width - 1);
+  p.y = BoundBetween(p.y, 0, height - 1);
+  return p;
+}
+
+// NearestDirectionIndex
+// the nearest one of dirs to a direction on the screen grid, dirs are stored
+// in rows of the pixels they fall in, and a map of the nearest dir to each
+// pixel, propagated from these pixels by forward and backward sweeps (wrapping
+// around in x on panoramas), bounds the window of pixels to search for a
+// direction, which is only a few pixels wide where dirs are dense
+// dirs and queried directions are unit vectors seen from a camera at the
+// origin, on perspective cameras they should fall on the screen
+template <class CameraT> class NearestDirectionIndex {
+public:
+  NearestDirectionIndex(const CameraT &cam, const std::vector<Vec3> &dirs,
+                        double maxAngle)
+      : _width(cam.screenSize().width), _height(cam.screenSize().height),
+        _dirs(dirs), _maxAngle(maxAngle), _nearest(_height, _width, -1) {
+    // pixel directions
+    std::vector<Vec3> pixelDirs(_width * _height);
+    std::vector<Point2> ps(_width);
+    for (int y = 0; y < _height; y++) {
+      for (int x = 0; x < _width; x++) {
+        ps[x] = Point2(x, y);
+      }
+      BatchToSpace(cam, ps.data(), pixelDirs.data() + y * _width, _width);
+      for (int x = 0; x < _width; x++) {
+        pixelDirs[y * _width + x] = normalize(pixelDirs[y * _width + x]);
+      }
+    }
+
+    // dirs in pixels
+    std::vector<int> dir2pixel(_dirs.size());
+    _pixel2dirs.resetCounts(_width * _height);
+    for (int k = 0; k < _dirs.size(); k++) {
+      Pixel p = BoundPixel(ToPixel(cam.toScreen(_dirs[k])), cam);
+      dir2pixel[k] = p.y * _width + p.x;
+      _pixel2dirs.count(dir2pixel[k]);
+    }
+    _pixel2dirs.allocate();
+    for (int k = 0; k < _dirs.size(); k++) {
+      _pixel2dirs.fill(dir2pixel[k], k);
+    }
+
+    // nearest dir map, bounded by maxAngle plus the angular size of a few
+    // pixels, which is at most 1 / focal
+    std::vector<double> nearestDot(
+        _width * _height, cos(std::min(maxAngle + 4.0 / cam.focal(), M_PI)));
+    auto tryDir = [this, &pixelDirs, &nearestDot](int x, int y, int k) {
+      double dot = pixelDirs[y * _width + x].dot(_dirs[k]);
+      if (dot > nearestDot[y * _width + x]) {
+        nearestDot[y * _width + x] = dot;
+        _nearest(y, x) = k;
+      }
+    };
+    for (int k = 0; k < _dirs.size(); k++) {
+      tryDir(dir2pixel[k] % _width, dir2pixel[k] / _width, k);
+    }
+    static const int forwardOffsets[4][2] = {
+        {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+    auto sweep = [this, &tryDir](bool forward) {
+      int sign = forward ? 1 : -1;
+      for (int i = 0; i < _height; i++) {
+        int y = forward ? i : _height - 1 - i;
+        for (int j = 0; j < _width; j++) {
+          int x = forward ? j : _width - 1 - j;
+          for (auto &o : forwardOffsets) {
+            int nx = x + sign * o[0], ny = y + sign * o[1];
+            if (ny < 0 || ny >= _height) {
+              continue;
+            }
+            if (CameraScreenTraits<CameraT>::wrapsHorizontally) {
+              nx = WrapBetween(nx, 0, _width);
+            } else if (nx < 0 || nx >= _width) {
+              continue;
+            }
+            int k = _nearest(ny, nx);
+            if (k != -1) {
+              tryDir(x, y, k);
+            }
+          }
+        }
+      }
+    };
+    // the second round carries dirs across the left and right borders of
+    // panoramas
+    for (int round = 0; round < 2; round++) {
+      sweep(true);
+      sweep(false);
+    }
+  }
+
+  const std::vector<Vec3> &dirs() const { return _dirs; }
+  double maxAngle() const { return _maxAngle; }
+
+  // index of the nearest dir within maxAngle to d, -1 if none
+  int nearest(const CameraT &cam, const Vec3 &d) const {
+    Point2 c = cam.toScreen(d);
+    Pixel p = BoundPixel(ToPixel(c), cam);
+    int k = _nearest(p);
+    if (k == -1) {
+      return -1;
+    }
+    // search the pixels within the angle to the nearest dir of the pixel
+    double radius = std::min(AngleBetweenDirected(_dirs[k], d), _maxAngle);
+    int dx, dy;
+    CameraScreenTraits<CameraT>::pixelWindow(cam, c, radius, dx, dy);
+    int xfirst = p.x - dx, xlast = p.x + dx;
+    if (!CameraScreenTraits<CameraT>::wrapsHorizontally) {
+      xfirst = std::max(xfirst, 0);
+      xlast = std::min(xlast, _width - 1);
+    } else if (xlast - xfirst + 1 >= _width) {
+      xfirst = 0;
+      xlast = _width - 1;
+    }
+    int nearestDir = -1;
+    double nearestDot = -1.0;
+    for (int y = std::max(p.y - dy, 0); y <= std::min(p.y + dy, _height - 1);
+         y++) {
+      for (int xx = xfirst; xx <= xlast; xx++) {
+        int x = WrapBetween(xx, 0, _width);
+        for (int dirId : _pixel2dirs[y * _width + x]) {
+          double dot = _dirs[dirId].dot(d);
+          if (dot > nearestDot) {
+            nearestDot = dot;
+            nearestDir = dirId;
+          }
+        }
+      }
+    }
+    if (nearestDir == -1 ||
+        AngleBetweenDirected(_dirs[nearestDir], d) >= _maxAngle) {
+      return -1;
+    }
+    return nearestDir;
+  }
+
+private:
+  int _width, _height;
+  std::vector<Vec3> _dirs;
+  double _maxAngle;
+  Imagei _nearest;
+  CompressedRows<int> _pixel2dirs;
+};
+}
+}
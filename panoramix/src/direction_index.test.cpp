@@ -0,0 +1,167 @@
+#include <random>
+
+#include "direction_index.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+
+namespace {
+
+// index of the nearest dir within maxAngle to d by exhaustive search
+int NearestByBruteForce(const std::vector<core::Vec3> &dirs,
+                        const core::Vec3 &d, double maxAngle) {
+  int nearestDir = -1;
+  double nearestDot = -1.0;
+  for (int i = 0; i < dirs.size(); i++) {
+    double dot = dirs[i].dot(d);
+    if (dot > nearestDot) {
+      nearestDot = dot;
+      nearestDir = i;
+    }
+  }
+  if (nearestDir == -1 ||
+      core::AngleBetweenDirected(dirs[nearestDir], d) >= maxAngle) {
+    return -1;
+  }
+  return nearestDir;
+}
+
+core::Vec3 Perturbed(const core::Vec3 &d, double sigma, std::mt19937 &rng) {
+  std::normal_distribution<double> noise(0.0, sigma);
+  return core::normalize(
+      core::Vec3(d[0] + noise(rng), d[1] + noise(rng), d[2] + noise(rng)));
+}
+
+// compares nearest() with the brute force on valid queries around the given
+// directions, counts the queries with and without a nearest dir
+template <class CameraT, class IsValidQueryT>
+void CompareWithBruteForce(const CameraT &cam,
+                           const std::vector<core::Vec3> &dirs,
+                           const std::vector<core::Vec3> &queryCenters,
+                           double maxAngle, IsValidQueryT isValidQuery,
+                           std::mt19937 &rng, int &nfound, int &nnotfound) {
+  core::NearestDirectionIndex<CameraT> index(cam, dirs, maxAngle);
+  for (auto &c : queryCenters) {
+    for (double sigma : {0.0, maxAngle / 4.0, maxAngle, maxAngle * 4.0}) {
+      core::Vec3 d = Perturbed(c, sigma, rng);
+      if (!isValidQuery(d)) {
+        continue;
+      }
+      int expected = NearestByBruteForce(dirs, d, maxAngle);
+      ASSERT_EQ(expected, index.nearest(cam, d));
+      (expected == -1 ? nnotfound : nfound)++;
+    }
+  }
+}
+}
+
+TEST(DirectionIndexTest, NearestOnPanoramicCamera) {
+  core::PanoramicCamera cam(100);
+  auto size = cam.screenSize();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> xs(0, size.width), ys(0, size.height);
+
+  // sparse dirs all over the sphere, and dense clusters on the seam and
+  // around the poles
+  std::vector<core::Vec3> dirs;
+  for (int i = 0; i < 500; i++) {
+    dirs.push_back(
+        core::normalize(cam.toSpace(core::Point2(xs(rng), ys(rng)))));
+  }
+  std::vector<core::Vec3> specials;
+  for (double y : {0.5, 3.0, size.height / 2.0, size.height - 3.0,
+                   size.height - 0.5}) {
+    for (double x : {0.2, size.width - 0.2}) {
+      specials.push_back(core::normalize(cam.toSpace(core::Point2(x, y))));
+    }
+  }
+  specials.push_back(core::Vec3(0, 0, 1));
+  specials.push_back(core::Vec3(0, 0, -1));
+  for (auto &s : specials) {
+    for (int i = 0; i < 20; i++) {
+      dirs.push_back(Perturbed(s, 0.02, rng));
+    }
+  }
+
+  for (double maxAngle : {0.02, 0.1, 0.5}) {
+    std::vector<core::Vec3> queryCenters = specials;
+    for (int i = 0; i < 500; i++) {
+      queryCenters.push_back(
+          core::normalize(cam.toSpace(core::Point2(xs(rng), ys(rng)))));
+    }
+    int nfound = 0, nnotfound = 0;
+    CompareWithBruteForce(cam, dirs, queryCenters, maxAngle,
+                          [](const core::Vec3 &) { return true; }, rng, nfound,
+                          nnotfound);
+    EXPECT_GT(nfound, 0);
+    if (maxAngle < 0.5) {
+      EXPECT_GT(nnotfound, 0);
+    }
+  }
+}
+
+TEST(DirectionIndexTest, NearestOnPerspectiveCamera) {
+  core::PerspectiveCamera cam(400, 300, core::Point2(200, 150), 150);
+  auto size = cam.screenSize();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> xs(0, size.width), ys(0, size.height);
+  auto onScreen = [&cam, &size](const core::Vec3 &d) {
+    if (d.dot(cam.center() - cam.eye()) <= 0) {
+      return false;
+    }
+    auto p = cam.toScreen(d);
+    return p[0] >= 0 && p[0] < size.width && p[1] >= 0 && p[1] < size.height;
+  };
+
+  // sparse dirs all over the screen, and dense clusters on the borders, dirs
+  // and queries are kept on the screen
+  std::vector<core::Vec3> dirs;
+  for (int i = 0; i < 500; i++) {
+    dirs.push_back(
+        core::normalize(cam.toSpace(core::Point2(xs(rng), ys(rng)))));
+  }
+  std::vector<core::Vec3> specials;
+  for (double x : {0.5, size.width / 2.0, size.width - 0.5}) {
+    for (double y : {0.5, size.height / 2.0, size.height - 0.5}) {
+      specials.push_back(core::normalize(cam.toSpace(core::Point2(x, y))));
+    }
+  }
+  for (auto &s : specials) {
+    for (int i = 0; i < 20; i++) {
+      core::Vec3 d = Perturbed(s, 0.02, rng);
+      if (onScreen(d)) {
+        dirs.push_back(d);
+      }
+    }
+  }
+
+  for (double maxAngle : {0.02, 0.1, 0.5}) {
+    std::vector<core::Vec3> queryCenters = specials;
+    for (int i = 0; i < 500; i++) {
+      queryCenters.push_back(
+          core::normalize(cam.toSpace(core::Point2(xs(rng), ys(rng)))));
+    }
+    int nfound = 0, nnotfound = 0;
+    CompareWithBruteForce(cam, dirs, queryCenters, maxAngle, onScreen, rng,
+                          nfound, nnotfound);
+    EXPECT_GT(nfound, 0);
+    if (maxAngle < 0.5) {
+      EXPECT_GT(nnotfound, 0);
+    }
+  }
+}
+
+TEST(DirectionIndexTest, NearestBeyondMaxAngle) {
+  core::PanoramicCamera cam(50);
+  std::vector<core::Vec3> dirs = {core::Vec3(1, 0, 0)};
+  core::NearestDirectionIndex<core::PanoramicCamera> index(cam, dirs, 0.1);
+  EXPECT_EQ(0, index.nearest(cam, core::normalize(core::Vec3(1, 0.05, 0))));
+  EXPECT_EQ(-1, index.nearest(cam, core::normalize(core::Vec3(1, 0.2, 0))));
+  EXPECT_EQ(-1, index.nearest(cam, core::Vec3(-1, 0, 0)));
+  EXPECT_EQ(-1, index.nearest(cam, core::Vec3(0, 0, 1)));
+
+  core::NearestDirectionIndex<core::PanoramicCamera> empty(
+      cam, std::vector<core::Vec3>(), 0.1);
+  EXPECT_EQ(-1, empty.nearest(cam, core::Vec3(1, 0, 0)));
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "geometry.hpp"
+
+namespace pano {
+namespace core {
+
+// ExactMath
+// the std math functions
+struct ExactMath {
+  static double atan(double x) { return std::atan(x); }
+  static double atan2(double y, double x) { return std::atan2(y, x); }
+  static double sin(double x) { return std::sin(x); }
+  static double cos(double x) { return std::cos(x); }
+};
+
+// FastMath
+// branch free polynomial approximations which compilers can vectorize
+//  atan, atan2: |error| <= 1.2e-5 rad (Abramowitz & Stegun 4.4.49)
+//  sin, cos:    |error| <= 1e-7 for |x| <= 1e6
+// i.e. about 0.01 pixel on a panorama 6000 pixels wide
+struct FastMath {
+  // atan on [-1, 1]
+  static double atanUnit(double x) {
+    double x2 = x * x;
+    return x * (0.9998660 +
+                x2 * (-0.3302995 +
+                      x2 * (0.1801410 + x2 * (-0.0851330 + x2 * 0.0208351))));
+  }
+  static double atan(double x) {
+    double ax = std::abs(x);
+    double a = ax <= 1.0 ? atanUnit(ax) : M_PI_2 - atanUnit(1.0 / ax);
+    return x < 0 ? -a : a;
+  }
+  static double atan2(double y, double x) {
+    double ax = std::abs(x), ay = std::abs(y);
+    double mx = std::max(ax, ay), mn = std::min(ax, ay);
+    double a = mx == 0.0 ? 0.0 : atanUnit(mn / mx);
+    a = ay > ax ? M_PI_2 - a : a;
+    a = x < 0 ? M_PI - a : a;
+    return y < 0 ? -a : a;
+  }
+  // sin on [-pi/2, pi/2], taylor series up to x^11
+  static double sinHalfPi(double x) {
+    double x2 = x * x;
+    return x *
+           (1.0 +
+            x2 * (-1.0 / 6.0 +
+                  x2 * (1.0 / 120.0 +
+                        x2 * (-1.0 / 5040.0 +
+                              x2 * (1.0 / 362880.0 + x2 * (-1.0 / 39916800.0))))));
+  }
+  static double sin(double x) {
+    x -= 2.0 * M_PI * std::round(x / (2.0 * M_PI)); // to [-pi, pi]
+    x = x > M_PI_2 ? M_PI - x : (x < -M_PI_2 ? -M_PI - x : x);
+    return sinHalfPi(x);
+  }
+  static double cos(double x) { return sin(x + M_PI_2); }
+};
+
+// RasterMath
+// the policy used by raster level code (remaps, per pixel directions, voting
+// panels), while solvers and per point conversions keep ExactMath, define
+// PANORAMIX_EXACT_RASTER_MATH to make raster level code exact as well
+#ifdef PANORAMIX_EXACT_RASTER_MATH
+using RasterMath = ExactMath;
+#else
+using RasterMath = FastMath;
+#endif
+
+// MakeGeoCoord
+template <class MathT = ExactMath, class T>
+inline GeoCoord MakeGeoCoord(const Vec<T, 3> &d) {
+  return GeoCoord(MathT::atan2(d(1), d(0)),
+                  MathT::atan2(d(2), std::sqrt(d(1) * d(1) + d(0) * d(0))));
+}
+
+// GeoCoordToVector
+template <class MathT = ExactMath, class T = double>
+inline Vec<T, 3> GeoCoordToVector(const GeoCoord &gc) {
+  double coslati = MathT::cos(gc.latitude);
+  return Vec<T, 3>(static_cast<T>(MathT::cos(gc.longitude) * coslati),
+                   static_cast<T>(MathT::sin(gc.longitude) * coslati),
+                   static_cast<T>(MathT::sin(gc.latitude)));
+}
+
+// SinCosTable
+// sin and cos of the uniform angle grid first + i * step, i in [0, n)
+class SinCosTable {
+public:
+  SinCosTable() {}
+  SinCosTable(double first, double step, int n) : _sin(n), _cos(n) {
+    for (int i = 0; i < n; i++) {
+      _sin[i] = std::sin(first + i * step);
+      _cos[i] = std::cos(first + i * step);
+    }
+  }
+
+  int size() const { return static_cast<int>(_sin.size()); }
+  double sin(int i) const { return _sin[i]; }
+  double cos(int i) const { return _cos[i]; }
+
+private:
+  std::vector<double> _sin, _cos;
+};
+}
+}
@@ -35,9 +35,8 @@ ComputeRawIndoorGeometricContextHedau(misc::Matlab &matlab, const Image &im) {
 
 Image5d MergeGeometricContextLabelsHoiem(const Image7d &rawgc) {
   Image5d result(rawgc.size(), Vec<double, 5>());
-  for (auto it = result.begin(); it != result.end(); ++it) {
-    auto &p = rawgc(it.pos());
-    auto &resultv = *it;
+  ForEachPixel(result, [&rawgc](const Pixel &pos, Vec<double, 5> &resultv) {
+    auto &p = rawgc(pos);
     // 0: ground, 1,2,3: vertical, 4:clutter, 5:poros, 6: sky
     resultv[ToUnderlying(GeometricContextIndex::FloorOrGround)] += p[0];
     resultv[ToUnderlying(GeometricContextIndex::ClutterOrPorous)] +=
@@ -56,9 +55,8 @@ Image5d MergeGeometricContextLabelsHoiem(const Image7d &rawgc) {
 
 Image5d MergeGeometricContextLabelsHedau(const Image7d &rawgc) {
   Image5d result(rawgc.size(), Vec<double, 5>());
-  for (auto it = result.begin(); it != result.end(); ++it) {
-    auto &p = rawgc(it.pos());
-    auto &resultv = *it;
+  ForEachPixel(result, [&rawgc](const Pixel &pos, Vec<double, 5> &resultv) {
+    auto &p = rawgc(pos);
     // 0: front, 1: left, 2: right, 3: floor, 4: ceiling, 5: clutter, 6: unknown
     resultv[ToUnderlying(GeometricContextIndex::FloorOrGround)] += (p[3]);
     resultv[ToUnderlying(GeometricContextIndex::ClutterOrPorous)] += p[5];
@@ -70,7 +68,7 @@ Image5d MergeGeometricContextLabelsHedau(const Image7d &rawgc) {
         std::accumulate(std::begin(resultv.val), std::end(resultv.val), 0.0) -
             1.0,
         1e-2));
-  }
+  });
   return result;
 }
 
@@ -85,9 +83,9 @@ Image6d MergeGeometricContextLabelsHedau(const Image7d &rawgc,
                                          const Vec3 &hvp1) {
   Image6d result(rawgc.size(), Vec<double, 6>());
   double angle = AngleBetweenUndirected(forward, hvp1);
-  for (auto it = result.begin(); it != result.end(); ++it) {
-    auto &p = rawgc(it.pos());
-    auto &resultv = *it;
+  ForEachPixel(result, [&rawgc, angle](const Pixel &pos,
+                                       Vec<double, 6> &resultv) {
+    auto &p = rawgc(pos);
     // 0: front, 1: left, 2: right, 3: floor, 4: ceiling, 5: clutter, 6: unknown
     resultv[ToUnderlying(
         GeometricContextIndexWithHorizontalOrientations::FloorOrGround)] +=
@@ -111,7 +109,7 @@ Image6d MergeGeometricContextLabelsHedau(const Image7d &rawgc,
         GeometricContextIndexWithHorizontalOrientations::Other)] += p[6];
     // assert(IsFuzzyZero(std::accumulate(std::begin(resultv.val),
     // std::end(resultv.val), 0.0) - 1.0, 1e-2));
-  }
+  });
   return result;
 }
 
@@ -120,9 +118,9 @@ Image6d MergeGeometricContextLabelsHoiem(const Image7d &rawgc,
                                          const Vec3 &hvp1) {
   Image6d result(rawgc.size(), Vec<double, 6>());
   double angle = AngleBetweenUndirected(forward, hvp1);
-  for (auto it = result.begin(); it != result.end(); ++it) {
-    auto &p = rawgc(it.pos());
-    auto &resultv = *it;
+  ForEachPixel(result, [&rawgc, angle](const Pixel &pos,
+                                       Vec<double, 6> &resultv) {
+    auto &p = rawgc(pos);
     // 0: ground, 1,2,3: vertical, 4:clutter, 5:poros, 6: sky
     resultv[ToUnderlying(
         GeometricContextIndexWithHorizontalOrientations::FloorOrGround)] +=
@@ -146,7 +144,7 @@ Image6d MergeGeometricContextLabelsHoiem(const Image7d &rawgc,
         GeometricContextIndexWithHorizontalOrientations::Other)] += 0.0;
     // assert(IsFuzzyZero(std::accumulate(std::begin(resultv.val),
     // std::end(resultv.val), 0.0) - 1.0, 1e-2));
-  }
+  });
   return result;
 }
 
@@ -133,7 +133,8 @@ std::vector<std::string> FileDialog::PickFiles(const std::string &dir,
 }
 
 bool MakePanoramaByHand(Image &im, bool *extendedOnTop, bool *extendedOnBottom,
-                        bool *topIsPlanar, bool *bottomIsPlanar) {
+                        bool *topIsPlanar, bool *bottomIsPlanar, int height,
+                        float *horiCenterRatio) {
   if (im.cols < im.rows * 2)
     return false;
   if (im.cols == im.rows * 2) {
@@ -141,6 +142,11 @@ bool MakePanoramaByHand(Image &im, bool *extendedOnTop, bool *extendedOnBottom,
       *extendedOnTop = false;
     if (extendedOnBottom)
       *extendedOnBottom = false;
+    if (horiCenterRatio)
+      *horiCenterRatio = 0.5f;
+    if (height > 0) {
+      ResizeToHeight(im, height);
+    }
     LOG("No need to adjust the panoramic image by hand");
     return true;
   }
@@ -284,8 +290,14 @@ bool MakePanoramaByHand(Image &im, bool *extendedOnTop, bool *extendedOnBottom,
   int panoHCenter = panoHCenterRatio * im.rows;
   std::cout << "hcenter ratio: " << panoHCenterRatio << std::endl;
   std::cout << "hcenter: " << panoHCenter << std::endl;
-
-  auto result = MakePanorama(im, panoHCenter, extendedOnTop, extendedOnBottom);
+  if (horiCenterRatio)
+    *horiCenterRatio = panoHCenterRatio;
+
+  auto result = height > 0 ? MakePanoramaOfHeight(im, height, panoHCenter,
+                                                  extendedOnTop,
+                                                  extendedOnBottom)
+                           : MakePanorama(im, panoHCenter, extendedOnTop,
+                                          extendedOnBottom);
   if (!result) {
     std::cerr << "input panorama shape is incorrect!" << std::endl;
     return false;
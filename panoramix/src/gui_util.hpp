@@ -41,7 +41,8 @@ public:
 bool MakePanoramaByHand(Image &im, bool *extendedOnTop = nullptr,
                         bool *extendedOnBottom = nullptr,
                         bool *topIsPlanar = nullptr,
-                        bool *bottomIsPlanar = nullptr);
+                        bool *bottomIsPlanar = nullptr, int height = -1,
+                        float *horiCenterRatio = nullptr);
 
 void PaintWith(const std::function<Image()> &updater,
                const std::vector<PenConfig> &penConfigs,
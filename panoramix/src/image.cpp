@@ -6,6 +6,41 @@
 namespace pano {
 namespace core {
 
+Image ImageReadReduced(const std::string &filename, const Sizei &minSize,
+                       Sizei *originalSize) {
+  // read the header only to get the size
+  QImageReader reader(QString::fromStdString(filename));
+  QSize sz = reader.size();
+  if (!sz.isValid()) {
+    Image im = cv::imread(filename);
+    if (originalSize) {
+      *originalSize = im.size();
+    }
+    return im;
+  }
+  if (originalSize) {
+    *originalSize = Sizei(sz.width(), sz.height());
+  }
+  static const std::pair<int, int> reductions[] = {
+      {8, cv::IMREAD_REDUCED_COLOR_8},
+      {4, cv::IMREAD_REDUCED_COLOR_4},
+      {2, cv::IMREAD_REDUCED_COLOR_2}};
+  for (auto &r : reductions) {
+    if (sz.width() / r.first >= minSize.width &&
+        sz.height() / r.first >= minSize.height) {
+      return cv::imread(filename, r.second);
+    }
+  }
+  return cv::imread(filename);
+}
+
+const Image &LazyImage::get() const {
+  if (_image.empty()) {
+    _image = cv::imread(_filename);
+  }
+  return _image;
+}
+
 void ClipToSquare(Image &image) {
   int mindim = std::min(image.cols, image.rows);
   image = image(
@@ -108,6 +143,42 @@ bool MakePanorama(Image &im, int horiCenter, bool *extendedOnTop,
   return true;
 }
 
+bool MakePanoramaOfHeight(Image &im, int height, int horiCenter,
+                          bool *extendedOnTop, bool *extendedOnBottom) {
+  if (im.cols < im.rows * 2)
+    return false;
+  if (horiCenter == -1) {
+    horiCenter = im.rows / 2;
+  }
+  double scale = height * 2.0 / im.cols;
+  if (im.cols == im.rows * 2) {
+    if (extendedOnTop)
+      *extendedOnTop = false;
+    if (extendedOnBottom)
+      *extendedOnBottom = false;
+    ResizeToHeight(im, height);
+    return true;
+  }
+  if (im.cols / 2 / 2.0 < horiCenter) {
+    return false;
+  }
+
+  if (extendedOnTop)
+    *extendedOnTop = horiCenter < im.cols / 2 / 2.0 - 1.0;
+  if (extendedOnBottom)
+    *extendedOnBottom = (im.rows - horiCenter) < im.cols / 2 / 2.0 - 1.0;
+
+  Image pim = Image::zeros(height, height * 2, im.type());
+  int top =
+      static_cast<int>(std::round((im.cols / 2 / 2.0 - horiCenter) * scale));
+  int rows =
+      std::min(static_cast<int>(std::round(im.rows * scale)), height - top);
+  cv::resize(im, pim(cv::Rect(0, top, pim.cols, rows)),
+             cv::Size(pim.cols, rows), 0, 0, cv::INTER_AREA);
+  im = pim;
+  return true;
+}
+
 std::pair<Pixel, Pixel> MinMaxLocOfImage(const Image &im) {
   Pixel minLoc, maxLoc;
   double minVal, maxVal;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "geometry.hpp"
+#include "parallel.hpp"
 
 namespace cv {
 template <class T>
@@ -87,6 +88,33 @@ inline bool ImageWrite(const std::string &filename, const Image_<T> &im) {
   return cv::imwrite(filename, im);
 }
 
+// ImageReadReduced
+// decode an image at the smallest of the 1, 1/2, 1/4 and 1/8 scales whose size
+// still covers minSize, jpeg images are scaled down inside the decoder, the
+// size of the image file is written to originalSize if given
+Image ImageReadReduced(const std::string &filename, const Sizei &minSize,
+                       Sizei *originalSize = nullptr);
+
+// LazyImage
+// handle of an image file which is decoded on first access only (not thread
+// safe)
+class LazyImage {
+public:
+  LazyImage() {}
+  explicit LazyImage(const std::string &filename) : _filename(filename) {}
+
+  const std::string &filename() const { return _filename; }
+  bool loaded() const { return !_image.empty(); }
+  const Image &get() const;
+  void release() { _image.release(); }
+
+  template <class Archive> void serialize(Archive &ar) { ar(_filename); }
+
+private:
+  std::string _filename;
+  mutable Image _image;
+};
+
 template <class T = int> inline T Area(const Image &im) {
   return im.cols * im.rows;
 }
@@ -122,6 +150,12 @@ void ResizeToMakeHeightUnder(Image &im, int heightUpperBound);
 bool MayBeAPanorama(const Image &im);
 bool MakePanorama(Image &im, int horiCenter = -1, bool *extendedOnTop = nullptr,
                   bool *extendedOnBottom = nullptr);
+// MakePanoramaOfHeight
+// MakePanorama followed by ResizeToHeight in one pass, only the image content
+// is resized, the padding is never materialized at the input resolution
+bool MakePanoramaOfHeight(Image &im, int height, int horiCenter = -1,
+                          bool *extendedOnTop = nullptr,
+                          bool *extendedOnBottom = nullptr);
 
 std::pair<Pixel, Pixel> MinMaxLocOfImage(const Image &im);
 std::pair<double, double> MinMaxValOfImage(const Image &im);
@@ -155,6 +189,133 @@ inline Pixel Ind2Sub(int ind, const Sizei &sz) {
   return Ind2Sub(ind, sz.width, sz.height);
 }
 
+namespace details {
+// enough rows for a thread to amortize its startup
+inline int MinRowsPerThread(int cols) {
+  return std::max(1, (1 << 14) / std::max(cols, 1));
+}
+}
+
+// ForEachRow
+// call fun(int row, T *rowPtr, int cols) on each row of the image, rows are
+// distributed over threads if parallel is true
+template <class T, class FunT>
+inline void ForEachRow(Image_<T> &im, FunT &&fun, bool parallel = true) {
+  auto body = [&im, &fun](int first, int last) {
+    for (int y = first; y < last; y++) {
+      fun(y, im[y], im.cols);
+    }
+  };
+  if (parallel) {
+    ParallelForRange(0, im.rows, body, -1,
+                     details::MinRowsPerThread(im.cols));
+  } else {
+    body(0, im.rows);
+  }
+}
+template <class T, class FunT>
+inline void ForEachRow(const Image_<T> &im, FunT &&fun, bool parallel = true) {
+  auto body = [&im, &fun](int first, int last) {
+    for (int y = first; y < last; y++) {
+      fun(y, im[y], im.cols);
+    }
+  };
+  if (parallel) {
+    ParallelForRange(0, im.rows, body, -1,
+                     details::MinRowsPerThread(im.cols));
+  } else {
+    body(0, im.rows);
+  }
+}
+
+// ForEachPixel
+// call fun(const Pixel &p, T &value) on each pixel, in parallel over rows
+template <class T, class FunT>
+inline void ForEachPixel(Image_<T> &im, FunT &&fun, bool parallel = true) {
+  ForEachRow(im,
+             [&fun](int y, T *row, int cols) {
+               for (int x = 0; x < cols; x++) {
+                 fun(Pixel(x, y), row[x]);
+               }
+             },
+             parallel);
+}
+template <class T, class FunT>
+inline void ForEachPixel(const Image_<T> &im, FunT &&fun,
+                         bool parallel = true) {
+  ForEachRow(im,
+             [&fun](int y, const T *row, int cols) {
+               for (int x = 0; x < cols; x++) {
+                 fun(Pixel(x, y), row[x]);
+               }
+             },
+             parallel);
+}
+
+// ImageRowWindow
+// rows [row - radius, row + radius] of an image around a center row,
+// columns are wrapped if wrapHorizontally (for panoramas), rows never are
+template <class T> class ImageRowWindow {
+public:
+  ImageRowWindow(const Image_<T> &im, int row, int radius,
+                 bool wrapHorizontally)
+      : _row(row), _radius(radius), _cols(im.cols),
+        _wrapHorizontally(wrapHorizontally), _rows(radius * 2 + 1, nullptr) {
+    for (int dy = -radius; dy <= radius; dy++) {
+      int y = row + dy;
+      if (y >= 0 && y < im.rows) {
+        _rows[dy + radius] = im[y];
+      }
+    }
+  }
+
+  int row() const { return _row; }
+  int radius() const { return _radius; }
+  int cols() const { return _cols; }
+  bool wrapHorizontally() const { return _wrapHorizontally; }
+
+  // whether (x, row + dy) falls in the image (after wrapping x)
+  bool contains(int x, int dy) const {
+    return _rows[dy + _radius] &&
+           (_wrapHorizontally || (x >= 0 && x < _cols));
+  }
+  // value at (x, row + dy), requires contains(x, dy)
+  const T &operator()(int x, int dy) const {
+    assert(contains(x, dy));
+    if (_wrapHorizontally) {
+      x = ((x % _cols) + _cols) % _cols;
+    }
+    return _rows[dy + _radius][x];
+  }
+  // the row pointer of row + dy, nullptr if out of the image
+  const T *rowPtr(int dy) const { return _rows[dy + _radius]; }
+
+private:
+  int _row, _radius, _cols;
+  bool _wrapHorizontally;
+  std::vector<const T *> _rows;
+};
+
+// ForEachRowWindow
+// call fun(int row, const ImageRowWindow<T> &window) on each row, in parallel
+// over rows
+template <class T, class FunT>
+inline void ForEachRowWindow(const Image_<T> &im, int radius,
+                             bool wrapHorizontally, FunT &&fun,
+                             bool parallel = true) {
+  auto body = [&im, radius, wrapHorizontally, &fun](int first, int last) {
+    for (int y = first; y < last; y++) {
+      fun(y, ImageRowWindow<T>(im, y, radius, wrapHorizontally));
+    }
+  };
+  if (parallel) {
+    ParallelForRange(0, im.rows, body, -1,
+                     details::MinRowsPerThread(im.cols * (radius * 2 + 1)));
+  } else {
+    body(0, im.rows);
+  }
+}
+
 Pixel PixelFromGeoCoord(const GeoCoord &p, int longidiv, int latidiv);
 GeoCoord GeoCoordFromPixel(const Pixel &pixel, int longidiv, int latidiv);
 
@@ -67,8 +67,8 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
   // collect votes of intersection directions
   Imagef votePanel = Imagef::zeros(longitudeDivideNum, latitudeDivideNum);
   for (const Vec3 &p : intersections) {
-    Pixel pixel =
-        PixelFromGeoCoord(GeoCoord(p), longitudeDivideNum, latitudeDivideNum);
+    Pixel pixel = PixelFromGeoCoord(MakeGeoCoord<RasterMath>(p),
+                                    longitudeDivideNum, latitudeDivideNum);
     votePanel(pixel.x, pixel.y) += 1.0;
   }
   cv::GaussianBlur(votePanel, votePanel,
@@ -98,8 +98,8 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
 
     double score = 0;
     for (const Vec3 &v : {vec1, vec1rev, vec2, vec2rev}) {
-      Pixel pixel =
-          PixelFromGeoCoord(GeoCoord(v), longitudeDivideNum, latitudeDivideNum);
+      Pixel pixel = PixelFromGeoCoord(MakeGeoCoord<RasterMath>(v),
+                                      longitudeDivideNum, latitudeDivideNum);
       score += votePanel(WrapBetween(pixel.x, 0, longitudeDivideNum),
                          WrapBetween(pixel.y, 0, latitudeDivideNum));
     }
@@ -126,7 +126,8 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
 
         double score = 0;
         for (Vec3 &v : vecs) {
-          Pixel pixel = PixelFromGeoCoord(GeoCoord(v), longitudeDivideNum,
+          Pixel pixel = PixelFromGeoCoord(MakeGeoCoord<RasterMath>(v),
+                                          longitudeDivideNum,
                                           latitudeDivideNum);
           score += votePanel(WrapBetween(pixel.x, 0, longitudeDivideNum),
                              WrapBetween(pixel.y, 0, latitudeDivideNum));
@@ -172,8 +173,8 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
 
       double score = 0;
       for (const Vec3 &v : {vec1, vec1rev, vec2, vec2rev}) {
-        Pixel pixel = PixelFromGeoCoord(GeoCoord(v), longitudeDivideNum,
-                                        latitudeDivideNum);
+        Pixel pixel = PixelFromGeoCoord(MakeGeoCoord<RasterMath>(v),
+                                        longitudeDivideNum, latitudeDivideNum);
         score += votePanel(WrapBetween(pixel.x, 0, longitudeDivideNum),
                            WrapBetween(pixel.y, 0, latitudeDivideNum));
       }
@@ -7,6 +7,14 @@ namespace core {
 template <class FunT> void ParallelRun(int n, int concurrency_num, FunT &&fun);
 template <class FunT>
 void ParallelRun(int n, int concurrency_num, int batch_num, FunT &&fun);
+
+// ParallelForRange
+// split [first, last) into contiguous chunks of at least min_chunk_size
+// indices and call fun(chunk_first, chunk_last) on each chunk in parallel,
+// concurrency_num <= 0 means using all hardware threads
+template <class FunT>
+void ParallelForRange(int first, int last, FunT &&fun, int concurrency_num = -1,
+                      int min_chunk_size = 1);
 }
 }
 
@@ -53,5 +61,39 @@ void ParallelRun(int n, int concurrency_num, int batch_num, FunT &&fun) {
     }
   }
 }
+
+template <class FunT>
+void ParallelForRange(int first, int last, FunT &&fun, int concurrency_num,
+                      int min_chunk_size) {
+  int n = last - first;
+  if (n <= 0) {
+    return;
+  }
+  if (concurrency_num <= 0) {
+    concurrency_num = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+  int nchunks =
+      std::min(concurrency_num, std::max(n / std::max(min_chunk_size, 1), 1));
+  if (nchunks == 1) {
+    fun(first, last);
+    return;
+  }
+  std::vector<std::thread> threads;
+  threads.reserve(nchunks - 1);
+  int chunk_first = first;
+  for (int i = 0; i < nchunks; i++) {
+    int chunk_last = first + int((long long)n * (i + 1) / nchunks);
+    if (i == nchunks - 1) { // run the last chunk in the calling thread
+      fun(chunk_first, chunk_last);
+    } else {
+      threads.emplace_back([&fun](int a, int b) { fun(a, b); }, chunk_first,
+                           chunk_last);
+    }
+    chunk_first = chunk_last;
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+}
 }
-}
\ No newline at end of file
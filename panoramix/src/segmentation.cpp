@@ -1,7 +1,6 @@
 #include "pch.hpp"
 
-#include <SLIC.h>
-
+#include "algorithms.hpp"
 #include "cameras.hpp"
 #include "containers.hpp"
 #include "segmentation.hpp"
@@ -67,36 +66,185 @@ inline float DefaultThreshold(float size, float c) {
   return size == 0.0 ? 1e8 : c / size;
 }
 
+// merge components along edges sorted by weights, threshold[i] is the
+// threshold of the component rooted at i, internal[i] records the largest
+// weight inside the component rooted at i (negative for single vertices)
+template <class ThresholdFunT>
+void MergeSortedEdges(const std::vector<Edge> &edges, Universe &u,
+                      std::vector<float> &threshold, float c,
+                      ThresholdFunT &&thresholdFun,
+                      std::vector<float> *internal = nullptr) {
+  for (int i = 0; i < edges.size(); i++) {
+    const Edge &edge = edges[i];
+
+    // components conected by this edge
+    int a = u.find(edge.a);
+    int b = u.find(edge.b);
+    if (a != b) {
+      if ((edge.w <= threshold[a]) && (edge.w <= threshold[b])) {
+        float w = edge.w;
+        if (internal) {
+          w = std::max({w, (*internal)[a], (*internal)[b]});
+        }
+        u.join(a, b);
+        a = u.find(a);
+        threshold[a] = w + thresholdFun(u.size(a), c);
+        if (internal) {
+          (*internal)[a] = w;
+        }
+      }
+    }
+  }
+}
+
 // merge similar nodes in graph
 template <class ThresholdFunT = decltype(DefaultThreshold)>
 Universe SegmentGraph(const std::vector<float> &verticesSizes,
                       std::vector<Edge> &edges, float c,
                       ThresholdFunT &&thresholdFun = DefaultThreshold) {
 
-  std::sort(edges.begin(), edges.end(),
-            [](const Edge &e1, const Edge &e2) { return e1.w < e2.w; });
+  // stable, so edges of equal weights keep the order they were composed in
+  ParallelRadixSort(edges,
+                    [](const Edge &e) { return RadixKeyOfFloat(e.w); });
 
   int numVertices = verticesSizes.size();
   Universe u(verticesSizes);
-  std::vector<float> threshold(numVertices);
+  std::vector<float> threshold(numVertices, thresholdFun(1, c));
+  MergeSortedEdges(edges, u, threshold, c, thresholdFun);
 
-  for (int i = 0; i < numVertices; i++)
-    threshold[i] = thresholdFun(1, c);
+  return u;
+}
 
-  for (int i = 0; i < edges.size(); i++) {
-    const Edge &edge = edges[i];
+// merge similar nodes in overlapping vertical tiles of the graph in parallel,
+// then reconcile the tiles by merging along edges across tile borders
+template <class ThresholdFunT = decltype(DefaultThreshold)>
+Universe SegmentGraphInTiles(const std::vector<float> &verticesSizes,
+                             std::vector<Edge> &edges, int width, int height,
+                             bool isPanorama, int numTiles, float c,
+                             ThresholdFunT &&thresholdFun = DefaultThreshold) {
+
+  numTiles = std::min(numTiles, width / 2);
+  if (numTiles <= 1) {
+    return SegmentGraph(verticesSizes, edges, c, thresholdFun);
+  }
 
-    // components conected by this edge
-    int a = u.find(edge.a);
-    int b = u.find(edge.b);
-    if (a != b) {
-      if ((edge.w <= threshold[a]) && (edge.w <= threshold[b])) {
-        u.join(a, b);
-        a = u.find(a);
-        threshold[a] = edge.w + thresholdFun(u.size(a), c);
+  ParallelRadixSort(edges,
+                    [](const Edge &e) { return RadixKeyOfFloat(e.w); });
+
+  // tile t owns columns [x0s[t], x0s[t+1]) and is extended by overlap columns
+  // on both sides, wrapping around for panoramas
+  std::vector<int> x0s(numTiles + 1);
+  std::vector<int> tileOfColumn(width);
+  for (int t = 0; t <= numTiles; t++) {
+    x0s[t] = width * t / numTiles;
+  }
+  for (int t = 0; t < numTiles; t++) {
+    std::fill(tileOfColumn.begin() + x0s[t], tileOfColumn.begin() + x0s[t + 1],
+              t);
+  }
+  int overlap = std::min(width / numTiles / 2, 32);
+  std::vector<int> extFirst(numTiles), extWidth(numTiles);
+  for (int t = 0; t < numTiles; t++) {
+    extFirst[t] = isPanorama ? x0s[t] - overlap : std::max(x0s[t] - overlap, 0);
+    int extLast = isPanorama ? x0s[t + 1] + overlap
+                             : std::min(x0s[t + 1] + overlap, width);
+    extWidth[t] = extLast - extFirst[t];
+  }
+  auto localColumn = [&](int t, int x) {
+    int lx = x - extFirst[t];
+    if (isPanorama) {
+      lx = (lx + width) % width;
+    }
+    return lx >= 0 && lx < extWidth[t] ? lx : -1;
+  };
+
+  // distribute the sorted edges to tiles, keep the ones across tile borders
+  std::vector<std::vector<Edge>> tileEdges(numTiles);
+  std::vector<Edge> crossEdges;
+  for (const Edge &edge : edges) {
+    int ya = edge.a / width, xa = edge.a % width;
+    int yb = edge.b / width, xb = edge.b % width;
+    int ta = tileOfColumn[xa];
+    if (ta != tileOfColumn[xb]) {
+      crossEdges.push_back(edge);
+    }
+    for (int dt = -1; dt <= 1; dt++) {
+      int t = ta + dt;
+      if (isPanorama) {
+        t = (t + numTiles) % numTiles;
+        if (dt == 1 && t == (ta + numTiles - 1) % numTiles) {
+          break; // only two tiles
+        }
+      } else if (t < 0 || t >= numTiles) {
+        continue;
+      }
+      int lxa = localColumn(t, xa);
+      int lxb = localColumn(t, xb);
+      if (lxa >= 0 && lxb >= 0) {
+        Edge e;
+        e.w = edge.w;
+        e.a = ya * extWidth[t] + lxa;
+        e.b = yb * extWidth[t] + lxb;
+        tileEdges[t].push_back(e);
+      }
+    }
+  }
+
+  // merge in tiles, each owned vertex records the first owned vertex of its
+  // component in the tile as the representative
+  int numVertices = verticesSizes.size();
+  std::vector<int> reps(numVertices);
+  std::vector<float> repInternals(numVertices, -1.0f);
+  ParallelForRange(0, numTiles, [&](int tfirst, int tlast) {
+    for (int t = tfirst; t < tlast; t++) {
+      int w = extWidth[t];
+      std::vector<float> sizes(w * height);
+      for (int y = 0; y < height; y++) {
+        for (int lx = 0; lx < w; lx++) {
+          int x = (extFirst[t] + lx + width) % width;
+          sizes[y * w + lx] = verticesSizes[y * width + x];
+        }
+      }
+      Universe u(sizes);
+      std::vector<float> threshold(sizes.size(), thresholdFun(1, c));
+      std::vector<float> internal(sizes.size(), -1.0f);
+      MergeSortedEdges(tileEdges[t], u, threshold, c, thresholdFun, &internal);
+      std::vector<Edge>().swap(tileEdges[t]);
+
+      std::vector<int> localReps(sizes.size(), -1);
+      for (int y = 0; y < height; y++) {
+        for (int x = x0s[t]; x < x0s[t + 1]; x++) {
+          int v = y * width + x;
+          int r = u.find(y * w + localColumn(t, x));
+          if (localReps[r] == -1) {
+            localReps[r] = v;
+            repInternals[v] = internal[r];
+          }
+          reps[v] = localReps[r];
+        }
       }
     }
+  }, numTiles);
+
+  // reconcile
+  Universe u(verticesSizes);
+  for (int v = 0; v < numVertices; v++) {
+    int a = u.find(v);
+    int b = u.find(reps[v]);
+    if (a != b) {
+      u.join(a, b);
+    }
+  }
+  std::vector<float> threshold(numVertices, thresholdFun(1, c));
+  std::vector<float> internal(numVertices, -1.0f);
+  for (int v = 0; v < numVertices; v++) {
+    if (reps[v] == v && repInternals[v] >= 0) {
+      int a = u.find(v);
+      internal[a] = repInternals[v];
+      threshold[a] = repInternals[v] + thresholdFun(u.size(a), c);
+    }
   }
+  MergeSortedEdges(crossEdges, u, threshold, c, thresholdFun, &internal);
 
   return u;
 }
@@ -165,6 +313,23 @@ inline float PixelDiff(const Image &im, const Imagei &linesOccupation,
   return ColorDistance(c1, c2, useYUV);
 }
 
+// concatenate edges of strips in order
+std::vector<Edge> ConcatEdgeStrips(std::vector<std::vector<Edge>> &strips) {
+  size_t num = 0;
+  for (auto &strip : strips) {
+    num += strip.size();
+  }
+  std::vector<Edge> edges;
+  edges.reserve(num);
+  for (auto &strip : strips) {
+    edges.insert(edges.end(), strip.begin(), strip.end());
+    std::vector<Edge>().swap(strip);
+  }
+  return edges;
+}
+
+// edges are collected in parallel row strips, the order is the same as
+// scanning the rows one by one
 template <class PixelDiffFuncT, class ImageT>
 std::vector<Edge>
 ComposeGraphEdges(int width, int height, bool isPanorama,
@@ -172,85 +337,120 @@ ComposeGraphEdges(int width, int height, bool isPanorama,
                   bool useOnlyStraightConnectivity = false,
                   bool connectAllPolerPixelsIfIsPanorama = true) {
 
-  std::vector<Edge> edges;
-  edges.reserve(width * height * 4);
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      if (x < width - 1) {
-        Edge edge;
-        edge.a = y * width + x;
-        edge.b = y * width + x + 1;
-        edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), y});
-        edges.push_back(edge);
-      }
+  int nstrips = std::max<int>(std::thread::hardware_concurrency(), 1) * 4;
+
+  // edges inside the image
+  int nrows = std::min(nstrips, std::max(height, 1));
+  std::vector<std::vector<Edge>> strips(nrows);
+  ParallelForRange(0, nrows, [&](int sfirst, int slast) {
+    for (int s = sfirst; s < slast; s++) {
+      int yfirst = height * s / nrows;
+      int ylast = height * (s + 1) / nrows;
+      auto &edges = strips[s];
+      edges.reserve((ylast - yfirst) * width * 4);
+      for (int y = yfirst; y < ylast; y++) {
+        for (int x = 0; x < width; x++) {
+          if (x < width - 1) {
+            Edge edge;
+            edge.a = y * width + x;
+            edge.b = y * width + x + 1;
+            edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), y});
+            edges.push_back(edge);
+          }
 
-      if (y < height - 1) {
-        Edge edge;
-        edge.a = y * width + x;
-        edge.b = (y + 1) * width + x;
-        edge.w = pixelDiff(smoothed, {x, y}, {x, (y + 1)});
-        edges.push_back(edge);
-      }
+          if (y < height - 1) {
+            Edge edge;
+            edge.a = y * width + x;
+            edge.b = (y + 1) * width + x;
+            edge.w = pixelDiff(smoothed, {x, y}, {x, (y + 1)});
+            edges.push_back(edge);
+          }
 
-      if (!useOnlyStraightConnectivity) {
-        if ((x < width - 1) && (y < height - 1)) {
-          Edge edge;
-          edge.a = y * width + x;
-          edge.b = (y + 1) * width + x + 1;
-          edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), (y + 1)});
-          edges.push_back(edge);
-        }
+          if (!useOnlyStraightConnectivity) {
+            if ((x < width - 1) && (y < height - 1)) {
+              Edge edge;
+              edge.a = y * width + x;
+              edge.b = (y + 1) * width + x + 1;
+              edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), (y + 1)});
+              edges.push_back(edge);
+            }
 
-        if ((x < width - 1) && (y > 0)) {
-          Edge edge;
-          edge.a = y * width + x;
-          edge.b = (y - 1) * width + (x + 1);
-          edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), (y - 1)});
-          edges.push_back(edge);
+            if ((x < width - 1) && (y > 0)) {
+              Edge edge;
+              edge.a = y * width + x;
+              edge.b = (y - 1) * width + (x + 1);
+              edge.w = pixelDiff(smoothed, {x, y}, {(x + 1), (y - 1)});
+              edges.push_back(edge);
+            }
+          }
         }
       }
     }
-  }
+  });
+
   if (isPanorama) { // collect panorama borders
+    std::vector<Edge> borderEdges;
     for (int y = 0; y < height; y++) {
       Edge edge;
       edge.a = y * width + 0;
       edge.b = y * width + width - 1;
       edge.w = pixelDiff(smoothed, cv::Point{0, y}, cv::Point{width - 1, y});
-      edges.push_back(edge);
+      borderEdges.push_back(edge);
       if (!useOnlyStraightConnectivity) {
         if (y < height - 1) {
           edge.b = (y + 1) * width + width - 1;
           edge.w =
               pixelDiff(smoothed, cv::Point{0, y}, cv::Point{width - 1, y + 1});
-          edges.push_back(edge);
+          borderEdges.push_back(edge);
         }
         if (y > 0) {
           edge.b = (y - 1) * width + width - 1;
           edge.w =
               pixelDiff(smoothed, cv::Point{0, y}, cv::Point{width - 1, y - 1});
-          edges.push_back(edge);
+          borderEdges.push_back(edge);
         }
       }
     }
+    strips.push_back(std::move(borderEdges));
+
     if (connectAllPolerPixelsIfIsPanorama) {
-      for (int x1 = 0; x1 < width; x1++) {
-        for (int x2 = x1; x2 < width; x2++) {
-          Edge edge;
-          edge.a = 0 * width + x1;
-          edge.b = 0 * width + x2;
-          edge.w = pixelDiff(smoothed, cv::Point{x1, 0}, cv::Point{x2, 0});
-          edges.push_back(edge);
-          edge.a = (height - 1) * width + x2;
-          edge.b = (height - 1) * width + x1;
-          edge.w = pixelDiff(smoothed, cv::Point{x2, height - 1},
-                             cv::Point{x1, height - 1});
-          edges.push_back(edge);
+      // x1 strips with balanced numbers of (x1, x2) pairs
+      int npolar = std::min(nstrips, std::max(width, 1));
+      std::vector<int> x1s(npolar + 1, width);
+      x1s[0] = 0;
+      double numPairs = width * (width + 1.0) / 2.0;
+      for (int x1 = 0, s = 1; x1 < width && s < npolar; x1++) {
+        double pairsBefore = x1 * (2.0 * width - x1 + 1.0) / 2.0;
+        while (s < npolar && pairsBefore >= numPairs * s / npolar) {
+          x1s[s++] = x1;
+        }
+      }
+      std::vector<std::vector<Edge>> polarStrips(npolar);
+      ParallelForRange(0, npolar, [&](int sfirst, int slast) {
+        for (int s = sfirst; s < slast; s++) {
+          auto &edges = polarStrips[s];
+          for (int x1 = x1s[s]; x1 < x1s[s + 1]; x1++) {
+            for (int x2 = x1; x2 < width; x2++) {
+              Edge edge;
+              edge.a = 0 * width + x1;
+              edge.b = 0 * width + x2;
+              edge.w = pixelDiff(smoothed, cv::Point{x1, 0}, cv::Point{x2, 0});
+              edges.push_back(edge);
+              edge.a = (height - 1) * width + x2;
+              edge.b = (height - 1) * width + x1;
+              edge.w = pixelDiff(smoothed, cv::Point{x2, height - 1},
+                                 cv::Point{x1, height - 1});
+              edges.push_back(edge);
+            }
+          }
         }
+      });
+      for (auto &edges : polarStrips) {
+        strips.push_back(std::move(edges));
       }
     }
   }
-  return edges;
+  return ConcatEdgeStrips(strips);
 }
 
 std::vector<float> ComposeGraphVerticesSizes(int width, int height,
@@ -275,10 +475,14 @@ std::pair<Imagei, Image>
 PerformSegmentation(const std::vector<float> &verticesSizes,
                     std::vector<Edge> &edges, int width, int height,
                     float sigma, float c, int minSize, int &numCCs,
-                    bool returnColoredResult = false) {
+                    bool returnColoredResult = false, bool isPanorama = false,
+                    int numTiles = 1) {
 
   int num = (int)edges.size();
-  Universe u = SegmentGraph(verticesSizes, edges, c);
+  Universe u = numTiles > 1
+                   ? SegmentGraphInTiles(verticesSizes, edges, width, height,
+                                         isPanorama, numTiles, c)
+                   : SegmentGraph(verticesSizes, edges, c);
 
   // bool merged = true;
   // while (merged) {
@@ -331,7 +535,7 @@ PerformSegmentation(const std::vector<float> &verticesSizes,
 std::pair<Imagei, Image> SegmentImage(const Image &im, float sigma, float c,
                                       int minSize, bool isPanorama, int &numCCs,
                                       bool returnColoredResult = false,
-                                      bool useYUV = true) {
+                                      bool useYUV = true, int numTiles = 1) {
 
   assert(im.depth() == CV_8U && im.channels() == 3);
 
@@ -352,14 +556,15 @@ std::pair<Imagei, Image> SegmentImage(const Image &im, float sigma, float c,
       });
 
   return PerformSegmentation(vSizes, edges, width, height, sigma, c, minSize,
-                             numCCs, returnColoredResult);
+                             numCCs, returnColoredResult, isPanorama, numTiles);
 }
 
 // first return is CV_32SC1, the second is CV_8UC3 (for display)
 std::pair<Imagei, Image>
 SegmentImage(const Image &im, float sigma, float c, int minSize,
              const std::vector<Line2> &lines, int &numCCs,
-             bool returnColoredResult = false, bool useYUV = true) {
+             bool returnColoredResult = false, bool useYUV = true,
+             int numTiles = 1) {
 
   assert(im.depth() == CV_8U && im.channels() == 3);
 
@@ -384,7 +589,7 @@ SegmentImage(const Image &im, float sigma, float c, int minSize,
       });
 
   return PerformSegmentation(vSizes, edges, width, height, sigma, c, minSize,
-                             numCCs, returnColoredResult);
+                             numCCs, returnColoredResult, false, numTiles);
 }
 
 // first return is CV_32SC1, the second is CV_8UC3 (for display)
@@ -393,7 +598,7 @@ std::pair<Imagei, Image> SegmentImage(const Image &im, float sigma, float c,
                                       const std::vector<Line3> &lines,
                                       const PanoramicCamera &cam, int &numCCs,
                                       bool returnColoredResult = false,
-                                      bool useYUV = true) {
+                                      bool useYUV = true, int numTiles = 1) {
 
   assert(im.depth() == CV_8U && im.channels() == 3);
 
@@ -424,240 +629,419 @@ std::pair<Imagei, Image> SegmentImage(const Image &im, float sigma, float c,
       });
 
   return PerformSegmentation(vSizes, edges, width, height, sigma, c, minSize,
-                             numCCs, returnColoredResult);
+                             numCCs, returnColoredResult, true, numTiles);
 }
 
+// sRGB (D65) to CIELAB through tables, the 8 bit channels are linearized by a
+// 256 entry table and the cube root of the xyz ratios is interpolated
+class LabLUT {
+public:
+  LabLUT() {
+    for (int i = 0; i < 256; i++) {
+      double c = i / 255.0;
+      _linear[i] =
+          c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+    }
+    for (int i = 0; i <= nsamples; i++) {
+      double t = double(i) / (nsamples - 1) * maxRatio;
+      _f[i] = t > 0.008856 ? std::cbrt(t) : (903.3 * t + 16.0) / 116.0;
+    }
+  }
+  void operator()(const Vec3ub &bgr, float &l, float &a, float &b) const {
+    float r = _linear[bgr[2]], g = _linear[bgr[1]], bl = _linear[bgr[0]];
+    float fx = f((r * 0.4124564f + g * 0.3575761f + bl * 0.1804375f) /
+                 0.950456f);
+    float fy = f(r * 0.2126729f + g * 0.7151522f + bl * 0.0721750f);
+    float fz = f((r * 0.0193339f + g * 0.1191920f + bl * 0.9503041f) /
+                 1.088754f);
+    l = 116.0f * fy - 16.0f;
+    a = 500.0f * (fx - fy);
+    b = 200.0f * (fy - fz);
+  }
+
+private:
+  float f(float t) const {
+    float pos = t * ((nsamples - 1) / maxRatio);
+    int i = std::min(static_cast<int>(pos), nsamples - 1);
+    float alpha = pos - i;
+    return _f[i] * (1.0f - alpha) + _f[i + 1] * alpha;
+  }
+
+private:
+  static const int nsamples = 4096;
+  static constexpr float maxRatio = 1.01f; // xyz ratios are in [0, 1]
+  float _linear[256];
+  float _f[nsamples + 1];
+};
+
+// rows are split into strips to run in parallel, strips write disjoint pixels
+inline int NumRowStrips(int height) {
+  return std::min(std::max<int>(std::thread::hardware_concurrency(), 1) * 4,
+                  std::max(height, 1));
+}
+
+// SLIC superpixels, in which each thread assigns the pixels of a row strip to
+// the cluster centers whose windows overlap the strip, the x coordinates
+// wrap around if isPanorama
 std::pair<Imagei, int> SegmentImageUsingSLIC(const Image &im, int spsize,
-                                             int spnum) {
+                                             int spnum, bool isPanorama,
+                                             double compactness = 50.0,
+                                             int iterations = 10) {
   assert(im.depth() == CV_8U && im.channels() == 3);
 
-  SLIC slic;
-  unsigned int *ubuff = new unsigned int[im.cols * im.rows];
-  // fill buffer
-  for (int x = 0; x < im.cols; x++) {
-    for (int y = 0; y < im.rows; y++) {
-      auto &pixel = ubuff[y * im.cols + x];
-      auto &color = im.at<Vec3ub>(Pixel(x, y));
-      pixel = (color[2] << 16) + (color[1] << 8) + color[0];
+  const int width = im.cols;
+  const int height = im.rows;
+  const int npixels = width * height;
+  if (spsize <= 0) {
+    spsize = 0.5 + double(npixels) / double(spnum);
+  }
+  const int step = std::max(int(std::sqrt(double(spsize)) + 0.5), 1);
+  const int nstrips = NumRowStrips(height);
+
+  // lab colors
+  static const LabLUT lab;
+  std::vector<float> ls(npixels), as(npixels), bs(npixels);
+  ParallelForRange(0, height, [&](int yfirst, int ylast) {
+    for (int y = yfirst; y < ylast; y++) {
+      const Vec3ub *row = im.ptr<Vec3ub>(y);
+      for (int x = 0; x < width; x++) {
+        int i = y * width + x;
+        lab(row[x], ls[i], as[i], bs[i]);
+      }
+    }
+  });
+
+  // centers on a uniform grid
+  int xstrips = std::max(int(0.5 + double(width) / step), 1);
+  int ystrips = std::max(int(0.5 + double(height) / step), 1);
+  const int ncenters = xstrips * ystrips;
+  std::vector<float> cls(ncenters), cas(ncenters), cbs(ncenters);
+  std::vector<double> cxs(ncenters), cys(ncenters);
+  for (int j = 0; j < ystrips; j++) {
+    for (int i = 0; i < xstrips; i++) {
+      int k = j * xstrips + i;
+      int x = (i + 0.5) * width / xstrips;
+      int y = (j + 0.5) * height / ystrips;
+      cxs[k] = x;
+      cys[k] = y;
+      cls[k] = ls[y * width + x];
+      cas[k] = as[y * width + x];
+      cbs[k] = bs[y * width + x];
     }
   }
 
-  int *klabels = nullptr;
-  int nlabels = 0;
-  if (spsize > 0) {
-    slic.DoSuperpixelSegmentation_ForGivenSuperpixelSize(
-        ubuff, im.cols, im.rows, klabels, nlabels, spsize, 50);
-  } else {
-    slic.DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels(
-        ubuff, im.cols, im.rows, klabels, nlabels, spnum, 50);
+  // x offset from the center, wrapped to [-width/2, width/2) for panoramas
+  auto xOffset = [width, isPanorama](double x, double cx) {
+    double dx = x - cx;
+    if (isPanorama) {
+      dx -= width * std::floor(dx / width + 0.5);
+    }
+    return dx;
+  };
+
+  const float spatialWeight = float(compactness * compactness / step / step);
+  std::vector<int> labels(npixels, 0);
+  std::vector<float> dists(npixels);
+  for (int iter = 0; iter < iterations; iter++) {
+    // assign
+    ParallelForRange(0, nstrips, [&](int sfirst, int slast) {
+      for (int s = sfirst; s < slast; s++) {
+        int yfirst = height * s / nstrips;
+        int ylast = height * (s + 1) / nstrips;
+        std::fill(dists.begin() + yfirst * width, dists.begin() + ylast * width,
+                  std::numeric_limits<float>::max());
+        for (int k = 0; k < ncenters; k++) {
+          int y1 = std::max<int>(yfirst, std::ceil(cys[k] - step));
+          int y2 = std::min<int>(ylast, std::ceil(cys[k] + step));
+          if (y1 >= y2) {
+            continue;
+          }
+          int x1 = std::ceil(cxs[k] - step);
+          int x2 = std::ceil(cxs[k] + step);
+          if (!isPanorama) {
+            x1 = std::max(x1, 0);
+            x2 = std::min(x2, width);
+          } else if (x2 - x1 > width) {
+            x2 = x1 + width;
+          }
+          for (int y = y1; y < y2; y++) {
+            float dy = float(y - cys[k]);
+            for (int xx = x1; xx < x2; xx++) {
+              int x = isPanorama ? (xx + width) % width : xx;
+              int i = y * width + x;
+              float dl = ls[i] - cls[k], da = as[i] - cas[k],
+                    db = bs[i] - cbs[k];
+              float dx = float(xx - cxs[k]);
+              float d = dl * dl + da * da + db * db +
+                        (dx * dx + dy * dy) * spatialWeight;
+              if (d < dists[i]) {
+                dists[i] = d;
+                labels[i] = k;
+              }
+            }
+          }
+        }
+      }
+    }, nstrips);
+
+    // update, per strip sums are reduced in order
+    std::vector<std::vector<double>> sums(nstrips);
+    ParallelForRange(0, nstrips, [&](int sfirst, int slast) {
+      for (int s = sfirst; s < slast; s++) {
+        auto &sum = sums[s];
+        sum.assign(ncenters * 6, 0.0);
+        for (int y = height * s / nstrips; y < height * (s + 1) / nstrips;
+             y++) {
+          for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            int k = labels[i];
+            double *sk = sum.data() + k * 6;
+            sk[0] += ls[i];
+            sk[1] += as[i];
+            sk[2] += bs[i];
+            sk[3] += xOffset(x, cxs[k]);
+            sk[4] += y;
+            sk[5] += 1.0;
+          }
+        }
+      }
+    }, nstrips);
+    for (int k = 0; k < ncenters; k++) {
+      double sk[6] = {0, 0, 0, 0, 0, 0};
+      for (auto &sum : sums) {
+        for (int j = 0; j < 6; j++) {
+          sk[j] += sum[k * 6 + j];
+        }
+      }
+      if (sk[5] == 0.0) { // an empty cluster keeps its center
+        continue;
+      }
+      cls[k] = sk[0] / sk[5];
+      cas[k] = sk[1] / sk[5];
+      cbs[k] = sk[2] / sk[5];
+      cxs[k] += sk[3] / sk[5];
+      if (isPanorama) {
+        cxs[k] -= width * std::floor(cxs[k] / width);
+      }
+      cys[k] = sk[4] / sk[5];
+    }
   }
 
-  // fill labels back
-  Imagei labels = Imagei::zeros(im.size());
-  for (int x = 0; x < im.cols; x++) {
-    for (int y = 0; y < im.rows; y++) {
-      labels(Pixel(x, y)) = klabels[y * im.cols + x];
+  // enforce connectivity, segments smaller than a quarter of the superpixel
+  // size are merged into an adjacent segment
+  static const int dx4[] = {-1, 0, 1, 0};
+  static const int dy4[] = {0, -1, 0, 1};
+  const int minSegSize = (npixels / ncenters) >> 2;
+  Imagei segs(height, width, -1);
+  std::vector<Pixel> members;
+  int nsegs = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (segs(y, x) >= 0) {
+        continue;
+      }
+      int label = labels[y * width + x];
+      int adjSeg = -1;
+      members.clear();
+      members.emplace_back(x, y);
+      segs(y, x) = nsegs;
+      for (int m = 0; m < members.size(); m++) {
+        for (int n = 0; n < 4; n++) {
+          Pixel p(members[m].x + dx4[n], members[m].y + dy4[n]);
+          if (isPanorama) {
+            p.x = (p.x + width) % width;
+          }
+          if (!Contains(segs.size(), p)) {
+            continue;
+          }
+          int &seg = segs(p);
+          if (seg >= 0 && seg != nsegs) {
+            adjSeg = seg;
+          } else if (seg < 0 && labels[p.y * width + p.x] == label) {
+            seg = nsegs;
+            members.push_back(p);
+          }
+        }
+      }
+      if (members.size() <= minSegSize && adjSeg >= 0) {
+        for (auto &p : members) {
+          segs(p) = adjSeg;
+        }
+      } else {
+        nsegs++;
+      }
     }
   }
 
-  delete[] ubuff;
-  delete[] klabels;
+  return std::make_pair(segs, nsegs);
+}
 
-  return std::make_pair(labels, nlabels);
+// QuickShift, colors are scaled to [0, 32] as in the vlfeat implementation,
+// the parent of each pixel is the closest pixel of higher density within tau,
+// which is searched on offsets sorted by their spatial lengths so that the
+// search stops once no closer pixel is possible
+std::pair<Imagei, int> SegmentImageUsingQuickShiftCPU(const Image &im,
+                                                      float sigma, float tau,
+                                                      bool isPanorama) {
+  assert(im.depth() == CV_8U && im.channels() == 3);
+
+  const int width = im.cols;
+  const int height = im.rows;
+  const int npixels = width * height;
+  std::vector<float> colors(npixels * 3);
+  for (int y = 0; y < height; y++) {
+    const Vec3ub *row = im.ptr<Vec3ub>(y);
+    for (int x = 0; x < width; x++) {
+      for (int k = 0; k < 3; k++) {
+        colors[(y * width + x) * 3 + k] = 32.0f * row[x][k] / 255.0f;
+      }
+    }
+  }
+  auto colorDist2 = [&colors](int i, int j) {
+    const float *ci = colors.data() + i * 3;
+    const float *cj = colors.data() + j * 3;
+    return (ci[0] - cj[0]) * (ci[0] - cj[0]) +
+           (ci[1] - cj[1]) * (ci[1] - cj[1]) +
+           (ci[2] - cj[2]) * (ci[2] - cj[2]);
+  };
+  // the neighbor of (x, y) with offset (dx, dy), -1 if out of the image
+  auto neighbor = [width, height, isPanorama](int x, int y, int dx, int dy) {
+    x += dx;
+    y += dy;
+    if (y < 0 || y >= height) {
+      return -1;
+    }
+    if (isPanorama) {
+      x = (x % width + width) % width;
+    } else if (x < 0 || x >= width) {
+      return -1;
+    }
+    return y * width + x;
+  };
+
+  // density
+  const int kernelRadius = std::ceil(3 * sigma);
+  const float kernelScale = -0.5f / (sigma * sigma);
+  std::vector<float> densities(npixels, 0.0f);
+  ParallelForRange(0, height, [&](int yfirst, int ylast) {
+    for (int y = yfirst; y < ylast; y++) {
+      for (int x = 0; x < width; x++) {
+        int i = y * width + x;
+        float density = 0.0f;
+        for (int dy = -kernelRadius; dy <= kernelRadius; dy++) {
+          for (int dx = -kernelRadius; dx <= kernelRadius; dx++) {
+            int j = neighbor(x, y, dx, dy);
+            if (j >= 0) {
+              density += std::exp(
+                  (dx * dx + dy * dy + colorDist2(i, j)) * kernelScale);
+            }
+          }
+        }
+        densities[i] = density;
+      }
+    }
+  });
+
+  // offsets within tau sorted by spatial lengths
+  const int searchRadius = std::ceil(tau);
+  const float tau2 = tau * tau;
+  std::vector<Pixel> offsets;
+  for (int dy = -searchRadius; dy <= searchRadius; dy++) {
+    for (int dx = -searchRadius; dx <= searchRadius; dx++) {
+      if ((dx != 0 || dy != 0) && dx * dx + dy * dy < tau2) {
+        offsets.emplace_back(dx, dy);
+      }
+    }
+  }
+  std::stable_sort(offsets.begin(), offsets.end(),
+                   [](const Pixel &a, const Pixel &b) {
+                     return a.x * a.x + a.y * a.y < b.x * b.x + b.y * b.y;
+                   });
+
+  // parents, densities are compared with the indices as tie breakers to
+  // make sure the links form a forest
+  std::vector<int> parents(npixels);
+  ParallelForRange(0, height, [&](int yfirst, int ylast) {
+    for (int y = yfirst; y < ylast; y++) {
+      for (int x = 0; x < width; x++) {
+        int i = y * width + x;
+        int parent = i;
+        float bestDist2 = tau2;
+        for (const Pixel &o : offsets) {
+          if (o.x * o.x + o.y * o.y >= bestDist2) {
+            break;
+          }
+          int j = neighbor(x, y, o.x, o.y);
+          if (j < 0 || densities[j] < densities[i] ||
+              (densities[j] == densities[i] && j < i)) {
+            continue;
+          }
+          float d2 = o.x * o.x + o.y * o.y + colorDist2(i, j);
+          if (d2 < bestDist2) {
+            bestDist2 = d2;
+            parent = j;
+          }
+        }
+        parents[i] = parent;
+      }
+    }
+  });
+
+  // flatten the trees by pointer jumping
+  std::vector<int> roots(npixels);
+  std::atomic<bool> changed(true);
+  while (changed) {
+    changed = false;
+    ParallelForRange(0, npixels, [&](int first, int last) {
+      bool chunkChanged = false;
+      for (int i = first; i < last; i++) {
+        roots[i] = parents[parents[i]];
+        chunkChanged |= roots[i] != parents[i];
+      }
+      if (chunkChanged) {
+        changed = true;
+      }
+    }, -1, 1 << 16);
+    std::swap(roots, parents);
+  }
+
+  // label the roots in scan order
+  std::vector<int> rootLabels(npixels, -1);
+  int nsegs = 0;
+  for (int i = 0; i < npixels; i++) {
+    if (parents[i] == i) {
+      rootLabels[i] = nsegs++;
+    }
+  }
+  Imagei segs(height, width);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      segs(y, x) = rootLabels[parents[y * width + x]];
+    }
+  }
+  return std::make_pair(segs, nsegs);
 }
 }
 
-#if 0
-            //    inline void ToQuickShiftImage(const Image & IMG, image_t & im){
-            //        im.N1 = IMG.rows;
-            //        im.N2 = IMG.cols;
-            //        im.K = IMG.channels();
-            //        assert(im.K == 3);
-            //        im.I = (float *)calloc(im.N1*im.N2*im.K, sizeof(float));
-            //        for (int k = 0; k < im.K; k++)
-            //        for (int col = 0; col < im.N2; col++)
-            //        for (int row = 0; row < im.N1; row++)
-            //        {
-            //            auto & pt = IMG.at<cv::Vec<uint8_t, 3>>(/*im.N1 - 1 - row*/row, col);
-            //            im.I[row + col*im.N1 + k*im.N1*im.N2] = 32. * pt[k] / 255.; // Scale 0-32
-            //        }
-            //    }
-
-            //    namespace quickshift_details {
-
-            //        int * map_to_flatmap(float * map, unsigned int size) {
-            //            /********** Flatmap **********/
-            //            int *flatmap = (int *)malloc(size*sizeof(int));
-            //            for (unsigned int p = 0; p < size; p++)
-            //            {
-            //                flatmap[p] = map[p];
-            //            }
-
-            //            bool changed = true;
-            //            while (changed)
-            //            {
-            //                changed = false;
-            //                for (unsigned int p = 0; p < size; p++)
-            //                {
-            //                    changed = changed || (flatmap[p] != flatmap[flatmap[p]]);
-            //                    flatmap[p] = flatmap[flatmap[p]];
-            //                }
-            //            }
-
-            //            /* Consistency check */
-            //            for (unsigned int p = 0; p < size; p++)
-            //                assert(flatmap[p] == flatmap[flatmap[p]]);
-
-            //            return flatmap;
-            //        }
-
-            //        image_t imseg(image_t im, int * flatmap) {
-            //            /********** Mean Color **********/
-            //            float * meancolor = (float *)calloc(im.N1*im.N2*im.K, sizeof(float));
-            //            float * counts = (float *)calloc(im.N1*im.N2, sizeof(float));
-
-            //            for (int p = 0; p < im.N1*im.N2; p++)
-            //            {
-            //                counts[flatmap[p]]++;
-            //                for (int k = 0; k < im.K; k++)
-            //                    meancolor[flatmap[p] + k*im.N1*im.N2] += im.I[p + k*im.N1*im.N2];
-            //            }
-
-            //            int roots = 0;
-            //            for (int p = 0; p < im.N1*im.N2; p++)
-            //            {
-            //                if (flatmap[p] == p)
-            //                    roots++;
-            //            }
-            //            printf("Roots: %d\n", roots);
-
-            //            int nonzero = 0;
-            //            for (int p = 0; p < im.N1*im.N2; p++)
-            //            {
-            //                if (counts[p] > 0)
-            //                {
-            //                    nonzero++;
-            //                    for (int k = 0; k < im.K; k++)
-            //                        meancolor[p + k*im.N1*im.N2] /= counts[p];
-            //                }
-            //            }
-            //            if (roots != nonzero)
-            //                printf("Nonzero: %d\n", nonzero);
-            //            assert(roots == nonzero);
-
-
-            //            /********** Create output image **********/
-            //            image_t imout = im;
-            //            imout.I = (float *)calloc(im.N1*im.N2*im.K, sizeof(float));
-            //            for (int p = 0; p < im.N1*im.N2; p++)
-            //            for (int k = 0; k < im.K; k++)
-            //                imout.I[p + k*im.N1*im.N2] = meancolor[flatmap[p] + k*im.N1*im.N2];
-
-            //            free(meancolor);
-            //            free(counts);
-
-            //            return imout;
-            //        }
-
-            //    }
-
-
-            //    std::pair<Imagei, int> SegmentImageUsingQuickShiftCPU(const Image & originalIm, float sigma, float tau) {
-            //        image_t im;
-            //        ToQuickShiftImage(originalIm, im);
-            //        float *map, *E, *gaps;
-            //        int * flatmap;
-            //        image_t imout;
-
-            //        map = (float *)calloc(im.N1*im.N2, sizeof(float));
-            //        gaps = (float *)calloc(im.N1*im.N2, sizeof(float));
-            //        E = (float *)calloc(im.N1*im.N2, sizeof(float));
-
-            //        quickshift(im, sigma, tau, map, gaps, E);
-
-            //        /* Consistency check */
-            //        for (int p = 0; p < im.N1*im.N2; p++)
-            //        if (map[p] == p) assert(gaps[p] == INF);
-
-            //        flatmap = quickshift_details::map_to_flatmap(map, im.N1*im.N2);
-            //        imout = quickshift_details::imseg(im, flatmap);
-            //        Imagei segmented(im.N1, im.N2);
-            //        for (int col = 0; col < im.N2; col++)
-            //        for (int row = 0; row < im.N1; row++)
-            //        {
-            //            segmented(row, col) = flatmap[row + col*im.N1];
-            //        }
-            //        int segnum = *std::max_element(flatmap, flatmap + im.N1 * im.N2) + 1;
-
-            //        free(im.I);
-            //        free(imout.I);
-            //        free(map);
-            //        free(gaps);
-            //        free(E);
-            //        free(flatmap);
-            //        return std::make_pair(segmented, segnum);
-            //    }
-
-            //    std::pair<Imagei, int> SegmentImageUsingQuickShiftGPU(const Image & originalIm, float sigma, float tau) {
-            //        image_t im;
-            //        ToQuickShiftImage(originalIm, im);
-            //        float *map, *E, *gaps;
-            //        int * flatmap;
-            //        image_t imout;
-
-            //        map = (float *)calloc(im.N1*im.N2, sizeof(float));
-            //        gaps = (float *)calloc(im.N1*im.N2, sizeof(float));
-            //        E = (float *)calloc(im.N1*im.N2, sizeof(float));
-
-            //        quickshift_gpu(im, sigma, tau, map, gaps, E);
-
-            //        /* Consistency check */
-            //        for (int p = 0; p < im.N1*im.N2; p++)
-            //        if (map[p] == p) assert(gaps[p] == INF);
-
-            //        flatmap = quickshift_details::map_to_flatmap(map, im.N1*im.N2);
-            //        imout = quickshift_details::imseg(im, flatmap);
-            //        Imagei segmented(im.N1, im.N2);
-            //        for (int col = 0; col < im.N2; col++)
-            //        for (int row = 0; row < im.N1; row++)
-            //        {
-            //            segmented(row, col) = flatmap[row + col*im.N1];
-            //        }
-            //        int segnum = *std::max_element(flatmap, flatmap + im.N1 * im.N2) + 1;
-
-            //        free(im.I);
-            //        free(imout.I);
-            //        free(map);
-            //        free(gaps);
-            //        free(E);
-            //        free(flatmap);
-            //        return std::make_pair(segmented, segnum);
-            //    }
-
-            //}
-#endif
-
 std::pair<Imagei, int> SegmentationExtractor::
 operator()(const Image &im, bool isPanorama) const {
   if (_params.algorithm == SLIC) {
-    assert(!isPanorama);
     return SegmentImageUsingSLIC(im, _params.superpixelSizeSuggestion,
-                                 _params.superpixelNumberSuggestion);
+                                 _params.superpixelNumberSuggestion,
+                                 isPanorama);
   } else if (_params.algorithm == GraphCut) {
     int numCCs;
     Imagei segim =
         SegmentImage(im, _params.sigma, _params.c, _params.minSize, isPanorama,
-                     numCCs, false, _params.useYUVColorSpace)
+                     numCCs, false, _params.useYUVColorSpace,
+                     _params.graphCutTileNumber)
             .first;
     return std::make_pair(segim, numCCs);
-  } else if (_params.algorithm == QuickShiftCPU) {
-    assert(!isPanorama);
-    NOT_IMPLEMENTED_YET();
-    // return SegmentImageUsingQuickShiftCPU(im, 6, 10);
-  } else if (_params.algorithm == QuickShiftGPU) {
-    assert(!isPanorama);
-    NOT_IMPLEMENTED_YET();
-    // return SegmentImageUsingQuickShiftGPU(im, 6, 10);
+  } else if (_params.algorithm == QuickShiftCPU ||
+             _params.algorithm == QuickShiftGPU) {
+    // no gpu backend is built, QuickShiftGPU uses QuickShiftCPU instead
+    return SegmentImageUsingQuickShiftCPU(im, _params.quickShiftSigma,
+                                          _params.quickShiftTau, isPanorama);
   } else {
     SHOULD_NEVER_BE_CALLED();
   }
@@ -670,7 +1054,8 @@ operator()(const Image &im, const std::vector<Line2> &lines,
   int numCCs;
   if (extensionLength == 0.0) {
     Imagei segim = SegmentImage(im, _params.sigma, _params.c, _params.minSize,
-                                lines, numCCs, false, _params.useYUVColorSpace)
+                                lines, numCCs, false, _params.useYUVColorSpace,
+                                _params.graphCutTileNumber)
                        .first;
     return std::make_pair(segim, numCCs);
   } else {
@@ -682,7 +1067,8 @@ operator()(const Image &im, const std::vector<Line2> &lines,
     }
     Imagei segim =
         SegmentImage(im, _params.sigma, _params.c, _params.minSize, extLines,
-                     numCCs, false, _params.useYUVColorSpace)
+                     numCCs, false, _params.useYUVColorSpace,
+                     _params.graphCutTileNumber)
             .first;
     return std::make_pair(segim, numCCs);
   }
@@ -696,7 +1082,8 @@ operator()(const Image &im, const std::vector<Line3> &lines,
   if (extensionAngle == 0.0) {
     Imagei segim =
         SegmentImage(im, _params.sigma, _params.c, _params.minSize, lines, cam,
-                     numCCs, false, _params.useYUVColorSpace)
+                     numCCs, false, _params.useYUVColorSpace,
+                     _params.graphCutTileNumber)
             .first;
     return std::make_pair(segim, numCCs);
   } else {
@@ -709,7 +1096,8 @@ operator()(const Image &im, const std::vector<Line3> &lines,
     }
     Imagei segim =
         SegmentImage(im, _params.sigma, _params.c, _params.minSize, extLines,
-                     cam, numCCs, false, _params.useYUVColorSpace)
+                     cam, numCCs, false, _params.useYUVColorSpace,
+                     _params.graphCutTileNumber)
             .first;
     return std::make_pair(segim, numCCs);
   }
@@ -717,6 +1105,92 @@ operator()(const Image &im, const std::vector<Line3> &lines,
 
 #pragma endregion SegmentationExtractor
 
+// ThinRegionInsiders
+// by runs of equal labels in rows (wrapping around if crossBorder) and then
+// runs of equal labels of the row insiders in columns
+Imageb ThinRegionInsiders(const Imagei &segs, int radius, bool crossBorder) {
+  int width = segs.cols, height = segs.rows;
+  radius = std::max(radius, 0);
+
+  // row insiders
+  Imageb rowInsiders(segs.size(), false);
+  ForEachRow(segs, [&rowInsiders, radius,
+                    crossBorder](int y, const int *row, int cols) {
+    // lengths of the runs of equal labels ending/starting at x
+    std::vector<int> left(cols), right(cols);
+    bool *insidersRow = rowInsiders[y];
+    if (!crossBorder) {
+      for (int x = 0; x < cols; x++) {
+        left[x] = x > 0 && row[x] == row[x - 1] ? left[x - 1] + 1 : 1;
+      }
+      for (int x = cols - 1; x >= 0; x--) {
+        right[x] = x < cols - 1 && row[x] == row[x + 1] ? right[x + 1] + 1 : 1;
+      }
+      for (int x = 0; x < cols; x++) {
+        insidersRow[x] = left[x] > std::min(radius, x) &&
+                         right[x] > std::min(radius, cols - 1 - x);
+      }
+      return;
+    }
+    // start from a run start to wrap around
+    int start = 0;
+    while (start < cols && row[start] == row[(start + cols - 1) % cols]) {
+      start++;
+    }
+    if (start == cols) { // a single label
+      std::fill_n(insidersRow, cols, true);
+      return;
+    }
+    for (int k = 0; k < cols; k++) {
+      int x = (start + k) % cols;
+      int prev = (x + cols - 1) % cols;
+      left[x] = k > 0 && row[x] == row[prev] ? left[prev] + 1 : 1;
+    }
+    for (int k = 0; k < cols; k++) {
+      int x = (start + 2 * cols - 1 - k) % cols;
+      int next = (x + 1) % cols;
+      right[x] = k > 0 && row[x] == row[next] ? right[next] + 1 : 1;
+    }
+    for (int x = 0; x < cols; x++) {
+      insidersRow[x] = left[x] > radius && right[x] > radius;
+    }
+  });
+
+  // column runs of row insiders with equal labels, in parallel over columns
+  Imageb insiders(segs.size(), false);
+  ParallelForRange(0, width, [&](int xfirst, int xlast) {
+    int n = xlast - xfirst;
+    // lengths of the runs ending at y
+    std::vector<int> up(n * height);
+    for (int y = 0; y < height; y++) {
+      for (int x = xfirst; x < xlast; x++) {
+        int i = y * n + x - xfirst;
+        up[i] = !rowInsiders(y, x)
+                    ? 0
+                    : (y > 0 && rowInsiders(y - 1, x) &&
+                               segs(y - 1, x) == segs(y, x)
+                           ? up[i - n] + 1
+                           : 1);
+      }
+    }
+    // lengths of the runs starting at y
+    std::vector<int> down(n, 0);
+    for (int y = height - 1; y >= 0; y--) {
+      for (int x = xfirst; x < xlast; x++) {
+        int &d = down[x - xfirst];
+        d = !rowInsiders(y, x)
+                ? 0
+                : (y < height - 1 && d > 0 && segs(y + 1, x) == segs(y, x)
+                       ? d + 1
+                       : 1);
+        insiders(y, x) = d > std::min(radius, height - 1 - y) &&
+                         up[y * n + x - xfirst] > std::min(radius, y);
+      }
+    }
+  }, -1, 16);
+  return insiders;
+}
+
 void RemoveThinRegionInSegmentation(Imagei &segs, int widthThres /*= 2.0*/,
                                     bool crossBorder /*= false*/) {
   /*if (crossBorder) {
@@ -726,35 +1200,7 @@ void RemoveThinRegionInSegmentation(Imagei &segs, int widthThres /*= 2.0*/,
 
   int width = segs.cols, height = segs.rows;
 
-  Imageb insiders(segs.size(), false);
-  for (auto it = insiders.begin(); it != insiders.end(); ++it) {
-    auto p = it.pos();
-    int seg = segs(p);
-    bool isInside = true;
-    for (int x = -widthThres; x <= widthThres; x++) {
-      if (!isInside) {
-        break;
-      }
-      int xx = p.x + x;
-      if ((xx < 0 || xx > width - 1) && !crossBorder) {
-        continue;
-      }
-      xx = (xx + width) % width;
-      for (int y = -widthThres; y <= widthThres; y++) {
-        if (!isInside) {
-          break;
-        }
-        int yy = p.y + y;
-        if (yy < 0 || yy > height - 1) {
-          continue;
-        }
-        if (segs(yy, xx) != seg) {
-          isInside = false;
-        }
-      }
-    }
-    *it = isInside;
-  }
+  Imageb insiders = ThinRegionInsiders(segs, widthThres, crossBorder);
 
   /*cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT,
       cv::Size(2 * widthThres + 1, 2 * widthThres + 1),
@@ -833,53 +1279,118 @@ void RemoveThinRegionInSegmentation(Imagei &segs, int widthThres /*= 2.0*/,
   }
 }
 
-int RemoveSmallRegionInSegmentation(Imagei &segs, double areaThres,
-                                    bool panoWeights) {
+namespace {
 
-  int nsegs = MinMaxValOfImage(segs).second + 1;
+// region adjacency graph of the labels of a segmentation
+struct RegionAdjacencyGraph {
+  int nlabels;
+  std::vector<int> counts;       // numbers of pixels
+  std::vector<double> panoAreas; // numbers of pixels weighted by cos(latitude)
+  // sorted 8 connected neighbors of each label, including the label itself if
+  // it has adjacent pixels, x wraps around if crossBorder
+  std::vector<std::vector<int>> neighbors;
+  // 2x2 pixel blocks with more than one label in scan order, x always wraps
+  // around
+  struct Block {
+    std::array<int, 4> labels; // sorted, unique
+    int size;
+    double weight; // cos(latitude)
+  };
+  std::vector<Block> blocks;
 
-  std::vector<Scored<int>> segAreas(nsegs);
-  for (int i = 0; i < nsegs; i++) {
-    segAreas[i].component = i;
-    segAreas[i].score = 0;
-  }
+  RegionAdjacencyGraph(const Imagei &segs, bool crossBorder);
+};
 
-  int height = segs.rows;
-  for (auto it = segs.begin(); it != segs.end(); ++it) {
-    double weight = 1.0;
-    if (panoWeights) {
-      weight = cos((it.pos().y - height / 2.0) / height * M_PI);
-    }
-    segAreas[*it].score -= weight; // record negative areas
-  }
+RegionAdjacencyGraph::RegionAdjacencyGraph(const Imagei &segs,
+                                           bool crossBorder) {
+  int width = segs.cols, height = segs.rows;
+  nlabels = MinMaxValOfImage(segs).second + 1;
+  counts.assign(nlabels, 0);
+  panoAreas.assign(nlabels, 0.0);
+  neighbors.resize(nlabels);
+
+  // cos of the latitude of each row
+  SinCosTable rowLatitudes(-M_PI_2, M_PI / height, height);
+  std::vector<char> selfAdjacent(nlabels, false);
+  std::vector<std::pair<int, int>> pairs;
+  static const int dxs[] = {1, 0, 1, -1};
+  static const int dys[] = {0, 1, 1, 1};
+  for (int y = 0; y < height; y++) {
+    const int *row = segs[y];
+    const int *nextRow = y < height - 1 ? segs[y + 1] : nullptr;
+    double weight = rowLatitudes.cos(y);
+    for (int x = 0; x < width; x++) {
+      int seg1 = row[x];
+      counts[seg1]++;
+      panoAreas[seg1] += weight;
 
-  std::vector<std::map<int, double>> segAdjacents(nsegs);
-  for (auto it = segs.begin(); it != segs.end(); ++it) {
-    auto p = it.pos();
+      for (int n = 0; n < 4; n++) {
+        int nx = x + dxs[n], ny = y + dys[n];
+        if (crossBorder) {
+          nx = (nx + width) % width;
+        }
+        if (!Contains(segs.size(), Pixel(nx, ny))) {
+          continue;
+        }
+        int seg2 = segs(ny, nx);
+        if (seg1 == seg2) {
+          selfAdjacent[seg1] = true;
+        } else {
+          pairs.emplace_back(seg1, seg2);
+          pairs.emplace_back(seg2, seg1);
+        }
+      }
 
-    // seg ids related
-    std::set<int> idset = {segs(p), segs(Pixel((p.x + 1) % segs.cols, p.y))};
-    if (p.y <
-        height - 1) { // note that the top/bottom borders cannot be crossed!
-      idset.insert(segs(Pixel(p.x, p.y + 1)));
-      idset.insert(segs(Pixel((p.x + 1) % segs.cols, p.y + 1)));
+      Block block;
+      int right = (x + 1) % width;
+      block.labels = {{seg1, row[right], nextRow ? nextRow[x] : seg1,
+                       nextRow ? nextRow[right] : seg1}};
+      std::sort(block.labels.begin(), block.labels.end());
+      block.size = std::unique(block.labels.begin(), block.labels.end()) -
+                   block.labels.begin();
+      if (block.size > 1) {
+        block.weight = weight;
+        blocks.push_back(block);
+      }
     }
+  }
 
-    if (idset.size() <= 1) {
-      continue;
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+  for (auto &pair : pairs) {
+    neighbors[pair.first].push_back(pair.second);
+  }
+  for (int label = 0; label < nlabels; label++) {
+    if (selfAdjacent[label]) {
+      auto &nbs = neighbors[label];
+      nbs.insert(std::lower_bound(nbs.begin(), nbs.end(), label), label);
     }
+  }
+}
 
-    double weight = cos((it.pos().y - height / 2.0) / height * M_PI);
-    ;
-
-    // register this pixel as a bnd candidate for bnd of related segids
-    for (auto ii = idset.begin(); ii != idset.end(); ++ii) {
-      for (auto jj = std::next(ii); jj != idset.end(); ++jj) {
-        segAdjacents[*ii][*jj] += weight;
-        segAdjacents[*jj][*ii] += weight;
-      }
+// the number of current labels of the regions in the graph
+int NumCurrentLabels(const RegionAdjacencyGraph &rag,
+                     const std::vector<int> &labelMap) {
+  int nsegs = 0;
+  for (int label = 0; label < rag.nlabels; label++) {
+    if (rag.counts[label] > 0) {
+      nsegs = std::max(nsegs, labelMap[label] + 1);
     }
   }
+  return nsegs;
+}
+
+// merge regions not larger than areaThres into the adjacent region sharing the
+// longest boundary, from the smallest one, returns the number of regions left
+int MergeSmallRegions(const std::vector<double> &areas,
+                      const std::vector<std::map<int, double>> &segAdjacents,
+                      double areaThres, std::vector<int> &old2new) {
+  int nsegs = areas.size();
+  std::vector<Scored<int>> segAreas(nsegs);
+  for (int i = 0; i < nsegs; i++) {
+    segAreas[i].component = i;
+    segAreas[i].score = -areas[i]; // record negative areas
+  }
 
   std::vector<int> segParent(nsegs);
   std::iota(segParent.begin(), segParent.end(), 0);
@@ -931,7 +1442,7 @@ int RemoveSmallRegionInSegmentation(Imagei &segs, double areaThres,
     root2new[root.component] = root2new.size();
   }
 
-  std::vector<int> old2new(nsegs);
+  old2new.resize(nsegs);
   for (int i = 0; i < nsegs; i++) {
     int seg = i;
     while (segParent[seg] != seg) {
@@ -940,129 +1451,238 @@ int RemoveSmallRegionInSegmentation(Imagei &segs, double areaThres,
     old2new[i] = root2new.at(seg);
   }
 
-  for (int &seg : segs) {
-    seg = old2new[seg];
+  return rootSegs.size();
+}
+
+// labelMap maps the labels of the graph to the current labels
+int RelabelSmallRegions(const RegionAdjacencyGraph &rag,
+                        std::vector<int> &labelMap, double areaThres,
+                        bool panoWeights) {
+  int nsegs = NumCurrentLabels(rag, labelMap);
+  std::vector<double> areas(nsegs, 0.0);
+  for (int label = 0; label < rag.nlabels; label++) {
+    if (rag.counts[label] > 0) {
+      areas[labelMap[label]] +=
+          panoWeights ? rag.panoAreas[label] : rag.counts[label];
+    }
   }
 
-  return rootSegs.size();
+  std::vector<std::map<int, double>> segAdjacents(nsegs);
+  for (auto &block : rag.blocks) {
+    // seg ids related
+    std::array<int, 4> idset;
+    for (int i = 0; i < block.size; i++) {
+      idset[i] = labelMap[block.labels[i]];
+    }
+    std::sort(idset.begin(), idset.begin() + block.size);
+    int nids = std::unique(idset.begin(), idset.begin() + block.size) -
+               idset.begin();
+    // register this block as a bnd candidate for bnd of related segids
+    for (int i = 0; i < nids; i++) {
+      for (int j = i + 1; j < nids; j++) {
+        segAdjacents[idset[i]][idset[j]] += block.weight;
+        segAdjacents[idset[j]][idset[i]] += block.weight;
+      }
+    }
+  }
+
+  std::vector<int> old2new;
+  int nsegsLeft = MergeSmallRegions(areas, segAdjacents, areaThres, old2new);
+  for (int label = 0; label < rag.nlabels; label++) {
+    if (rag.counts[label] > 0) {
+      labelMap[label] = old2new[labelMap[label]];
+    }
+  }
+  return nsegsLeft;
 }
 
-void RemoveDanglingPixelsInSegmentation(Imagei &segs, bool crossBorder) {
+// labelMap maps the labels of the graph to the current labels
+void RelabelEmbededRegions(const RegionAdjacencyGraph &rag,
+                           std::vector<int> &labelMap) {
+  int nsegs = NumCurrentLabels(rag, labelMap);
+  std::vector<std::vector<int>> segNeighbors(nsegs);
+  for (int label = 0; label < rag.nlabels; label++) {
+    for (int nb : rag.neighbors[label]) {
+      segNeighbors[labelMap[label]].push_back(labelMap[nb]);
+    }
+  }
+  std::vector<int> newLabels(nsegs);
+  for (int seg = 0; seg < nsegs; seg++) {
+    auto &nbs = segNeighbors[seg];
+    std::sort(nbs.begin(), nbs.end());
+    nbs.erase(std::unique(nbs.begin(), nbs.end()), nbs.end());
+    newLabels[seg] = nbs.size() == 1 ? nbs.front() : seg;
+  }
+  for (int label = 0; label < rag.nlabels; label++) {
+    if (rag.counts[label] > 0) {
+      labelMap[label] = newLabels[labelMap[label]];
+    }
+  }
+}
 
+// number the 4 connected components of labelMap[segs(p)] (or segs(p) if
+// labelMap is null) by their first pixels in scan order
+int NumberConnectedComponents(Imagei &segs, bool crossBorder,
+                              const std::vector<int> *labelMap = nullptr) {
   int width = segs.cols;
   int height = segs.rows;
+  std::vector<int> labels(width * height);
+  for (int y = 0; y < height; y++) {
+    const int *row = segs[y];
+    for (int x = 0; x < width; x++) {
+      labels[y * width + x] = labelMap ? (*labelMap)[row[x]] : row[x];
+    }
+  }
 
-  while (true) {
-    bool hasDanglingPixels = false;
-    for (auto it = segs.begin(); it != segs.end(); ++it) {
-      int seg = *it;
-      std::vector<int> neighbors;
-      neighbors.reserve(4);
-      auto p = it.pos();
-      if (p.x > 0 || crossBorder) {
-        neighbors.push_back(segs(Pixel((p.x + width - 1) % width, p.y)));
-      }
-      if (p.x < width - 1 || crossBorder) {
-        neighbors.push_back(segs(Pixel((p.x + 1) % width, p.y)));
-      }
-      if (p.y > 0) {
-        neighbors.push_back(segs(Pixel(p.x, p.y - 1)));
-      }
-      if (p.y < height - 1) {
-        neighbors.push_back(segs(Pixel(p.x, p.y + 1)));
+  std::vector<int> parents(width * height);
+  std::iota(parents.begin(), parents.end(), 0);
+  auto find = [&parents](int i) {
+    while (parents[i] != i) {
+      i = parents[i] = parents[parents[i]];
+    }
+    return i;
+  };
+  auto join = [&parents, &find](int i, int j) {
+    i = find(i);
+    j = find(j);
+    if (i != j) {
+      parents[std::max(i, j)] = std::min(i, j);
+    }
+  };
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int i = y * width + x;
+      if (x > 0 && labels[i - 1] == labels[i]) {
+        join(i - 1, i);
       }
-      bool isDanglingPixel = true;
-      for (int nb : neighbors) {
-        if (nb == seg) {
-          isDanglingPixel = false;
-          break;
-        }
+      if (y > 0 && labels[i - width] == labels[i]) {
+        join(i - width, i);
       }
-      if (isDanglingPixel) {
-        int maxCountNeighbor = *std::max_element(
-            neighbors.begin(), neighbors.end(), [&neighbors](int nb1, int nb2) {
-              return std::count(neighbors.begin(), neighbors.end(), nb1) <
-                     std::count(neighbors.begin(), neighbors.end(), nb2);
-            });
-        *it = maxCountNeighbor;
-        hasDanglingPixels = true;
+      if (crossBorder && x == width - 1 && x > 0 &&
+          labels[y * width] == labels[i]) {
+        join(y * width, i);
       }
     }
-    if (!hasDanglingPixels) {
-      break;
-    }
   }
-}
 
-void RemoveEmbededRegionsInSegmentation(Imagei &segs, bool crossBorder) {
-  int nsegs = MinMaxValOfImage(segs).second + 1;
-  std::vector<std::set<int>> segNeighbors(nsegs);
-  for (int x = 0; x < segs.cols; x++) {
-    for (int y = 0; y < segs.rows; y++) {
-      Pixel p(x, y);
-      int seg1 = segs(p);
-      Pixel nbs[] = {Pixel(x + 1, y), Pixel(x, y + 1), Pixel(x + 1, y + 1),
-                     Pixel(x - 1, y + 1)};
-      for (auto &nb : nbs) {
-        if (crossBorder) {
-          nb.x = (nb.x + segs.cols) % segs.cols;
-        }
-        if (Contains(segs.size(), nb)) {
-          int seg2 = segs(nb);
-          segNeighbors[seg1].insert(seg2);
-          segNeighbors[seg2].insert(seg1);
-        }
+  std::vector<int> compLabels(width * height, -1);
+  int ncomps = 0;
+  for (int y = 0; y < height; y++) {
+    int *row = segs[y];
+    for (int x = 0; x < width; x++) {
+      int &comp = compLabels[find(y * width + x)];
+      if (comp == -1) {
+        comp = ncomps++;
       }
+      row[x] = comp;
     }
   }
-  for (int &s : segs) {
-    if (segNeighbors[s].size() == 1) {
-      s = *segNeighbors[s].begin();
-    }
+  return ncomps;
+}
+}
+
+int RemoveSmallRegionInSegmentation(Imagei &segs, double areaThres,
+                                    bool panoWeights) {
+  RegionAdjacencyGraph rag(segs, false);
+  std::vector<int> labelMap(rag.nlabels);
+  std::iota(labelMap.begin(), labelMap.end(), 0);
+  int nsegs = RelabelSmallRegions(rag, labelMap, areaThres, panoWeights);
+  for (int &seg : segs) {
+    seg = labelMap[seg];
   }
+  return nsegs;
 }
 
-int DensifySegmentation(Imagei &segs, bool crossBorder) {
+void RemoveDanglingPixelsInSegmentation(Imagei &segs, bool crossBorder) {
 
   int width = segs.cols;
   int height = segs.rows;
 
-  // build pixel graph
-  std::vector<float> vSizes =
-      ComposeGraphVerticesSizes(width, height, crossBorder);
-  std::vector<Edge> edges = ComposeGraphEdges(
-      width, height, crossBorder, segs,
-      [](const Imagei &im, const cv::Point &p1, const cv::Point &p2) {
-        return im(p1) == im(p2) ? 0 : 1e5;
-      },
-      true, false);
+  // 4 connected neighbors in the order of left, right, up and down
+  auto neighborsOf = [width, height, crossBorder](int i,
+                                                  std::vector<int> &nbs) {
+    nbs.clear();
+    int x = i % width, y = i / width;
+    if (x > 0 || crossBorder) {
+      nbs.push_back(y * width + (x + width - 1) % width);
+    }
+    if (x < width - 1 || crossBorder) {
+      nbs.push_back(y * width + (x + 1) % width);
+    }
+    if (y > 0) {
+      nbs.push_back(i - width);
+    }
+    if (y < height - 1) {
+      nbs.push_back(i + width);
+    }
+  };
 
-  int num = (int)edges.size();
-  Universe u = SegmentGraph(vSizes, edges, 0.1);
+  int *data = segs.ptr<int>();
+  assert(segs.isContinuous());
+  std::vector<int> nbs, neighbors;
+  // relabel pixel i if it is dangling, returns whether it is relabeled
+  auto fix = [&](int i) {
+    neighborsOf(i, nbs);
+    neighbors.clear();
+    for (int nb : nbs) {
+      neighbors.push_back(data[nb]);
+    }
+    if (std::find(neighbors.begin(), neighbors.end(), data[i]) !=
+        neighbors.end()) {
+      return false;
+    }
+    data[i] = *std::max_element(
+        neighbors.begin(), neighbors.end(), [&neighbors](int nb1, int nb2) {
+          return std::count(neighbors.begin(), neighbors.end(), nb1) <
+                 std::count(neighbors.begin(), neighbors.end(), nb2);
+        });
+    return true;
+  };
 
-  for (int i = 0; i < num; i++) {
-    int a = u.find(edges[i].a);
-    int b = u.find(edges[i].b);
-    if (a != b && edges[i].w == 0)
-      u.join(a, b);
+  // scan all pixels first, then only the ones near the relabeled pixels, a
+  // pixel relabeled in a pass queues its neighbors after it in the same pass
+  // and the ones before it in the next pass
+  std::set<int> next;
+  for (int i = 0; i < width * height; i++) {
+    if (fix(i)) {
+      for (int nb : nbs) {
+        if (nb < i) {
+          next.insert(nb);
+        }
+      }
+    }
   }
-
-  int numCCs = u.numSets();
-  std::unordered_map<int, int> compIntSet;
-  Imagei output(cv::Size2i(width, height));
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      int comp = u.find(y * width + x);
-      if (compIntSet.find(comp) == compIntSet.end()) {
-        compIntSet.insert(std::make_pair(comp, (int)compIntSet.size()));
+  while (!next.empty()) {
+    std::set<int> current;
+    std::swap(current, next);
+    for (auto it = current.begin(); it != current.end(); ++it) {
+      int i = *it;
+      if (!fix(i)) {
+        continue;
+      }
+      for (int nb : nbs) {
+        if (nb > i) {
+          current.insert(nb);
+        } else if (nb < i) {
+          next.insert(nb);
+        }
       }
-      output(cv::Point(x, y)) = compIntSet[comp];
     }
   }
-  assert(compIntSet.size() == numCCs);
+}
+
+void RemoveEmbededRegionsInSegmentation(Imagei &segs, bool crossBorder) {
+  RegionAdjacencyGraph rag(segs, crossBorder);
+  std::vector<int> labelMap(rag.nlabels);
+  std::iota(labelMap.begin(), labelMap.end(), 0);
+  RelabelEmbededRegions(rag, labelMap);
+  for (int &seg : segs) {
+    seg = labelMap[seg];
+  }
+}
 
-  segs = output;
-  return numCCs;
+int DensifySegmentation(Imagei &segs, bool crossBorder) {
+  return NumberConnectedComponents(segs, crossBorder);
 }
 
 bool IsDenseSegmentation(const Imagei &segRegions) {
@@ -1183,6 +1803,149 @@ FindRegionBoundaries(const Imagei &segRegions, int connectionExtendSize,
   return boundaryEdges;
 }
 
+RegionBoundaryChains FindRegionBoundaryChains(const Imagei &segRegions,
+                                              int connectionExtendSize) {
+  int width = segRegions.cols;
+  int height = segRegions.rows;
+
+  // the pixel pairs (p, q) of FindRegionBoundaries with middle pixel m, i.e.
+  // p.x + q.x is 2 * m.x or 2 * m.x + 1, |p.x - q.x| <= connectionExtendSize,
+  // p is not on the last column (and the same for y)
+  auto middleCoords = [connectionExtendSize](
+      int m, int size, std::vector<std::pair<int, int>> &coords) {
+    coords.clear();
+    for (int a = std::max(m - connectionExtendSize, 0);
+         a <= std::min(m + connectionExtendSize, size - 2); a++) {
+      for (int b = 2 * m - a; b <= 2 * m + 1 - a; b++) {
+        if (b >= 0 && b < size && std::abs(a - b) <= connectionExtendSize) {
+          coords.emplace_back(a, b);
+        }
+      }
+    }
+  };
+
+  // boundary pixels of region pairs, sorted in the order of region pairs and
+  // then in the order of pixels
+  struct BoundaryPixel {
+    std::pair<int, int> rids;
+    int pixelIndex;
+    bool operator<(const BoundaryPixel &b) const {
+      return std::tie(rids, pixelIndex) < std::tie(b.rids, b.pixelIndex);
+    }
+  };
+  std::vector<std::vector<std::pair<int, int>>> xs(width), ys(height);
+  for (int mx = 0; mx < width; mx++) {
+    middleCoords(mx, width, xs[mx]);
+  }
+  for (int my = 0; my < height; my++) {
+    middleCoords(my, height, ys[my]);
+  }
+  const int nstrips = NumRowStrips(height);
+  std::vector<std::vector<BoundaryPixel>> stripBoundaryPixels(nstrips);
+  ParallelForRange(0, nstrips, [&](int sfirst, int slast) {
+    std::vector<std::pair<int, int>> rids;
+    for (int s = sfirst; s < slast; s++) {
+      for (int my = height * s / nstrips; my < height * (s + 1) / nstrips;
+           my++) {
+        for (int mx = 0; mx < width; mx++) {
+          rids.clear();
+          for (auto &y : ys[my]) {
+            for (auto &x : xs[mx]) {
+              int rid1 = segRegions(y.first, x.first);
+              int rid2 = segRegions(y.second, x.second);
+              if (rid1 != rid2) {
+                rids.push_back(MakeOrderedPair(rid1, rid2));
+              }
+            }
+          }
+          if (rids.empty()) {
+            continue;
+          }
+          std::sort(rids.begin(), rids.end());
+          rids.erase(std::unique(rids.begin(), rids.end()), rids.end());
+          for (auto &r : rids) {
+            stripBoundaryPixels[s].push_back(
+                BoundaryPixel{r, Sub2Ind(Pixel(mx, my), width, height)});
+          }
+        }
+      }
+    }
+  });
+  std::vector<BoundaryPixel> boundaryPixels;
+  for (auto &bps : stripBoundaryPixels) {
+    boundaryPixels.insert(boundaryPixels.end(), bps.begin(), bps.end());
+    std::vector<BoundaryPixel>().swap(bps);
+  }
+  std::sort(boundaryPixels.begin(), boundaryPixels.end());
+
+  std::vector<int> pairFirsts;
+  for (int i = 0; i < boundaryPixels.size(); i++) {
+    if (i == 0 || boundaryPixels[i].rids != boundaryPixels[i - 1].rids) {
+      pairFirsts.push_back(i);
+    }
+  }
+  const int npairs = pairFirsts.size();
+  pairFirsts.push_back(boundaryPixels.size());
+
+  // trace chains of each pair, always moving to the first remaining pixel
+  // along the steps, and starting a new chain at the first remaining pixel
+  std::vector<std::vector<BoundaryChain>> pairChains(npairs);
+  ParallelForRange(0, npairs, [&](int first, int last) {
+    // indices of boundary pixels, those out of the current pair are stale
+    Imagei indices(segRegions.size(), -1);
+    std::vector<bool> erased;
+    for (int k = first; k < last; k++) {
+      const int pixelsFirst = pairFirsts[k];
+      const int pixelsLast = pairFirsts[k + 1];
+      for (int i = pixelsFirst; i < pixelsLast; i++) {
+        indices(Ind2Sub(boundaryPixels[i].pixelIndex, width, height)) = i;
+      }
+      erased.assign(pixelsLast - pixelsFirst, false);
+
+      auto &chains = pairChains[k];
+      int nextStart = 0;
+      while (nextStart < erased.size()) {
+        Pixel tail = Ind2Sub(boundaryPixels[pixelsFirst + nextStart].pixelIndex,
+                             width, height);
+        BoundaryChain chain(tail);
+        erased[nextStart] = true;
+        while (true) {
+          bool foundMore = false;
+          for (int dir = 0; dir < BoundaryChain::ndirections; dir++) {
+            Pixel next = tail + BoundaryChain::step(dir);
+            if (!IsBetween(next.x, 0, width) || !IsBetween(next.y, 0, height))
+              continue;
+            int id = indices(next) - pixelsFirst;
+            if (!IsBetween(id, 0, erased.size()) || erased[id])
+              continue;
+            chain.append(dir);
+            erased[id] = true;
+            tail = next;
+            foundMore = true;
+            break;
+          }
+          if (!foundMore)
+            break;
+        }
+        if (chain.npixels() > 1) {
+          chains.push_back(std::move(chain));
+        }
+        while (nextStart < erased.size() && erased[nextStart]) {
+          nextStart++;
+        }
+      }
+    }
+  });
+
+  RegionBoundaryChains result;
+  for (int k = 0; k < npairs; k++) {
+    if (!pairChains[k].empty()) {
+      result.add(boundaryPixels[pairFirsts[k]].rids, std::move(pairChains[k]));
+    }
+  }
+  return result;
+}
+
 std::vector<std::pair<std::vector<int>, Pixel>>
 ExtractBoundaryJunctions(const Imagei &regions, bool crossBorder) {
   std::vector<std::pair<std::vector<int>, Pixel>> junctions;
@@ -1206,6 +1969,196 @@ ExtractBoundaryJunctions(const Imagei &regions, bool crossBorder) {
   return junctions;
 }
 
+namespace {
+// the sorted distinct labels of the 2x2 block starting at (x, y), which wraps
+// around the image borders
+inline int BlockLabels(const Imagei &segs, int x, int y, int labels[4]) {
+  int x1 = (x + 1) % segs.cols, y1 = (y + 1) % segs.rows;
+  labels[0] = segs(y, x);
+  labels[1] = segs(y, x1);
+  labels[2] = segs(y1, x);
+  labels[3] = segs(y1, x1);
+  std::sort(labels, labels + 4);
+  return std::unique(labels, labels + 4) - labels;
+}
+
+// the boundaries traced from a junction to the junctions with larger ids
+struct TracedBoundaries {
+  std::vector<Pixel> pixels;
+  std::vector<int> sizes;
+  std::vector<int> tojuncs;
+  std::vector<std::pair<int, int>> segpairs;
+};
+}
+
+SegmentationTopo::SegmentationTopo(const Imagei &segs, bool crossBorder) {
+  const int width = segs.cols;
+  const int height = segs.rows;
+  const int nsegs = MinMaxValOfImage(segs).second + 1;
+  // blocks starting at the last column/row wrap around
+  const int xend = crossBorder ? width : width - 1;
+  const int yend = crossBorder ? height : height - 1;
+
+  // count junctions in row strips
+  const int nstrips = NumRowStrips(yend);
+  std::vector<int> stripJuncFirst(nstrips + 1, 0);
+  ParallelForRange(0, nstrips, [&](int sfirst, int slast) {
+    int labels[4];
+    for (int s = sfirst; s < slast; s++) {
+      for (int y = yend * s / nstrips; y < yend * (s + 1) / nstrips; y++) {
+        for (int x = 0; x < xend; x++) {
+          stripJuncFirst[s + 1] += BlockLabels(segs, x, y, labels) >= 3;
+        }
+      }
+    }
+  });
+  std::partial_sum(stripJuncFirst.begin(), stripJuncFirst.end(),
+                   stripJuncFirst.begin());
+
+  // fill junctions in the raster order
+  const int njuncs = stripJuncFirst.back();
+  Imagei juncIds(segs.size(), -1);
+  juncpositions.resize(njuncs);
+  junc2segs.resetCounts(njuncs);
+  ParallelForRange(0, nstrips, [&](int sfirst, int slast) {
+    int labels[4];
+    for (int s = sfirst; s < slast; s++) {
+      int juncid = stripJuncFirst[s];
+      for (int y = yend * s / nstrips; y < yend * (s + 1) / nstrips; y++) {
+        for (int x = 0; x < xend; x++) {
+          int nlabels = BlockLabels(segs, x, y, labels);
+          if (nlabels < 3) {
+            continue;
+          }
+          juncIds(y, x) = juncid;
+          juncpositions[juncid] = Pixel(x, y);
+          junc2segs.count(juncid, nlabels);
+          juncid++;
+        }
+      }
+    }
+  });
+  junc2segs.allocate();
+  ParallelForRange(0, njuncs, [&](int first, int last) {
+    int labels[4];
+    for (int i = first; i < last; i++) {
+      const Pixel &p = juncpositions[i];
+      int nlabels = BlockLabels(segs, p.x, p.y, labels);
+      for (int k = 0; k < nlabels; k++) {
+        junc2segs.fill(i, labels[k]);
+      }
+    }
+  });
+
+  seg2juncs.resetCounts(nsegs);
+  for (int i = 0; i < njuncs; i++) {
+    for (int segid : junc2segs[i]) {
+      seg2juncs.count(segid);
+    }
+  }
+  seg2juncs.allocate();
+  for (int i = 0; i < njuncs; i++) {
+    for (int segid : junc2segs[i]) {
+      seg2juncs.fill(segid, i);
+    }
+  }
+
+  // trace the boundary of each seg pair of each junction by BFS over the
+  // blocks holding both segs, until meeting a junction with a larger id
+  std::vector<TracedBoundaries> traced(njuncs);
+  ParallelForRange(0, njuncs, [&](int first, int last) {
+    Imagei visited(segs.size(), -1);
+    int stamp = 0;
+    std::vector<Pixel> Q;
+    int labels[4];
+    for (int i = first; i < last; i++) {
+      auto relatedSegIds = junc2segs[i];
+      auto &result = traced[i];
+      for (int ii = 0; ii < relatedSegIds.size(); ii++) {
+        for (int jj = ii + 1; jj < relatedSegIds.size(); jj++) {
+          int segi = relatedSegIds[ii];
+          int segj = relatedSegIds[jj];
+          stamp++;
+          Q.clear();
+          Q.push_back(juncpositions[i]);
+          visited(juncpositions[i]) = stamp;
+          for (int head = 0; head < Q.size(); head++) {
+            Pixel curp = Q[head];
+            if (juncIds(curp) > i) { // find another junc!
+              result.pixels.insert(result.pixels.end(), Q.begin(),
+                                   Q.begin() + head + 1);
+              result.sizes.push_back(head + 1);
+              result.tojuncs.push_back(juncIds(curp));
+              result.segpairs.emplace_back(segi, segj);
+              break;
+            }
+            for (int x = -1; x <= 1; x++) {
+              for (int y = -1; y <= 1; y++) {
+                Pixel nextp = curp + Pixel(x, y);
+                if (nextp.x < 0 || nextp.x >= xend || nextp.y < 0 ||
+                    nextp.y >= yend || visited(nextp) == stamp) {
+                  continue;
+                }
+                int nlabels = BlockLabels(segs, nextp.x, nextp.y, labels);
+                if (!std::binary_search(labels, labels + nlabels, segi) ||
+                    !std::binary_search(labels, labels + nlabels, segj)) {
+                  continue;
+                }
+                Q.push_back(nextp);
+                visited(nextp) = stamp;
+              }
+            }
+          }
+        }
+      }
+    }
+  }, -1, 16);
+
+  // concatenate boundaries in the junction order
+  std::vector<int> juncBndFirst(njuncs + 1, 0);
+  for (int i = 0; i < njuncs; i++) {
+    juncBndFirst[i + 1] = juncBndFirst[i] + traced[i].sizes.size();
+  }
+  const int nbnds = juncBndFirst.back();
+  bnd2juncs.resize(nbnds);
+  bnd2segs.resize(nbnds);
+  bndpixels.resetCounts(nbnds);
+  for (int i = 0; i < njuncs; i++) {
+    for (int k = 0; k < traced[i].sizes.size(); k++) {
+      int bndid = juncBndFirst[i] + k;
+      bnd2juncs[bndid] = std::make_pair(i, traced[i].tojuncs[k]);
+      bnd2segs[bndid] = traced[i].segpairs[k];
+      bndpixels.count(bndid, traced[i].sizes[k]);
+    }
+  }
+  bndpixels.allocate();
+  ParallelForRange(0, njuncs, [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      if (!traced[i].pixels.empty()) {
+        std::copy(traced[i].pixels.begin(), traced[i].pixels.end(),
+                  bndpixels[juncBndFirst[i]].begin());
+      }
+    }
+  });
+
+  seg2bnds.resetCounts(nsegs);
+  junc2bnds.resetCounts(njuncs);
+  for (int bndid = 0; bndid < nbnds; bndid++) {
+    seg2bnds.count(bnd2segs[bndid].first);
+    seg2bnds.count(bnd2segs[bndid].second);
+    junc2bnds.count(bnd2juncs[bndid].first);
+    junc2bnds.count(bnd2juncs[bndid].second);
+  }
+  seg2bnds.allocate();
+  junc2bnds.allocate();
+  for (int bndid = 0; bndid < nbnds; bndid++) {
+    seg2bnds.fill(bnd2segs[bndid].first, bndid);
+    seg2bnds.fill(bnd2segs[bndid].second, bndid);
+    junc2bnds.fill(bnd2juncs[bndid].first, bndid);
+    junc2bnds.fill(bnd2juncs[bndid].second, bndid);
+  }
+}
+
 void ExtractSegmentationTopology(const Imagei &segs,
                                  std::vector<std::vector<Pixel>> &bndpixels,
                                  std::vector<Pixel> &juncpositions,
@@ -1216,143 +2169,136 @@ void ExtractSegmentationTopology(const Imagei &segs,
                                  std::vector<std::pair<int, int>> &bnd2juncs,
                                  std::vector<std::vector<int>> &junc2bnds,
                                  bool crossBorder) {
+  SegmentationTopo topo(segs, crossBorder);
+  bndpixels = topo.bndpixels.evalAsStdVectors();
+  juncpositions = std::move(topo.juncpositions);
+  seg2bnds = topo.seg2bnds.evalAsStdVectors();
+  bnd2segs = std::move(topo.bnd2segs);
+  seg2juncs = topo.seg2juncs.evalAsStdVectors();
+  junc2segs = topo.junc2segs.evalAsStdVectors();
+  bnd2juncs = std::move(topo.bnd2juncs);
+  junc2bnds = topo.junc2bnds.evalAsStdVectors();
+}
 
-  bndpixels.clear();
-  juncpositions.clear();
-  seg2bnds.clear();
-  seg2juncs.clear();
-  bnd2segs.clear();
-  bnd2juncs.clear();
-  junc2segs.clear();
-  junc2bnds.clear();
+CleanupSegmentation &CleanupSegmentation::removeThinRegions(int widthThres) {
+  _rules.push_back(Rule{ThinRegions, widthThres, 0.0, false});
+  return *this;
+}
 
-  int width = segs.cols;
-  int height = segs.rows;
-  int nsegs = MinMaxValOfImage(segs).second + 1;
+CleanupSegmentation &
+CleanupSegmentation::removeSmallRegions(double areaThres, bool panoWeights) {
+  _rules.push_back(Rule{SmallRegions, 0, areaThres, panoWeights});
+  return *this;
+}
 
-  seg2bnds.resize(nsegs);
-  seg2juncs.resize(nsegs);
+CleanupSegmentation &CleanupSegmentation::removeDanglingPixels() {
+  _rules.push_back(Rule{DanglingPixels, 0, 0.0, false});
+  return *this;
+}
 
-  std::map<std::set<int>, std::vector<int>> segs2juncs;
-  std::map<std::pair<int, int>, std::set<Pixel>> segpair2pixels;
-  std::map<Pixel, std::set<int>> pixel2segs;
-  std::map<Pixel, int> pixel2junc;
+CleanupSegmentation &CleanupSegmentation::removeEmbededRegions() {
+  _rules.push_back(Rule{EmbededRegions, 0, 0.0, false});
+  return *this;
+}
 
-  for (auto it = segs.begin(); it != segs.end(); ++it) {
-    auto p = it.pos();
-    if (p.x == segs.cols - 1 && !crossBorder)
-      continue;
-    if (p.y == segs.rows - 1 && !crossBorder)
-      continue;
+int CleanupSegmentation::operator()(Imagei &segs) const {
+  // rules on regions relabel the regions of the graph by labelMap, which is
+  // applied to the pixels before any rule on pixels
+  std::unique_ptr<RegionAdjacencyGraph> rag;
+  std::vector<int> labelMap;
+  auto applyLabelMap = [&]() {
+    if (rag) {
+      for (int &seg : segs) {
+        seg = labelMap[seg];
+      }
+      rag.reset();
+    }
+  };
+  auto buildGraph = [&]() {
+    if (!rag) {
+      rag = std::make_unique<RegionAdjacencyGraph>(segs, _crossBorder);
+      labelMap.resize(rag->nlabels);
+      std::iota(labelMap.begin(), labelMap.end(), 0);
+    }
+  };
 
-    // seg ids related
-    std::set<int> idset = {
-        segs(p), segs(Pixel((p.x + 1) % segs.cols, p.y)),
-        segs(Pixel(p.x, (p.y + 1) % segs.rows)),
-        segs(Pixel((p.x + 1) % segs.cols, (p.y + 1) % segs.rows))};
+  for (auto &rule : _rules) {
+    switch (rule.type) {
+    case ThinRegions:
+      applyLabelMap();
+      RemoveThinRegionInSegmentation(segs, rule.widthThres, _crossBorder);
+      break;
+    case DanglingPixels:
+      applyLabelMap();
+      RemoveDanglingPixelsInSegmentation(segs, _crossBorder);
+      break;
+    case SmallRegions:
+      buildGraph();
+      RelabelSmallRegions(*rag, labelMap, rule.areaThres, rule.panoWeights);
+      break;
+    case EmbededRegions:
+      buildGraph();
+      RelabelEmbededRegions(*rag, labelMap);
+      break;
+    }
+  }
+  return NumberConnectedComponents(segs, _crossBorder,
+                                   rag ? &labelMap : nullptr);
+}
 
-    if (idset.size() <= 1) {
+template <class IsCutT>
+int SegmentationHierarchy::cutIf(size_t nmerges, IsCutT isCut,
+                                 Imagei &segs) const {
+  assert(nmerges <= _merges.size());
+  std::vector<int> parents(_width * _height);
+  std::iota(parents.begin(), parents.end(), 0);
+  auto find = [&parents](int i) {
+    while (parents[i] != i) {
+      i = parents[i] = parents[parents[i]];
+    }
+    return i;
+  };
+  for (size_t i = 0; i < nmerges; i++) {
+    if (!isCut(i)) {
       continue;
     }
-
-    // meet a bnd or a junc (and bnd) pixel
-    pixel2segs[p] = std::move(idset);
-    auto &relatedsegs = pixel2segs[p];
-
-    // register this pixel as a bnd candidate for bnd of related segids
-    for (auto ii = relatedsegs.begin(); ii != relatedsegs.end(); ++ii) {
-      for (auto jj = std::next(ii); jj != relatedsegs.end(); ++jj) {
-        segpair2pixels[MakeOrderedPair(*ii, *jj)].insert(p);
-      }
+    int a = find(_merges[i].first);
+    int b = find(_merges[i].second);
+    if (a != b) {
+      parents[std::max(a, b)] = std::min(a, b);
     }
+  }
 
-    // meet a junc
-    if (relatedsegs.size() >= 3) {
-      // create a new junc
-      juncpositions.push_back(p);
-      int newjuncid = juncpositions.size() - 1;
-      pixel2junc[p] = newjuncid;
-      segs2juncs[relatedsegs].push_back(newjuncid);
-      for (int segid : relatedsegs) {
-        seg2juncs[segid].push_back(newjuncid);
-      }
-      junc2segs.emplace_back(relatedsegs.begin(), relatedsegs.end());
-    }
-  }
-
-  junc2bnds.resize(juncpositions.size());
-
-  // connect different junctions using allbndpixels
-  // and thus generate seperated bnds
-  for (int i = 0; i < juncpositions.size(); i++) {
-    auto &juncpos = juncpositions[i];
-    auto &relatedSegIds = junc2segs[i];
-
-    for (int ii = 0; ii < relatedSegIds.size(); ii++) {
-      for (int jj = ii + 1; jj < relatedSegIds.size(); jj++) {
-        int segi = relatedSegIds[ii];
-        int segj = relatedSegIds[jj];
-
-        const auto &pixelsForThisSegPair =
-            segpair2pixels.at(MakeOrderedPair(segi, segj));
-        std::vector<Pixel> pixelsForThisBnd;
-
-        std::set<Pixel> visitedPixels;
-
-        // use BFS
-        std::queue<Pixel> Q;
-        Q.push(juncpos);
-        visitedPixels.insert(juncpos);
-
-        while (!Q.empty()) {
-          auto curp = Q.front();
-          pixelsForThisBnd.push_back(curp);
-
-          // find another junc!
-          if (Contains(pixel2junc, curp) && i < pixel2junc.at(curp) &&
-              !pixelsForThisBnd.empty()) {
-            int tojuncid = pixel2junc.at(curp);
-            // make a new bnd!
-            bndpixels.push_back(std::move(pixelsForThisBnd));
-            int newbndid = bndpixels.size() - 1;
-            bnd2juncs.emplace_back(i, tojuncid);
-            bnd2segs.emplace_back(segi, segj);
-            junc2bnds[i].push_back(newbndid);
-            junc2bnds[tojuncid].push_back(newbndid);
-            seg2bnds[segi].push_back(newbndid);
-            seg2bnds[segj].push_back(newbndid);
-            break;
-          }
-
-          Q.pop();
-          for (int x = -1; x <= 1; x++) {
-            for (int y = -1; y <= 1; y++) {
-              auto nextp = curp + Pixel(x, y);
-              if (!Contains(segs.size(), nextp) && !crossBorder) {
-                continue;
-              }
-              if (!Contains(pixelsForThisSegPair, nextp)) {
-                continue;
-              }
-              nextp.x = (nextp.x + width) % width;
-              nextp.y = (nextp.y + height) % height;
-              if (Contains(visitedPixels, nextp)) {
-                continue;
-              }
-              Q.push(nextp);
-              visitedPixels.insert(nextp);
-            }
-          }
-        }
+  segs = Imagei(_height, _width);
+  std::vector<int> compLabels(_width * _height, -1);
+  int ncomps = 0;
+  for (int y = 0; y < _height; y++) {
+    int *row = segs[y];
+    for (int x = 0; x < _width; x++) {
+      int &comp = compLabels[find(Sub2Ind(Pixel(x, y), _width, _height))];
+      if (comp == -1) {
+        comp = ncomps++;
       }
+      row[x] = comp;
     }
   }
+  return ncomps;
 }
 
-SegmentationTopo::SegmentationTopo(const Imagei &segs, bool crossBorder) {
-  core::ExtractSegmentationTopology(segs, bndpixels, juncpositions, seg2bnds,
-                                    bnd2segs, seg2juncs, junc2segs, bnd2juncs,
-                                    junc2bnds, crossBorder);
+int SegmentationHierarchy::cut(size_t nmerges, Imagei &segs) const {
+  return cutIf(nmerges, [](size_t) { return true; }, segs);
+}
+
+int SegmentationHierarchy::cutAtLevel(double level, Imagei &segs) const {
+  return cutIf(_merges.size(),
+               [this, level](size_t i) { return _levels[i] <= float(level); },
+               segs);
+}
+
+int SegmentationHierarchy::cutToSegmentNumber(int nsegs, Imagei &segs) const {
+  int npixels = _width * _height;
+  return cut(std::min<size_t>(std::max(npixels - nsegs, 0), _merges.size()),
+             segs);
+}
 }
 }
-}
\ No newline at end of file
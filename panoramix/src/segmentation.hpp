@@ -1,6 +1,7 @@
 #pragma once
 
 #include "basic_types.hpp"
+#include "containers.hpp"
 
 namespace pano {
 namespace core {
@@ -17,7 +18,8 @@ public:
     inline Params()
         : sigma(0.8f), c(100.0f), minSize(200), algorithm(GraphCut),
           superpixelSizeSuggestion(1000), superpixelNumberSuggestion(100),
-          useYUVColorSpace(false) {}
+          useYUVColorSpace(false), graphCutTileNumber(1),
+          quickShiftSigma(6.0f), quickShiftTau(10.0f) {}
     float sigma; // for smoothing
     float c;     // threshold function
     int minSize; // min component size
@@ -27,9 +29,43 @@ public:
     int superpixelNumberSuggestion; // use superpixel number suggestion if
                                     // [superpixelSizeSuggestion < 0]
     bool useYUVColorSpace;
-    template <class Archive> inline void serialize(Archive &ar) {
+    int graphCutTileNumber; // merge [graphCutTileNumber] overlapping vertical
+                            // tiles in parallel, then reconcile the tile
+                            // borders if [graphCutTileNumber > 1]
+    float quickShiftSigma; // kernel size of the density
+    float quickShiftTau;   // max distance to the parent
+
+    // version 1 adds graphCutTileNumber and starts with archiveMagic, version
+    // 2 adds quickShiftSigma and quickShiftTau, which keep their defaults when
+    // version 1 is loaded, params of other versions or without the magic are
+    // rejected, the unversioned ones read their first fields as the version
+    // and the magic
+    static constexpr std::uint64_t archiveMagic = 0x6D61726150676553ull;
+    template <class Archive>
+    inline void save(Archive &ar, const std::uint32_t version) const {
+      std::uint64_t magic = archiveMagic;
+      ar(magic);
+      ar(sigma, c, minSize, algorithm, superpixelSizeSuggestion,
+         superpixelNumberSuggestion, useYUVColorSpace, graphCutTileNumber);
+      ar(quickShiftSigma, quickShiftTau);
+    }
+    template <class Archive>
+    inline void load(Archive &ar, const std::uint32_t version) {
+      if (version != 1 && version != 2) {
+        throw std::runtime_error(
+            "SegmentationExtractor::Params of an old version is not loaded");
+      }
+      std::uint64_t magic = 0;
+      ar(magic);
+      if (magic != archiveMagic) {
+        throw std::runtime_error(
+            "SegmentationExtractor::Params archive is not recognized");
+      }
       ar(sigma, c, minSize, algorithm, superpixelSizeSuggestion,
-         superpixelNumberSuggestion, useYUVColorSpace);
+         superpixelNumberSuggestion, useYUVColorSpace, graphCutTileNumber);
+      if (version >= 2) {
+        ar(quickShiftSigma, quickShiftTau);
+      }
     }
   };
 
@@ -53,7 +89,15 @@ private:
   Params _params;
 };
 
+// ThinRegionInsiders
+// whether all the pixels within the (2 * radius + 1)^2 window of each pixel
+// share its label, the window wraps around horizontally if crossBorder
+Imageb ThinRegionInsiders(const Imagei &segs, int radius,
+                          bool crossBorder = false);
+
 // RemoveThinRegionInSegmentation
+// pixels that are not insiders take the label of the nearest insiders
+// around them
 void RemoveThinRegionInSegmentation(Imagei &segs, int widthThres = 1.0,
                                     bool crossBorder = false);
 
@@ -73,11 +117,232 @@ int DensifySegmentation(Imagei &segs, bool crossBorder = false);
 // IsDenseSegmentation
 bool IsDenseSegmentation(const Imagei &segRegions);
 
+// CleanupSegmentation
+// applies the clean up rules in the order they are added and densifies the
+// result, the same as calling the Remove*InSegmentation functions in order
+// followed by DensifySegmentation, but the rules on whole regions (small and
+// embeded regions) share one region adjacency graph and only relabel regions,
+// pixels are relabeled once at the end
+class CleanupSegmentation {
+public:
+  explicit CleanupSegmentation(bool crossBorder = false)
+      : _crossBorder(crossBorder) {}
+
+  CleanupSegmentation &removeThinRegions(int widthThres = 1);
+  CleanupSegmentation &removeSmallRegions(double areaThres,
+                                          bool panoWeights = false);
+  CleanupSegmentation &removeDanglingPixels();
+  CleanupSegmentation &removeEmbededRegions();
+
+  // returns the number of segments
+  int operator()(Imagei &segs) const;
+
+private:
+  enum RuleType { ThinRegions, SmallRegions, DanglingPixels, EmbededRegions };
+  struct Rule {
+    RuleType type;
+    int widthThres;
+    double areaThres;
+    bool panoWeights;
+  };
+  bool _crossBorder;
+  std::vector<Rule> _rules;
+};
+
+// SegmentationHierarchy
+// the ordered merges of a graph based segmentation of pixels (indexed by
+// Sub2Ind), with the weights of the edges they join as their levels, label
+// maps of different granularities are cut from it in O(pixels) without
+// recomputing edges
+// the first merges of a hierarchy are the states of the segmentation run, up
+// to those of its result, the levels of merges are not ordered since merges of
+// small segments and those after the result may join lighter edges than the
+// earlier ones, so a cut at a level is not a cut of the first merges
+class SegmentationHierarchy {
+public:
+  SegmentationHierarchy() : _width(0), _height(0), _nmergesOfSegmentation(0) {}
+  SegmentationHierarchy(int width, int height)
+      : _width(width), _height(height), _nmergesOfSegmentation(0) {}
+
+  int width() const { return _width; }
+  int height() const { return _height; }
+  size_t nmerges() const { return _merges.size(); }
+  float level(size_t i) const { return _levels[i]; }
+
+  // ind1 and ind2 should be in different components
+  void merge(int ind1, int ind2, double level) {
+    _merges.emplace_back(ind1, ind2);
+    _levels.push_back(float(level));
+  }
+  // mark the merges so far as those of the segmentation result
+  void markSegmentation() { _nmergesOfSegmentation = _merges.size(); }
+  size_t nmergesOfSegmentation() const { return _nmergesOfSegmentation; }
+
+  // label maps with the first nmerges merges, labels are numbered by the
+  // first pixels in scan order, returns the number of segments
+  int cut(size_t nmerges, Imagei &segs) const;
+  // label map with all the merges of levels up to level, the components of
+  // pixels joined by the merged edges no heavier than level
+  int cutAtLevel(double level, Imagei &segs) const;
+  int cutToSegmentNumber(int nsegs, Imagei &segs) const;
+  int cutSegmentation(Imagei &segs) const {
+    return cut(_nmergesOfSegmentation, segs);
+  }
+
+  template <class Archiver> void serialize(Archiver &ar) {
+    ar(_width, _height, _merges, _levels, _nmergesOfSegmentation);
+  }
+
+private:
+  template <class IsCutT>
+  int cutIf(size_t nmerges, IsCutT isCut, Imagei &segs) const;
+
+  int _width, _height;
+  std::vector<std::pair<int, int>> _merges;
+  std::vector<float> _levels;
+  size_t _nmergesOfSegmentation;
+};
+
 // FindRegionBoundaries
 std::map<std::pair<int, int>, std::vector<std::vector<Pixel>>>
 FindRegionBoundaries(const Imagei &segRegions, int connectionExtendSize,
                      bool simplifyStraightEdgePixels = true);
 
+// BoundaryChain
+// a boundary stored as its start pixel and chain codes, each code is a
+// direction (the upper 4 bits) of the steps used by FindRegionBoundaries and
+// the length - 1 (the lower 4 bits) of a straight run along it
+class BoundaryChain {
+public:
+  BoundaryChain() : _npixels(0) {}
+  explicit BoundaryChain(const Pixel &start) : _start(start), _npixels(1) {}
+
+  static const int ndirections = 12;
+  static Pixel step(int dir) {
+    static const int xdirs[] = {1, 0, -1, 0, -1, 1, 1, -1, 0, 0, 2, -2};
+    static const int ydirs[] = {0, 1, 0, -1, 1, -1, 1, -1, 2, -2, 0, 0};
+    return Pixel(xdirs[dir], ydirs[dir]);
+  }
+
+  // extends the last run if it goes along dir
+  void append(int dir) {
+    if (!_codes.empty() && (_codes.back() >> 4) == dir &&
+        (_codes.back() & 0xf) < 0xf) {
+      _codes.back()++;
+    } else {
+      _codes.push_back(uint8_t(dir << 4));
+    }
+    _npixels++;
+  }
+
+  const Pixel &start() const { return _start; }
+  size_t npixels() const { return _npixels; }
+  const std::vector<uint8_t> &codes() const { return _codes; }
+
+  // fun(const Pixel &) on all the pixels
+  template <class FunT> void forEachPixel(FunT &&fun) const {
+    Pixel p = _start;
+    fun(p);
+    for (uint8_t code : _codes) {
+      Pixel s = step(code >> 4);
+      for (int i = 0; i <= (code & 0xf); i++) {
+        p += s;
+        fun(p);
+      }
+    }
+  }
+  std::vector<Pixel> pixels() const {
+    std::vector<Pixel> ps;
+    ps.reserve(_npixels);
+    forEachPixel([&ps](const Pixel &p) { ps.push_back(p); });
+    return ps;
+  }
+  // the pixels where the direction changes, i.e. straight runs simplified
+  std::vector<Pixel> vertices() const {
+    std::vector<Pixel> vs = {_start};
+    Pixel p = _start;
+    for (int i = 0; i < _codes.size(); i++) {
+      p += step(_codes[i] >> 4) * ((_codes[i] & 0xf) + 1);
+      if (i + 1 == _codes.size() || (_codes[i + 1] >> 4) != (_codes[i] >> 4)) {
+        vs.push_back(p);
+      }
+    }
+    return vs;
+  }
+
+  template <class Archiver> void serialize(Archiver &ar) {
+    ar(_start, _npixels, _codes);
+  }
+
+private:
+  Pixel _start;
+  size_t _npixels;
+  std::vector<uint8_t> _codes;
+};
+
+// RegionBoundaryChains
+// boundary chains of adjacent region pairs, chains of a pair are stored
+// consecutively and located by a flat hash map
+class RegionBoundaryChains {
+public:
+  using RegionPair = std::pair<int, int>;
+  struct RegionPairHash {
+    size_t operator()(const RegionPair &p) const {
+      uint64_t h = (uint64_t(uint32_t(p.first)) << 32) | uint32_t(p.second);
+      h *= 0x9e3779b97f4a7c15ull;
+      return size_t(h ^ (h >> 29));
+    }
+  };
+  using ChainRange = Range<std::vector<BoundaryChain>::const_iterator>;
+
+  size_t npairs() const { return _pairs.size(); }
+  size_t nchains() const { return _chains.size(); }
+  const std::vector<RegionPair> &pairs() const { return _pairs; }
+  const std::vector<BoundaryChain> &chains() const { return _chains; }
+
+  // empty if the two regions are not adjacent
+  ChainRange chainsOf(int rid1, int rid2) const {
+    auto *range = _ranges.find(MakeOrderedPair(rid1, rid2));
+    if (!range) {
+      return ChainRange(_chains.end(), _chains.end());
+    }
+    return ChainRange(_chains.begin() + range->first,
+                      _chains.begin() + range->second);
+  }
+
+  // fun(const RegionPair &, ChainRange), in the order of region pairs
+  template <class FunT> void forEach(FunT &&fun) const {
+    for (auto &p : _pairs) {
+      fun(p, chainsOf(p.first, p.second));
+    }
+  }
+
+  // chains of a pair must be added at once
+  void add(const RegionPair &p, std::vector<BoundaryChain> &&chains) {
+    assert(!_ranges.contains(p));
+    _pairs.push_back(p);
+    _ranges[p] = std::make_pair(int(_chains.size()),
+                                int(_chains.size() + chains.size()));
+    _chains.insert(_chains.end(), std::make_move_iterator(chains.begin()),
+                   std::make_move_iterator(chains.end()));
+  }
+
+  template <class Archiver> void serialize(Archiver &ar) {
+    ar(_pairs, _ranges, _chains);
+  }
+
+private:
+  std::vector<RegionPair> _pairs;
+  FlatHashMap<RegionPair, std::pair<int, int>, RegionPairHash> _ranges;
+  std::vector<BoundaryChain> _chains;
+};
+
+// FindRegionBoundaryChains
+// same boundaries as FindRegionBoundaries (without simplification) stored as
+// chains, use BoundaryChain::vertices() to simplify straight runs
+RegionBoundaryChains FindRegionBoundaryChains(const Imagei &segRegions,
+                                              int connectionExtendSize);
+
 // ExtractBoundaryJunctions
 std::vector<std::pair<std::vector<int>, Pixel>>
 ExtractBoundaryJunctions(const Imagei &regions, bool crossBorder = false);
@@ -95,15 +360,17 @@ void ExtractSegmentationTopology(const Imagei &segs,
                                  bool crossBorder = false);
 
 // SegmentationTopo
+// the relations are stored in compressed rows, which are filled in parallel
+// by counting first
 struct SegmentationTopo {
-  std::vector<std::vector<Pixel>> bndpixels;
+  CompressedRows<Pixel> bndpixels;
   std::vector<Pixel> juncpositions;
-  std::vector<std::vector<int>> seg2bnds;
+  CompressedRows<int> seg2bnds;
   std::vector<std::pair<int, int>> bnd2segs;
-  std::vector<std::vector<int>> seg2juncs;
-  std::vector<std::vector<int>> junc2segs;
+  CompressedRows<int> seg2juncs;
+  CompressedRows<int> junc2segs;
   std::vector<std::pair<int, int>> bnd2juncs;
-  std::vector<std::vector<int>> junc2bnds;
+  CompressedRows<int> junc2bnds;
 
   SegmentationTopo() {}
   explicit SegmentationTopo(const Imagei &segs, bool corssBorder = false);
@@ -119,3 +386,5 @@ struct SegmentationTopo {
 };
 }
 }
+
+CEREAL_CLASS_VERSION(pano::core::SegmentationExtractor::Params, 2);
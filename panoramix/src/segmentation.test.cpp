@@ -152,4 +152,344 @@ TEST(SegmentationTest, ExtractSegmentationTopology) {
       .thickness(2)
       .add(bndpixels)
       .show();
-}
\ No newline at end of file
+}
+namespace {
+// the fraction of pixels covered by the best matching segments of gt
+double AchievableSegmentationAccuracy(const core::Imagei &segs, int nsegs,
+                                      const core::Imagei &gt, int ngt) {
+  std::vector<std::vector<int>> overlaps(nsegs, std::vector<int>(ngt, 0));
+  for (auto it = segs.begin(); it != segs.end(); ++it) {
+    overlaps[*it][gt(it.pos())]++;
+  }
+  int covered = 0;
+  for (auto &o : overlaps) {
+    covered += *std::max_element(o.begin(), o.end());
+  }
+  return double(covered) / segs.total();
+}
+}
+
+TEST(SegmentationTest, TileParallelGraphCut) {
+  // blocks of colors with noise
+  core::Image3ub im(300, 600);
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    int bx = it.pos().x * 7 / im.cols, by = it.pos().y * 4 / im.rows;
+    *it = core::Vec3ub((bx * 37 + by * 91) % 256, (bx * 53 + by * 17) % 256,
+                       (bx * 11 + by * 71) % 256);
+  }
+  cv::Mat noise(im.size(), CV_16SC3);
+  cv::RNG rng(0);
+  rng.fill(noise, cv::RNG::NORMAL, 0, 4);
+  cv::add(im, noise, im, cv::noArray(), CV_8U);
+
+  for (bool isPanorama : {false, true}) {
+    core::SegmentationExtractor::Params p;
+    p.c = 100;
+    p.minSize = 50;
+    p.sigma = 1;
+    core::Imagei serial;
+    int nserial = 0;
+    std::tie(serial, nserial) = core::SegmentationExtractor(p)(im, isPanorama);
+    for (int ntiles : {2, 3, 8}) {
+      p.graphCutTileNumber = ntiles;
+      core::Imagei tiled;
+      int ntiled = 0;
+      std::tie(tiled, ntiled) = core::SegmentationExtractor(p)(im, isPanorama);
+      EXPECT_TRUE(core::IsDenseSegmentation(tiled));
+      EXPECT_NEAR(nserial, ntiled, nserial * 0.1);
+      EXPECT_GT(AchievableSegmentationAccuracy(tiled, ntiled, serial, nserial),
+                0.99);
+      EXPECT_GT(AchievableSegmentationAccuracy(serial, nserial, tiled, ntiled),
+                0.99);
+    }
+  }
+}
+
+TEST(SegmentationTest, SLICPanorama) {
+  // vertical bands of colors, one of which crosses the left/right seam
+  core::Image3ub im(300, 600);
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    int band = (it.pos().x + 40) % im.cols * 5 / im.cols;
+    *it = core::Vec3ub(band * 50, 255 - band * 40, (band * 90) % 256);
+  }
+
+  core::SegmentationExtractor::Params p;
+  p.algorithm = core::SegmentationExtractor::SLIC;
+  p.superpixelSizeSuggestion = 1000;
+  for (bool isPanorama : {false, true}) {
+    core::Imagei segs;
+    int nsegs = 0;
+    std::tie(segs, nsegs) = core::SegmentationExtractor(p)(im, isPanorama);
+    EXPECT_TRUE(core::IsDenseSegmentation(segs));
+    EXPECT_NEAR(nsegs, im.total() / p.superpixelSizeSuggestion,
+                im.total() / p.superpixelSizeSuggestion * 0.5);
+    // superpixels cross the seam only for panoramas
+    int nseamSegs = 0;
+    for (int y = 0; y < im.rows; y++) {
+      nseamSegs += segs(y, 0) == segs(y, im.cols - 1);
+    }
+    if (isPanorama) {
+      EXPECT_GT(nseamSegs, 0);
+    } else {
+      EXPECT_EQ(0, nseamSegs);
+    }
+  }
+}
+
+TEST(SegmentationTest, QuickShiftCPU) {
+  // blocks of colors, the left and right blocks have the same color
+  core::Image3ub im(90, 180);
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    int bx = (it.pos().x + 20) % im.cols * 3 / im.cols;
+    int by = it.pos().y * 2 / im.rows;
+    *it = core::Vec3ub(bx * 100, by * 200, 255 - bx * 60);
+  }
+
+  core::SegmentationExtractor::Params p;
+  p.algorithm = core::SegmentationExtractor::QuickShiftCPU;
+  for (bool isPanorama : {false, true}) {
+    core::Imagei segs;
+    int nsegs = 0;
+    std::tie(segs, nsegs) = core::SegmentationExtractor(p)(im, isPanorama);
+    EXPECT_TRUE(core::IsDenseSegmentation(segs));
+    // no segment crosses the color borders
+    for (auto it = segs.begin(); it != segs.end(); ++it) {
+      core::Pixel right(it.pos().x + 1, it.pos().y);
+      core::Pixel down(it.pos().x, it.pos().y + 1);
+      if (right.x < im.cols && im(right) != im(it.pos())) {
+        EXPECT_NE(segs(right), *it);
+      }
+      if (down.y < im.rows && im(down) != im(it.pos())) {
+        EXPECT_NE(segs(down), *it);
+      }
+    }
+    // the block crossing the seam is one segment only for panoramas
+    EXPECT_EQ(isPanorama, segs(0, 0) == segs(0, im.cols - 1));
+  }
+}
+
+TEST(SegmentationTest, CleanupSegmentation) {
+  // blocks with noisy labels
+  core::Imagei segs(120, 240);
+  cv::RNG rng(0);
+  for (auto it = segs.begin(); it != segs.end(); ++it) {
+    int block = it.pos().y / 20 * 12 + it.pos().x / 20;
+    *it = rng.uniform(0.0, 1.0) < 0.1 ? rng.uniform(0, 12 * 6) : block;
+  }
+
+  for (bool crossBorder : {false, true}) {
+    // thin, embeded
+    {
+      core::Imagei expected = segs.clone();
+      core::RemoveThinRegionInSegmentation(expected, 1, crossBorder);
+      core::RemoveEmbededRegionsInSegmentation(expected, crossBorder);
+      int nexpected = core::DensifySegmentation(expected, crossBorder);
+
+      core::Imagei result = segs.clone();
+      int n = core::CleanupSegmentation(crossBorder)
+                  .removeThinRegions(1)
+                  .removeEmbededRegions()(result);
+      EXPECT_EQ(nexpected, n);
+      EXPECT_EQ(0, cv::countNonZero(expected != result));
+      EXPECT_TRUE(core::IsDenseSegmentation(result));
+    }
+    // embeded, small, embeded, dangling, small
+    {
+      core::Imagei expected = segs.clone();
+      core::RemoveEmbededRegionsInSegmentation(expected, crossBorder);
+      core::RemoveSmallRegionInSegmentation(expected, 30);
+      core::RemoveEmbededRegionsInSegmentation(expected, crossBorder);
+      core::RemoveDanglingPixelsInSegmentation(expected, crossBorder);
+      core::RemoveSmallRegionInSegmentation(expected, 100, true);
+      int nexpected = core::DensifySegmentation(expected, crossBorder);
+
+      core::Imagei result = segs.clone();
+      int n = core::CleanupSegmentation(crossBorder)
+                  .removeEmbededRegions()
+                  .removeSmallRegions(30)
+                  .removeEmbededRegions()
+                  .removeDanglingPixels()
+                  .removeSmallRegions(100, true)(result);
+      EXPECT_EQ(nexpected, n);
+      EXPECT_EQ(0, cv::countNonZero(expected != result));
+    }
+  }
+}
+
+TEST(SegmentationTest, RemoveThinRegionInSegmentationStripes) {
+  // two regions split by a 1 pixel wide stripe and a 6 pixel wide stripe, the
+  // left region continues across the seam
+  core::Imagei segs(20, 40, 0);
+  segs.colRange(10, 11).setTo(1);
+  segs.colRange(11, 25).setTo(2);
+  segs.colRange(25, 31).setTo(3);
+
+  for (bool crossBorder : {false, true}) {
+    core::Imagei result = segs.clone();
+    core::RemoveThinRegionInSegmentation(result, 1, crossBorder);
+    EXPECT_EQ(0, cv::countNonZero(result == 1));
+    EXPECT_EQ(6 * segs.rows, cv::countNonZero(result == 3));
+    EXPECT_EQ(0, cv::countNonZero(result(cv::Rect(0, 0, 10, 20)) != 0));
+    EXPECT_EQ(0, cv::countNonZero(result(cv::Rect(31, 0, 9, 20)) != 0));
+  }
+}
+
+TEST(SegmentationTest, ThinRegionInsidersRandom) {
+  // random rectangles of a few labels, some of them wrap around the seam
+  std::mt19937 rng(42);
+  for (int k = 0; k < 20; k++) {
+    core::Imagei segs(std::uniform_int_distribution<int>(8, 40)(rng),
+                      std::uniform_int_distribution<int>(8, 60)(rng), 0);
+    int nrects = std::uniform_int_distribution<int>(3, 30)(rng);
+    for (int i = 0; i < nrects; i++) {
+      int label = std::uniform_int_distribution<int>(0, 3)(rng);
+      int x0 = std::uniform_int_distribution<int>(0, segs.cols - 1)(rng);
+      int y0 = std::uniform_int_distribution<int>(0, segs.rows - 1)(rng);
+      int w = std::uniform_int_distribution<int>(1, segs.cols / 2)(rng);
+      int h = std::uniform_int_distribution<int>(1, segs.rows / 2)(rng);
+      for (int y = y0; y < std::min(y0 + h, segs.rows); y++) {
+        for (int x = x0; x < x0 + w; x++) {
+          segs(y, x % segs.cols) = label;
+        }
+      }
+    }
+
+    for (bool crossBorder : {false, true}) {
+      for (int radius : {0, 1, 2, 3}) {
+        // brute force window test
+        core::Imageb expected(segs.size(), false);
+        for (auto it = segs.begin(); it != segs.end(); ++it) {
+          auto p = it.pos();
+          bool isInside = true;
+          for (int dy = -radius; dy <= radius; dy++) {
+            for (int dx = -radius; dx <= radius; dx++) {
+              int x = p.x + dx, y = p.y + dy;
+              if (y < 0 || y >= segs.rows) {
+                continue;
+              }
+              if (x < 0 || x >= segs.cols) {
+                if (!crossBorder) {
+                  continue;
+                }
+                x = (x + segs.cols) % segs.cols;
+              }
+              if (segs(y, x) != *it) {
+                isInside = false;
+              }
+            }
+          }
+          expected(p) = isInside;
+        }
+        core::Imageb insiders =
+            core::ThinRegionInsiders(segs, radius, crossBorder);
+        ASSERT_EQ(0, cv::countNonZero(insiders != expected));
+
+        // insiders keep their labels, the others take labels of insiders
+        core::Imagei result = segs.clone();
+        core::RemoveThinRegionInSegmentation(result, radius, crossBorder);
+        std::set<int> insiderLabels;
+        for (auto it = segs.begin(); it != segs.end(); ++it) {
+          if (expected(it.pos())) {
+            EXPECT_EQ(*it, result(it.pos()));
+            insiderLabels.insert(*it);
+          }
+        }
+        for (auto it = result.begin(); it != result.end(); ++it) {
+          if (*it != segs(it.pos())) {
+            EXPECT_TRUE(core::Contains(insiderLabels, *it));
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(SegmentationTest, SegmentationTopo) {
+  // a grid of 4x3 blocks, whose inner corners are junctions of 4 segs
+  core::Imagei segs(30, 40);
+  for (auto it = segs.begin(); it != segs.end(); ++it) {
+    *it = it.pos().y / 10 * 4 + it.pos().x / 10;
+  }
+
+  for (bool crossBorder : {false, true}) {
+    core::SegmentationTopo topo(segs, crossBorder);
+    EXPECT_EQ(12, topo.nsegs());
+    if (!crossBorder) {
+      EXPECT_EQ(6, topo.njunctions());
+      EXPECT_EQ(7, topo.nboundaries());
+    }
+    for (int junc = 0; junc < topo.njunctions(); junc++) {
+      EXPECT_EQ(4, topo.junc2segs[junc].size());
+      for (int seg : topo.junc2segs[junc]) {
+        EXPECT_TRUE(core::Contains(topo.seg2juncs[seg], junc));
+      }
+    }
+    for (int bnd = 0; bnd < topo.nboundaries(); bnd++) {
+      auto &juncs = topo.bnd2juncs[bnd];
+      auto &segpair = topo.bnd2segs[bnd];
+      EXPECT_EQ(topo.juncpositions[juncs.first], topo.bndpixels[bnd].front());
+      EXPECT_EQ(topo.juncpositions[juncs.second], topo.bndpixels[bnd].back());
+      EXPECT_TRUE(core::Contains(topo.junc2bnds[juncs.first], bnd));
+      EXPECT_TRUE(core::Contains(topo.junc2bnds[juncs.second], bnd));
+      EXPECT_TRUE(core::Contains(topo.seg2bnds[segpair.first], bnd));
+      EXPECT_TRUE(core::Contains(topo.seg2bnds[segpair.second], bnd));
+    }
+  }
+}
+
+TEST(SegmentationTest, FindRegionBoundaryChains) {
+  core::Imagei segs(60, 80);
+  for (auto it = segs.begin(); it != segs.end(); ++it) {
+    auto p = it.pos();
+    *it = (p.x + p.y / 3) / 17 + (p.y > 30 + p.x / 4 ? 10 : 0);
+  }
+
+  for (int extendSize : {1, 2}) {
+    auto boundaries = core::FindRegionBoundaries(segs, extendSize, false);
+    auto chains = core::FindRegionBoundaryChains(segs, extendSize);
+    ASSERT_EQ(boundaries.size(), chains.npairs());
+    for (auto &b : boundaries) {
+      auto cs = chains.chainsOf(b.first.second, b.first.first);
+      std::vector<std::vector<core::Pixel>> pixels;
+      for (auto &c : cs) {
+        pixels.push_back(c.pixels());
+        auto vertices = c.vertices();
+        EXPECT_LE(vertices.size(), c.npixels());
+        EXPECT_EQ(pixels.back().front(), vertices.front());
+        EXPECT_EQ(pixels.back().back(), vertices.back());
+      }
+      EXPECT_TRUE(pixels == b.second);
+    }
+    EXPECT_TRUE(chains.chainsOf(-1, -2).begin() ==
+                chains.chainsOf(-1, -2).end());
+  }
+}
+
+TEST(SegmentationTest, SegmentationHierarchy) {
+  using core::Pixel;
+  int width = 4, height = 2;
+  auto ind = [width, height](int x, int y) {
+    return core::Sub2Ind(Pixel(x, y), width, height);
+  };
+  core::SegmentationHierarchy hierarchy(width, height);
+  hierarchy.merge(ind(0, 0), ind(0, 1), 1.0);
+  hierarchy.merge(ind(1, 0), ind(1, 1), 2.0);
+  hierarchy.markSegmentation();
+  hierarchy.merge(ind(0, 1), ind(1, 1), 0.5);
+  hierarchy.merge(ind(2, 0), ind(3, 0), 3.0);
+  EXPECT_EQ(0.5f, hierarchy.level(2));
+
+  core::Imagei segs;
+  EXPECT_EQ(8, hierarchy.cut(0, segs));
+  EXPECT_EQ(4, segs(1, 0));
+  // the merges at levels up to 1.5, not the first ones
+  EXPECT_EQ(6, hierarchy.cutAtLevel(1.5, segs));
+  EXPECT_EQ(segs(0, 0), segs(1, 1));
+  EXPECT_NE(segs(0, 0), segs(0, 1));
+  EXPECT_EQ(7, hierarchy.cutAtLevel(0.5, segs));
+  EXPECT_EQ(6, hierarchy.cutSegmentation(segs));
+  EXPECT_EQ(5, hierarchy.cutToSegmentNumber(5, segs));
+  EXPECT_EQ(0, segs(1, 1));
+  EXPECT_EQ(4, hierarchy.cutToSegmentNumber(1, segs));
+  EXPECT_EQ(segs(0, 2), segs(0, 3));
+}
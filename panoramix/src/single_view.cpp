@@ -119,10 +119,14 @@ std::vector<int> ComputeSpatialRegionPropertiesTemplated(
     std::vector<std::vector<Vec3>> normalizedContours(contours.size());
     double area = 0.0;
     for (int k = 0; k < contours.size(); k++) {
-      normalizedContours[k].reserve(contours[k].size());
-      for (auto &p : contours[k]) {
-        normalizedContours[k].push_back(normalize(sCam.toSpace(p)));
-        center += normalizedContours[k].back();
+      std::vector<Point2> contourp(contours[k].size());
+      for (int kk = 0; kk < contours[k].size(); kk++) {
+        contourp[kk] = ecast<double>(contours[k][kk]);
+      }
+      normalizedContours[k] = BatchToSpace(sCam, contourp);
+      for (auto &d : normalizedContours[k]) {
+        d = normalize(d);
+        center += d;
       }
       std::vector<Point2f> contourf(contours[k].size());
       for (int kk = 0; kk < contours[k].size(); kk++) {
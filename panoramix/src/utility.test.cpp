@@ -383,3 +383,28 @@ TEST(UtilityTest, EigenVectorsAndValues) {
                                   result[1].score / result[0].score)
             << std::endl;
 }
+
+TEST(UtilityTest, FastMath) {
+  std::default_random_engine e;
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  for (int i = 0; i < 100000; i++) {
+    double y = u(e) * 10, x = u(e) * 10, a = u(e) * 100;
+    double d = std::abs(core::FastMath::atan2(y, x) - std::atan2(y, x));
+    ASSERT_LE(std::min(d, std::abs(d - 2 * M_PI)), 1.2e-5);
+    ASSERT_LE(std::abs(core::FastMath::atan(y) - std::atan(y)), 1.2e-5);
+    ASSERT_LE(std::abs(core::FastMath::sin(a) - std::sin(a)), 1e-7);
+    ASSERT_LE(std::abs(core::FastMath::cos(a) - std::cos(a)), 1e-7);
+  }
+  core::Vec3 v(1, 2, 3);
+  auto gc = core::MakeGeoCoord<core::FastMath>(v);
+  ASSERT_LE(std::abs(gc.longitude - core::GeoCoord(v).longitude), 1.2e-5);
+  ASSERT_LE(std::abs(gc.latitude - core::GeoCoord(v).latitude), 1.2e-5);
+  ASSERT_LE(core::norm(core::GeoCoordToVector<core::FastMath>(gc) -
+                       core::normalize(v)),
+            1e-4);
+
+  core::SinCosTable table(-M_PI_2, M_PI / 100, 100);
+  for (int i = 0; i < table.size(); i++) {
+    ASSERT_DOUBLE_EQ(table.cos(i), std::cos(-M_PI_2 + i * M_PI / 100));
+  }
+}